@@ -31,8 +31,13 @@ static int mongodb_loglevel;
 #include <libu8/u8printf.h>
 #include <libu8/u8crypto.h>
 #include <libu8/u8pathfns.h>
+#include <libu8/u8timefns.h>
 
 #include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
 
 /* Initialization */
 
@@ -44,12 +49,24 @@ u8_condition kno_BSON_Compound_Overflow=_("BSON/Kno compound overflow");
 
 /* These are the new cons types introducted for mongodb */
 kno_lisp_type kno_mongoc_server, kno_mongoc_collection, kno_mongoc_cursor;
+kno_lisp_type kno_mongoc_fieldmap, kno_mongoc_lazydoc;
+kno_lisp_type kno_mongoc_param, kno_mongoc_prepared, kno_mongoc_opts;
 #define KNO_MONGOC_SERVER     0xEF5970L
 #define KNO_MONGOC_COLLECTION 0xEF5971L
 #define KNO_MONGOC_CURSOR     0xEF5972L
+#define KNO_MONGOC_FIELDMAP   0xEF5973L
+#define KNO_MONGOC_LAZYDOC    0xEF5974L
+#define KNO_MONGOC_PARAM      0xEF5975L
+#define KNO_MONGOC_PREPARED   0xEF5976L
+#define KNO_MONGOC_OPTS       0xEF5977L
 #define kno_mongoc_server_type kno_mongoc_server
 #define kno_mongoc_collection_type kno_mongoc_collection
 #define kno_mongoc_cursor_type kno_mongoc_cursor
+#define kno_mongoc_fieldmap_type kno_mongoc_fieldmap
+#define kno_mongoc_lazydoc_type kno_mongoc_lazydoc
+#define kno_mongoc_param_type kno_mongoc_param
+#define kno_mongoc_prepared_type kno_mongoc_prepared
+#define kno_mongoc_opts_type kno_mongoc_opts
 
 #define KNO_FIND_MATCHES  1
 #define KNO_COUNT_MATCHES 0
@@ -68,6 +85,7 @@ static lispval hosts_symbol, connections_symbol, fieldmap_symbol, logopsym;
 static lispval knoparse_symbol, dotcar_symbol, dotcdr_symbol;
 static lispval certfile, certpass, cafilesym, cadirsym, crlsym;
 static lispval symslots_symbol, choiceslots_symbol, rawslots_symbol;
+static lispval internslots_symbol;
 static lispval mongo_timestamp_tag;
 
 static lispval choice_tagstring, choice_tagsym;
@@ -81,12 +99,38 @@ static int mongo_opmap_size = 0, mongo_opmap_space = 0;
 #define MONGO_OPMAP_MAX 8000
 #endif
 
-#define MONGO_MULTISLOTS_MAX 2032
-static lispval multislots[MONGO_MULTISLOTS_MAX];
-static int n_multislots = 0;
-static u8_mutex multislots_lock;
+/* The global slot property registry (see below) */
+struct MONGODB_SLOTPROPS {
+  int slotprops_n_slots, slotprops_n_buckets;
+  struct KNO_MONGODB_SLOTINFO *slotprops_slots;
+  struct MONGODB_SLOTPROPS *slotprops_prev;};
+static struct MONGODB_SLOTPROPS *slotprops = NULL;
+static u8_mutex slotprops_lock;
+
+/* This is bumped whenever global slot properties change, which
+   invalidates any compiled encode plans. */
+static unsigned int slotprops_generation = 1;
 
 static bool bson_append_keyval(struct KNO_BSON_OUTPUT,lispval,lispval);
+static lispval bson2lisp(bson_t *,int,lispval,struct KNO_BSON_FIELDCACHE *,
+			 struct KNO_BSON_ARENA *);
+static void init_bson_arena(struct KNO_BSON_ARENA *arena,size_t size);
+static int bson_arena_size = 65536;
+static void free_bson_arena(struct KNO_BSON_ARENA *arena);
+static int parallel_decodingp(int flags,lispval opts);
+static struct KNO_MONGODB_COALESCER *make_coalescer(lispval opts);
+static void free_coalescer(struct KNO_MONGODB_COALESCER *c);
+static lispval coalesced_get(struct KNO_MONGODB_COLLECTION *coll,
+			     lispval key,int flags,lispval opts);
+static bson_t *getn_encode_key(lispval key,int flags,lispval opts);
+static struct KNO_MONGODB_QCACHE *
+make_qcache(struct KNO_MONGODB_DATABASE *server,u8_string name,lispval opts);
+static void free_qcache(struct KNO_MONGODB_QCACHE *qc);
+static void qcache_invalidate(struct KNO_MONGODB_COLLECTION *coll);
+static int parallel_decode(bson_t **docs,int n,int flags,lispval opts,
+			   lispval *results,struct KNO_BSON_FIELDCACHE *fc,
+			   struct KNO_BSON_ARENA *arena);
+#define DECODE_BATCH_SIZE 256
 static bool bson_append_lisp(struct KNO_BSON_OUTPUT,const char *,int,
 			      lispval,int);
 static lispval idsym, maxkey, minkey;
@@ -137,15 +181,252 @@ static void grab_mongodb_error(bson_error_t *error,u8_string caller)
 
 #define IGNORE_ERRNO(iftrue) if (iftrue) errno=0; else {};
 
-static mongoc_client_t *get_client(KNO_MONGODB_DATABASE *server,int block)
+static void record_pop(struct KNO_MONGODB_POOLSTATS *stats,
+		       mongoc_client_t *client,int block,double started)
+{
+  if (client == NULL) {
+    if (!(block))
+      __atomic_add_fetch(&(stats->pool_nowait_fails),1,__ATOMIC_RELAXED);
+    return;}
+  long long usecs = (long long) ((u8_elapsed_time()-started)*1000000.0);
+  long long max_wait = __atomic_load_n(&(stats->pool_max_wait_usecs),
+				       __ATOMIC_RELAXED);
+  int bucket = 0; long long limit = 10;
+  while ( (bucket < (KNO_MONGODB_WAIT_BUCKETS-1)) && (usecs >= limit) ) {
+    bucket++; limit = limit*10;}
+  __atomic_add_fetch(&(stats->pool_pops),1,__ATOMIC_RELAXED);
+  __atomic_add_fetch(&(stats->pool_wait_usecs),usecs,__ATOMIC_RELAXED);
+  __atomic_add_fetch(&(stats->pool_waits[bucket]),1,__ATOMIC_RELAXED);
+  while ( (usecs > max_wait) &&
+	  (!(__atomic_compare_exchange_n
+	     (&(stats->pool_max_wait_usecs),&max_wait,usecs,0,
+	      __ATOMIC_RELAXED,__ATOMIC_RELAXED))) ) {}
+  int busy = __atomic_add_fetch(&(stats->pool_busy),1,__ATOMIC_RELAXED);
+  int peak = __atomic_load_n(&(stats->pool_peak),__ATOMIC_RELAXED);
+  while ( (busy > peak) &&
+	  (!(__atomic_compare_exchange_n
+	     (&(stats->pool_peak),&peak,busy,0,
+	      __ATOMIC_RELAXED,__ATOMIC_RELAXED))) ) {}
+}
+
+static mongoc_client_t *pool_pop(struct KNO_MONGODB_POOL *pool,int block)
+{
+  mongoc_client_t *client;
+  double started = u8_elapsed_time();
+  if (block)
+    client = mongoc_client_pool_pop(pool->pool_clients);
+  else client = mongoc_client_pool_try_pop(pool->pool_clients);
+  IGNORE_ERRNO(client);
+  record_pop(&(pool->pool_stats),client,block,started);
+  return client;
+}
+
+static void pool_push(struct KNO_MONGODB_POOL *pool,mongoc_client_t *client)
+{
+  mongoc_client_pool_push(pool->pool_clients,client);
+  __atomic_sub_fetch(&(pool->pool_stats.pool_busy),1,__ATOMIC_RELAXED);
+}
+
+/* Priority lanes */
+
+/* A server opened with the `lanes` option (a table mapping lane names
+   to numbers of reserved clients) keeps that many of its pool's
+   clients for operations in each lane. Operations use their lane's
+   reserved clients first and then the clients which aren't reserved
+   by any lane; operations without a lane only use the latter. An
+   operation's lane comes from its `lane` option or from the thread's
+   default lane (set with mongodb/lane!). The lanes are part of the
+   pool's key, so every server using a pool has the same lanes and
+   the pool does the accounting for all of them. */
+
+#define LANE_SHARED (-1)
+#define LANE_UNTRACKED (-2)
+#define LANE_UNAVAILABLE (-3)
+
+static u8_tld_key thread_lane_key;
+
+DEF_KNOSYM(lane); DEF_KNOSYM(lanes);
+
+static lispval get_lane(lispval opts)
+{
+  lispval lane = kno_getopt(opts,KNOSYM(lane),KNO_VOID);
+  if (KNO_SYMBOLP(lane)) return lane;
+  kno_decref(lane);
+  /* Lane names are symbols, so they don't need to be refcounted */
+  lispval dflt = (lispval) u8_tld_get(thread_lane_key);
+  return (dflt) ? (dflt) : (KNO_VOID);
+}
+
+static struct KNO_MONGODB_LANES *make_lanes(lispval spec,int pool_limit,
+					    u8_string dbspec)
+{
+  lispval keys = kno_getkeys(spec);
+  int n = KNO_CHOICE_SIZE(keys), n_lanes = 0, reserved = 0;
+  struct KNO_MONGODB_LANES *lanes = u8_alloc(struct KNO_MONGODB_LANES);
+  memset(lanes,0,sizeof(struct KNO_MONGODB_LANES));
+  lanes->lanes = u8_alloc_n((n) ? (n) : (1),struct KNO_MONGODB_LANE);
+  {KNO_DO_CHOICES(key,keys) {
+      lispval v = kno_get(spec,key,KNO_VOID);
+      if ( (KNO_SYMBOLP(key)) && (KNO_UINTP(v)) ) {
+	struct KNO_MONGODB_LANE *lane = &(lanes->lanes[n_lanes++]);
+	lane->lane_name = key;
+	lane->lane_reserved = KNO_FIX2INT(v);
+	lane->lane_busy = 0;
+	reserved += lane->lane_reserved;}
+      else u8_logf(LOG_WARN,"MongoDB/lanes","Ignoring lane %q=%q for %s",
+		   key,v,dbspec);
+      kno_decref(v);}}
+  kno_decref(keys);
+  if (reserved > pool_limit)
+    u8_logf(LOG_WARN,"MongoDB/lanes",
+	    "Lanes for %s reserve %d clients from a pool of %d",
+	    dbspec,reserved,pool_limit);
+  lanes->lanes_n = n_lanes;
+  lanes->lanes_shared = (reserved < pool_limit) ? (pool_limit-reserved) : (0);
+  lanes->lanes_shared_busy = 0;
+  lanes->lanes_max_clients = reserved+lanes->lanes_shared;
+  lanes->lanes_clients =
+    u8_alloc_n(lanes->lanes_max_clients+1,struct KNO_MONGODB_LANE_CLIENT);
+  memset(lanes->lanes_clients,0,
+	 (lanes->lanes_max_clients+1)*sizeof(struct KNO_MONGODB_LANE_CLIENT));
+  u8_init_mutex(&(lanes->lanes_lock));
+  u8_init_condvar(&(lanes->lanes_free));
+  return lanes;
+}
+
+static void free_lanes(struct KNO_MONGODB_LANES *lanes)
+{
+  u8_destroy_mutex(&(lanes->lanes_lock));
+  u8_destroy_condvar(&(lanes->lanes_free));
+  u8_free(lanes->lanes_clients);
+  u8_free(lanes->lanes);
+  u8_free(lanes);
+}
+
+/* This waits (if *block* is true) for a client to be available to
+   *lane* and returns the lane index it was counted against. When every
+   client is reserved, operations without a lane aren't limited. */
+static int lane_acquire(struct KNO_MONGODB_LANES *lanes,lispval lane,
+			int block)
+{
+  int li = -1, i = 0, n = lanes->lanes_n, result;
+  if (KNO_SYMBOLP(lane)) while (i < n) {
+      if (lanes->lanes[i].lane_name == lane) {
+	li = i; break;}
+      else i++;}
+  u8_lock_mutex(&(lanes->lanes_lock));
+  while (1) {
+    if ( (li >= 0) &&
+	 (lanes->lanes[li].lane_busy < lanes->lanes[li].lane_reserved) ) {
+      lanes->lanes[li].lane_busy++;
+      result = li;
+      break;}
+    else if (lanes->lanes_shared_busy < lanes->lanes_shared) {
+      lanes->lanes_shared_busy++;
+      result = LANE_SHARED;
+      break;}
+    else if ( (li < 0) && (lanes->lanes_shared == 0) ) {
+      result = LANE_UNTRACKED;
+      break;}
+    else if (!(block)) {
+      result = LANE_UNAVAILABLE;
+      break;}
+    else u8_condvar_wait(&(lanes->lanes_free),&(lanes->lanes_lock));}
+  u8_unlock_mutex(&(lanes->lanes_lock));
+  return result;
+}
+
+/* This returns the number of clients which operations in *lane* can
+   use, or -1 if they aren't limited by the lanes */
+static int lane_capacity(struct KNO_MONGODB_LANES *lanes,lispval lane)
+{
+  int i = 0, n = lanes->lanes_n;
+  if (KNO_SYMBOLP(lane)) while (i < n) {
+      if (lanes->lanes[i].lane_name == lane)
+	return lanes->lanes[i].lane_reserved+lanes->lanes_shared;
+      else i++;}
+  if (lanes->lanes_shared == 0)
+    return -1;
+  else return lanes->lanes_shared;
+}
+
+/* This returns the number of clients which operations in *lane* could
+   get right now, or -1 if they aren't limited by the lanes */
+static int lane_spare(struct KNO_MONGODB_LANES *lanes,lispval lane)
+{
+  int i = 0, n = lanes->lanes_n, li = -1, spare = 0;
+  u8_lock_mutex(&(lanes->lanes_lock));
+  if (KNO_SYMBOLP(lane)) while (i < n) {
+      if (lanes->lanes[i].lane_name == lane) {
+	li = i;
+	spare = lanes->lanes[i].lane_reserved-lanes->lanes[i].lane_busy;
+	break;}
+      else i++;}
+  if ( (li < 0) && (lanes->lanes_shared == 0) )
+    spare = -1;
+  else spare += lanes->lanes_shared-lanes->lanes_shared_busy;
+  u8_unlock_mutex(&(lanes->lanes_lock));
+  return spare;
+}
+
+/* This is called with lanes_lock held */
+static void lane_free(struct KNO_MONGODB_LANES *lanes,int lane_index)
+{
+  if (lane_index >= 0)
+    lanes->lanes[lane_index].lane_busy--;
+  else if (lane_index == LANE_SHARED)
+    lanes->lanes_shared_busy--;
+  else return;
+  u8_condvar_broadcast(&(lanes->lanes_free));
+}
+
+static void lane_record(struct KNO_MONGODB_LANES *lanes,
+			mongoc_client_t *client,int lane_index)
+{
+  u8_lock_mutex(&(lanes->lanes_lock));
+  if (client == NULL)
+    lane_free(lanes,lane_index);
+  else if (lane_index != LANE_UNTRACKED) {
+    struct KNO_MONGODB_LANE_CLIENT *scan = lanes->lanes_clients;
+    struct KNO_MONGODB_LANE_CLIENT *limit = scan+lanes->lanes_max_clients;
+    while ( (scan < limit) && (scan->lane_client) ) scan++;
+    scan->lane_client = client;
+    scan->lane_index = lane_index;}
+  else NO_ELSE;
+  u8_unlock_mutex(&(lanes->lanes_lock));
+}
+
+static void lane_release(struct KNO_MONGODB_LANES *lanes,
+			 mongoc_client_t *client)
+{
+  u8_lock_mutex(&(lanes->lanes_lock));
+  struct KNO_MONGODB_LANE_CLIENT *scan = lanes->lanes_clients;
+  struct KNO_MONGODB_LANE_CLIENT *limit = scan+lanes->lanes_max_clients;
+  while (scan < limit) {
+    if (scan->lane_client == client) {
+      lane_free(lanes,scan->lane_index);
+      scan->lane_client = NULL;
+      break;}
+    else scan++;}
+  u8_unlock_mutex(&(lanes->lanes_lock));
+}
+
+static mongoc_client_t *get_client(KNO_MONGODB_DATABASE *server,int block,
+				   lispval lane)
 {
   mongoc_client_t *client;
-  if (block) {
+  struct KNO_MONGODB_LANES *lanes = server->dbpool->pool_lanes;
+  int lane_index = (lanes) ? (lane_acquire(lanes,lane,block)) :
+    (LANE_UNTRACKED);
+  if (lane_index == LANE_UNAVAILABLE) {
+    __atomic_add_fetch(&(server->dbpool->pool_stats.pool_nowait_fails),1,
+		       __ATOMIC_RELAXED);
+    return NULL;}
+  if (block)
     u8_logf(LOG_DEBUG,_("MongoDB/get_client"),
 	    "Getting client from server %llx (%s)",server->dbclients,server->dbspec);
-    client = mongoc_client_pool_pop(server->dbclients);}
-  else client = mongoc_client_pool_try_pop(server->dbclients);
-  IGNORE_ERRNO(client);
+  client = pool_pop(server->dbpool,block);
+  if (lanes) lane_record(lanes,client,lane_index);
   u8_logf(LOG_DEBUG,_("MongoDB/got_client"),
 	  "Got client %llx from server %llx (%s)",
 	  client,server->dbclients,server->dbspec);
@@ -157,7 +438,9 @@ static void release_client(KNO_MONGODB_DATABASE *server,mongoc_client_t *client)
   u8_logf(LOG_DEBUG,_("MongoDB/release_client"),
 	  "Releasing client %llx to server %llx (%s)",
 	  client,server->dbclients,server->dbspec);
-  mongoc_client_pool_push(server->dbclients,client);
+  pool_push(server->dbpool,client);
+  if (server->dbpool->pool_lanes)
+    lane_release(server->dbpool->pool_lanes,client);
 }
 
 static int boolopt(lispval opts,lispval key,int dflt)
@@ -266,10 +549,17 @@ static void free_lisp_vec(lispval *vec,int n)
 int mongodb_defaults = KNO_MONGODB_DEFAULTS;
 
 DEF_KNOSYM(prefchoices); DEF_KNOSYM(prefvecs); DEF_KNOSYM(noblock);
+DEF_KNOSYM(schemaps); DEF_KNOSYM(lazy); DEF_KNOSYM(parallel);
+DEF_KNOSYM(affinity); DEF_KNOSYM(poolmin); DEF_KNOSYM(warmup);
+DEF_KNOSYM(singleflight);
 
 static int getflags(lispval opts,int dflt)
 {
-  if ((KNO_VOIDP(opts)||(KNO_FALSEP(opts))||(KNO_DEFAULTP(opts))))
+  if (KNO_TYPEP(opts,kno_mongoc_opts)) {
+    struct KNO_MONGODB_OPTS *c = (kno_mongodb_opts) opts;
+    if (dflt<0) dflt = KNO_MONGODB_DEFAULTS;
+    return (dflt&(c->opts_keepflags))|(c->opts_setflags);}
+  else if ((KNO_VOIDP(opts)||(KNO_FALSEP(opts))||(KNO_DEFAULTP(opts))))
     if (dflt<0) return mongodb_defaults;
     else return dflt;
   else if (KNO_UINTP(opts)) return KNO_FIX2INT(opts);
@@ -294,6 +584,16 @@ static int getflags(lispval opts,int dflt)
       flags |= KNO_MONGODB_LOGOPS;
     if (kno_overlapp(opts,KNOSYM(noblock)))
       flags |= KNO_MONGODB_NOBLOCK;
+    if (kno_overlapp(opts,KNOSYM(schemaps)))
+      flags |= KNO_MONGODB_SCHEMAPS;
+    if (kno_overlapp(opts,KNOSYM(lazy)))
+      flags |= KNO_MONGODB_LAZY;
+    if (kno_overlapp(opts,KNOSYM(parallel)))
+      flags |= KNO_MONGODB_PARALLEL;
+    if (kno_overlapp(opts,KNOSYM(affinity)))
+      flags |= KNO_MONGODB_AFFINITY;
+    if (kno_overlapp(opts,KNOSYM(singleflight)))
+      flags |= KNO_MONGODB_SINGLEFLIGHT;
     return flags;}
   else if (KNO_TABLEP(opts)) {
     lispval flagsv = kno_getopt(opts,bsonflags,KNO_VOID);
@@ -319,6 +619,31 @@ static int getflags(lispval opts,int dflt)
       flags |= KNO_MONGODB_NOBLOCK;
     if (kno_testopt(opts,logopsym,KNO_VOID))
       flags |= KNO_MONGODB_LOGOPS;
+    if (kno_testopt(opts,KNOSYM(schemaps),KNO_FALSE))
+      flags &= (~(KNO_MONGODB_SCHEMAPS));
+    else if (kno_testopt(opts,KNOSYM(schemaps),KNO_VOID))
+      flags |= KNO_MONGODB_SCHEMAPS;
+    else NO_ELSE;
+    if (kno_testopt(opts,KNOSYM(lazy),KNO_FALSE))
+      flags &= (~(KNO_MONGODB_LAZY));
+    else if (kno_testopt(opts,KNOSYM(lazy),KNO_VOID))
+      flags |= KNO_MONGODB_LAZY;
+    else NO_ELSE;
+    if (kno_testopt(opts,KNOSYM(parallel),KNO_FALSE))
+      flags &= (~(KNO_MONGODB_PARALLEL));
+    else if (kno_testopt(opts,KNOSYM(parallel),KNO_VOID))
+      flags |= KNO_MONGODB_PARALLEL;
+    else NO_ELSE;
+    if (kno_testopt(opts,KNOSYM(affinity),KNO_FALSE))
+      flags &= (~(KNO_MONGODB_AFFINITY));
+    else if (kno_testopt(opts,KNOSYM(affinity),KNO_VOID))
+      flags |= KNO_MONGODB_AFFINITY;
+    else NO_ELSE;
+    if (kno_testopt(opts,KNOSYM(singleflight),KNO_FALSE))
+      flags &= (~(KNO_MONGODB_SINGLEFLIGHT));
+    else if (kno_testopt(opts,KNOSYM(singleflight),KNO_VOID))
+      flags |= KNO_MONGODB_SINGLEFLIGHT;
+    else NO_ELSE;
     return flags;}
   else if (dflt<0) return KNO_MONGODB_DEFAULTS;
   else return dflt;
@@ -343,6 +668,11 @@ static int get_write_flags(lispval val)
 
 static mongoc_write_concern_t *get_write_concern(lispval opts)
 {
+  if (KNO_TYPEP(opts,kno_mongoc_opts)) {
+    struct KNO_MONGODB_OPTS *c = (kno_mongodb_opts) opts;
+    if (c->opts_writeconcern)
+      return mongoc_write_concern_copy(c->opts_writeconcern);
+    else return NULL;}
   lispval val = kno_getopt(opts,writesym,KNO_VOID);
   lispval wait = kno_getopt(opts,wtimeoutsym,KNO_VOID);
   if ((KNO_VOIDP(val))&&(KNO_VOIDP(wait))) return NULL;
@@ -359,6 +689,15 @@ static mongoc_write_concern_t *get_write_concern(lispval opts)
     return wc;}
 }
 
+/* This returns true if the encoded parts of compiled options still
+   reflect the configs they depend on */
+static int compiled_opts_currentp(struct KNO_MONGODB_OPTS *c)
+{
+  return ( (c->opts_generation ==
+	    __atomic_load_n(&slotprops_generation,__ATOMIC_ACQUIRE)) &&
+	   (c->opts_defaults == mongodb_defaults) );
+}
+
 static int getreadmode(lispval val)
 {
   if (KNO_EQ(val,primarysym))
@@ -379,6 +718,13 @@ static int getreadmode(lispval val)
 
 static mongoc_read_prefs_t *get_read_prefs(lispval opts)
 {
+  if (KNO_TYPEP(opts,kno_mongoc_opts)) {
+    struct KNO_MONGODB_OPTS *c = (kno_mongodb_opts) opts;
+    if (!(compiled_opts_currentp(c)))
+      opts = c->opts_table;
+    else if (c->opts_readprefs)
+      return mongoc_read_prefs_copy(c->opts_readprefs);
+    else return NULL;}
   lispval spec = kno_getopt(opts,readsym,KNO_VOID);
   if (KNO_VOIDP(spec)) return NULL;
   else {
@@ -402,6 +748,12 @@ static lispval combine_opts(lispval opts,lispval clopts)
 {
   if (opts == clopts) {
     kno_incref(opts); return opts;}
+  else if (KNO_TYPEP(opts,kno_mongoc_opts)) {
+    /* Compiled options which already include clopts are used as is */
+    struct KNO_MONGODB_OPTS *c = (kno_mongodb_opts) opts;
+    if ( (c->opts_base == clopts) || (!(KNO_TABLEP(clopts))) ) {
+      kno_incref(opts); return opts;}
+    else return kno_make_pair(opts,clopts);}
   else if (KNO_PAIRP(opts)) {
     kno_incref(opts); return opts;}
   else if ((KNO_TABLEP(opts))&&(KNO_TABLEP(clopts))) {
@@ -428,6 +780,11 @@ DEF_KNOSYM(notimeout);
 
 static U8_MAYBE_UNUSED bson_t *get_search_opts(lispval opts,int flags,int for_find)
 {
+  if (KNO_TYPEP(opts,kno_mongoc_opts)) {
+    struct KNO_MONGODB_OPTS *c = (kno_mongodb_opts) opts;
+    if ( (flags == c->opts_flags) && (compiled_opts_currentp(c)) )
+      return bson_copy((for_find) ? (c->opts_findopts) : (c->opts_countopts));
+    else opts = c->opts_table;}
   struct KNO_BSON_OUTPUT out;
   bson_t *doc = bson_new();
   out.bson_doc = doc;
@@ -573,74 +930,714 @@ static U8_MAYBE_UNUSED bson_t *getbulkopts(lispval opts,int flags)
   return out.bson_doc;
 }
 
+/* Compiled options */
+
+/* mongodb/opts resolves an options table once into a compiled options
+   object, which holds its flags together with the finished search
+   options, read preferences and write concern. getflags(),
+   get_search_opts(), get_read_prefs() and get_write_concern() use
+   these directly, and other options are looked up in the underlying
+   table (the compiled object is itself a table). Because getflags()
+   is applied to a default, the flags are stored as a pair of masks:
+   opts_setflags are always set and only the bits in opts_keepflags
+   are taken from the default; these come from *flagopts*, which is
+   the table getflags() would otherwise be called on. The search
+   options are only used when the flags match the opts_flags they were
+   generated with. */
+
+static lispval compile_opts(lispval opts,lispval flagopts,lispval base,
+			    int flags)
+{
+  unsigned int generation =
+    __atomic_load_n(&slotprops_generation,__ATOMIC_ACQUIRE);
+  int defaults = mongodb_defaults;
+  bson_t *findopts = get_search_opts(opts,flags,KNO_FIND_MATCHES);
+  if (findopts == NULL) return KNO_ERROR_VALUE;
+  bson_t *countopts = get_search_opts(opts,flags,KNO_COUNT_MATCHES);
+  if (countopts == NULL) {
+    bson_destroy(findopts);
+    return KNO_ERROR_VALUE;}
+  struct KNO_MONGODB_OPTS *c = u8_alloc(struct KNO_MONGODB_OPTS);
+  KNO_INIT_CONS(c,kno_mongoc_opts);
+  c->opts_table = kno_incref(opts);
+  c->opts_base = kno_incref(base);
+  c->opts_fieldmap = kno_getopt(opts,fieldmap_symbol,KNO_VOID);
+  c->opts_flags = flags;
+  c->opts_generation = generation;
+  c->opts_defaults = defaults;
+  c->opts_setflags = getflags(flagopts,0);
+  c->opts_keepflags = getflags(flagopts,INT_MAX);
+  c->opts_findopts = findopts;
+  c->opts_countopts = countopts;
+  c->opts_readprefs = get_read_prefs(opts);
+  c->opts_writeconcern = get_write_concern(opts);
+  return (lispval) c;
+}
+
+static lispval compiled_opts_get(lispval obj,lispval key,lispval dflt)
+{
+  struct KNO_MONGODB_OPTS *c = (kno_mongodb_opts) obj;
+  if (key == fieldmap_symbol) {
+    if (KNO_VOIDP(c->opts_fieldmap))
+      return kno_incref(dflt);
+    else return kno_incref(c->opts_fieldmap);}
+  else return kno_getopt(c->opts_table,key,dflt);
+}
+
+static int compiled_opts_test(lispval obj,lispval key,lispval val)
+{
+  struct KNO_MONGODB_OPTS *c = (kno_mongodb_opts) obj;
+  return kno_testopt(c->opts_table,key,val);
+}
+
+static lispval compiled_opts_keys(lispval obj)
+{
+  struct KNO_MONGODB_OPTS *c = (kno_mongodb_opts) obj;
+  lispval scan = c->opts_table, keys = KNO_EMPTY;
+  while (KNO_PAIRP(scan)) {
+    lispval car = KNO_CAR(scan);
+    if (KNO_TABLEP(car)) {
+      lispval more = kno_getkeys(car);
+      KNO_ADD_TO_CHOICE(keys,more);}
+    scan = KNO_CDR(scan);}
+  if (KNO_TABLEP(scan)) {
+    lispval more = kno_getkeys(scan);
+    KNO_ADD_TO_CHOICE(keys,more);}
+  return kno_simplify_choice(keys);
+}
+
+static struct KNO_TABLEFNS compiled_opts_tablefns = {
+  .get = compiled_opts_get,
+  .test = compiled_opts_test,
+  .keys = compiled_opts_keys};
+
+static void recycle_compiled_opts(struct KNO_RAW_CONS *c)
+{
+  struct KNO_MONGODB_OPTS *copts = (struct KNO_MONGODB_OPTS *)c;
+  if (copts->opts_writeconcern)
+    mongoc_write_concern_destroy(copts->opts_writeconcern);
+  if (copts->opts_readprefs)
+    mongoc_read_prefs_destroy(copts->opts_readprefs);
+  bson_destroy(copts->opts_countopts);
+  bson_destroy(copts->opts_findopts);
+  kno_decref(copts->opts_fieldmap);
+  kno_decref(copts->opts_base);
+  kno_decref(copts->opts_table);
+  if (!(KNO_STATIC_CONSP(c))) u8_free(c);
+}
+static int unparse_compiled_opts(struct U8_OUTPUT *out,lispval x)
+{
+  struct KNO_MONGODB_OPTS *c = (struct KNO_MONGODB_OPTS *)x;
+  u8_printf(out,"#<MongoDB/Opts 0x%x %q>",c->opts_flags,c->opts_table);
+  return 1;
+}
+
 static int mongodb_getflags(lispval mongodb);
 
-/* MongoDB multislots */
+/* Slot tables */
 
-/* These are slots which should always have vector (array) values, so
-   if their value is a choice, it is rendered as an array, but if it's
-   a singleton, it's rendered as an array of one value. */
+/* These are simple open-addressed hash tables of KNO_MONGODB_SLOTINFO
+   entries, keyed by symbols, OIDs, or strings. Immediate keys are
+   compared by identity and strings by content. */
 
-static int get_choiceslot(lispval slot)
+static unsigned int mongodb_hash_bytes(const unsigned char *bytes,size_t len)
 {
-  int i = 0, n = n_multislots;
-  while (i<n)
-    if (multislots[i] == slot)
-      return i;
-    else i++;
-  return -1;
+  unsigned int hash = 2166136261U;
+  const unsigned char *scan = bytes, *limit = bytes+len;
+  while (scan < limit) {
+    hash ^= *scan++;
+    hash *= 16777619U;}
+  return hash;
 }
 
-static int add_choiceslot(lispval slot)
+static unsigned int slot_hash(lispval key)
 {
-  int off = get_choiceslot(slot);
-  if (off>=0) return off;
+  if (KNO_STRINGP(key))
+    return mongodb_hash_bytes(KNO_CSTRING(key),KNO_STRLEN(key));
   else {
-    u8_lock_mutex(&multislots_lock);
-    int i = 0, n = n_multislots;
-    while (i<n)
-      if (multislots[i] == slot) {
-	u8_unlock_mutex(&multislots_lock);
-	return i;}
-      else i++;
-    if (i >= MONGO_MULTISLOTS_MAX) {
-      u8_unlock_mutex(&multislots_lock);
-      return -1;}
-    multislots[i] = slot;
-    n_multislots++;
-    u8_unlock_mutex(&multislots_lock);
-    return i;}
+    unsigned long long bits = (unsigned long long) key;
+    bits ^= (bits>>17);
+    bits *= 0x9E3779B97F4A7C15ULL;
+    return (unsigned int) (bits>>32);}
+}
+
+static int slot_keyeqp(lispval key,lispval probe)
+{
+  if (key == probe)
+    return 1;
+  else if ( (KNO_STRINGP(key)) && (KNO_STRINGP(probe)) )
+    return ( (KNO_STRLEN(key) == KNO_STRLEN(probe)) &&
+	     (memcmp(KNO_CSTRING(key),KNO_CSTRING(probe),
+		     KNO_STRLEN(key)) == 0) );
+  else return 0;
+}
+
+static struct KNO_MONGODB_SLOTINFO *
+slotinfo_lookup(struct KNO_MONGODB_SLOTINFO *slots,int n_buckets,lispval key)
+{
+  if (n_buckets <= 0) return NULL;
+  unsigned int probe = slot_hash(key)%n_buckets;
+  int i = 0; while (i < n_buckets) {
+    struct KNO_MONGODB_SLOTINFO *info = &(slots[probe]);
+    if (KNO_VOIDP(info->slot_key))
+      return NULL;
+    else if (slot_keyeqp(info->slot_key,key))
+      return info;
+    else probe = (probe+1)%n_buckets;
+    i++;}
+  return NULL;
+}
+
+/* This assumes that the table has room for *key* */
+static struct KNO_MONGODB_SLOTINFO *
+slotinfo_add(struct KNO_MONGODB_SLOTINFO *slots,int n_buckets,lispval key)
+{
+  unsigned int probe = slot_hash(key)%n_buckets;
+  while (1) {
+    struct KNO_MONGODB_SLOTINFO *info = &(slots[probe]);
+    if (KNO_VOIDP(info->slot_key)) {
+      info->slot_key = kno_incref(key);
+      info->slot_flags = 0;
+      info->slot_mapfn = KNO_VOID;
+      return info;}
+    else if (slot_keyeqp(info->slot_key,key))
+      return info;
+    else probe = (probe+1)%n_buckets;}
+}
+
+static struct KNO_MONGODB_SLOTINFO *new_slotinfo_table(int n_buckets)
+{
+  struct KNO_MONGODB_SLOTINFO *slots =
+    u8_alloc_n(n_buckets,struct KNO_MONGODB_SLOTINFO);
+  int i = 0; while (i < n_buckets) {
+    slots[i].slot_key = KNO_VOID;
+    slots[i].slot_flags = 0;
+    slots[i].slot_mapfn = KNO_VOID;
+    i++;}
+  return slots;
+}
+
+static void free_slotinfo_table(struct KNO_MONGODB_SLOTINFO *slots,int n_buckets)
+{
+  int i = 0; while (i < n_buckets) {
+    kno_decref(slots[i].slot_key);
+    kno_decref(slots[i].slot_mapfn);
+    i++;}
+  u8_free(slots);
+}
+
+/* Global slot properties */
+
+/* This is a registry of encoding properties for particular slots
+   (symbols or OIDs), combining the flags KNO_MONGODB_CHOICESLOT,
+   KNO_MONGODB_SYMSLOT, KNO_MONGODB_RAWSLOT, KNO_MONGODB_PREFCHOICES,
+   and KNO_MONGODB_VECSLOT. Choiceslots (or multislots) are slots which
+   should always have vector (array) values, so if their value is a
+   choice, it is rendered as an array, but if it's a singleton, it's
+   rendered as an array of one value. PREFCHOICES and VECSLOT
+   determine whether arrays stored in the slot are treated as choices
+   or vectors.
+
+   Lookups happen for every field encoded, so they don't lock.
+   Writers (which are rare) lock slotprops_lock and either add entries
+   in place (publishing the key last) or, when the table fills up,
+   copy it into a larger table which is then published. Old tables
+   are kept on the slotprops_prev chain since readers may still be
+   looking at them. */
+
+static struct KNO_MONGODB_SLOTINFO *
+slotprops_probe(struct MONGODB_SLOTPROPS *table,lispval slot)
+{
+  int n_buckets = table->slotprops_n_buckets;
+  struct KNO_MONGODB_SLOTINFO *slots = table->slotprops_slots;
+  unsigned int probe = slot_hash(slot)%n_buckets;
+  int i = 0; while (i < n_buckets) {
+    struct KNO_MONGODB_SLOTINFO *info = &(slots[probe]);
+    lispval key = __atomic_load_n(&(info->slot_key),__ATOMIC_ACQUIRE);
+    if (KNO_VOIDP(key))
+      return NULL;
+    else if (key == slot)
+      return info;
+    else probe = (probe+1)%n_buckets;
+    i++;}
+  return NULL;
+}
+
+static int get_slotprops(lispval slot)
+{
+  struct MONGODB_SLOTPROPS *table =
+    __atomic_load_n(&slotprops,__ATOMIC_ACQUIRE);
+  if (table == NULL) return 0;
+  struct KNO_MONGODB_SLOTINFO *info = slotprops_probe(table,slot);
+  if (info)
+    return __atomic_load_n(&(info->slot_flags),__ATOMIC_RELAXED);
+  else return 0;
+}
+
+static struct MONGODB_SLOTPROPS *grow_slotprops(struct MONGODB_SLOTPROPS *old)
+{
+  int old_buckets = (old) ? (old->slotprops_n_buckets) : (0);
+  int n_buckets = (old_buckets) ? ((old_buckets*2)+1) : (127);
+  struct MONGODB_SLOTPROPS *table = u8_alloc(struct MONGODB_SLOTPROPS);
+  struct KNO_MONGODB_SLOTINFO *slots = new_slotinfo_table(n_buckets);
+  if (old) {
+    struct KNO_MONGODB_SLOTINFO *scan = old->slotprops_slots;
+    struct KNO_MONGODB_SLOTINFO *limit = scan+old_buckets;
+    while (scan < limit) {
+      if (!(KNO_VOIDP(scan->slot_key))) {
+	struct KNO_MONGODB_SLOTINFO *info =
+	  slotinfo_add(slots,n_buckets,scan->slot_key);
+	info->slot_flags = scan->slot_flags;}
+      scan++;}}
+  table->slotprops_n_slots = (old) ? (old->slotprops_n_slots) : (0);
+  table->slotprops_n_buckets = n_buckets;
+  table->slotprops_slots = slots;
+  table->slotprops_prev = old;
+  return table;
+}
+
+/* Sets the flags *set* and clears the flags *clear* for *slot* */
+static int set_slotprops(lispval slot,int set,int clear)
+{
+  u8_lock_mutex(&slotprops_lock);
+  struct MONGODB_SLOTPROPS *table = slotprops;
+  struct KNO_MONGODB_SLOTINFO *info = (table) ?
+    (slotprops_probe(table,slot)) : (NULL);
+  if (info == NULL) {
+    if ( (table == NULL) ||
+	 (((table->slotprops_n_slots+1)*2) > table->slotprops_n_buckets) ) {
+      table = grow_slotprops(table);
+      __atomic_store_n(&slotprops,table,__ATOMIC_RELEASE);}
+    int n_buckets = table->slotprops_n_buckets;
+    unsigned int probe = slot_hash(slot)%n_buckets;
+    while (!(KNO_VOIDP(table->slotprops_slots[probe].slot_key)))
+      probe = (probe+1)%n_buckets;
+    info = &(table->slotprops_slots[probe]);
+    info->slot_flags = set & (~clear);
+    /* Publishing the key makes the entry visible */
+    __atomic_store_n(&(info->slot_key),kno_incref(slot),__ATOMIC_RELEASE);
+    table->slotprops_n_slots++;}
+  else {
+    int flags = (info->slot_flags | set) & (~clear);
+    __atomic_store_n(&(info->slot_flags),flags,__ATOMIC_RELEASE);}
+  __atomic_add_fetch(&slotprops_generation,1,__ATOMIC_RELEASE);
+  u8_unlock_mutex(&slotprops_lock);
+  return 1;
+}
+
+/* Applies global slot properties (in *props*) to *flags* */
+static int apply_slotprops(int flags,int props)
+{
+  if (props&KNO_MONGODB_PREFCHOICES)
+    flags |= KNO_MONGODB_PREFCHOICES;
+  else if (props&KNO_MONGODB_VECSLOT)
+    flags &= (~KNO_MONGODB_PREFCHOICES);
+  return flags;
+}
+
+static int slotprop_config_flag(void *data)
+{
+  return (int) ((intptr_t)data);
 }
 
-static lispval multislots_config_get(lispval var,void *data)
+static lispval slotprops_config_get(lispval var,void *data)
 {
+  int flag = slotprop_config_flag(data);
   lispval result = KNO_EMPTY;
-  int i = 0, n = n_multislots;
+  struct MONGODB_SLOTPROPS *table =
+    __atomic_load_n(&slotprops,__ATOMIC_ACQUIRE);
+  if (table == NULL) return result;
+  int i = 0, n = table->slotprops_n_buckets;
   while (i < n) {
-    lispval slot = multislots[i++];
-    KNO_ADD_TO_CHOICE(result,slot);}
+    struct KNO_MONGODB_SLOTINFO *info = &(table->slotprops_slots[i++]);
+    lispval slot = __atomic_load_n(&(info->slot_key),__ATOMIC_ACQUIRE);
+    if ( (!(KNO_VOIDP(slot))) && ((info->slot_flags)&flag) ) {
+      KNO_ADD_TO_CHOICE(result,slot);}}
   return result;
 }
 
-static int multislots_config_add(lispval var,lispval val,void *data)
+/* Setting one of the slot property configs adds a slot to it, and
+   setting it to a pair (slot . #f) takes the slot out of it */
+static int slotprops_config_add(lispval var,lispval val,void *data)
 {
-  lispval sym = KNO_VOID;
-  if (KNO_SYMBOLP(val))
-    sym = val;
+  int flag = slotprop_config_flag(data), remove = 0;
+  lispval slot = KNO_VOID;
+  if ( (KNO_PAIRP(val)) && (KNO_FALSEP(KNO_CDR(val))) ) {
+    val = KNO_CAR(val);
+    remove = 1;}
+  if ( (KNO_SYMBOLP(val)) || (KNO_OIDP(val)) )
+    slot = val;
   else if (KNO_STRINGP(val))
-    sym = kno_intern(CSTRING(val));
+    slot = kno_intern(CSTRING(val));
   else {
-    kno_seterr("Not symbolic","mongodb/multislots_config_add",
+    kno_seterr("Not symbolic","mongodb/slotprops_config_add",
 	       NULL,val);
     return -1;}
-  int rv = add_choiceslot(sym);
-  if (rv < 0) {
-    char buf[64];
-    kno_seterr("Too many multislots declared","mongodb/multislots_config_add",
-	       u8_sprintf(buf,sizeof(buf),"%d",MONGO_MULTISLOTS_MAX),
-	       val);
-    return rv;}
-  else return rv;
+  if (remove)
+    return set_slotprops(slot,0,flag);
+  /* A slot has one preferred array shape */
+  int clear = (flag == KNO_MONGODB_PREFCHOICES) ? (KNO_MONGODB_VECSLOT) :
+    (flag == KNO_MONGODB_VECSLOT) ? (KNO_MONGODB_PREFCHOICES) : (0);
+  return set_slotprops(slot,flag,clear);
+}
+
+/* Compiled fieldmaps */
+
+/* A fieldmap table can specify, for particular slots, a mapping
+   function and whether the slot is a rawslot, symslot, or choiceslot.
+   Checking all of those for every field of every document is a lot of
+   table probes, so MONGODB/FIELDMAP compiles a fieldmap table into a
+   KNO_MONGODB_FIELDMAP which answers all of them with one probe. */
+
+static struct KNO_MONGODB_SLOTINFO *
+fieldmap_lookup(struct KNO_MONGODB_FIELDMAP *fm,lispval key)
+{
+  return slotinfo_lookup(fm->fieldmap_slots,fm->fieldmap_n_buckets,key);
+}
+
+static void add_fieldmap_flag(struct KNO_MONGODB_SLOTINFO *slots,int n_buckets,
+			      lispval keys,int flag)
+{
+  KNO_DO_CHOICES(key,keys) {
+    if ( (KNO_SYMBOLP(key)) || (KNO_OIDP(key)) || (KNO_STRINGP(key)) ) {
+      struct KNO_MONGODB_SLOTINFO *info = slotinfo_add(slots,n_buckets,key);
+      info->slot_flags |= flag;}}
+}
+
+static lispval compile_fieldmap(lispval source)
+{
+  lispval keys = kno_getkeys(source);
+  if (KNO_ABORTP(keys)) return keys;
+  lispval rawslots = kno_getopt(source,rawslots_symbol,KNO_EMPTY);
+  lispval symslots = kno_getopt(source,symslots_symbol,KNO_EMPTY);
+  lispval choiceslots = kno_getopt(source,choiceslots_symbol,KNO_EMPTY);
+  lispval internslots = kno_getopt(source,internslots_symbol,KNO_EMPTY);
+  int n = KNO_CHOICE_SIZE(keys) + KNO_CHOICE_SIZE(rawslots) +
+    KNO_CHOICE_SIZE(symslots) + KNO_CHOICE_SIZE(choiceslots) +
+    KNO_CHOICE_SIZE(internslots);
+  int n_buckets = (n*2)+1, string_keys = 0, n_mapfns = 0;
+  struct KNO_MONGODB_SLOTINFO *slots = new_slotinfo_table(n_buckets);
+  {KNO_DO_CHOICES(key,keys) {
+      if ( (key == rawslots_symbol) || (key == symslots_symbol) ||
+	   (key == choiceslots_symbol) || (key == internslots_symbol) )
+	continue;
+      else if ( (KNO_SYMBOLP(key)) || (KNO_OIDP(key)) || (KNO_STRINGP(key)) ) {
+	struct KNO_MONGODB_SLOTINFO *info = slotinfo_add(slots,n_buckets,key);
+	lispval mapfn = kno_get(source,key,KNO_VOID);
+	kno_decref(info->slot_mapfn);
+	info->slot_mapfn = mapfn;
+	if (!(KNO_VOIDP(mapfn))) n_mapfns++;
+	if (KNO_STRINGP(key)) string_keys = 1;}
+      else NO_ELSE;}}
+  add_fieldmap_flag(slots,n_buckets,rawslots,KNO_MONGODB_RAWSLOT);
+  add_fieldmap_flag(slots,n_buckets,symslots,KNO_MONGODB_SYMSLOT);
+  add_fieldmap_flag(slots,n_buckets,choiceslots,KNO_MONGODB_CHOICESLOT);
+  add_fieldmap_flag(slots,n_buckets,internslots,KNO_MONGODB_INTERNSLOT);
+  int n_slots = 0, i = 0; while (i < n_buckets) {
+    if (!(KNO_VOIDP(slots[i].slot_key))) n_slots++;
+    i++;}
+  kno_decref(keys);
+  kno_decref(rawslots);
+  kno_decref(symslots);
+  kno_decref(choiceslots);
+  kno_decref(internslots);
+  struct KNO_MONGODB_FIELDMAP *fm = u8_alloc(struct KNO_MONGODB_FIELDMAP);
+  KNO_INIT_CONS(fm,kno_mongoc_fieldmap);
+  fm->fieldmap_source = kno_incref(source);
+  fm->fieldmap_n_slots = n_slots;
+  fm->fieldmap_n_buckets = n_buckets;
+  fm->fieldmap_string_keys = string_keys;
+  fm->fieldmap_n_mapfns = n_mapfns;
+  fm->fieldmap_slots = slots;
+  return (lispval) fm;
+}
+
+DEFC_PRIM("mongodb/fieldmap",mongodb_fieldmap,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Compiles the fieldmap table *spec* into a fieldmap descriptor "
+	  "which can be used as the `fieldmap` option anywhere a fieldmap "
+	  "table can.",
+	  {"spec",kno_any_type,KNO_VOID})
+static lispval mongodb_fieldmap(lispval spec)
+{
+  if (KNO_TYPEP(spec,kno_mongoc_fieldmap))
+    return kno_incref(spec);
+  else if (KNO_TABLEP(spec))
+    return compile_fieldmap(spec);
+  else return kno_type_error("fieldmap table","mongodb_fieldmap",spec);
+}
+
+static void recycle_fieldmap(struct KNO_RAW_CONS *c)
+{
+  struct KNO_MONGODB_FIELDMAP *fm = (struct KNO_MONGODB_FIELDMAP *)c;
+  free_slotinfo_table(fm->fieldmap_slots,fm->fieldmap_n_buckets);
+  kno_decref(fm->fieldmap_source);
+  if (!(KNO_STATIC_CONSP(c))) u8_free(c);
+}
+static int unparse_fieldmap(struct U8_OUTPUT *out,lispval x)
+{
+  struct KNO_MONGODB_FIELDMAP *fm = (struct KNO_MONGODB_FIELDMAP *)x;
+  u8_printf(out,"#<MongoDB/Fieldmap %d slots>",fm->fieldmap_n_slots);
+  return 1;
+}
+
+/* Field caches */
+
+/* A field cache belongs to a single decoding context (a cursor or a
+   single collection/find call) and saves resolving the same field
+   names into slotids over and over. It is keyed on the field name (as
+   stored) and the flags in effect when reading it, and is cleared
+   whenever it is used with a different fieldmap or `internslots`
+   option, since those also change how fields are resolved. When it
+   fills up, further fields just aren't cached. */
+
+#define FIELDCACHE_MAX_FIELDS 96
+
+static int fieldcache_max_fields = FIELDCACHE_MAX_FIELDS;
+
+static struct KNO_BSON_FIELDCACHE *new_fieldcache()
+{
+  if (fieldcache_max_fields <= 0) return NULL;
+  int n_buckets = (fieldcache_max_fields*4)/3+1;
+  struct KNO_BSON_FIELDCACHE *fc = u8_alloc(struct KNO_BSON_FIELDCACHE);
+  fc->fieldcache_n_buckets = n_buckets;
+  fc->fieldcache_n_fields = 0;
+  fc->fieldcache_generation = slotprops_generation;
+  fc->fieldcache_fieldmap = KNO_VOID;
+  fc->fieldcache_internslots = KNO_VOID;
+  fc->fieldcache_fields = u8_alloc_n(n_buckets,struct KNO_BSON_FIELDINFO);
+  memset(fc->fieldcache_fields,0,n_buckets*sizeof(struct KNO_BSON_FIELDINFO));
+  return fc;
+}
+
+static void clear_fieldcache(struct KNO_BSON_FIELDCACHE *fc)
+{
+  int i = 0, n = fc->fieldcache_n_buckets;
+  struct KNO_BSON_FIELDINFO *fields = fc->fieldcache_fields;
+  while (i < n) {
+    struct KNO_BSON_FIELDINFO *info = &(fields[i++]);
+    if (info->field_name) {
+      u8_free(info->field_name);
+      kno_decref(info->field_slotid);
+      kno_decref(info->field_mapfn);}}
+  memset(fields,0,n*sizeof(struct KNO_BSON_FIELDINFO));
+  fc->fieldcache_n_fields = 0;
+  kno_decref(fc->fieldcache_fieldmap);
+  fc->fieldcache_fieldmap = KNO_VOID;
+  kno_decref(fc->fieldcache_internslots);
+  fc->fieldcache_internslots = KNO_VOID;
+}
+
+static void free_fieldcache(struct KNO_BSON_FIELDCACHE *fc)
+{
+  if (fc == NULL) return;
+  clear_fieldcache(fc);
+  u8_free(fc->fieldcache_fields);
+  u8_free(fc);
+}
+
+/* Field caches are only used with compiled fieldmaps (or none), since
+   fieldmap tables may change while a cursor is open. This returns 1
+   if *fc* can be used with *fieldmap* and *opts*, clearing it if it
+   was being used with a different fieldmap or `internslots` option. */
+static int use_fieldcache(struct KNO_BSON_FIELDCACHE *fc,lispval fieldmap,
+			  lispval opts)
+{
+  if (fc == NULL)
+    return 0;
+  else if (! ( (KNO_VOIDP(fieldmap)) ||
+	       (KNO_TYPEP(fieldmap,kno_mongoc_fieldmap)) ) )
+    return 0;
+  lispval internslots = kno_getopt(opts,internslots_symbol,KNO_VOID);
+  if ( (fc->fieldcache_fieldmap != fieldmap) ||
+       (fc->fieldcache_generation != slotprops_generation) ||
+       ( (fc->fieldcache_internslots != internslots) &&
+	 (!(kno_equalp(fc->fieldcache_internslots,internslots))) ) ) {
+    clear_fieldcache(fc);
+    fc->fieldcache_fieldmap = kno_incref(fieldmap);
+    fc->fieldcache_internslots = internslots;
+    fc->fieldcache_generation = slotprops_generation;}
+  else kno_decref(internslots);
+  return 1;
+}
+
+static struct KNO_BSON_FIELDINFO *
+fieldcache_lookup(struct KNO_BSON_FIELDCACHE *fc,const u8_byte *field,int flags)
+{
+  size_t len = strlen(field);
+  unsigned int hash = mongodb_hash_bytes(field,len);
+  int n_buckets = fc->fieldcache_n_buckets, i = 0;
+  unsigned int probe = hash%n_buckets;
+  struct KNO_BSON_FIELDINFO *fields = fc->fieldcache_fields;
+  while (i < n_buckets) {
+    struct KNO_BSON_FIELDINFO *info = &(fields[probe]);
+    if (info->field_name == NULL)
+      return NULL;
+    else if ( (info->field_hash == hash) && (info->field_len == len) &&
+	      (info->field_inflags == flags) &&
+	      (memcmp(info->field_name,field,len) == 0) )
+      return info;
+    else probe = (probe+1)%n_buckets;
+    i++;}
+  return NULL;
+}
+
+static void fieldcache_add(struct KNO_BSON_FIELDCACHE *fc,const u8_byte *field,
+			   int inflags,int flags,lispval slotid,lispval mapfn,
+			   int symslot,int choiceslot,
+			   struct KNO_MONGODB_INTERNS *interns)
+{
+  if (fc->fieldcache_n_fields >= fieldcache_max_fields) return;
+  size_t len = strlen(field);
+  unsigned int hash = mongodb_hash_bytes(field,len);
+  int n_buckets = fc->fieldcache_n_buckets;
+  unsigned int probe = hash%n_buckets;
+  struct KNO_BSON_FIELDINFO *fields = fc->fieldcache_fields;
+  while (fields[probe].field_name) probe = (probe+1)%n_buckets;
+  struct KNO_BSON_FIELDINFO *info = &(fields[probe]);
+  u8_byte *name = u8_malloc(len+1);
+  memcpy(name,field,len+1);
+  info->field_hash = hash;
+  info->field_len = len;
+  info->field_name = name;
+  info->field_inflags = inflags;
+  info->field_flags = flags;
+  info->field_symslot = symslot;
+  info->field_choiceslot = choiceslot;
+  info->field_slotid = kno_incref(slotid);
+  info->field_mapfn = kno_incref(mapfn);
+  info->field_interns = interns;
+  fc->fieldcache_n_fields++;
+}
+
+/* Interned values */
+
+/* Slots flagged as internslots (in a fieldmap, with the `internslots`
+   option or with the MONGODB:INTERNSLOTS config) share a single string
+   for each distinct value read. Each slot's table holds at most
+   MONGODB:INTERNMAX distinct values; when it fills up, it is emptied
+   (and resized if MONGODB:INTERNMAX has changed) and starts over with
+   the values read after that. There are at most INTERNS_MAX_TABLES
+   tables and other slots just aren't interned. Lookups only take a
+   read lock, so parallel decoders can share tables. */
+
+#define INTERNS_MAX_VALUES 256
+#define INTERNS_MAX_TABLES 256
+
+static int interns_max_values = INTERNS_MAX_VALUES;
+static int n_intern_tables = 0;
+static struct KNO_MONGODB_INTERNS *intern_tables = NULL;
+static u8_mutex intern_tables_lock;
+
+static struct KNO_MONGODB_INTERNS *probe_interns(lispval slot)
+{
+  struct KNO_MONGODB_INTERNS *scan =
+    __atomic_load_n(&intern_tables,__ATOMIC_ACQUIRE);
+  while (scan) {
+    if (scan->interns_slot == slot) return scan;
+    else scan = scan->interns_next;}
+  return NULL;
+}
+
+static void init_intern_values(struct KNO_MONGODB_INTERNS *interns,
+			       int max_values)
+{
+  if (max_values < 0) max_values = 0;
+  int n_buckets = max_values*2+1;
+  interns->interns_n_values = 0;
+  interns->interns_max_values = max_values;
+  interns->interns_n_buckets = n_buckets;
+  interns->interns_values = u8_alloc_n(n_buckets,lispval);
+  memset(interns->interns_values,0,n_buckets*sizeof(lispval));
+}
+
+/* This is called with the table's write lock held */
+static void flush_interns(struct KNO_MONGODB_INTERNS *interns)
+{
+  lispval *values = interns->interns_values;
+  int i = 0, n = interns->interns_n_buckets;
+  while (i < n) {
+    lispval v = values[i++];
+    if (v != KNO_NULL) kno_decref(v);}
+  u8_free(values);
+  init_intern_values(interns,interns_max_values);
+}
+
+/* Returns the intern table for *slot*, creating it if needed, or NULL
+   if interning is disabled or there are already too many tables. */
+static struct KNO_MONGODB_INTERNS *get_interns(lispval slot)
+{
+  struct KNO_MONGODB_INTERNS *interns = probe_interns(slot);
+  if (interns) return interns;
+  else if (interns_max_values <= 0) return NULL;
+  u8_lock_mutex(&intern_tables_lock);
+  interns = probe_interns(slot);
+  if ( (interns == NULL) && (n_intern_tables < INTERNS_MAX_TABLES) ) {
+    interns = u8_alloc(struct KNO_MONGODB_INTERNS);
+    interns->interns_slot = kno_incref(slot);
+    init_intern_values(interns,interns_max_values);
+    u8_init_rwlock(&(interns->interns_lock));
+    interns->interns_next = intern_tables;
+    n_intern_tables++;
+    __atomic_store_n(&intern_tables,interns,__ATOMIC_RELEASE);}
+  u8_unlock_mutex(&intern_tables_lock);
+  return interns;
+}
+
+/* This is called with the table locked */
+static lispval *probe_intern(struct KNO_MONGODB_INTERNS *interns,
+			     const unsigned char *bytes,int len,
+			     unsigned int hash)
+{
+  int n_buckets = interns->interns_n_buckets, i = 0;
+  lispval *values = interns->interns_values;
+  unsigned int probe = hash%n_buckets;
+  while (i < n_buckets) {
+    lispval v = values[probe];
+    if (v == KNO_NULL)
+      return &(values[probe]);
+    else if ( (KNO_STRLEN(v) == len) &&
+	      (memcmp(KNO_CSTRING(v),bytes,len) == 0) )
+      return &(values[probe]);
+    else probe = (probe+1)%n_buckets;
+    i++;}
+  return NULL;
+}
+
+/* Returns a string for *bytes*, sharing an existing one from
+   *interns* if there is one. */
+static lispval bson_make_string(struct KNO_MONGODB_INTERNS *interns,
+				const unsigned char *bytes,int len)
+{
+  if (interns == NULL)
+    return kno_make_string(NULL,len,(unsigned char *)bytes);
+  if (len < 0) len = strlen(bytes);
+  unsigned int hash = mongodb_hash_bytes(bytes,len);
+  lispval result = KNO_VOID;
+  u8_read_lock(&(interns->interns_lock));
+  lispval *entry = probe_intern(interns,bytes,len,hash);
+  if ( (entry) && (*entry != KNO_NULL) )
+    result = kno_incref(*entry);
+  u8_rw_unlock(&(interns->interns_lock));
+  if (!(KNO_VOIDP(result))) return result;
+  result = kno_make_string(NULL,len,(unsigned char *)bytes);
+  u8_write_lock(&(interns->interns_lock));
+  if ( (interns->interns_n_values >= interns->interns_max_values) &&
+       ( (interns->interns_n_values > 0) ||
+	 (interns->interns_max_values != interns_max_values) ) )
+    flush_interns(interns);
+  entry = probe_intern(interns,bytes,len,hash);
+  if (entry == NULL) {}
+  else if (*entry != KNO_NULL) {
+    /* Someone else interned it first */
+    kno_decref(result);
+    result = kno_incref(*entry);}
+  else if (interns->interns_n_values < interns->interns_max_values) {
+    *entry = kno_incref(result);
+    interns->interns_n_values++;}
+  else NO_ELSE;
+  u8_rw_unlock(&(interns->interns_lock));
+  return result;
 }
 
 /* Consing MongoDB clients, collections, and cursors */
@@ -877,79 +1874,527 @@ static mongoc_uri_t *setup_mongoc_uri(mongoc_uri_t *info,lispval opts)
   return info;
 }
 
+static u8_string ping_client(mongoc_client_t *client)
+{
+  bson_t *command = BCON_NEW("ping",BCON_INT32(1)), reply;
+  bson_error_t error;
+  bool rv = mongoc_client_command_simple(client,"admin",command,NULL,
+					 &reply,&error);
+  bson_destroy(command);
+  if (! rv )
+    return u8_strdup(error.message);
+  else {
+    bson_destroy(&reply);
+    return NULL;}
+}
+
 static u8_string mongodb_check(mongoc_client_pool_t *client_pool)
 {
   mongoc_client_t *probe = mongoc_client_pool_pop(client_pool);
   if (probe) {
-    bson_t *command = BCON_NEW("ping",BCON_INT32(1)), reply;
-    bson_error_t error;
-    bool rv = mongoc_client_command_simple(probe,"admin",command,NULL,&reply,&error);
+    u8_string errmsg = ping_client(probe);
     mongoc_client_pool_push(client_pool,probe);
-    bson_destroy(command);
-    if (! rv )
-      return u8_strdup(error.message);
-    else {
-      bson_destroy(&reply);
-      return NULL;}}
+    return errmsg;}
   else return u8_strdup("mongoc_client_pool_pop failed");
 }
 
-#if MONGOC_CHECK_VERSION(1,7,0)
-#define mongoc_uri_info(s,e) mongoc_uri_new_with_error((s),e)
-#else
-#define mongoc_uri_info(s,e) mongoc_uri_new((s))
-#endif
+/* Threads */
 
-/* This returns a MongoDB server object which wraps a MongoDB client
-   pool. */
+/* Threads started by this module (decoders, prefetchers, scanners,
+   pool keepers and the like) are set up the way Kno sets up its own
+   threads: the stack is recorded for stack checks, thread init
+   functions are run before they start, and thread exit functions
+   (which free thread-local state like encode plans and thread
+   clients) are run when they finish. */
 
-DEFC_PRIM("mongodb/open",mongodb_open,
-	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
-	  "**undocumented**",
-	  {"arg",kno_any_type,KNO_VOID},
-	  {"opts",kno_any_type,KNO_VOID})
-static lispval mongodb_open(lispval arg,lispval opts)
-{
-  mongoc_client_pool_t *client_pool;
-  mongoc_uri_t *info;
-  mongoc_ssl_opt_t ssl_opts={ 0 };
-  bson_error_t error = { 0 };
-  int smoke_test = boolopt(opts,smoketest_sym,1);
-  int flags = getflags(opts,mongodb_defaults);;
+struct MONGODB_THREAD_START {
+  void *(*start_fn)(void *);
+  void *start_arg;};
 
-  if ( (KNO_STRINGP(arg)) || (KNO_TYPEP(arg,kno_secret_type)) )
-    info = mongoc_uri_info(KNO_CSTRING(arg),&error);
-  else if (KNO_SYMBOLP(arg)) {
-    lispval conf_val = kno_config_get(KNO_SYMBOL_NAME(arg));
-    if (KNO_VOIDP(conf_val))
-      return kno_type_error("MongoDB URI config","mongodb_open",arg);
-    else if ((KNO_STRINGP(conf_val))||
-	     (KNO_TYPEP(conf_val,kno_secret_type))) {
-      info = mongoc_uri_info(KNO_CSTRING(conf_val),&error);
-      kno_decref(conf_val);}
-    else return kno_type_error("MongoDB URI config val",
-			       KNO_SYMBOL_NAME(arg),conf_val);}
-  else return kno_type_error("MongoDB URI","mongodb_open",arg);
+static void *mongodb_thread_main(void *arg)
+{
+  struct MONGODB_THREAD_START *start = (struct MONGODB_THREAD_START *)arg;
+  void *(*fn)(void *) = start->start_fn;
+  void *fn_arg = start->start_arg;
+  u8_free(start);
+  u8_init_stack();
+  kno_init_cstack();
+  u8_threadcheck();
+  void *result = fn(fn_arg);
+  kno_clear_errors(0);
+  u8_threadexit();
+  return result;
+}
 
-  if (info == NULL)
-    return kno_err("MongoDB URI spec","mongodb_open",NULL,arg);
-  else info = setup_mongoc_uri(info,opts);
+/* This is like pthread_create (and returns what it does) */
+static int mongodb_thread_create(pthread_t *thread,void *(*fn)(void *),
+				 void *arg)
+{
+  struct MONGODB_THREAD_START *start = u8_alloc(struct MONGODB_THREAD_START);
+  start->start_fn = fn;
+  start->start_arg = arg;
+  int rv = pthread_create(thread,NULL,mongodb_thread_main,start);
+  if (rv) u8_free(start);
+  return rv;
+}
+
+/* Worker threads keep the first error they run into in a
+   MONGODB_THREAD_ERROR, which the thread waiting on them signals
+   again (with its condition, context, details and irritant) when it
+   reports the failure. */
+
+struct MONGODB_THREAD_ERROR {
+  u8_condition error_cond;
+  u8_context error_context;
+  u8_string error_details;
+  lispval error_irritant;};
+
+/* This records an error in *err* unless it already has one. A NULL
+   *cxt* means the context of whoever signals the error. */
+static void thread_error_set(struct MONGODB_THREAD_ERROR *err,
+			     u8_condition cond,u8_context cxt,
+			     u8_string details,lispval irritant)
+{
+  if (err->error_cond) return;
+  err->error_cond = cond;
+  err->error_context = cxt;
+  err->error_details = (details) ? (u8_strdup(details)) : (NULL);
+  err->error_irritant = kno_incref(irritant);
+}
+
+/* This records the current exception in *err* (or *cond* if there
+   isn't one) */
+static void thread_error_catch(struct MONGODB_THREAD_ERROR *err,
+			       u8_condition cond,u8_string details)
+{
+  u8_exception ex = u8_current_exception;
+  if (ex)
+    thread_error_set(err,ex->u8x_cond,ex->u8x_context,ex->u8x_details,
+		     kno_exception_xdata(ex));
+  else thread_error_set(err,cond,NULL,details,KNO_VOID);
+}
+
+/* This signals the error in *err*, using *cxt* and *irritant* if it
+   doesn't have its own */
+static lispval thread_error_raise(struct MONGODB_THREAD_ERROR *err,
+				  u8_context cxt,lispval irritant)
+{
+  kno_seterr(err->error_cond,
+	     (err->error_context) ? (err->error_context) : (cxt),
+	     err->error_details,
+	     (KNO_VOIDP(err->error_irritant)) ? (irritant) :
+	     (err->error_irritant));
+  return KNO_ERROR_VALUE;
+}
+
+static void thread_error_free(struct MONGODB_THREAD_ERROR *err)
+{
+  if (err->error_cond == NULL) return;
+  if (err->error_details) u8_free(err->error_details);
+  kno_decref(err->error_irritant);
+  err->error_cond = NULL;
+  err->error_details = NULL;
+  err->error_irritant = KNO_VOID;
+}
+
+/* Warming up client pools */
+
+/* The `warmup` option to mongodb/open gets clients from the pool and
+   pings them in parallel, so that their connections are established
+   (and authenticated) before they're needed. With the `poolmin`
+   option, a keeper thread also does this every
+   MONGODB:KEEPER:INTERVAL seconds for as many clients as it takes to
+   keep *poolmin* clients connected. The keeper never blocks waiting
+   for clients. */
+
+/* This is libmongoc's default max pool size */
+#define MONGODB_DEFAULT_POOLMAX 100
+
+#define KEEPER_RUNNING 1
+#define KEEPER_STOPPING 2
+
+static int pool_keeper_interval = 30;
+
+struct MONGODB_WARMUP {
+  mongoc_client_t *warmup_client;
+  u8_string warmup_error;
+  pthread_t warmup_thread;
+  int warmup_threaded;};
+
+static void *warmup_client(void *arg)
+{
+  struct MONGODB_WARMUP *w = (struct MONGODB_WARMUP *)arg;
+  w->warmup_error = ping_client(w->warmup_client);
+  return NULL;
+}
+
+/* This pings up to *n* clients from *pool* in parallel and returns
+   the number of clients which were pinged successfully. It takes the
+   clients straight from the pool, so they aren't counted as pops (or
+   as busy); successful pings are counted as warmups instead. */
+static int warm_pool(struct KNO_MONGODB_POOL *pool,int n,int block)
+{
+  if (n <= 0) return 0;
+  struct MONGODB_WARMUP *warm = u8_alloc_n(n,struct MONGODB_WARMUP);
+  int n_clients = 0, n_ok = 0, i;
+  while (n_clients < n) {
+    mongoc_client_t *client = (block) ?
+      (mongoc_client_pool_pop(pool->pool_clients)) :
+      (mongoc_client_pool_try_pop(pool->pool_clients));
+    IGNORE_ERRNO(client);
+    if (client == NULL) break;
+    warm[n_clients].warmup_client = client;
+    warm[n_clients].warmup_error = NULL;
+    warm[n_clients].warmup_threaded = 0;
+    n_clients++;}
+  i = 1; while (i < n_clients) {
+    struct MONGODB_WARMUP *w = &(warm[i++]);
+    if (mongodb_thread_create(&(w->warmup_thread),warmup_client,w) == 0)
+      w->warmup_threaded = 1;
+    else warmup_client(w);}
+  if (n_clients > 0) warmup_client(&(warm[0]));
+  i = 0; while (i < n_clients) {
+    struct MONGODB_WARMUP *w = &(warm[i++]);
+    if (w->warmup_threaded) pthread_join(w->warmup_thread,NULL);
+    if (w->warmup_error) {
+      u8_logf(LOG_WARN,"MongoDB/warmup","Couldn't warm up client: %s",
+	      w->warmup_error);
+      u8_free(w->warmup_error);}
+    else n_ok++;
+    mongoc_client_pool_push(pool->pool_clients,w->warmup_client);}
+  u8_free(warm);
+  __atomic_add_fetch(&(pool->pool_stats.pool_warmups),n_ok,__ATOMIC_RELAXED);
+  return n_ok;
+}
+
+static void *pool_keeper(void *arg)
+{
+  struct KNO_MONGODB_POOL *pool = (struct KNO_MONGODB_POOL *)arg;
+  u8_lock_mutex(&(pool->pool_keeper_lock));
+  while (pool->pool_keeper_state == KEEPER_RUNNING) {
+    struct timespec until;
+    int interval = (pool_keeper_interval > 0) ? (pool_keeper_interval) : (1);
+    clock_gettime(CLOCK_REALTIME,&until);
+    until.tv_sec += interval;
+    u8_condvar_timedwait(&(pool->pool_keeper_wakeup),
+			 &(pool->pool_keeper_lock),
+			 &until);
+    if (pool->pool_keeper_state != KEEPER_RUNNING) break;
+    u8_unlock_mutex(&(pool->pool_keeper_lock));
+    int busy = __atomic_load_n(&(pool->pool_stats.pool_busy),__ATOMIC_RELAXED);
+    int poolmin = __atomic_load_n(&(pool->pool_min),__ATOMIC_RELAXED);
+    warm_pool(pool,poolmin-busy,MONGODB_CLIENT_NOBLOCK);
+    u8_lock_mutex(&(pool->pool_keeper_lock));}
+  u8_unlock_mutex(&(pool->pool_keeper_lock));
+  return NULL;
+}
+
+/* This is called with client_pools_lock held. A keeper which is
+   stopping is left alone, since release_pool restarts it (if it's
+   still needed) once it has stopped. */
+static void start_pool_keeper(struct KNO_MONGODB_POOL *pool)
+{
+  if (pool->pool_keeper_state) return;
+  pool->pool_keeper_state = KEEPER_RUNNING;
+  int rv = mongodb_thread_create(&(pool->pool_keeper),pool_keeper,pool);
+  if (rv) {
+    u8_logf(LOG_WARN,"MongoDB/keeper","Couldn't start pool keeper: %s",
+	    strerror(rv));
+    pool->pool_keeper_state = 0;}
+}
+
+/* This tells the keeper to stop without waiting for it */
+static void signal_pool_keeper(struct KNO_MONGODB_POOL *pool)
+{
+  u8_lock_mutex(&(pool->pool_keeper_lock));
+  pool->pool_keeper_state = KEEPER_STOPPING;
+  u8_condvar_broadcast(&(pool->pool_keeper_wakeup));
+  u8_unlock_mutex(&(pool->pool_keeper_lock));
+}
+
+static void stop_pool_keeper(struct KNO_MONGODB_POOL *pool)
+{
+  if (pool->pool_keeper_state != KEEPER_RUNNING) return;
+  signal_pool_keeper(pool);
+  pthread_join(pool->pool_keeper,NULL);
+  pool->pool_keeper_state = 0;
+}
+
+/* Sharing client pools */
+
+/* Client pools are kept in a process-wide registry and shared by all
+   the servers opened with the same key, which combines the parts of
+   the URI that matter for connections (hosts, credentials and URI
+   options) with the TLS options, poolmax and lanes. Credentials
+   (including the TLS certificate password) only go into the key as a
+   SHA-256 hash, so they aren't kept in the registry. Pools are
+   refcounted by the servers using them. */
+
+static struct KNO_MONGODB_POOL *client_pools = NULL;
+static u8_mutex client_pools_lock;
+
+static void add_key_string(struct U8_OUTPUT *out,u8_string string)
+{
+  u8_putc(out,'|');
+  if (string) u8_puts(out,string);
+}
+
+static void add_key_bson(struct U8_OUTPUT *out,const bson_t *doc)
+{
+  u8_putc(out,'|');
+  if (doc) {
+    char *json = bson_as_json(doc,NULL);
+    u8_puts(out,json);
+    bson_free(json);}
+}
+
+static int compare_lane_names(const void *x,const void *y)
+{
+  lispval xl = *((lispval *)x), yl = *((lispval *)y);
+  return strcmp(KNO_SYMBOL_NAME(xl),KNO_SYMBOL_NAME(yl));
+}
+
+/* This adds the lanes of *spec* to a pool key, ordered by name */
+static void add_key_lanes(struct U8_OUTPUT *out,lispval spec)
+{
+  u8_putc(out,'|');
+  if (!(KNO_TABLEP(spec))) return;
+  lispval keys = kno_getkeys(spec);
+  int n = KNO_CHOICE_SIZE(keys), n_lanes = 0;
+  lispval *names = u8_alloc_n((n) ? (n) : (1),lispval);
+  {KNO_DO_CHOICES(key,keys) {
+      if (KNO_SYMBOLP(key)) names[n_lanes++] = key;}}
+  qsort(names,n_lanes,sizeof(lispval),compare_lane_names);
+  int i = 0; while (i < n_lanes) {
+    lispval v = kno_get(spec,names[i],KNO_VOID);
+    if (KNO_UINTP(v))
+      u8_printf(out,"%s=%d,",KNO_SYMBOL_NAME(names[i]),KNO_FIX2INT(v));
+    kno_decref(v);
+    i++;}
+  u8_free(names);
+  kno_decref(keys);
+}
+
+static u8_string get_pool_key(mongoc_uri_t *info,mongoc_ssl_opt_t *ssl_opts,
+			      int poolmax,lispval lanes)
+{
+  struct U8_OUTPUT out; U8_INIT_OUTPUT(&out,256);
+  const mongoc_host_list_t *hosts = mongoc_uri_get_hosts(info);
+  while (hosts) {
+    u8_string host = u8_downcase(hosts->host_and_port);
+    u8_puts(&out,host); u8_putc(&out,',');
+    u8_free(host);
+    hosts = hosts->next;}
+#if MONGOC_CHECK_VERSION(1,11,0)
+  add_key_string(&out,mongoc_uri_get_srv_hostname(info));
+#endif
+  struct U8_OUTPUT creds; U8_INIT_OUTPUT(&creds,128);
+  add_key_string(&creds,mongoc_uri_get_username(info));
+  add_key_string(&creds,mongoc_uri_get_password(info));
+  /* Authentication defaults to the URI's database */
+  if ( (mongoc_uri_get_username(info)) &&
+       (mongoc_uri_get_auth_source(info) == NULL) )
+    add_key_string(&creds,mongoc_uri_get_database(info));
+  else add_key_string(&creds,NULL);
+  add_key_bson(&creds,mongoc_uri_get_credentials(info));
+  if (ssl_opts) add_key_string(&creds,ssl_opts->pem_pwd);
+  unsigned char digest[32];
+  u8_sha256(creds.u8_outbuf,creds.u8_write-creds.u8_outbuf,digest);
+  memset(creds.u8_outbuf,0,creds.u8_write-creds.u8_outbuf);
+  u8_close((u8_stream)&creds);
+  u8_putc(&out,'|');
+  int i = 0; while (i < 32) u8_printf(&out,"%02x",digest[i++]);
+  add_key_bson(&out,mongoc_uri_get_options(info));
+  if (ssl_opts) {
+    add_key_string(&out,ssl_opts->pem_file);
+    add_key_string(&out,ssl_opts->ca_file);
+    add_key_string(&out,ssl_opts->ca_dir);
+    add_key_string(&out,ssl_opts->crl_file);}
+  u8_printf(&out,"|%d",poolmax);
+  add_key_lanes(&out,lanes);
+  return out.u8_outbuf;
+}
+
+/* This returns a pool for *key* (which it takes), creating it from
+   *info* if needed, and increments its refcount. Since *lanes* are
+   part of the key, the servers sharing a pool share its lanes. */
+static struct KNO_MONGODB_POOL *use_pool(u8_string key,mongoc_uri_t *info,
+					 mongoc_ssl_opt_t *ssl_opts,
+					 int poolmax,lispval lanes,
+					 u8_string dbspec)
+{
+  u8_lock_mutex(&client_pools_lock);
+  struct KNO_MONGODB_POOL *scan = client_pools;
+  while (scan) {
+    if (strcmp(scan->pool_key,key) == 0) {
+      scan->pool_refcount++;
+      u8_unlock_mutex(&client_pools_lock);
+      u8_free(key);
+      return scan;}
+    else scan = scan->pool_next;}
+  mongoc_client_pool_t *clients = mongoc_client_pool_new(info);
+  if (clients == NULL) {
+    u8_unlock_mutex(&client_pools_lock);
+    u8_free(key);
+    return NULL;}
+  if (ssl_opts) mongoc_client_pool_set_ssl_opts(clients,ssl_opts);
+  if (poolmax > 0) mongoc_client_pool_max_size(clients,poolmax);
+  struct KNO_MONGODB_POOL *pool = u8_alloc(struct KNO_MONGODB_POOL);
+  memset(pool,0,sizeof(struct KNO_MONGODB_POOL));
+  pool->pool_key = key;
+  pool->pool_refcount = 1;
+  pool->pool_clients = clients;
+  pool->pool_stats.pool_max = poolmax;
+  if (KNO_TABLEP(lanes))
+    pool->pool_lanes =
+      make_lanes(lanes,(poolmax) ? (poolmax) : (MONGODB_DEFAULT_POOLMAX),
+		 dbspec);
+  u8_init_mutex(&(pool->pool_keeper_lock));
+  u8_init_condvar(&(pool->pool_keeper_wakeup));
+  pool->pool_next = client_pools;
+  client_pools = pool;
+  u8_unlock_mutex(&client_pools_lock);
+  return pool;
+}
+
+/* A pool's *poolmin* is the largest of the poolmins asked for by the
+   servers using it, which are kept in pool_mins. */
+
+/* This records a server's *poolmin* for *pool* (starting its keeper
+   if needed) */
+static void set_pool_min(struct KNO_MONGODB_POOL *pool,int poolmin)
+{
+  u8_lock_mutex(&client_pools_lock);
+  if (pool->pool_n_mins >= pool->pool_mins_len) {
+    int new_len = (pool->pool_mins_len) ? (pool->pool_mins_len*2) : (4);
+    pool->pool_mins = u8_realloc_n(pool->pool_mins,new_len,int);
+    pool->pool_mins_len = new_len;}
+  pool->pool_mins[pool->pool_n_mins++] = poolmin;
+  if (poolmin > pool->pool_min) {
+    __atomic_store_n(&(pool->pool_min),poolmin,__ATOMIC_RELAXED);
+    start_pool_keeper(pool);}
+  u8_unlock_mutex(&client_pools_lock);
+}
+
+/* This forgets a server's *poolmin* for *pool* and recomputes the
+   pool's *poolmin*. It is called with client_pools_lock held. */
+static void drop_pool_min(struct KNO_MONGODB_POOL *pool,int poolmin)
+{
+  int i = 0, n = pool->pool_n_mins, new_min = 0;
+  while (i < n) {
+    if (pool->pool_mins[i] == poolmin) {
+      pool->pool_mins[i] = pool->pool_mins[n-1];
+      pool->pool_n_mins = --n;
+      break;}
+    else i++;}
+  i = 0; while (i < n) {
+    if (pool->pool_mins[i] > new_min) new_min = pool->pool_mins[i];
+    i++;}
+  __atomic_store_n(&(pool->pool_min),new_min,__ATOMIC_RELAXED);
+}
+
+/* This releases a server's use of *pool*, which it opened with
+   *poolmin* (or 0) */
+static void release_pool(struct KNO_MONGODB_POOL *pool,int poolmin)
+{
+  u8_lock_mutex(&client_pools_lock);
+  if (poolmin > 0) drop_pool_min(pool,poolmin);
+  if ( (pool->pool_min == 0) &&
+       (pool->pool_keeper_state == KEEPER_RUNNING) ) {
+    /* The keeper is joined without holding client_pools_lock. Our
+       reference keeps the pool around in the meanwhile and
+       set_pool_min leaves a stopping keeper for us to restart. */
+    signal_pool_keeper(pool);
+    u8_unlock_mutex(&client_pools_lock);
+    pthread_join(pool->pool_keeper,NULL);
+    u8_lock_mutex(&client_pools_lock);
+    pool->pool_keeper_state = 0;
+    if (pool->pool_min > 0) start_pool_keeper(pool);}
+  if (--(pool->pool_refcount) > 0) {
+    u8_unlock_mutex(&client_pools_lock);
+    return;}
+  struct KNO_MONGODB_POOL **scan = &client_pools;
+  while (*scan != pool) scan = &((*scan)->pool_next);
+  *scan = pool->pool_next;
+  u8_unlock_mutex(&client_pools_lock);
+  stop_pool_keeper(pool);
+  mongoc_client_pool_destroy(pool->pool_clients);
+  if (pool->pool_lanes) free_lanes(pool->pool_lanes);
+  u8_destroy_mutex(&(pool->pool_keeper_lock));
+  u8_destroy_condvar(&(pool->pool_keeper_wakeup));
+  if (pool->pool_mins) u8_free(pool->pool_mins);
+  u8_free(pool->pool_key);
+  u8_free(pool);
+}
+
+#if MONGOC_CHECK_VERSION(1,7,0)
+#define mongoc_uri_info(s,e) mongoc_uri_new_with_error((s),e)
+#else
+#define mongoc_uri_info(s,e) mongoc_uri_new((s))
+#endif
+
+/* This returns a MongoDB server object which wraps a MongoDB client
+   pool. */
+
+DEFC_PRIM("mongodb/open",mongodb_open,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "**undocumented**",
+	  {"arg",kno_any_type,KNO_VOID},
+	  {"opts",kno_any_type,KNO_VOID})
+static lispval mongodb_open(lispval arg,lispval opts)
+{
+  mongoc_client_pool_t *client_pool;
+  mongoc_uri_t *info;
+  mongoc_ssl_opt_t ssl_opts={ 0 };
+  bson_error_t error = { 0 };
+  int smoke_test = boolopt(opts,smoketest_sym,1);
+  int flags = getflags(opts,mongodb_defaults);;
+
+  if ( (KNO_STRINGP(arg)) || (KNO_TYPEP(arg,kno_secret_type)) )
+    info = mongoc_uri_info(KNO_CSTRING(arg),&error);
+  else if (KNO_SYMBOLP(arg)) {
+    lispval conf_val = kno_config_get(KNO_SYMBOL_NAME(arg));
+    if (KNO_VOIDP(conf_val))
+      return kno_type_error("MongoDB URI config","mongodb_open",arg);
+    else if ((KNO_STRINGP(conf_val))||
+	     (KNO_TYPEP(conf_val,kno_secret_type))) {
+      info = mongoc_uri_info(KNO_CSTRING(conf_val),&error);
+      kno_decref(conf_val);}
+    else return kno_type_error("MongoDB URI config val",
+			       KNO_SYMBOL_NAME(arg),conf_val);}
+  else return kno_type_error("MongoDB URI","mongodb_open",arg);
+
+  if (info == NULL)
+    return kno_err("MongoDB URI spec","mongodb_open",NULL,arg);
+  else info = setup_mongoc_uri(info,opts);
 
   if (!(info))
     return kno_err(kno_MongoDB_Error,"mongodb_open",error.message,arg);
-  else client_pool = mongoc_client_pool_new(info);
 
-  if (client_pool == NULL) {
-    mongoc_uri_destroy(info);
-    return kno_type_error("MongoDB client URI","mongodb_open",arg);}
-  else if ( (setup_tls(&ssl_opts,info,opts)) ) {
-    mongoc_client_pool_set_ssl_opts(client_pool,&ssl_opts);
+  lispval poolmax_arg = kno_getopt(opts,poolmaxsym,KNO_VOID);
+  int poolmax = (KNO_UINTP(poolmax_arg)) ? (KNO_FIX2INT(poolmax_arg)) : (0);
+  kno_decref(poolmax_arg);
+  lispval lanes = kno_getopt(opts,KNOSYM(lanes),KNO_VOID);
+  u8_string dbspec = get_connection_spec(info);
+  int use_tls = setup_tls(&ssl_opts,info,opts);
+  u8_string pool_key =
+    get_pool_key(info,(use_tls)?(&ssl_opts):(NULL),poolmax,lanes);
+  struct KNO_MONGODB_POOL *pool =
+    use_pool(pool_key,info,(use_tls)?(&ssl_opts):(NULL),poolmax,
+	     lanes,dbspec);
+  if (use_tls) {
     u8_free(ssl_opts.pem_file);
     u8_free(ssl_opts.pem_pwd);
     u8_free(ssl_opts.ca_file);
     u8_free(ssl_opts.ca_dir);
     u8_free(ssl_opts.crl_file);}
-  else NO_ELSE;
+
+  if (pool == NULL) {
+    mongoc_uri_destroy(info);
+    kno_decref(lanes);
+    u8_free(dbspec);
+    return kno_type_error("MongoDB client URI","mongodb_open",arg);}
+  else client_pool = pool->pool_clients;
 
   if (smoke_test) {
     u8_string errmsg = mongodb_check(client_pool);
@@ -957,29 +2402,47 @@ static lispval mongodb_open(lispval arg,lispval opts)
       lispval uri_string = knostring(mongoc_uri_get_string(info));
       kno_seterr("MongoDB/ConnectFailed","mongodb_open",errmsg,uri_string);
       kno_decref(uri_string);
-      mongoc_client_pool_destroy(client_pool);
+      release_pool(pool,0);
       mongoc_uri_destroy(info);
+      kno_decref(lanes);
+      u8_free(dbspec);
       u8_free(errmsg);
       return KNO_ERROR;}}
 
   u8_string uri = u8_strdup(mongoc_uri_get_string(info));
   struct KNO_MONGODB_DATABASE *srv = u8_alloc(struct KNO_MONGODB_DATABASE);
   u8_string dbname = mongoc_uri_get_database(info);
-  lispval poolmax = kno_getopt(opts,poolmaxsym,KNO_VOID);
-  if (KNO_UINTP(poolmax)) {
-    int pmax = KNO_FIX2INT(poolmax);
-    mongoc_client_pool_max_size(client_pool,pmax);}
-  kno_decref(poolmax);
+  lispval poolmin_arg = kno_getopt(opts,KNOSYM(poolmin),KNO_VOID);
+  lispval warmup = kno_getopt(opts,KNOSYM(warmup),KNO_VOID);
+  int pool_limit = (poolmax) ? (poolmax) : (MONGODB_DEFAULT_POOLMAX);
+  int poolmin = (KNO_UINTP(poolmin_arg)) ? (KNO_FIX2INT(poolmin_arg)) : (0);
+  if (poolmin > pool_limit) poolmin = pool_limit;
+  int n_warmup = (KNO_UINTP(warmup)) ? (KNO_FIX2INT(warmup)) :
+    (KNO_FALSEP(warmup)) ? (0) : (poolmin);
+  if (n_warmup > pool_limit) n_warmup = pool_limit;
+  kno_decref(poolmin_arg);
+  kno_decref(warmup);
   KNO_INIT_CONS(srv,kno_mongoc_server);
   srv->dburi = uri;
   if (dbname == NULL)
     srv->dbname = NULL;
   else srv->dbname = u8_strdup(dbname);
-  srv->dbspec = get_connection_spec(info);
+  srv->dbspec = dbspec;
   srv->dburi_info = info;
   srv->dbclients = client_pool;
+  srv->dbpool = pool;
+  srv->dbpoolmin = poolmin;
   srv->dbopts = kno_incref(opts);
   srv->dbflags = flags;
+  if (n_warmup > 0) {
+    int n_ok = warm_pool(pool,n_warmup,MONGODB_CLIENT_BLOCK);
+    u8_logf(LOG_INFO,"MongoDB/warmup","Warmed up %d/%d clients for %s",
+	    n_ok,n_warmup,srv->dbspec);}
+  if (poolmin > 0) set_pool_min(pool,poolmin);
+  if (!( (KNO_VOIDP(lanes)) || (KNO_FALSEP(lanes)) || (KNO_TABLEP(lanes)) ))
+    u8_logf(LOG_WARN,"MongoDB/lanes","Ignoring `lanes` option %q for %s",
+	    lanes,srv->dbspec);
+  kno_decref(lanes);
   if ((logops)||(flags&KNO_MONGODB_LOGOPS))
     u8_logf(LOG_INFO,"MongoDB/open","Opened %s with %s",dbname,srv->dbspec);
   return (lispval)srv;
@@ -988,7 +2451,10 @@ static void recycle_server(struct KNO_RAW_CONS *c)
 {
   struct KNO_MONGODB_DATABASE *s = (struct KNO_MONGODB_DATABASE *)c;
   mongoc_uri_destroy(s->dburi_info);
-  mongoc_client_pool_destroy(s->dbclients);
+  release_pool(s->dbpool,s->dbpoolmin);
+  u8_free(s->dburi);
+  u8_free(s->dbname);
+  u8_free(s->dbspec);
   kno_decref(s->dbopts);
   if (!(KNO_STATIC_CONSP(c))) u8_free(c);
 }
@@ -1057,7 +2523,11 @@ DEF_KNOSYM(oidslot);
 
 DEFC_PRIM("collection/open",mongodb_collection,
 	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(1),
-	  "**undocumented**",
+	  "Returns the collection *name* on *server* (a server, URI or "
+	  "config name). *opts* (combined with the server's options) are "
+	  "compiled when the collection is opened, so its flags are fixed "
+	  "then. Its encoded search options and read preferences are "
+	  "redone when MONGODB:FLAGS or the slot property configs change.",
 	  {"server",kno_any_type,KNO_VOID},
 	  {"name_arg",kno_string_type,KNO_VOID},
 	  {"opts_arg",kno_any_type,KNO_VOID})
@@ -1082,6 +2552,13 @@ static lispval mongodb_collection(lispval server,lispval name_arg,
     flags = getflags(opts_arg,srv->dbflags);
     opts = combine_opts(opts_arg,srv->dbopts);}
   else return kno_type_error("MongoDB client","mongodb_collection",server);
+  if (!(KNO_TYPEP(opts,kno_mongoc_opts))) {
+    lispval compiled = compile_opts(opts,opts,srv->dbopts,flags);
+    kno_decref(opts);
+    if (KNO_ABORTP(compiled)) {
+      kno_decref(server);
+      return compiled;}
+    opts = compiled;}
   if (strchr(name,'/')) {
     char *slash = strchr(name,'/');
     collection_name = slash+1;}
@@ -1105,6 +2582,8 @@ static lispval mongodb_collection(lispval server,lispval name_arg,
   result->collection_oidkey = (KNO_SYMBOLP(oidslot)) ?
     (KNO_SYMBOL_NAME(oidslot)) : (U8S("_id"));
   result->collection_name = collection_name;
+  result->collection_coalescer = make_coalescer(opts);
+  result->collection_qcache = make_qcache(srv,collection_name,opts);
   return (lispval) result;
 }
 static void recycle_collection(struct KNO_RAW_CONS *c)
@@ -1112,6 +2591,10 @@ static void recycle_collection(struct KNO_RAW_CONS *c)
   struct KNO_MONGODB_COLLECTION *collection = (struct KNO_MONGODB_COLLECTION *)c;
   kno_decref(collection->collection_db);
   kno_decref(collection->collection_opts);
+  if (collection->collection_coalescer)
+    free_coalescer(collection->collection_coalescer);
+  if (collection->collection_qcache)
+    free_qcache(collection->collection_qcache);
   if (!(KNO_STATIC_CONSP(c))) u8_free(c);
 }
 static int unparse_collection(struct U8_OUTPUT *out,lispval x)
@@ -1124,19 +2607,360 @@ static int unparse_collection(struct U8_OUTPUT *out,lispval x)
   return 1;
 }
 
+/* Per-thread clients */
+
+/* With the `affinity` option, a thread keeps the client it pops from
+   a server's pool, together with the collection handles it opens on
+   that client, rather than returning them after each operation. These
+   are released when the thread exits or, by a sweeper thread, when
+   they've been idle for more than MONGODB:AFFINITY:IDLE seconds.
+   Cursors, which can outlive the call that creates them, always get
+   their own clients. Since a client is counted against the lane it
+   was popped for, operations in other lanes don't reuse it.
+
+   Each thread client is on its thread's list and in a global
+   registry which the sweeper scans. The owning thread marks a client
+   active while it's using it, and the sweeper only takes clients
+   which are idle, marking them as reclaimed. It takes them out of the
+   registry with the lock held but releases them after unlocking
+   (since dropping the last reference to a server can take a while),
+   and then marks them as dropped. The owning thread frees dropped
+   clients the next time it looks at its list.
+
+   A thread client holds a reference to its server, so a server which
+   is otherwise unused stays open (along with its pool) until the
+   thread exits or the sweeper takes the client. */
+
+#define THREAD_CLIENT_MAX_HANDLES 16
+
+#define TCLIENT_IDLE 0
+#define TCLIENT_ACTIVE 1
+#define TCLIENT_RECLAIMED 2
+#define TCLIENT_DROPPED 3
+
+struct MONGODB_THREAD_HANDLE {
+  lispval handle_coll;
+  mongoc_collection_t *handle_collection;};
+
+struct MONGODB_THREAD_CLIENT {
+  lispval tclient_server;
+  mongoc_client_t *tclient_client;
+  lispval tclient_lane;
+  time_t tclient_used;
+  int tclient_busy, tclient_n_handles, tclient_state;
+  struct MONGODB_THREAD_HANDLE tclient_handles[THREAD_CLIENT_MAX_HANDLES];
+  struct MONGODB_THREAD_CLIENT *tclient_next, *tclient_registry_next;};
+
+static u8_tld_key thread_clients_key;
+static int thread_client_idle = 60;
+
+static int thread_client_sweep = -1;
+
+static struct MONGODB_THREAD_CLIENT *registered_thread_clients = NULL;
+static u8_mutex thread_clients_lock;
+static u8_condvar thread_clients_wakeup;
+static int thread_client_sweeper_started = 0;
+static int thread_client_sweeper_stopping = 0;
+static pthread_t thread_client_sweeper_thread;
+
+/* This releases the client, handles and server of *tc* but doesn't
+   free it. It is called without thread_clients_lock, since dropping
+   the server can recycle it and its pool. */
+static void drop_thread_client(struct MONGODB_THREAD_CLIENT *tc)
+{
+  int i = 0, n = tc->tclient_n_handles;
+  while (i < n) {
+    struct MONGODB_THREAD_HANDLE *h = &(tc->tclient_handles[i++]);
+    mongoc_collection_destroy(h->handle_collection);
+    kno_decref(h->handle_coll);}
+  tc->tclient_n_handles = 0;
+  release_client((kno_mongodb_database)(tc->tclient_server),
+		 tc->tclient_client);
+  tc->tclient_client = NULL;
+  /* tclient_server is left as it is, since the owning thread compares
+     it (without locking) to the servers it's looking for */
+  kno_decref(tc->tclient_server);
+}
+
+/* This is called with thread_clients_lock held */
+static void unregister_thread_client(struct MONGODB_THREAD_CLIENT *tc)
+{
+  struct MONGODB_THREAD_CLIENT **scan = &registered_thread_clients;
+  while (*scan) {
+    if (*scan == tc) {
+      *scan = tc->tclient_registry_next;
+      return;}
+    else scan = &((*scan)->tclient_registry_next);}
+}
+
+static int thread_client_sweep_interval()
+{
+  int idle = thread_client_idle;
+  if (thread_client_sweep > 0)
+    return thread_client_sweep;
+  else return (idle > 2) ? (idle/2) : (1);
+}
+
+static void *thread_client_sweeper(void *ignored)
+{
+  u8_lock_mutex(&thread_clients_lock);
+  while (!(thread_client_sweeper_stopping)) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME,&until);
+    until.tv_sec += thread_client_sweep_interval();
+    u8_condvar_timedwait(&thread_clients_wakeup,&thread_clients_lock,&until);
+    int idle = thread_client_idle;
+    if ( (thread_client_sweeper_stopping) || (idle < 0) ) continue;
+    time_t now = time(NULL);
+    struct MONGODB_THREAD_CLIENT *swept = NULL;
+    struct MONGODB_THREAD_CLIENT **scan = &registered_thread_clients;
+    while (*scan) {
+      struct MONGODB_THREAD_CLIENT *tc = *scan;
+      time_t used = __atomic_load_n(&(tc->tclient_used),__ATOMIC_RELAXED);
+      int state = TCLIENT_IDLE;
+      if ( ((now-used) > idle) &&
+	   (__atomic_compare_exchange_n
+	    (&(tc->tclient_state),&state,TCLIENT_RECLAIMED,0,
+	     __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)) ) {
+	*scan = tc->tclient_registry_next;
+	tc->tclient_registry_next = swept;
+	swept = tc;}
+      else scan = &(tc->tclient_registry_next);}
+    if (swept == NULL) continue;
+    u8_unlock_mutex(&thread_clients_lock);
+    struct MONGODB_THREAD_CLIENT *tc = swept;
+    while (tc) {
+      drop_thread_client(tc);
+      tc = tc->tclient_registry_next;}
+    u8_lock_mutex(&thread_clients_lock);
+    /* The owning threads can free them after this */
+    while (swept) {
+      struct MONGODB_THREAD_CLIENT *next = swept->tclient_registry_next;
+      __atomic_store_n(&(swept->tclient_state),TCLIENT_DROPPED,
+		       __ATOMIC_RELEASE);
+      swept = next;}
+    u8_condvar_broadcast(&thread_clients_wakeup);}
+  u8_unlock_mutex(&thread_clients_lock);
+  return NULL;
+}
+
+static void register_thread_client(struct MONGODB_THREAD_CLIENT *tc)
+{
+  u8_lock_mutex(&thread_clients_lock);
+  tc->tclient_registry_next = registered_thread_clients;
+  registered_thread_clients = tc;
+  if ( (!(thread_client_sweeper_started)) &&
+       (!(thread_client_sweeper_stopping)) ) {
+    int rv = mongodb_thread_create(&thread_client_sweeper_thread,
+				   thread_client_sweeper,NULL);
+    if (rv)
+      u8_logf(LOG_WARN,"MongoDB/affinity",
+	      "Couldn't start thread client sweeper: %s",strerror(rv));
+    else thread_client_sweeper_started = 1;}
+  u8_unlock_mutex(&thread_clients_lock);
+}
+
+/* This is called when the process exits */
+static void stop_thread_client_sweeper()
+{
+  u8_lock_mutex(&thread_clients_lock);
+  int started = thread_client_sweeper_started;
+  thread_client_sweeper_stopping = 1;
+  u8_condvar_broadcast(&thread_clients_wakeup);
+  u8_unlock_mutex(&thread_clients_lock);
+  if (started) pthread_join(thread_client_sweeper_thread,NULL);
+}
+
+static int thread_client_sweep_config_set(lispval var,lispval val,void *data)
+{
+  int rv = kno_intconfig_set(var,val,data);
+  if (rv < 0) return rv;
+  /* Start over with the new interval */
+  u8_lock_mutex(&thread_clients_lock);
+  u8_condvar_broadcast(&thread_clients_wakeup);
+  u8_unlock_mutex(&thread_clients_lock);
+  return rv;
+}
+
+/* This frees *tc* once the sweeper has reclaimed it, waiting for the
+   sweeper to finish dropping it */
+static void free_reclaimed_client(struct MONGODB_THREAD_CLIENT *tc)
+{
+  u8_lock_mutex(&thread_clients_lock);
+  while (__atomic_load_n(&(tc->tclient_state),__ATOMIC_ACQUIRE) !=
+	 TCLIENT_DROPPED)
+    u8_condvar_wait(&thread_clients_wakeup,&thread_clients_lock);
+  u8_unlock_mutex(&thread_clients_lock);
+  u8_free(tc);
+}
+
+/* This takes *tc* (which the sweeper can't take, since it's active)
+   out of the registry, releases it and frees it */
+static void free_thread_client(struct MONGODB_THREAD_CLIENT *tc)
+{
+  u8_lock_mutex(&thread_clients_lock);
+  unregister_thread_client(tc);
+  u8_unlock_mutex(&thread_clients_lock);
+  drop_thread_client(tc);
+  u8_free(tc);
+}
+
+static void free_thread_clients(void *ptr)
+{
+  struct MONGODB_THREAD_CLIENT *scan = (struct MONGODB_THREAD_CLIENT *)ptr;
+  while (scan) {
+    struct MONGODB_THREAD_CLIENT *next = scan->tclient_next;
+    int state = TCLIENT_IDLE;
+    /* Marking it active keeps the sweeper from taking it */
+    if ( (__atomic_compare_exchange_n
+	  (&(scan->tclient_state),&state,TCLIENT_ACTIVE,0,
+	   __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)) ||
+	 (state == TCLIENT_ACTIVE) )
+      free_thread_client(scan);
+    else free_reclaimed_client(scan);
+    scan = next;}
+}
+
+/* This returns the current thread's client for *server*, marked
+   active, getting one from the server's pool if needed. Clients which
+   the sweeper has reclaimed are freed along the way. */
+static struct MONGODB_THREAD_CLIENT *
+get_thread_client(struct KNO_MONGODB_DATABASE *server,int block,lispval lane)
+{
+  struct MONGODB_THREAD_CLIENT *clients = u8_tld_get(thread_clients_key);
+  struct MONGODB_THREAD_CLIENT **scan = &clients, *found = NULL;
+  time_t now = time(NULL);
+  while (*scan) {
+    struct MONGODB_THREAD_CLIENT *tc = *scan;
+    int state = TCLIENT_IDLE;
+    if (tc->tclient_server != ((lispval)server))
+      state = __atomic_load_n(&(tc->tclient_state),__ATOMIC_ACQUIRE);
+    else if (__atomic_compare_exchange_n
+	     (&(tc->tclient_state),&state,TCLIENT_ACTIVE,0,
+	      __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+      state = TCLIENT_ACTIVE;
+    else NO_ELSE; /* state is now ACTIVE (when nested), RECLAIMED or DROPPED */
+    if (state == TCLIENT_DROPPED) {
+      *scan = tc->tclient_next;
+      u8_free(tc);}
+    else if (state == TCLIENT_RECLAIMED)
+      /* The sweeper is still dropping it */
+      scan = &(tc->tclient_next);
+    else {
+      if (tc->tclient_server == ((lispval)server)) found = tc;
+      scan = &(tc->tclient_next);}}
+  /* A client which isn't in use is given back when it was popped for
+     another lane, and one is popped for *lane* instead. */
+  if ( (found) && (found->tclient_busy == 0) &&
+       (found->tclient_lane != lane) ) {
+    scan = &clients;
+    while (*scan != found) scan = &((*scan)->tclient_next);
+    *scan = found->tclient_next;
+    free_thread_client(found);
+    found = NULL;}
+  if (found == NULL) {
+    mongoc_client_t *client = get_client(server,block,lane);
+    if (client) {
+      found = u8_alloc(struct MONGODB_THREAD_CLIENT);
+      memset(found,0,sizeof(struct MONGODB_THREAD_CLIENT));
+      found->tclient_server = (lispval) server;
+      kno_incref(found->tclient_server);
+      found->tclient_client = client;
+      found->tclient_lane = lane;
+      found->tclient_state = TCLIENT_ACTIVE;
+      found->tclient_next = clients;
+      clients = found;
+      register_thread_client(found);}}
+  u8_tld_set(thread_clients_key,clients);
+  if (found) __atomic_store_n(&(found->tclient_used),now,__ATOMIC_RELAXED);
+  return found;
+}
+
+/* This marks *tc* as idle (so the sweeper can take it) unless it's
+   still being used */
+static void thread_client_used(struct MONGODB_THREAD_CLIENT *tc)
+{
+  __atomic_store_n(&(tc->tclient_used),time(NULL),__ATOMIC_RELAXED);
+  if (tc->tclient_busy == 0)
+    __atomic_store_n(&(tc->tclient_state),TCLIENT_IDLE,__ATOMIC_RELEASE);
+}
+
+/* This returns the thread client (if any) which *client* belongs to */
+static struct MONGODB_THREAD_CLIENT *
+find_thread_client(mongoc_client_t *client)
+{
+  struct MONGODB_THREAD_CLIENT *scan = u8_tld_get(thread_clients_key);
+  while (scan) {
+    if ( (scan->tclient_client == client) &&
+	 (__atomic_load_n(&(scan->tclient_state),__ATOMIC_ACQUIRE) ==
+	  TCLIENT_ACTIVE) )
+      return scan;
+    else scan = scan->tclient_next;}
+  return NULL;
+}
+
+static mongoc_collection_t *
+thread_collection(struct MONGODB_THREAD_CLIENT *tc,
+		  struct KNO_MONGODB_COLLECTION *coll)
+{
+  struct KNO_MONGODB_DATABASE *server =
+    (struct KNO_MONGODB_DATABASE *)(coll->collection_db);
+  int i = 0, n = tc->tclient_n_handles;
+  while (i < n) {
+    struct MONGODB_THREAD_HANDLE *h = &(tc->tclient_handles[i++]);
+    if (h->handle_coll == ((lispval)coll))
+      return h->handle_collection;}
+  mongoc_collection_t *collection =
+    mongoc_client_get_collection(tc->tclient_client,server->dbname,
+				 coll->collection_name);
+  /* When the handle table is full, the handle is just destroyed by
+     collection_done */
+  if ( (collection) && (n < THREAD_CLIENT_MAX_HANDLES) ) {
+    struct MONGODB_THREAD_HANDLE *h = &(tc->tclient_handles[n]);
+    h->handle_coll = (lispval) coll;
+    kno_incref(h->handle_coll);
+    h->handle_collection = collection;
+    tc->tclient_n_handles++;}
+  return collection;
+}
+
+static int thread_handlep(struct MONGODB_THREAD_CLIENT *tc,
+			  mongoc_collection_t *collection)
+{
+  int i = 0, n = tc->tclient_n_handles;
+  while (i < n) {
+    if (tc->tclient_handles[i++].handle_collection == collection)
+      return 1;}
+  return 0;
+}
+
 /* Using collections */
 
 /*  This is where the collection actually gets created based on
     a client popped from the client pool for the server. */
 mongoc_collection_t *open_collection(struct KNO_MONGODB_COLLECTION *coll,
 				     mongoc_client_t **clientp,
-				     int flags)
+				     int flags,lispval opts)
 {
   struct KNO_MONGODB_DATABASE *server=
     (struct KNO_MONGODB_DATABASE *)(coll->collection_db);
   u8_string dbname = server->dbname;
   u8_string collection_name = coll->collection_name;
-  mongoc_client_t *client = get_client(server,(!(flags&KNO_MONGODB_NOBLOCK)));
+  lispval lane = (server->dbpool->pool_lanes) ? (get_lane(opts)) : (KNO_VOID);
+  if (flags&KNO_MONGODB_AFFINITY) {
+    struct MONGODB_THREAD_CLIENT *tc =
+      get_thread_client(server,(!(flags&KNO_MONGODB_NOBLOCK)),lane);
+    mongoc_collection_t *collection = (tc) ?
+      (thread_collection(tc,coll)) : (NULL);
+    if (collection) {
+      tc->tclient_busy++;
+      *clientp = tc->tclient_client;}
+    else if (tc)
+      thread_client_used(tc);
+    else NO_ELSE;
+    return collection;}
+  mongoc_client_t *client =
+    get_client(server,(!(flags&KNO_MONGODB_NOBLOCK)),lane);
   if (client) {
     mongoc_collection_t *collection=
       mongoc_client_get_collection(client,dbname,collection_name);
@@ -1165,15 +2989,23 @@ static void client_done(lispval arg,mongoc_client_t *client)
     u8_logf(LOG_ERR,"BAD client_done call","Wrong type for %q",arg);}
 }
 
-/* This destroys the collection returns a client to a client pool. */
+/* This destroys the collection returns a client to a client pool,
+   unless they're being kept by the current thread. */
 static void collection_done(mongoc_collection_t *collection,
 			    mongoc_client_t *client,
 			    struct KNO_MONGODB_COLLECTION *coll)
 {
   struct KNO_MONGODB_DATABASE *server=
     (kno_mongodb_database)coll->collection_db;
-  mongoc_collection_destroy(collection);
-  release_client(server,client);
+  struct MONGODB_THREAD_CLIENT *tc = find_thread_client(client);
+  if (tc) {
+    if (!(thread_handlep(tc,collection)))
+      mongoc_collection_destroy(collection);
+    tc->tclient_busy--;
+    thread_client_used(tc);}
+  else {
+    mongoc_collection_destroy(collection);
+    release_client(server,client);}
 }
 
 mongoc_cursor_t *open_cursor(mongoc_collection_t *collection,
@@ -1233,7 +3065,7 @@ static lispval collection_insert(lispval arg,lispval objects,lispval opts_arg)
   lispval opts = combine_opts(opts_arg,db->dbopts);
   bson_t *bulkopts = getbulkopts(opts,flags);
   mongoc_client_t *client = NULL; bool retval;
-  mongoc_collection_t *collection = open_collection(coll,&client,flags);
+  mongoc_collection_t *collection = open_collection(coll,&client,flags,opts);
   if (collection) {
     bson_t reply;
     bson_error_t error = { 0 };
@@ -1282,6 +3114,7 @@ static lispval collection_insert(lispval arg,lispval objects,lispval opts_arg)
 		   kno_incref(objects));
 	result = KNO_ERROR_VALUE;}
       if (wc) mongoc_write_concern_destroy(wc);}
+    qcache_invalidate(coll);
     collection_done(collection,client,coll);}
   else result = KNO_ERROR_VALUE;
   kno_decref(opts);
@@ -1327,7 +3160,7 @@ static lispval collection_insert(lispval collection,lispval objects,
   int flags = getflags(opts_arg,coll->collection_flags);
   lispval opts = combine_opts(opts_arg,db->dbopts);
   mongoc_client_t *client = NULL; bool retval;
-  mongoc_collection_t *collection = open_collection(coll,&client,flags);
+  mongoc_collection_t *collection = open_collection(coll,&client,flags,opts);
   if (collection) {
     bson_t reply;
     bson_error_t error;
@@ -1374,6 +3207,7 @@ static lispval collection_insert(lispval collection,lispval objects,
 		   kno_incref(objects));
 	result = KNO_ERROR_VALUE;}}
     if (wc) mongoc_write_concern_destroy(wc);
+    qcache_invalidate(coll);
     collection_done(collection,client,coll);}
   else result = KNO_ERROR_VALUE;
   kno_decref(opts);
@@ -1392,12 +3226,12 @@ DEFC_PRIM("collection/remove!",collection_remove,
 static lispval collection_remove(lispval coll_arg,lispval obj,lispval opts_arg)
 {
   lispval result = KNO_VOID;
-  struct KNO_MONGODB_COLLECTION *coll=(struct KNO_MONGODB_COLLECTION *)coll;
+  struct KNO_MONGODB_COLLECTION *coll=(struct KNO_MONGODB_COLLECTION *)coll_arg;
   struct KNO_MONGODB_DATABASE *db = COLL2DB(coll);
   lispval opts = combine_opts(opts_arg,db->dbopts);
   int flags = getflags(opts_arg,coll->collection_flags), hasid = 1;
   mongoc_client_t *client = NULL;
-  mongoc_collection_t *collection = open_collection(coll,&client,flags);
+  mongoc_collection_t *collection = open_collection(coll,&client,flags,opts);
   u8_string oidkey = coll->collection_oidkey;
   lispval oidslot = coll->collection_oidslot;
   if (collection) {
@@ -1444,6 +3278,7 @@ static lispval collection_remove(lispval coll_arg,lispval obj,lispval opts_arg)
 			    error.message,db->dburi,coll->collection_name),
 		 kno_incref(obj));
       result = KNO_ERROR_VALUE;}
+    qcache_invalidate(coll);
     collection_done(collection,client,coll);
     if (wc) mongoc_write_concern_destroy(wc);
     kno_decref(q.bson_fieldmap);
@@ -1462,7 +3297,7 @@ static lispval mongodb_updater(lispval arg,lispval query,lispval update,
   int flags = getflags(opts_arg,coll->collection_flags);
   lispval opts = combine_opts(opts_arg,coll->collection_opts);
   mongoc_client_t *client = NULL;
-  mongoc_collection_t *collection = open_collection(coll,&client,flags);
+  mongoc_collection_t *collection = open_collection(coll,&client,flags,opts);
   if (collection) {
     bson_t *q = kno_lisp2bson(query,flags,opts);
     bson_t *u = kno_lisp2bson(update,flags,opts);
@@ -1484,6 +3319,7 @@ static lispval mongodb_updater(lispval arg,lispval query,lispval update,
     if ((q)&&(u))
       success = mongoc_collection_update(collection,update_flags,q,u,wc,&error);
     IGNORE_ERRNO(success);
+    qcache_invalidate(coll);
     collection_done(collection,client,coll);
     if (q) bson_destroy(q);
     if (u) bson_destroy(u);
@@ -1546,87 +3382,142 @@ static lispval collection_upsert(lispval collection,lispval query,
   return mongodb_updater(collection,query,update,(MONGOC_UPDATE_UPSERT),opts_arg);
 }
 
+/* This runs *q* over *collection* and returns the decoded results, as
+   a vector if *sort_results* is true or as a choice otherwise. */
+static lispval find_results(lispval arg,lispval query,
+			  mongoc_collection_t *collection,bson_t *q,
+			  const bson_t *findopts,const mongoc_read_prefs_t *rp,
+			  int flags,lispval opts,int sort_results)
+{
+  lispval results = KNO_EMPTY_CHOICE;
+  mongoc_cursor_t *cursor = NULL;
+  const bson_t *doc;
+  lispval *vec = NULL; size_t n = 0, max = 0;
+  struct KNO_BSON_FIELDCACHE *fc = new_fieldcache();
+  struct KNO_BSON_ARENA arena;
+  init_bson_arena(&arena,bson_arena_size);
+  if (q) cursor = open_cursor(collection,q,findopts,rp,opts);
+  if (cursor) {
+    int parallel = parallel_decodingp(flags,opts), more = 1;
+    bson_t *docs[DECODE_BATCH_SIZE];
+    lispval decoded[DECODE_BATCH_SIZE];
+    U8_CLEAR_ERRNO();
+    while (more) {
+      int n_decoded = 0, j = 0;
+      if (parallel) {
+	/* Copy a batch of documents and decode them in parallel */
+	int n_docs = 0;
+	while ( (n_docs < DECODE_BATCH_SIZE) &&
+		(more = mongoc_cursor_next(cursor,&doc)) )
+	  docs[n_docs++] = bson_copy(doc);
+	n_decoded = parallel_decode(docs,n_docs,flags,opts,decoded,fc,&arena);
+	int k = 0; while (k < n_docs) bson_destroy(docs[k++]);}
+      else if ( (more = mongoc_cursor_next(cursor,&doc)) ) {
+	lispval r = bson2lisp((bson_t *)doc,flags,opts,fc,&arena);
+	if (KNO_ABORTP(r))
+	  n_decoded = -1;
+	else {
+	  decoded[0] = r;
+	  n_decoded = 1;}}
+      else NO_ELSE;
+      if (n_decoded < 0) {
+	kno_decref(results);
+	free_lisp_vec(vec,n);
+	vec = NULL; n = 0;
+	results = KNO_ERROR_VALUE;
+	sort_results = 0;
+	break;}
+      while (j < n_decoded) {
+	lispval r = decoded[j++];
+	if (sort_results) {
+	  if (n>=max) {
+	    if (!(grow_lisp_vec(&vec,n,&max))) {
+	      kno_decref(r);
+	      kno_decref_elts(decoded+j,n_decoded-j);
+	      free_lisp_vec(vec,n);
+	      vec = NULL; n = 0;
+	      results = KNO_ERROR_VALUE;
+	      sort_results = 0;
+	      more = 0;
+	      break;}}
+	  vec[n++]=r;}
+	else {
+	  KNO_ADD_TO_CHOICE(results,r);}}}
+    bson_error_t err;
+    bool trouble = (KNO_ABORTP(results)) ? (1) :
+      (mongoc_cursor_error(cursor,&err));
+    if (trouble) {
+      if (KNO_ABORTP(results)) {}
+      else {
+	grab_mongodb_error(&err,"mongodb_find");
+	kno_decref(results);
+	free_lisp_vec(vec,n);
+	vec = NULL; n = 0;
+	results = KNO_ERROR_VALUE;
+	sort_results = 0;}}
+    mongoc_cursor_destroy(cursor);}
+  else {
+    u8_byte buf[1000];
+    kno_seterr(kno_MongoDB_Error,"mongodb_find",
+	       u8_sprintf(buf,1000,
+			  "couldn't get query cursor over %q with options:\n%Q",
+			  arg,opts),
+	       kno_incref(query));
+    results = KNO_ERROR_VALUE;}
+  free_fieldcache(fc);
+  free_bson_arena(&arena);
+  if (KNO_ABORTED(results)) {}
+  else if (sort_results) {
+    if ((vec == NULL)||(n==0)) return kno_make_vector(0,NULL);
+    else results = kno_make_vector(n,vec);
+    if (vec) u8_free(vec);}
+  return results;
+}
+
+/* The BSON for a query and its search options. When the functions
+   below are called with one (by single_flight and cached_query, which
+   encode both for their keys), they use it instead of encoding their
+   own and leave it for the caller to free. enc_query is NULL when the
+   key's encoding isn't the one the function sends. */
+struct MONGODB_ENCODED {
+  bson_t *enc_query, *enc_searchopts;};
+
+static void free_encoded(struct MONGODB_ENCODED *enc)
+{
+  if (enc->enc_query) bson_destroy(enc->enc_query);
+  if (enc->enc_searchopts) bson_destroy(enc->enc_searchopts);
+  enc->enc_query = enc->enc_searchopts = NULL;
+}
+
 #if HAVE_MONGOC_OPTS_FUNCTIONS
 
-DEFC_PRIM("collection/find",collection_find,
-	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
-	  "**undocumented**",
-	  {"collection",KNO_MONGOC_COLLECTION,KNO_VOID},
-	  {"query",kno_any_type,KNO_VOID},
-	  {"opts_arg",kno_any_type,KNO_VOID})
-static lispval collection_find(lispval arg,lispval query,lispval opts_arg)
+static lispval find_documents(lispval arg,lispval query,lispval opts_arg,
+			      int flags,struct MONGODB_ENCODED *enc)
 {
   struct KNO_MONGODB_COLLECTION *coll = (struct KNO_MONGODB_COLLECTION *)arg;
-  int flags = getflags(opts_arg,coll->collection_flags);
   lispval opts = combine_opts(opts_arg,coll->collection_opts);
   mongoc_client_t *client = NULL;
-  mongoc_collection_t *collection = open_collection(coll,&client,flags);
+  mongoc_collection_t *collection = open_collection(coll,&client,flags,opts);
   if (collection) {
-    lispval results = KNO_EMPTY_CHOICE;
-    mongoc_cursor_t *cursor = NULL;
-    const bson_t *doc;
-    bson_t *q = kno_lisp2bson(query,flags,opts);
-    bson_t *findopts = get_search_opts(opts,flags,KNO_FIND_MATCHES);
+    bson_t *q = (enc) ? (enc->enc_query) : (kno_lisp2bson(query,flags,opts));
+    bson_t *findopts = (enc) ? (enc->enc_searchopts) :
+      (get_search_opts(opts,flags,KNO_FIND_MATCHES));
     mongoc_read_prefs_t *rp = get_read_prefs(opts);
-    lispval *vec = NULL; size_t n = 0, max = 0;
     int sort_results = kno_testopt(opts,KNOSYM_SORTED,KNO_VOID);
     if ((logops)||(flags&KNO_MONGODB_LOGOPS)) {
       char *qstring = bson_as_json(q,NULL);
       u8_logf(LOG_NOTICE,"mongodb_find","Matches in %q to\n%Q\n%s",
 	      arg,query,qstring);
       bson_free(qstring);}
-    if (q) cursor = open_cursor(collection,q,findopts,rp,opts);
-    if (cursor) {
-      U8_CLEAR_ERRNO();
-      while (mongoc_cursor_next(cursor,&doc)) {
-	/* u8_string json = bson_as_json(doc,NULL); */
-	lispval r = kno_bson2lisp((bson_t *)doc,flags,opts);
-	if (KNO_ABORTP(r)) {
-	  kno_decref(results);
-	  free_lisp_vec(vec,n);
-	  results = KNO_ERROR_VALUE;
-	  sort_results = 0;
-	  break;}
-	else if (sort_results) {
-	  if (n>=max) {
-	    if (!(grow_lisp_vec(&vec,n,&max))) {
-	      free_lisp_vec(vec,n);
-	      results = KNO_ERROR_VALUE;
-	      sort_results = 0;
-	      break;}}
-	  vec[n++]=r;}
-	else {
-	  KNO_ADD_TO_CHOICE(results,r);}}
-      bson_error_t err;
-      bool trouble = (KNO_ABORTP(results)) ? (1) :
-	(mongoc_cursor_error(cursor,&err));
-      if (trouble) {
-	free_lisp_vec(vec,n);
-	if (! (KNO_ABORTP(results)) )
-	  grab_mongodb_error(&err,"mongodb_find");
-	mongoc_cursor_destroy(cursor);
-	kno_decref(opts);
-	return KNO_ERROR;}
-      else mongoc_cursor_destroy(cursor);}
-    else {
-      u8_byte buf[1000];
-      kno_seterr(kno_MongoDB_Error,"mongodb_find",
-		 u8_sprintf(buf,1000,
-			    "couldn't get query cursor over %q with options:\n%Q",
-			    arg,opts),
-		 kno_incref(query));
-      results = KNO_ERROR_VALUE;}
+    lispval results = find_results(arg,query,collection,q,findopts,rp,
+				   flags,opts,sort_results);
     if (rp) mongoc_read_prefs_destroy(rp);
-    if (q) bson_destroy(q);
-    if (findopts) bson_destroy(findopts);
+    if (enc == NULL) {
+      if (q) bson_destroy(q);
+      if (findopts) bson_destroy(findopts);}
     collection_done(collection,client,coll);
     kno_decref(opts);
     U8_CLEAR_ERRNO();
-    if (KNO_ABORTED(results)) {}
-    else if (sort_results) {
-      if ((vec == NULL)||(n==0)) return kno_make_vector(0,NULL);
-      else results = kno_make_vector(n,vec);
-      if (vec) u8_free(vec);}
     return results;}
   else {
     kno_decref(opts);
@@ -1635,20 +3526,16 @@ static lispval collection_find(lispval arg,lispval query,lispval opts_arg)
 }
 #else
 
-DEFC_PRIM("collection/find",collection_find,
-	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
-	  "**undocumented**",
-	  {"collection",KNO_MONGOC_COLLECTION,KNO_VOID},
-	  {"query",kno_any_type,KNO_VOID},
-	  {"opts_arg",kno_any_type,KNO_VOID})
-static lispval collection_find(lispval collection,lispval query,lispval opts_arg)
+/* This doesn't use the search options, so it encodes its own query */
+static lispval find_documents(lispval collection,lispval query,
+			      lispval opts_arg,int flags,
+			      struct MONGODB_ENCODED *enc)
 {
   struct KNO_MONGODB_COLLECTION *coll =
     (struct KNO_MONGODB_COLLECTION *)collection;
-  int flags = getflags(opts_arg,coll->collection_flags);
   lispval opts = combine_opts(opts_arg,coll->collection_opts);
   mongoc_client_t *client = NULL;
-  mongoc_collection_t *collection = open_collection(coll,&client,flags);
+  mongoc_collection_t *collection = open_collection(coll,&client,flags,opts);
   if (collection) {
     lispval results = KNO_EMPTY_CHOICE;
     mongoc_cursor_t *cursor = NULL;
@@ -1733,35 +3620,35 @@ static int query_check(lispval query)
   else  return -1;
 }
 
-DEFC_PRIM("collection/count",collection_count,
-	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
-	  "**undocumented**",
-	  {"collection",KNO_MONGOC_COLLECTION,KNO_VOID},
-	  {"query",kno_any_type,KNO_VOID},
-	  {"opts_arg",kno_any_type,KNO_VOID})
-static lispval collection_count(lispval arg,lispval query,lispval opts_arg)
+static lispval count_documents(lispval arg,lispval query,lispval opts_arg,
+			       int flags,struct MONGODB_ENCODED *enc)
 {
   struct KNO_MONGODB_COLLECTION *coll = (struct KNO_MONGODB_COLLECTION *)arg;
-  int flags = getflags(opts_arg,coll->collection_flags);
+  lispval opts = combine_opts(opts_arg,coll->collection_opts);
   mongoc_client_t *client = NULL;
-  mongoc_collection_t *collection = open_collection(coll,&client,flags);
+  mongoc_collection_t *collection = open_collection(coll,&client,flags,opts);
   if (collection) {
     lispval result = KNO_VOID;
     long n_documents = -1;
     bson_error_t error = { 0 };
-    lispval opts = combine_opts(opts_arg,coll->collection_opts);
-    bson_t *findopts = get_search_opts(opts,flags,KNO_COUNT_MATCHES);
+    bson_t *findopts = (enc) ? (enc->enc_searchopts) :
+      (get_search_opts(opts,flags,KNO_COUNT_MATCHES));
     mongoc_read_prefs_t *rp = get_read_prefs(opts);
     int n_keys = query_check(query);
     if (RARELY(n_keys<0)) {
       kno_seterr("BadMongoQuery","collection_count",coll->collection_name,
 		 query);
+      if (rp) mongoc_read_prefs_destroy(rp);
+      if ( (findopts) && (enc == NULL) ) bson_destroy(findopts);
+      collection_done(collection,client,coll);
+      kno_decref(opts);
       return KNO_ERROR;}
     else if (n_keys == 0)
       n_documents = mongoc_collection_estimated_document_count
 	(collection,findopts,rp,NULL,&error);
     else {
-      bson_t *q = kno_lisp2bson(query,flags,opts);
+      bson_t *q = ( (enc) && (enc->enc_query) ) ? (enc->enc_query) :
+	(kno_lisp2bson(query,flags,opts));
       if (q == NULL) {
 	n_documents = -1;
 	result = KNO_ERROR_VALUE;}
@@ -1774,7 +3661,7 @@ static lispval collection_count(lispval arg,lispval query,lispval opts_arg)
 	  bson_free(qstring);}
 	n_documents = mongoc_collection_count_documents
 	  (collection,q,findopts,rp,NULL,&error);
-	bson_destroy(q);}}
+	if ( (enc == NULL) || (q != enc->enc_query) ) bson_destroy(q);}}
     if (n_documents>=0) {
       U8_CLEAR_ERRNO();
       result = KNO_INT(n_documents);}
@@ -1790,37 +3677,612 @@ static lispval collection_count(lispval arg,lispval query,lispval opts_arg)
       result = KNO_ERROR_VALUE;}
     else NO_ELSE;
     if (rp) mongoc_read_prefs_destroy(rp);
-    if (findopts) bson_destroy(findopts);
+    if ( (findopts) && (enc == NULL) ) bson_destroy(findopts);
     collection_done(collection,client,coll);
     kno_decref(opts);
     U8_CLEAR_ERRNO();
     return result;}
   else {
+    kno_decref(opts);
     U8_CLEAR_ERRNO();
     return KNO_ERROR_VALUE;}
 }
 
 
-DEFC_PRIM("collection/get",collection_get,
+/* In-flight queries */
+
+/* With the `singleflight` flag, concurrent calls to collection/find
+   or collection/count which would send the same query share a single
+   request. The first caller (the leader) runs the query, while later
+   callers with the same key wait for it and share the leader's result
+   (or get its error). Since the result is shared between threads, the
+   leader makes its tables read-only before publishing it; this
+   happens whether or not anyone joined the flight, so callers always
+   get the same kind of result. Flights are forgotten as soon as the
+   leader finishes, so nothing is cached.
+
+   A flight's key (also used by query caches, below) combines the
+   operation, the collection object, the flags and the `sorted`
+   option with the read mode, the BSON for the query and the search
+   options and the printed `fieldmap` and `internslots` options (which
+   change how results are decoded). */
+
+#define FLIGHT_FIND 1
+#define FLIGHT_COUNT 2
+#define FLIGHT_GET 3
+#define FLIGHT_BUCKETS 64
+
+struct MONGODB_FLIGHT_HEADER {
+  int flight_op, flight_flags, flight_sorted, flight_readmode;
+  lispval flight_coll;};
+
+/* A flight's key belongs to its leader, which takes the flight out of
+   the table before it returns */
+struct MONGODB_FLIGHT {
+  unsigned int flight_hash;
+  size_t flight_keylen;
+  const unsigned char *flight_key;
+  int flight_users, flight_done;
+  lispval flight_result;
+  struct MONGODB_THREAD_ERROR flight_error;
+  u8_condvar flight_ready;
+  struct MONGODB_FLIGHT *flight_next;};
+
+static struct MONGODB_FLIGHT *flights[FLIGHT_BUCKETS];
+static u8_mutex flights_lock;
+
+typedef lispval (*mongodb_flightfn)(lispval,lispval,lispval,int,
+				    struct MONGODB_ENCODED *);
+
+static void free_flight(struct MONGODB_FLIGHT *flight)
+{
+  if (!(KNO_ABORTP(flight->flight_result)))
+    kno_decref(flight->flight_result);
+  thread_error_free(&(flight->flight_error));
+  u8_destroy_condvar(&(flight->flight_ready));
+  u8_free(flight);
+}
+
+/* This makes the tables in *x* (and in their values) read-only */
+static void freeze_result(lispval x)
+{
+  if (!(KNO_CONSP(x))) return;
+  else if (KNO_CHOICEP(x)) {
+    KNO_DO_CHOICES(elt,x) freeze_result(elt);}
+  else if (KNO_VECTORP(x)) {
+    int i = 0, n = KNO_VECTOR_LENGTH(x);
+    while (i < n) freeze_result(KNO_VECTOR_REF(x,i++));}
+  else if (KNO_SLOTMAPP(x)) {
+    struct KNO_SLOTMAP *smap = (kno_slotmap) x;
+    int i = 0, n = smap->n_slots;
+    smap->table_readonly = 1;
+    while (i < n) freeze_result(smap->sm_keyvals[i++].kv_val);}
+  else if (KNO_SCHEMAPP(x)) {
+    struct KNO_SCHEMAP *smap = (kno_schemap) x;
+#if KNO_MAJOR_VERSION >= 2004
+    lispval *values = smap->table_values;
+#else
+    lispval *values = smap->schema_values;
+#endif
+    int i = 0, n = smap->schema_length;
+    smap->table_readonly = 1;
+    while (i < n) freeze_result(values[i++]);}
+  else NO_ELSE;
+}
+
+/* Fieldmaps and slot lists are compared by their contents, so
+   equivalent options made separately share flights */
+static void flight_decode_opts(struct U8_OUTPUT *out,lispval opts)
+{
+  lispval fieldmap = kno_getopt(opts,fieldmap_symbol,KNO_VOID);
+  lispval internslots = kno_getopt(opts,internslots_symbol,KNO_VOID);
+  if (KNO_TYPEP(fieldmap,kno_mongoc_fieldmap))
+    kno_unparse(out,((kno_mongodb_fieldmap)fieldmap)->fieldmap_source);
+  else if (!(KNO_VOIDP(fieldmap)))
+    kno_unparse(out,fieldmap);
+  else NO_ELSE;
+  u8_putc(out,'|');
+  if (!(KNO_VOIDP(internslots))) kno_unparse(out,internslots);
+  kno_decref(fieldmap);
+  kno_decref(internslots);
+}
+
+/* This returns the key for a flight (which the caller should free) or
+   NULL (with an error) if the query can't be encoded. The BSON for the
+   query and search options is kept in *enc* (which the caller should
+   also free) for the function which runs the query. */
+static unsigned char *flight_key(int op,lispval arg,lispval query,
+				 int flags,lispval opts,size_t *lenp,
+				 struct MONGODB_ENCODED *enc)
+{
+  /* Gets send keys under their own field, so only tables are sent as
+     they're encoded here */
+  int keyp = ( (op == FLIGHT_GET) && (!(KNO_TABLEP(query))) );
+  bson_t *q = (keyp) ? (getn_encode_key(query,flags,opts)) :
+    (kno_lisp2bson(query,flags,opts));
+  if (q == NULL) return NULL;
+  bson_t *searchopts = get_search_opts
+    (opts,flags,(op == FLIGHT_COUNT) ? (KNO_COUNT_MATCHES) : (KNO_FIND_MATCHES));
+  mongoc_read_prefs_t *rp = get_read_prefs(opts);
+  struct U8_OUTPUT decode; U8_INIT_OUTPUT(&decode,64);
+  flight_decode_opts(&decode,opts);
+  struct MONGODB_FLIGHT_HEADER header;
+  memset(&header,0,sizeof(header));
+  header.flight_op = op;
+  header.flight_flags = flags;
+  header.flight_sorted = kno_testopt(opts,KNOSYM_SORTED,KNO_VOID);
+  header.flight_readmode = (rp) ? (mongoc_read_prefs_get_mode(rp)) : (-1);
+  header.flight_coll = arg;
+  size_t qlen = q->len, slen = (searchopts) ? (searchopts->len) : (0);
+  size_t dlen = decode.u8_write-decode.u8_outbuf;
+  size_t len = sizeof(header)+qlen+slen+dlen;
+  unsigned char *key = u8_malloc(len);
+  memcpy(key,&header,sizeof(header));
+  memcpy(key+sizeof(header),bson_get_data(q),qlen);
+  if (searchopts)
+    memcpy(key+sizeof(header)+qlen,bson_get_data(searchopts),slen);
+  memcpy(key+sizeof(header)+qlen+slen,decode.u8_outbuf,dlen);
+  u8_close_output(&decode);
+  if (rp) mongoc_read_prefs_destroy(rp);
+  if (keyp) {
+    bson_destroy(q);
+    q = NULL;}
+  enc->enc_query = q;
+  enc->enc_searchopts = searchopts;
+  *lenp = len;
+  return key;
+}
+
+/* This calls *fn* unless a call with the same *key* is already in
+   flight, in which case it waits for and returns that call's
+   result. */
+static lispval run_flight(mongodb_flightfn fn,int op,lispval arg,
+			  lispval query,lispval opts_arg,int flags,
+			  const unsigned char *key,size_t keylen,
+			  unsigned int hash,struct MONGODB_ENCODED *enc)
+{
+  struct MONGODB_FLIGHT *flight, **bucket = &(flights[hash%FLIGHT_BUCKETS]);
+  u8_lock_mutex(&flights_lock);
+  flight = *bucket;
+  while (flight) {
+    if ( (flight->flight_hash == hash) && (flight->flight_keylen == keylen) &&
+	 (memcmp(flight->flight_key,key,keylen) == 0) )
+      break;
+    else flight = flight->flight_next;}
+  if (flight) {
+    /* Wait for the leader */
+    lispval result;
+    flight->flight_users++;
+    while (!(flight->flight_done))
+      u8_condvar_wait(&(flight->flight_ready),&flights_lock);
+    if (KNO_ABORTP(flight->flight_result))
+      result = thread_error_raise(&(flight->flight_error),"single_flight",arg);
+    else result = kno_incref(flight->flight_result);
+    int last = (--(flight->flight_users) == 0);
+    u8_unlock_mutex(&flights_lock);
+    if (last) free_flight(flight);
+    if ((logops)||(flags&KNO_MONGODB_LOGOPS))
+      u8_logf(LOG_NOTICE,"single_flight","Shared in-flight %s on %q",
+	      (op == FLIGHT_FIND) ? ("find") : ("count"),arg);
+    return result;}
+  flight = u8_alloc(struct MONGODB_FLIGHT);
+  memset(flight,0,sizeof(struct MONGODB_FLIGHT));
+  flight->flight_hash = hash;
+  flight->flight_key = key;
+  flight->flight_keylen = keylen;
+  flight->flight_users = 1;
+  flight->flight_result = KNO_VOID;
+  u8_init_condvar(&(flight->flight_ready));
+  flight->flight_next = *bucket;
+  *bucket = flight;
+  u8_unlock_mutex(&flights_lock);
+  lispval result = fn(arg,query,opts_arg,flags,enc);
+  if (!(KNO_ABORTP(result))) freeze_result(result);
+  u8_lock_mutex(&flights_lock);
+  /* Once the flight is out of the table, no more callers can join it */
+  struct MONGODB_FLIGHT **scan = bucket;
+  while (*scan != flight) scan = &((*scan)->flight_next);
+  *scan = flight->flight_next;
+  if (KNO_ABORTP(result)) {
+    thread_error_catch(&(flight->flight_error),kno_MongoDB_Error,NULL);
+    flight->flight_result = KNO_ERROR_VALUE;}
+  else flight->flight_result = kno_incref(result);
+  flight->flight_done = 1;
+  u8_condvar_broadcast(&(flight->flight_ready));
+  int last = (--(flight->flight_users) == 0);
+  u8_unlock_mutex(&flights_lock);
+  if (last) free_flight(flight);
+  return result;
+}
+
+/* This calls *fn* (with the other arguments) unless an identical call
+   is already in flight, in which case it waits for and returns that
+   call's result. */
+static lispval single_flight(mongodb_flightfn fn,int op,lispval arg,
+			     lispval query,lispval opts_arg,int flags)
+{
+  struct KNO_MONGODB_COLLECTION *coll = (struct KNO_MONGODB_COLLECTION *)arg;
+  lispval opts = combine_opts(opts_arg,coll->collection_opts);
+  struct MONGODB_ENCODED enc = { NULL, NULL };
+  size_t keylen = 0;
+  unsigned char *key = flight_key(op,arg,query,flags,opts,&keylen,&enc);
+  kno_decref(opts);
+  if (key == NULL) return KNO_ERROR_VALUE;
+  lispval result = run_flight(fn,op,arg,query,opts_arg,flags,key,keylen,
+			      mongodb_hash_bytes(key,keylen),&enc);
+  free_encoded(&enc);
+  u8_free(key);
+  return result;
+}
+
+/* Query result caches */
+
+/* A collection opened with the `cache` option (a number of bytes, or
+   #t for qcache_max_bytes) keeps the results of collection/find and
+   collection/get for `cachettl` seconds (or qcache_ttl). Results are
+   keyed like in-flight queries. The cache keeps its own copy of each
+   result and every hit gets a fresh copy, so callers can modify what
+   they get. Entry sizes are estimated from the decoded results.
+
+   Writes through this module (including bulk inserts and commands)
+   clear the caches for their collection; commands run on a server
+   clear the caches for every collection in its database. Writes made
+   by other processes or other connections aren't seen until entries
+   expire. */
+
+#define QCACHE_BUCKETS 1024
+
+static int qcache_max_bytes = 16*1024*1024;
+static int qcache_ttl = 60;
+
+static struct KNO_MONGODB_QCACHE *qcaches = NULL;
+static u8_mutex qcaches_lock;
+
+struct MONGODB_QCACHE_ENTRY {
+  unsigned int entry_hash;
+  size_t entry_keylen, entry_bytes;
+  unsigned char *entry_key;
+  lispval entry_value;
+  double entry_expires;
+  struct MONGODB_QCACHE_ENTRY *entry_next, *entry_newer, *entry_older;};
+
+DEF_KNOSYM(cache); DEF_KNOSYM(cachettl);
+
+/* This returns a rough estimate of the memory used by *x* */
+static size_t estimate_size(lispval x,int depth)
+{
+  if (!(KNO_CONSP(x)))
+    return sizeof(lispval);
+  else if (depth > 16)
+    return 64;
+  else if (KNO_STRINGP(x))
+    return sizeof(struct KNO_STRING)+KNO_STRLEN(x)+1;
+  else if (KNO_PACKETP(x))
+    return sizeof(struct KNO_STRING)+KNO_PACKET_LENGTH(x);
+  else if (KNO_CHOICEP(x)) {
+    size_t size = sizeof(struct KNO_CHOICE);
+    KNO_DO_CHOICES(elt,x) size += estimate_size(elt,depth+1);
+    return size;}
+  else if (KNO_VECTORP(x)) {
+    size_t size = sizeof(struct KNO_VECTOR);
+    int i = 0, n = KNO_VECTOR_LENGTH(x);
+    while (i < n) size += estimate_size(KNO_VECTOR_REF(x,i++),depth+1);
+    return size;}
+  else if (KNO_SLOTMAPP(x)) {
+    struct KNO_SLOTMAP *smap = (kno_slotmap) x;
+    size_t size = sizeof(struct KNO_SLOTMAP);
+    int i = 0, n = smap->n_slots;
+    while (i < n) {
+      size += estimate_size(smap->sm_keyvals[i].kv_key,depth+1);
+      size += estimate_size(smap->sm_keyvals[i].kv_val,depth+1);
+      i++;}
+    return size;}
+  else if (KNO_SCHEMAPP(x)) {
+    struct KNO_SCHEMAP *smap = (kno_schemap) x;
+#if KNO_MAJOR_VERSION >= 2004
+    lispval *values = smap->table_values;
+#else
+    lispval *values = smap->schema_values;
+#endif
+    size_t size = sizeof(struct KNO_SCHEMAP);
+    int i = 0, n = smap->schema_length;
+    while (i < n) size += estimate_size(values[i++],depth+1)+sizeof(lispval);
+    return size;}
+  else if (KNO_TYPEP(x,kno_mongoc_lazydoc)) {
+    struct KNO_MONGODB_LAZYDOC *doc = (struct KNO_MONGODB_LAZYDOC *)x;
+    return sizeof(struct KNO_MONGODB_LAZYDOC)+doc->lazydoc_bson->len;}
+  else return 64;
+}
+
+static struct KNO_MONGODB_QCACHE *
+make_qcache(struct KNO_MONGODB_DATABASE *server,u8_string name,lispval opts)
+{
+  struct KNO_MONGODB_QCACHE *qc = NULL;
+  lispval spec = kno_getopt(opts,KNOSYM(cache),KNO_FALSE);
+  lispval ttl = kno_getopt(opts,KNOSYM(cachettl),KNO_VOID);
+  if ( (KNO_FALSEP(spec)) || (KNO_VOIDP(spec)) ) {}
+  else {
+    qc = u8_alloc(struct KNO_MONGODB_QCACHE);
+    memset(qc,0,sizeof(struct KNO_MONGODB_QCACHE));
+    qc->qcache_max_bytes = (KNO_UINTP(spec)) ? (KNO_FIX2INT(spec)) :
+      (qcache_max_bytes);
+    qc->qcache_ttl = (KNO_FIXNUMP(ttl)) ? (KNO_FIX2INT(ttl)) :
+      (KNO_FLONUMP(ttl)) ? (KNO_FLONUM(ttl)) : (qcache_ttl);
+    qc->qcache_pool = server->dbpool;
+    qc->qcache_dbname = server->dbname;
+    qc->qcache_collection = name;
+    qc->qcache_buckets = u8_alloc_n(QCACHE_BUCKETS,struct MONGODB_QCACHE_ENTRY *);
+    memset(qc->qcache_buckets,0,sizeof(struct MONGODB_QCACHE_ENTRY *)*QCACHE_BUCKETS);
+    u8_init_mutex(&(qc->qcache_lock));
+    u8_lock_mutex(&qcaches_lock);
+    qc->qcache_next = qcaches;
+    qcaches = qc;
+    u8_unlock_mutex(&qcaches_lock);}
+  kno_decref(spec);
+  kno_decref(ttl);
+  return qc;
+}
+
+static void free_qcache_entry(struct MONGODB_QCACHE_ENTRY *e)
+{
+  kno_decref(e->entry_value);
+  u8_free(e->entry_key);
+  u8_free(e);
+}
+
+/* These are called with qcache_lock held */
+static void qcache_lru_unlink(struct KNO_MONGODB_QCACHE *qc,
+			      struct MONGODB_QCACHE_ENTRY *e)
+{
+  if (e->entry_newer) e->entry_newer->entry_older = e->entry_older;
+  else qc->qcache_newest = e->entry_older;
+  if (e->entry_older) e->entry_older->entry_newer = e->entry_newer;
+  else qc->qcache_oldest = e->entry_newer;
+}
+
+static void qcache_unlink(struct KNO_MONGODB_QCACHE *qc,
+			  struct MONGODB_QCACHE_ENTRY *e)
+{
+  struct MONGODB_QCACHE_ENTRY **scan =
+    &(qc->qcache_buckets[e->entry_hash%QCACHE_BUCKETS]);
+  while (*scan != e) scan = &((*scan)->entry_next);
+  *scan = e->entry_next;
+  qcache_lru_unlink(qc,e);
+  qc->qcache_bytes -= e->entry_bytes;
+  qc->qcache_n_entries--;
+}
+
+static void qcache_push(struct KNO_MONGODB_QCACHE *qc,
+			struct MONGODB_QCACHE_ENTRY *e)
+{
+  e->entry_newer = NULL;
+  e->entry_older = qc->qcache_newest;
+  if (qc->qcache_newest) qc->qcache_newest->entry_newer = e;
+  else qc->qcache_oldest = e;
+  qc->qcache_newest = e;
+}
+
+static void qcache_clear(struct KNO_MONGODB_QCACHE *qc)
+{
+  struct MONGODB_QCACHE_ENTRY *e = qc->qcache_newest;
+  while (e) {
+    struct MONGODB_QCACHE_ENTRY *older = e->entry_older;
+    free_qcache_entry(e);
+    e = older;}
+  memset(qc->qcache_buckets,0,sizeof(struct MONGODB_QCACHE_ENTRY *)*QCACHE_BUCKETS);
+  qc->qcache_newest = qc->qcache_oldest = NULL;
+  qc->qcache_n_entries = 0;
+  qc->qcache_bytes = 0;
+  qc->qcache_generation++;
+}
+
+static void free_qcache(struct KNO_MONGODB_QCACHE *qc)
+{
+  u8_lock_mutex(&qcaches_lock);
+  struct KNO_MONGODB_QCACHE **scan = &qcaches;
+  while (*scan != qc) scan = &((*scan)->qcache_next);
+  *scan = qc->qcache_next;
+  u8_unlock_mutex(&qcaches_lock);
+  qcache_clear(qc);
+  u8_free(qc->qcache_buckets);
+  u8_destroy_mutex(&(qc->qcache_lock));
+  u8_free(qc);
+}
+
+/* This clears the caches for the collection *name* (or for every
+   collection when *name* is NULL) in *server*'s database */
+static void qcache_invalidate_db(struct KNO_MONGODB_DATABASE *server,
+				 u8_string name)
+{
+  if (qcaches == NULL) return;
+  u8_lock_mutex(&qcaches_lock);
+  struct KNO_MONGODB_QCACHE *qc = qcaches;
+  while (qc) {
+    if ( (qc->qcache_pool == server->dbpool) &&
+	 ( (name == NULL) || (strcmp(qc->qcache_collection,name) == 0) ) &&
+	 ( (qc->qcache_dbname == server->dbname) ||
+	   ( (qc->qcache_dbname) && (server->dbname) &&
+	     (strcmp(qc->qcache_dbname,server->dbname) == 0) ) ) ) {
+      u8_lock_mutex(&(qc->qcache_lock));
+      qcache_clear(qc);
+      qc->qcache_invalidations++;
+      u8_unlock_mutex(&(qc->qcache_lock));}
+    qc = qc->qcache_next;}
+  u8_unlock_mutex(&qcaches_lock);
+}
+
+/* This clears the caches for *coll* (and any other collection objects
+   for the same collection) after it's been written to. */
+static void qcache_invalidate(struct KNO_MONGODB_COLLECTION *coll)
+{
+  qcache_invalidate_db(COLL2DB(coll),coll->collection_name);
+}
+
+/* This returns the cached value for *key* (or VOID), storing the
+   cache's current generation in *genp* */
+static lispval qcache_lookup(struct KNO_MONGODB_QCACHE *qc,
+			     unsigned char *key,size_t keylen,
+			     unsigned int hash,unsigned int *genp)
+{
+  lispval result = KNO_VOID;
+  double now = u8_elapsed_time();
+  u8_lock_mutex(&(qc->qcache_lock));
+  struct MONGODB_QCACHE_ENTRY *e = qc->qcache_buckets[hash%QCACHE_BUCKETS];
+  while (e) {
+    if ( (e->entry_hash == hash) && (e->entry_keylen == keylen) &&
+	 (memcmp(e->entry_key,key,keylen) == 0) )
+      break;
+    else e = e->entry_next;}
+  if ( (e) && (e->entry_expires < now) ) {
+    qcache_unlink(qc,e);
+    free_qcache_entry(e);
+    qc->qcache_expired++;
+    e = NULL;}
+  if (e) {
+    result = kno_incref(e->entry_value);
+    if (e != qc->qcache_newest) {
+      qcache_lru_unlink(qc,e);
+      qcache_push(qc,e);}
+    qc->qcache_hits++;}
+  else qc->qcache_misses++;
+  *genp = qc->qcache_generation;
+  u8_unlock_mutex(&(qc->qcache_lock));
+  return result;
+}
+
+/* This stores *value* for *key* (taking both) unless the cache has
+   been cleared since generation *gen* */
+static void qcache_store(struct KNO_MONGODB_QCACHE *qc,
+			 unsigned char *key,size_t keylen,unsigned int hash,
+			 lispval value,unsigned int gen)
+{
+  size_t bytes = sizeof(struct MONGODB_QCACHE_ENTRY)+keylen+
+    estimate_size(value,0);
+  if (bytes > qc->qcache_max_bytes) {
+    kno_decref(value);
+    u8_free(key);
+    return;}
+  struct MONGODB_QCACHE_ENTRY *e = u8_alloc(struct MONGODB_QCACHE_ENTRY);
+  e->entry_hash = hash;
+  e->entry_key = key;
+  e->entry_keylen = keylen;
+  e->entry_bytes = bytes;
+  e->entry_value = value;
+  e->entry_expires = u8_elapsed_time()+qc->qcache_ttl;
+  u8_lock_mutex(&(qc->qcache_lock));
+  if (gen != qc->qcache_generation) {
+    u8_unlock_mutex(&(qc->qcache_lock));
+    free_qcache_entry(e);
+    return;}
+  /* Replace any entry stored by another thread in the meanwhile */
+  struct MONGODB_QCACHE_ENTRY *old = qc->qcache_buckets[hash%QCACHE_BUCKETS];
+  while (old) {
+    if ( (old->entry_hash == hash) && (old->entry_keylen == keylen) &&
+	 (memcmp(old->entry_key,key,keylen) == 0) )
+      break;
+    else old = old->entry_next;}
+  if (old) {
+    qcache_unlink(qc,old);
+    free_qcache_entry(old);}
+  while ( (qc->qcache_oldest) &&
+	  ((qc->qcache_bytes+bytes) > qc->qcache_max_bytes) ) {
+    struct MONGODB_QCACHE_ENTRY *evict = qc->qcache_oldest;
+    qcache_unlink(qc,evict);
+    free_qcache_entry(evict);
+    qc->qcache_evictions++;}
+  e->entry_next = qc->qcache_buckets[hash%QCACHE_BUCKETS];
+  qc->qcache_buckets[hash%QCACHE_BUCKETS] = e;
+  qc->qcache_bytes += bytes;
+  qc->qcache_n_entries++;
+  qcache_push(qc,e);
+  u8_unlock_mutex(&(qc->qcache_lock));
+}
+
+/* This returns the cached result of calling *fn* or calls it (through
+   single_flight when appropriate) and caches its result. */
+static lispval cached_query(mongodb_flightfn fn,int op,lispval arg,
+			    lispval query,lispval opts_arg,int flags)
+{
+  struct KNO_MONGODB_COLLECTION *coll = (struct KNO_MONGODB_COLLECTION *)arg;
+  struct KNO_MONGODB_QCACHE *qc = coll->collection_qcache;
+  lispval opts = combine_opts(opts_arg,coll->collection_opts);
+  struct MONGODB_ENCODED enc = { NULL, NULL };
+  size_t keylen = 0;
+  unsigned char *key = flight_key(op,arg,query,flags,opts,&keylen,&enc);
+  kno_decref(opts);
+  if (key == NULL) return KNO_ERROR_VALUE;
+  unsigned int hash = mongodb_hash_bytes(key,keylen), gen = 0;
+  lispval result = qcache_lookup(qc,key,keylen,hash,&gen);
+  if (!(KNO_VOIDP(result))) {
+    lispval copy = kno_deep_copy(result);
+    kno_decref(result);
+    free_encoded(&enc);
+    u8_free(key);
+    return copy;}
+  else if ( (op != FLIGHT_GET) && (flags&KNO_MONGODB_SINGLEFLIGHT) )
+    result = run_flight(fn,op,arg,query,opts_arg,flags,key,keylen,hash,&enc);
+  else result = fn(arg,query,opts_arg,flags,&enc);
+  free_encoded(&enc);
+  if (KNO_ABORTP(result))
+    u8_free(key);
+  else qcache_store(qc,key,keylen,hash,kno_deep_copy(result),gen);
+  return result;
+}
+
+DEFC_PRIM("collection/find",collection_find,
 	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
 	  "**undocumented**",
 	  {"collection",KNO_MONGOC_COLLECTION,KNO_VOID},
 	  {"query",kno_any_type,KNO_VOID},
 	  {"opts_arg",kno_any_type,KNO_VOID})
-static lispval collection_get(lispval arg,lispval query,lispval opts_arg)
+static lispval collection_find(lispval arg,lispval query,lispval opts_arg)
+{
+  struct KNO_MONGODB_COLLECTION *coll = (struct KNO_MONGODB_COLLECTION *)arg;
+  int flags = getflags(opts_arg,coll->collection_flags);
+  if (coll->collection_qcache)
+    return cached_query(find_documents,FLIGHT_FIND,arg,query,opts_arg,flags);
+  else if (flags&KNO_MONGODB_SINGLEFLIGHT)
+    return single_flight(find_documents,FLIGHT_FIND,arg,query,opts_arg,flags);
+  else return find_documents(arg,query,opts_arg,flags,NULL);
+}
+
+DEFC_PRIM("collection/count",collection_count,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "**undocumented**",
+	  {"collection",KNO_MONGOC_COLLECTION,KNO_VOID},
+	  {"query",kno_any_type,KNO_VOID},
+	  {"opts_arg",kno_any_type,KNO_VOID})
+static lispval collection_count(lispval arg,lispval query,lispval opts_arg)
 {
-  lispval result = KNO_EMPTY_CHOICE;
   struct KNO_MONGODB_COLLECTION *coll = (struct KNO_MONGODB_COLLECTION *)arg;
   int flags = getflags(opts_arg,coll->collection_flags);
+  /* Estimated counts (without a query) are cheap enough to not share */
+  if ( (flags&KNO_MONGODB_SINGLEFLIGHT) && (query_check(query) > 0) )
+    return single_flight(count_documents,FLIGHT_COUNT,arg,query,opts_arg,flags);
+  else return count_documents(arg,query,opts_arg,flags,NULL);
+}
+
+
+static lispval get_document(lispval arg,lispval query,lispval opts_arg,
+			    int flags,struct MONGODB_ENCODED *enc)
+{
+  lispval result = KNO_EMPTY_CHOICE;
+  struct KNO_MONGODB_COLLECTION *coll = (struct KNO_MONGODB_COLLECTION *)arg;
+  if ( (coll->collection_coalescer) && (!(KNO_TABLEP(query))) &&
+       ( (KNO_VOIDP(opts_arg)) || (KNO_FALSEP(opts_arg)) ) )
+    return coalesced_get(coll,query,flags,coll->collection_opts);
   lispval opts = combine_opts(opts_arg,coll->collection_opts);
   mongoc_client_t *client = NULL;
-  mongoc_collection_t *collection = open_collection(coll,&client,flags);
+  mongoc_collection_t *collection = open_collection(coll,&client,flags,opts);
   if (collection) {
     mongoc_cursor_t *cursor;
     const bson_t *doc;
-    bson_t *q, *findopts = get_search_opts(opts,flags,KNO_FIND_MATCHES);
+    bson_t *q, *findopts = (enc) ? (enc->enc_searchopts) :
+      (get_search_opts(opts,flags,KNO_FIND_MATCHES));
     mongoc_read_prefs_t *rp = get_read_prefs(opts);
-    if (OIDP(query)) {
+    if ( (enc) && (enc->enc_query) )
+      q = enc->enc_query;
+    else if (OIDP(query)) {
       struct KNO_BSON_OUTPUT out;
       out.bson_doc = bson_new();
       out.bson_flags = ((flags<0)?(getflags(opts,KNO_MONGODB_DEFAULTS)):(flags));
@@ -1848,8 +4310,8 @@ static lispval collection_get(lispval arg,lispval query,lispval opts_arg)
       result = kno_bson2lisp((bson_t *)doc,flags,opts);}
     if (cursor) mongoc_cursor_destroy(cursor);
     if (rp) mongoc_read_prefs_destroy(rp);
-    if (findopts) bson_destroy(findopts);
-    if (q) bson_destroy(q);
+    if ( (findopts) && (enc == NULL) ) bson_destroy(findopts);
+    if ( (q) && ( (enc == NULL) || (q != enc->enc_query) ) ) bson_destroy(q);
     kno_decref(opts);
     collection_done(collection,client,coll);
     U8_CLEAR_ERRNO();
@@ -1860,133 +4322,1046 @@ static lispval collection_get(lispval arg,lispval query,lispval opts_arg)
     return KNO_ERROR_VALUE;}
 }
 
-DEFC_PRIM("collection/oidslot",collection_oidslot,
-	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
-	  "Returns the OID slot associated with *collection*",
-	  {"collection",KNO_MONGOC_COLLECTION,KNO_VOID})
-static lispval collection_oidslot(lispval arg)
-{
-  struct KNO_MONGODB_COLLECTION *coll = (struct KNO_MONGODB_COLLECTION *)arg;
-  return coll->collection_oidslot;
-}
-
-/* Find and Modify */
-
-static int getnewopt(lispval opts,int dflt);
-
-
-DEFC_PRIM("collection/modify!",collection_modify,
-	  KNO_MAX_ARGS(4)|KNO_MIN_ARGS(3),
+DEFC_PRIM("collection/get",collection_get,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
 	  "**undocumented**",
 	  {"collection",KNO_MONGOC_COLLECTION,KNO_VOID},
 	  {"query",kno_any_type,KNO_VOID},
-	  {"update",kno_any_type,KNO_VOID},
 	  {"opts_arg",kno_any_type,KNO_VOID})
-static lispval collection_modify(lispval arg,lispval query,
-				 lispval update,
-				 lispval opts_arg)
+static lispval collection_get(lispval arg,lispval query,lispval opts_arg)
 {
   struct KNO_MONGODB_COLLECTION *coll = (struct KNO_MONGODB_COLLECTION *)arg;
-  struct KNO_MONGODB_DATABASE *db = COLL2DB(coll);
   int flags = getflags(opts_arg,coll->collection_flags);
-  lispval opts = combine_opts(opts_arg,coll->collection_opts);
-  mongoc_client_t *client;
-  mongoc_collection_t *collection = open_collection(coll,&client,flags);
-  if (collection) {
-    lispval result = KNO_VOID;
-    lispval sort = kno_getopt(opts,KNOSYM_SORT,KNO_VOID);
-    lispval fields = kno_getopt(opts,fieldssym,KNO_VOID);
-    lispval upsert = kno_getopt(opts,upsertsym,KNO_FALSE);
-    lispval remove = kno_getopt(opts,removesym,KNO_FALSE);
-    int return_new = getnewopt(opts,1);
-    bson_t *q = kno_lisp2bson(query,flags,opts);
-    bson_t *u = kno_lisp2bson(update,flags,opts);
-    if ((q == NULL)||(u == NULL)) {
-      U8_CLEAR_ERRNO();
-      return KNO_ERROR_VALUE;}
-    if ((logops)||(flags&KNO_MONGODB_LOGOPS)) {
-      unsigned char *qstring = bson_as_json(q,NULL);
-      unsigned char *ustring = bson_as_json(u,NULL);
-      u8_logf(LOG_NOTICE,"mongodb_modify",
-	      "Updating in %q to\n%Q\n%s\n+%Q\n+%s",
-	      arg,query,qstring,update,ustring);
-      bson_free(qstring);
-      bson_free(ustring);}
-    bson_t reply; bson_error_t error = { 0 };
-    if (mongoc_collection_find_and_modify
-	(collection,
-	 q,kno_lisp2bson(sort,flags,opts),
-	 u,kno_lisp2bson(fields,flags,opts),
-	 ((KNO_FALSEP(remove))?(false):(true)),
-	 ((KNO_FALSEP(upsert))?(false):(true)),
-	 ((return_new)?(true):(false)),
-	 &reply,&error)) {
-      U8_CLEAR_ERRNO();
-      result = kno_bson2lisp(&reply,flags,opts);}
-    else {
-      u8_byte buf[1000];
-      kno_seterr(kno_MongoDB_Error,"mongodb_modify",
-		 u8_sprintf(buf,1000,"%s (%s>%s)",
-			    error.message,db->dburi,coll->collection_name),
-		 kno_make_pair(query,update));
-      result = KNO_ERROR_VALUE;}
-    collection_done(collection,client,coll);
-    if (q) bson_destroy(q);
-    if (u) bson_destroy(u);
-    bson_destroy(&reply);
-    kno_decref(opts);
-    kno_decref(fields);
-    kno_decref(upsert);
-    kno_decref(remove);
-    U8_CLEAR_ERRNO();
-    return result;}
-  else {
-    kno_decref(opts);
-    U8_CLEAR_ERRNO();
-    return KNO_ERROR_VALUE;}
+  if (coll->collection_qcache)
+    return cached_query(get_document,FLIGHT_GET,arg,query,opts_arg,flags);
+  else return get_document(arg,query,opts_arg,flags,NULL);
 }
 
-static int getnewopt(lispval opts,int dflt)
+/* Fetching documents for many keys */
+
+/* collection/getn fetches the documents for a vector of keys (OIDs or
+   _id values) with `$in` queries, splitting the keys into chunks of
+   at most getn_chunk_bytes of BSON. When the pool has idle clients,
+   helper threads fetch chunks concurrently. Documents are matched to
+   their keys by comparing the BSON encodings of the keys, so keys
+   should be stored with the BSON type they're written with. OIDs are
+   matched on the collection's oidslot and other keys on _id, unless
+   the `keyslot` option names the slot to match all of them on. */
+
+static int getn_chunk_bytes = 262144;
+static int getn_threads = 4;
+
+#define GETN_MAX_THREADS 16
+
+struct GETN_KEY {
+  bson_t *key_bson;
+  unsigned int key_hash;
+  int key_field, key_dup;};
+
+struct GETN_CHUNK {
+  const char *chunk_field;
+  int chunk_start, chunk_end;};
+
+struct GETN_JOB {
+  struct GETN_KEY *getn_keys;
+  int *getn_buckets, getn_n_buckets;
+  const char *getn_fields[2];
+  /* Positions of the distinct keys, in chunk order */
+  int *getn_order, getn_n_unique;
+  struct GETN_CHUNK *getn_chunks;
+  int getn_n_chunks, getn_next_chunk, getn_failed;
+  const bson_t *getn_findopts;
+  const mongoc_read_prefs_t *getn_readprefs;
+  /* The document (if found) for each distinct key */
+  bson_t **getn_docs;
+  u8_mutex getn_lock;
+  struct MONGODB_THREAD_ERROR getn_error;};
+
+struct GETN_HELPER {
+  struct GETN_JOB *helper_job;
+  mongoc_client_t *helper_client;
+  mongoc_collection_t *helper_collection;
+  pthread_t helper_thread;};
+
+static unsigned int getn_hash(const bson_t *key,int field)
 {
-  lispval v = kno_getopt(opts,newsym,KNO_VOID);
-  if (KNO_VOIDP(v)) {
-    v = kno_getopt(opts,originalsym,KNO_VOID);
-    if (KNO_VOIDP(v))
-      return dflt;
-    else if (KNO_FALSEP(v))
-      return 1;
-    else {
-      kno_decref(v);
-      return 0;}}
-  else if (KNO_FALSEP(v))
-    return 0;
-  else {
-    kno_decref(v);
-    return 1;}
+  return mongodb_hash_bytes(bson_get_data(key),key->len)+field;
 }
 
-/* Command execution */
+/* Returns the position of the first key matching *key* and *field* or
+   -1 if there isn't one. If *add* is not negative and there's no
+   matching key, the key at position *add* is stored. */
+static int getn_probe(struct GETN_JOB *job,const bson_t *key,int field,
+		      unsigned int hash,int add)
+{
+  int mask = job->getn_n_buckets-1, probe = hash&mask;
+  while (job->getn_buckets[probe] >= 0) {
+    struct GETN_KEY *k = &(job->getn_keys[job->getn_buckets[probe]]);
+    if ( (k->key_hash == hash) && (k->key_field == field) &&
+	 (k->key_bson->len == key->len) &&
+	 (memcmp(bson_get_data(k->key_bson),bson_get_data(key),key->len) == 0) )
+      return job->getn_buckets[probe];
+    probe = (probe+1)&mask;}
+  if (add >= 0) job->getn_buckets[probe] = add;
+  return -1;
+}
 
-DEFC_PRIM("->mongovec",make_mongovec,
-	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
-	  "**undocumented**",
-	  {"vec",kno_vector_type,KNO_VOID})
-static lispval make_mongovec(lispval vec)
+/* This records the first error for *job*, which is the current
+   exception if *msg* is NULL */
+static void getn_error(struct GETN_JOB *job,u8_string msg)
 {
-  lispval *elts = KNO_VECTOR_ELTS(vec);
-  int n = KNO_VECTOR_LENGTH(vec);
-  return kno_init_compound_from_elts
-    (NULL,mongovec_symbol,KNO_COMPOUND_INCREF|KNO_COMPOUND_SEQUENCE,n,elts);
+  u8_lock_mutex(&(job->getn_lock));
+  if (msg)
+    thread_error_set(&(job->getn_error),kno_MongoDB_Error,NULL,msg,KNO_VOID);
+  else thread_error_catch(&(job->getn_error),kno_MongoDB_Error,
+			  "couldn't get a client");
+  __atomic_store_n(&(job->getn_failed),1,__ATOMIC_RELEASE);
+  u8_unlock_mutex(&(job->getn_lock));
 }
 
-static lispval make_command(int n,kno_argvec values)
+/* This records *doc* as the document for its key (if it has one) */
+static void getn_match(struct GETN_JOB *job,struct GETN_CHUNK *chunk,
+		       int field,const bson_t *doc)
 {
-  if ((n%2)==1)
-    return kno_err(kno_SyntaxError,"make_command","Odd number of arguments",KNO_VOID);
-  else {
-    lispval result = kno_make_slotmap(n/2,n/2,NULL);
-    struct KNO_KEYVAL *keyvals = KNO_SLOTMAP_KEYVALS(result);
-    int n_slots=n/2;
+  bson_iter_t iter;
+  if (!(bson_iter_init_find(&iter,doc,chunk->chunk_field))) return;
+  bson_t key;
+  bson_init(&key);
+  if (bson_append_iter(&key,"",0,&iter)) {
+    int pos = getn_probe(job,&key,field,getn_hash(&key,field),-1);
+    if ( (pos >= 0) && (job->getn_docs[pos] == NULL) )
+      job->getn_docs[pos] = bson_copy(doc);}
+  bson_destroy(&key);
+}
+
+static int getn_fetch_chunk(struct GETN_JOB *job,
+			    mongoc_collection_t *collection,
+			    struct GETN_CHUNK *chunk)
+{
+  bson_t q, match, in;
+  char buf[16];
+  int field = (chunk->chunk_field == job->getn_fields[0]) ? (0) : (1);
+  bson_init(&q);
+  bson_append_document_begin(&q,chunk->chunk_field,-1,&match);
+  bson_append_array_begin(&match,"$in",3,&in);
+  int i = chunk->chunk_start, j = 0; while (i < chunk->chunk_end) {
+    struct GETN_KEY *key = &(job->getn_keys[job->getn_order[i++]]);
+    const char *index;
+    size_t index_len = bson_uint32_to_string(j++,&index,buf,sizeof(buf));
+    bson_iter_t iter;
+    if ( (bson_iter_init(&iter,key->key_bson)) && (bson_iter_next(&iter)) )
+      bson_append_iter(&in,index,index_len,&iter);}
+  bson_append_array_end(&match,&in);
+  bson_append_document_end(&q,&match);
+  mongoc_cursor_t *cursor = mongoc_collection_find_with_opts
+    (collection,&q,job->getn_findopts,job->getn_readprefs);
+  const bson_t *doc;
+  bson_error_t err;
+  int ok = 1;
+  while (mongoc_cursor_next(cursor,&doc))
+    getn_match(job,chunk,field,doc);
+  if (mongoc_cursor_error(cursor,&err)) {
+    getn_error(job,err.message);
+    ok = 0;}
+  mongoc_cursor_destroy(cursor);
+  bson_destroy(&q);
+  return ok;
+}
+
+/* This fetches unclaimed chunks until there aren't any more (or one
+   of the fetches has failed) */
+static void getn_work(struct GETN_JOB *job,mongoc_collection_t *collection)
+{
+  while (!(__atomic_load_n(&(job->getn_failed),__ATOMIC_ACQUIRE))) {
+    int i = __atomic_fetch_add(&(job->getn_next_chunk),1,__ATOMIC_ACQ_REL);
+    if (i >= job->getn_n_chunks) break;
+    getn_fetch_chunk(job,collection,&(job->getn_chunks[i]));}
+}
+
+static void *getn_helper(void *arg)
+{
+  struct GETN_HELPER *h = (struct GETN_HELPER *)arg;
+  getn_work(h->helper_job,h->helper_collection);
+  return NULL;
+}
+
+/* This splits the distinct keys into chunks, each of which has keys
+   for a single field and at most getn_chunk_bytes of key BSON. */
+static void getn_make_chunks(struct GETN_JOB *job)
+{
+  int i = 0, bytes = 0;
+  struct GETN_CHUNK *chunk = NULL;
+  job->getn_chunks = u8_alloc_n(job->getn_n_unique,struct GETN_CHUNK);
+  job->getn_n_chunks = 0;
+  while (i < job->getn_n_unique) {
+    struct GETN_KEY *key = &(job->getn_keys[job->getn_order[i]]);
+    const char *field = job->getn_fields[key->key_field];
+    int key_bytes = key->key_bson->len+8;
+    if ( (chunk == NULL) || (chunk->chunk_field != field) ||
+	 ( (bytes+key_bytes) > getn_chunk_bytes) ) {
+      chunk = &(job->getn_chunks[job->getn_n_chunks++]);
+      chunk->chunk_field = field;
+      chunk->chunk_start = i;
+      bytes = 0;}
+    bytes += key_bytes;
+    chunk->chunk_end = ++i;}
+}
+
+static void getn_init(struct GETN_JOB *job,int n,
+		      struct KNO_MONGODB_COLLECTION *coll,
+		      const char *keyfield)
+{
+  int n_buckets = 8;
+  while (n_buckets < n*2) n_buckets = n_buckets*2;
+  memset(job,0,sizeof(struct GETN_JOB));
+  job->getn_keys = u8_alloc_n(n,struct GETN_KEY);
+  job->getn_docs = u8_alloc_n(n,bson_t *);
+  job->getn_buckets = u8_alloc_n(n_buckets,int);
+  job->getn_n_buckets = n_buckets;
+  job->getn_order = u8_alloc_n(n,int);
+  job->getn_fields[0] = coll->collection_oidkey;
+  job->getn_fields[1] = (keyfield) ? (keyfield) : ("_id");
+  u8_init_mutex(&(job->getn_lock));
+  memset(job->getn_keys,0,sizeof(struct GETN_KEY)*n);
+  memset(job->getn_docs,0,sizeof(bson_t *)*n);
+  memset(job->getn_buckets,0xFF,sizeof(int)*n_buckets);
+}
+
+/* This returns the BSON for {"": *key*} or NULL (with an error) */
+static bson_t *getn_encode_key(lispval key,int flags,lispval opts)
+{
+  struct KNO_BSON_OUTPUT out;
+  out.bson_doc = bson_new();
+  out.bson_flags = flags;
+  out.bson_opts = opts;
+  out.bson_fieldmap = KNO_VOID;
+  if (bson_append_lisp(out,"",0,key,-1))
+    return out.bson_doc;
+  bson_destroy(out.bson_doc);
+  if (u8_current_exception == NULL)
+    kno_seterr("BadMongoKey","getn_encode_key",NULL,key);
+  return NULL;
+}
+
+/* This stores *key_bson* (which it takes) as key *i* of *job* and
+   returns the position of the first key which is the same as it. */
+static int getn_add_key(struct GETN_JOB *job,int i,bson_t *key_bson,int field)
+{
+  struct GETN_KEY *k = &(job->getn_keys[i]);
+  k->key_bson = key_bson;
+  k->key_field = field;
+  k->key_dup = -1;
+  k->key_hash = getn_hash(key_bson,field);
+  int first = getn_probe(job,key_bson,field,k->key_hash,i);
+  if (first < 0) return i;
+  /* Keep duplicates in order after the first position */
+  struct GETN_KEY *scan = &(job->getn_keys[first]);
+  while (scan->key_dup >= 0) scan = &(job->getn_keys[scan->key_dup]);
+  scan->key_dup = i;
+  return first;
+}
+
+/* This orders the first *n* keys by field and splits them into chunks */
+static void getn_prepare(struct GETN_JOB *job,int n)
+{
+  int field = 0; while (field < 2) {
+    int i = 0; while (i < n) {
+      struct GETN_KEY *k = &(job->getn_keys[i]);
+      if ( (k->key_field == field) &&
+	   (getn_probe(job,k->key_bson,field,k->key_hash,-1) == i) )
+	job->getn_order[job->getn_n_unique++] = i;
+      i++;}
+    field++;}
+  getn_make_chunks(job);
+}
+
+static void getn_free(struct GETN_JOB *job,int n)
+{
+  int i = 0; while (i < n) {
+    if (job->getn_keys[i].key_bson) bson_destroy(job->getn_keys[i].key_bson);
+    if (job->getn_docs[i]) bson_destroy(job->getn_docs[i]);
+    i++;}
+  u8_free(job->getn_keys);
+  u8_free(job->getn_docs);
+  u8_free(job->getn_buckets);
+  u8_free(job->getn_order);
+  if (job->getn_chunks) u8_free(job->getn_chunks);
+  thread_error_free(&(job->getn_error));
+  u8_destroy_mutex(&(job->getn_lock));
+}
+
+DEF_KNOSYM(threads); DEF_KNOSYM(keyslot);
+
+DEFC_PRIM("collection/getn",collection_getn,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "Returns a vector of the documents in *collection* for each "
+	  "of *keys* (OIDs or _id values), with #f for missing documents. "
+	  "The `keyslot` option matches every key on that slot.",
+	  {"collection",KNO_MONGOC_COLLECTION,KNO_VOID},
+	  {"keys",kno_vector_type,KNO_VOID},
+	  {"opts_arg",kno_any_type,KNO_VOID})
+static lispval collection_getn(lispval arg,lispval keys,lispval opts_arg)
+{
+  struct KNO_MONGODB_COLLECTION *coll = (struct KNO_MONGODB_COLLECTION *)arg;
+  struct KNO_MONGODB_DATABASE *server = COLL2DB(coll);
+  int n = KNO_VECTOR_LENGTH(keys);
+  if (n == 0) return kno_make_vector(0,NULL);
+  int flags = getflags(opts_arg,coll->collection_flags);
+  lispval opts = combine_opts(opts_arg,coll->collection_opts);
+  mongoc_client_t *client = NULL;
+  mongoc_collection_t *collection = open_collection(coll,&client,flags,opts);
+  if (collection == NULL) {
+    kno_decref(opts);
+    U8_CLEAR_ERRNO();
+    return KNO_ERROR_VALUE;}
+  lispval result = KNO_VOID;
+  struct GETN_JOB job;
+  int i = 0;
+  lispval keyslot = kno_getopt(opts,KNOSYM(keyslot),KNO_VOID);
+  int use_keyslot = KNO_SYMBOLP(keyslot);
+  getn_init(&job,n,coll,(use_keyslot) ? (KNO_SYMBOL_NAME(keyslot)) : (NULL));
+  kno_decref(keyslot);
+  while (i < n) {
+    lispval key = KNO_VECTOR_REF(keys,i);
+    bson_t *key_bson = getn_encode_key(key,flags,opts);
+    if (key_bson == NULL) {
+      result = KNO_ERROR_VALUE;
+      break;}
+    getn_add_key(&job,i++,key_bson,
+		 ( (OIDP(key)) && (!(use_keyslot)) ) ? (0) : (1));}
+  if (!(KNO_ABORTP(result))) {
+    getn_prepare(&job,n);
+    bson_t *findopts = get_search_opts(opts,flags,KNO_FIND_MATCHES);
+    mongoc_read_prefs_t *rp = get_read_prefs(opts);
+    job.getn_findopts = findopts;
+    job.getn_readprefs = rp;
+    lispval threads_arg = kno_getopt(opts,KNOSYM(threads),KNO_VOID);
+    int max_threads = (KNO_FIXNUMP(threads_arg)) ?
+      (KNO_FIX2INT(threads_arg)) : (getn_threads);
+    if (max_threads > GETN_MAX_THREADS) max_threads = GETN_MAX_THREADS;
+    if (max_threads > job.getn_n_chunks) max_threads = job.getn_n_chunks;
+    kno_decref(threads_arg);
+    /* Helpers only use clients which the pool has to spare */
+    struct GETN_HELPER helpers[GETN_MAX_THREADS];
+    lispval lane = (server->dbpool->pool_lanes) ? (get_lane(opts)) : (KNO_VOID);
+    int n_helpers = 0;
+    while (n_helpers < (max_threads-1)) {
+      struct GETN_HELPER *h = &(helpers[n_helpers]);
+      h->helper_job = &job;
+      h->helper_client = get_client(server,0,lane);
+      if (h->helper_client == NULL) break;
+      h->helper_collection = mongoc_client_get_collection
+	(h->helper_client,server->dbname,coll->collection_name);
+      if ( (h->helper_collection == NULL) ||
+	   (mongodb_thread_create(&(h->helper_thread),getn_helper,h) != 0) ) {
+	if (h->helper_collection) mongoc_collection_destroy(h->helper_collection);
+	release_client(server,h->helper_client);
+	break;}
+      n_helpers++;}
+    if ((logops)||(flags&KNO_MONGODB_LOGOPS))
+      u8_logf(LOG_NOTICE,"collection_getn",
+	      "Fetching %d documents from %q in %d chunks with %d threads",
+	      n,arg,job.getn_n_chunks,n_helpers+1);
+    getn_work(&job,collection);
+    i = 0; while (i < n_helpers) {
+      struct GETN_HELPER *h = &(helpers[i++]);
+      pthread_join(h->helper_thread,NULL);
+      mongoc_collection_destroy(h->helper_collection);
+      release_client(server,h->helper_client);}
+    U8_CLEAR_ERRNO();
+    if (rp) mongoc_read_prefs_destroy(rp);
+    if (findopts) bson_destroy(findopts);
+    if (job.getn_failed)
+      result = thread_error_raise(&(job.getn_error),"collection_getn",arg);}
+  collection_done(collection,client,coll);
+  if (!(KNO_ABORTP(result))) {
+    /* Decode the documents which were found */
+    bson_t **found = u8_alloc_n(job.getn_n_unique,bson_t *);
+    int *where = u8_alloc_n(job.getn_n_unique,int), n_found = 0;
+    lispval *decoded = u8_alloc_n(job.getn_n_unique,lispval);
+    i = 0; while (i < job.getn_n_unique) {
+      int pos = job.getn_order[i++];
+      if (job.getn_docs[pos]) {
+	found[n_found] = job.getn_docs[pos];
+	where[n_found] = pos;
+	n_found++;}}
+    struct KNO_BSON_FIELDCACHE *fc = new_fieldcache();
+    struct KNO_BSON_ARENA arena;
+    init_bson_arena(&arena,bson_arena_size);
+    int n_decoded = 0;
+    if (parallel_decodingp(flags,opts))
+      n_decoded = parallel_decode(found,n_found,flags,opts,decoded,fc,&arena);
+    else while (n_decoded < n_found) {
+	lispval r = bson2lisp(found[n_decoded],flags,opts,fc,&arena);
+	if (KNO_ABORTP(r)) {
+	  kno_decref_elts(decoded,n_decoded);
+	  n_decoded = -1;
+	  break;}
+	else decoded[n_decoded++] = r;}
+    free_fieldcache(fc);
+    free_bson_arena(&arena);
+    if (n_decoded < 0)
+      result = KNO_ERROR_VALUE;
+    else {
+      lispval *elts = u8_alloc_n(n,lispval);
+      i = 0; while (i < n) elts[i++] = KNO_FALSE;
+      i = 0; while (i < n_found) {
+	lispval doc = decoded[i];
+	int pos = where[i++];
+	elts[pos] = doc;
+	pos = job.getn_keys[pos].key_dup;
+	while (pos >= 0) {
+	  elts[pos] = kno_incref(doc);
+	  pos = job.getn_keys[pos].key_dup;}}
+      result = kno_make_vector(n,elts);
+      u8_free(elts);}
+    u8_free(found);
+    u8_free(where);
+    u8_free(decoded);}
+  getn_free(&job,n);
+  kno_decref(opts);
+  return result;
+}
+
+/* Coalescing gets */
+
+/* A collection opened with the `coalesce` option (a number of
+   microseconds, or #t for the default window) combines concurrent
+   collection/get calls for single keys (made without options of their
+   own) into batches. The first caller to add a key to a batch waits
+   for the window to pass (or for the batch to have `coalescemax` keys)
+   and then fetches the whole batch with one client. The other callers
+   wait for the fetch and decode their own documents. */
+
+static int coalesce_usecs = 200;
+static int coalesce_max = 64;
+
+struct MONGODB_COALESCE_BATCH {
+  struct GETN_JOB batch_job;
+  int batch_n, batch_max, batch_users, batch_done;
+  u8_condvar batch_ready;};
+
+DEF_KNOSYM(coalesce); DEF_KNOSYM(coalescemax);
+
+static struct KNO_MONGODB_COALESCER *make_coalescer(lispval opts)
+{
+  struct KNO_MONGODB_COALESCER *c = NULL;
+  lispval spec = kno_getopt(opts,KNOSYM(coalesce),KNO_FALSE);
+  lispval max = kno_getopt(opts,KNOSYM(coalescemax),KNO_VOID);
+  if ( (KNO_FALSEP(spec)) || (KNO_VOIDP(spec)) ) {}
+  else {
+    c = u8_alloc(struct KNO_MONGODB_COALESCER);
+    c->coalesce_usecs = (KNO_UINTP(spec)) ? (KNO_FIX2INT(spec)) :
+      (coalesce_usecs);
+    c->coalesce_max = ( (KNO_UINTP(max)) && (KNO_FIX2INT(max) > 0) ) ?
+      (KNO_FIX2INT(max)) : (coalesce_max);
+    if (c->coalesce_max < 1) c->coalesce_max = 1;
+    u8_init_mutex(&(c->coalesce_lock));
+    c->coalesce_batch = NULL;}
+  kno_decref(spec);
+  kno_decref(max);
+  return c;
+}
+
+static void free_coalescer(struct KNO_MONGODB_COALESCER *c)
+{
+  u8_destroy_mutex(&(c->coalesce_lock));
+  u8_free(c);
+}
+
+static struct MONGODB_COALESCE_BATCH *
+new_coalesce_batch(struct KNO_MONGODB_COLLECTION *coll,int max)
+{
+  struct MONGODB_COALESCE_BATCH *batch =
+    u8_alloc(struct MONGODB_COALESCE_BATCH);
+  getn_init(&(batch->batch_job),max,coll,NULL);
+  batch->batch_n = 0;
+  batch->batch_max = max;
+  batch->batch_users = 0;
+  batch->batch_done = 0;
+  u8_init_condvar(&(batch->batch_ready));
+  return batch;
+}
+
+static void free_coalesce_batch(struct MONGODB_COALESCE_BATCH *batch)
+{
+  getn_free(&(batch->batch_job),batch->batch_n);
+  u8_destroy_condvar(&(batch->batch_ready));
+  u8_free(batch);
+}
+
+/* This fetches the documents for the keys in *batch*, recording any
+   error in the batch's job */
+static void coalesce_fetch(struct KNO_MONGODB_COLLECTION *coll,
+			   struct MONGODB_COALESCE_BATCH *batch,
+			   int flags,lispval opts)
+{
+  struct GETN_JOB *job = &(batch->batch_job);
+  mongoc_client_t *client = NULL;
+  getn_prepare(job,batch->batch_n);
+  mongoc_collection_t *collection = open_collection(coll,&client,flags,opts);
+  if (collection == NULL) {
+    getn_error(job,NULL);
+    kno_clear_errors(0);
+    U8_CLEAR_ERRNO();
+    return;}
+  bson_t *findopts = get_search_opts(opts,flags,KNO_FIND_MATCHES);
+  mongoc_read_prefs_t *rp = get_read_prefs(opts);
+  job->getn_findopts = findopts;
+  job->getn_readprefs = rp;
+  if ((logops)||(flags&KNO_MONGODB_LOGOPS))
+    u8_logf(LOG_NOTICE,"collection_get",
+	    "Fetching %d coalesced keys from %s in %d queries",
+	    batch->batch_n,coll->collection_name,job->getn_n_chunks);
+  getn_work(job,collection);
+  collection_done(collection,client,coll);
+  if (rp) mongoc_read_prefs_destroy(rp);
+  if (findopts) bson_destroy(findopts);
+  U8_CLEAR_ERRNO();
+}
+
+static lispval coalesced_get(struct KNO_MONGODB_COLLECTION *coll,
+			     lispval key,int flags,lispval opts)
+{
+  struct KNO_MONGODB_COALESCER *c = coll->collection_coalescer;
+  bson_t *key_bson = getn_encode_key(key,flags,opts);
+  if (key_bson == NULL) return KNO_ERROR_VALUE;
+  u8_lock_mutex(&(c->coalesce_lock));
+  struct MONGODB_COALESCE_BATCH *batch = c->coalesce_batch;
+  int leader = (batch == NULL);
+  if (leader)
+    batch = c->coalesce_batch = new_coalesce_batch(coll,c->coalesce_max);
+  int slot = batch->batch_n++;
+  int pos = getn_add_key(&(batch->batch_job),slot,key_bson,
+			 (OIDP(key)) ? (0) : (1));
+  batch->batch_users++;
+  if (batch->batch_n >= batch->batch_max) {
+    /* Close the batch and wake up its leader */
+    c->coalesce_batch = NULL;
+    u8_condvar_broadcast(&(batch->batch_ready));}
+  if (leader) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME,&until);
+    long long nsecs = until.tv_nsec+(((long long)c->coalesce_usecs)*1000);
+    until.tv_sec += nsecs/1000000000;
+    until.tv_nsec = nsecs%1000000000;
+    while (c->coalesce_batch == batch) {
+      if (u8_condvar_timedwait(&(batch->batch_ready),&(c->coalesce_lock),
+			       &until) == ETIMEDOUT)
+	break;}
+    if (c->coalesce_batch == batch) c->coalesce_batch = NULL;
+    u8_unlock_mutex(&(c->coalesce_lock));
+    coalesce_fetch(coll,batch,flags,opts);
+    u8_lock_mutex(&(c->coalesce_lock));
+    batch->batch_done = 1;
+    u8_condvar_broadcast(&(batch->batch_ready));}
+  else while (!(batch->batch_done))
+	 u8_condvar_wait(&(batch->batch_ready),&(c->coalesce_lock));
+  u8_unlock_mutex(&(c->coalesce_lock));
+  lispval result = KNO_EMPTY_CHOICE;
+  struct GETN_JOB *job = &(batch->batch_job);
+  if (job->getn_failed)
+    result = thread_error_raise(&(job->getn_error),"collection_get",
+				(lispval)coll);
+  else if (job->getn_docs[pos])
+    result = kno_bson2lisp(job->getn_docs[pos],flags,opts);
+  else NO_ELSE;
+  u8_lock_mutex(&(c->coalesce_lock));
+  int last = (--(batch->batch_users) == 0);
+  u8_unlock_mutex(&(c->coalesce_lock));
+  if (last) free_coalesce_batch(batch);
+  return result;
+}
+
+DEFC_PRIM("collection/oidslot",collection_oidslot,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Returns the OID slot associated with *collection*",
+	  {"collection",KNO_MONGOC_COLLECTION,KNO_VOID})
+static lispval collection_oidslot(lispval arg)
+{
+  struct KNO_MONGODB_COLLECTION *coll = (struct KNO_MONGODB_COLLECTION *)arg;
+  return coll->collection_oidslot;
+}
+
+/* Prepared queries */
+
+/* collection/prepare encodes a query and its options once. The query
+   can contain parameters (made by mongodb/param), which are written as
+   user-defined binary values holding a pointer to the parameter
+   object; the prepared query keeps its parameters in
+   prepared_params and where they were written in prepared_sites.
+   collection/execute copies the bytes between the parameters,
+   encoding just their bound values (and adjusting the lengths of the
+   documents containing them), and runs the result with the prepared
+   search options and read preferences. */
+
+#define PARAM_MAGIC "%KNOPRM%"
+#define PARAM_MAGIC_LEN 8
+
+DEFC_PRIM("mongodb/param",mongodb_param,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Returns a parameter for use in prepared queries, which is "
+	  "bound by *name* (a symbol, or a position in a vector of values)",
+	  {"name",kno_any_type,KNO_VOID})
+static lispval mongodb_param(lispval name)
+{
+  if (!( (KNO_SYMBOLP(name)) || (KNO_UINTP(name)) ))
+    return kno_type_error("parameter name","mongodb_param",name);
+  struct KNO_MONGODB_PARAM *param = u8_alloc(struct KNO_MONGODB_PARAM);
+  KNO_INIT_CONS(param,kno_mongoc_param);
+  param->param_name = name;
+  return (lispval) param;
+}
+
+static void recycle_param(struct KNO_RAW_CONS *c)
+{
+  if (!(KNO_STATIC_CONSP(c))) u8_free(c);
+}
+static int unparse_param(struct U8_OUTPUT *out,lispval x)
+{
+  struct KNO_MONGODB_PARAM *param = (struct KNO_MONGODB_PARAM *)x;
+  u8_printf(out,"#<MongoDB/Param %q>",param->param_name);
+  return 1;
+}
+
+static bool bson_append_param(struct KNO_BSON_OUTPUT out,
+			      const char *key,int keylen,lispval param)
+{
+  if (!(out.bson_flags&KNO_MONGODB_PREPARING)) {
+    kno_seterr("MongoDB/UnpreparedParameter","bson_append_param",
+	       "Parameters can only be used in collection/prepare",param);
+    return false;}
+  unsigned char buf[PARAM_MAGIC_LEN+sizeof(lispval)];
+  memcpy(buf,PARAM_MAGIC,PARAM_MAGIC_LEN);
+  memcpy(buf+PARAM_MAGIC_LEN,&param,sizeof(lispval));
+  return bson_append_binary(out.bson_doc,key,keylen,BSON_SUBTYPE_USER,
+			    buf,sizeof(buf));
+}
+
+/* This adds the parameters in *x* to the choice *params* */
+static void collect_params(lispval x,lispval *params,int depth)
+{
+  if ( (!(KNO_CONSP(x))) || (depth > 32) ) return;
+  else if (KNO_TYPEP(x,kno_mongoc_param)) {
+    kno_incref(x);
+    KNO_ADD_TO_CHOICE(*params,x);}
+  else if (KNO_CHOICEP(x)) {
+    KNO_DO_CHOICES(elt,x) collect_params(elt,params,depth+1);}
+  else if (KNO_VECTORP(x)) {
+    int i = 0, n = KNO_VECTOR_LENGTH(x);
+    while (i < n) collect_params(KNO_VECTOR_REF(x,i++),params,depth+1);}
+  else if (KNO_TYPEP(x,kno_mongoc_lazydoc)) {}
+  else if (KNO_TABLEP(x)) {
+    lispval keys = kno_getkeys(x);
+    KNO_DO_CHOICES(key,keys) {
+      lispval val = kno_get(x,key,KNO_VOID);
+      collect_params(val,params,depth+1);
+      kno_decref(val);}
+    kno_decref(keys);}
+  else NO_ELSE;
+}
+
+/* This returns the parameter (if any) which *data* refers to */
+static lispval prepared_param(struct KNO_MONGODB_PREPARED *p,
+			      const uint8_t *data,uint32_t len)
+{
+  lispval param;
+  if ( (len != (PARAM_MAGIC_LEN+sizeof(lispval))) ||
+       (memcmp(data,PARAM_MAGIC,PARAM_MAGIC_LEN) != 0) )
+    return KNO_VOID;
+  memcpy(&param,data+PARAM_MAGIC_LEN,sizeof(lispval));
+  int i = 0; while (i < p->prepared_n_params) {
+    if (p->prepared_params[i] == param)
+      return param;
+    else i++;}
+  return KNO_VOID;
+}
+
+static lispval param_binding(lispval param,lispval bindings)
+{
+  lispval name = ((struct KNO_MONGODB_PARAM *)param)->param_name;
+  if ( (KNO_VECTORP(bindings)) && (KNO_UINTP(name)) ) {
+    int i = KNO_FIX2INT(name);
+    if (i < KNO_VECTOR_LENGTH(bindings))
+      return kno_incref(KNO_VECTOR_REF(bindings,i));
+    else return KNO_VOID;}
+  else if (KNO_TABLEP(bindings))
+    return kno_get(bindings,name,KNO_VOID);
+  else return KNO_VOID;
+}
+
+/* This records the parameters in the document which *iter* is
+   iterating over. *base* is the start of the prepared BSON and
+   *parents* are the offsets of the lengths of the documents
+   containing *iter*'s document. */
+static int find_param_sites(struct KNO_MONGODB_PREPARED *p,bson_iter_t *iter,
+			    const uint8_t *base,uint32_t *parents,
+			    int n_parents,int *max_sites)
+{
+  while (bson_iter_next(iter)) {
+    bson_type_t type = bson_iter_type(iter);
+    if (type == BSON_TYPE_BINARY) {
+      bson_subtype_t subtype;
+      uint32_t len;
+      const uint8_t *data;
+      bson_iter_binary(iter,&subtype,&len,&data);
+      lispval param = (subtype == BSON_SUBTYPE_USER) ?
+	(prepared_param(p,data,len)) : (KNO_VOID);
+      if (KNO_VOIDP(param)) continue;
+      if (p->prepared_n_sites >= *max_sites) {
+	int new_max = (*max_sites)*2;
+	p->prepared_sites = u8_realloc_n
+	  (p->prepared_sites,new_max,struct KNO_MONGODB_PARAM_SITE);
+	*max_sites = new_max;}
+      struct KNO_MONGODB_PARAM_SITE *site =
+	&(p->prepared_sites[p->prepared_n_sites++]);
+      /* An element is its type byte, its key and its value */
+      site->site_param = param;
+      site->site_start = (((const uint8_t *)bson_iter_key(iter))-1)-base;
+      site->site_end = (data+len)-base;
+      site->site_n_parents = n_parents;
+      memcpy(site->site_parents,parents,n_parents*sizeof(uint32_t));}
+    else if ( (type == BSON_TYPE_DOCUMENT) || (type == BSON_TYPE_ARRAY) ) {
+      uint32_t len;
+      const uint8_t *data;
+      bson_iter_t child;
+      if (type == BSON_TYPE_DOCUMENT)
+	bson_iter_document(iter,&len,&data);
+      else bson_iter_array(iter,&len,&data);
+      if (n_parents >= KNO_MONGODB_PARAM_DEPTH) {
+	kno_seterr("MongoDB/PreparedQueryTooDeep","find_param_sites",
+		   NULL,p->prepared_query);
+	return -1;}
+      parents[n_parents] = data-base;
+      if ( (bson_iter_recurse(iter,&child)) &&
+	   (find_param_sites(p,&child,base,parents,n_parents+1,max_sites) < 0) )
+	return -1;}
+    else NO_ELSE;}
+  return p->prepared_n_sites;
+}
+
+static void add_bson_length(uint8_t *buf,uint32_t off,int32_t delta)
+{
+  int32_t len;
+  memcpy(&len,buf+off,sizeof(int32_t));
+  len = BSON_UINT32_TO_LE(BSON_UINT32_FROM_LE(len)+delta);
+  memcpy(buf+off,&len,sizeof(int32_t));
+}
+
+/* This returns a copy of the prepared query with its parameters
+   replaced by their values in *bindings*, or NULL (with an error). */
+static bson_t *bind_params(struct KNO_MONGODB_PREPARED *p,lispval bindings)
+{
+  int i = 0, n = p->prepared_n_sites;
+  const uint8_t *src = bson_get_data(p->prepared_bson);
+  uint32_t src_len = p->prepared_bson->len;
+  struct KNO_MONGODB_PARAM_SITE *sites = p->prepared_sites;
+  bson_t **values = u8_alloc_n(n,bson_t *);
+  int32_t *deltas = u8_alloc_n(n,int32_t);
+  size_t total = src_len;
+  uint8_t *buf = NULL;
+  uint32_t from = 0, to = 0;
+  bson_t *result = NULL;
+  memset(values,0,n*sizeof(bson_t *));
+  /* Encode each bound value as an element with the parameter's key */
+  while (i < n) {
+    struct KNO_MONGODB_PARAM_SITE *site = &(sites[i]);
+    const char *key = (const char *)(src+site->site_start+1);
+    lispval value = param_binding(site->site_param,bindings);
+    if (KNO_VOIDP(value)) {
+      kno_seterr("UnboundParameter","collection_execute",NULL,
+		 ((struct KNO_MONGODB_PARAM *)(site->site_param))->param_name);
+      goto done;}
+    struct KNO_BSON_OUTPUT out;
+    out.bson_doc = values[i] = bson_new();
+    out.bson_flags = p->prepared_flags;
+    out.bson_opts = p->prepared_opts;
+    out.bson_fieldmap = p->prepared_fieldmap;
+    bool ok = bson_append_lisp(out,key,strlen(key),value,-1);
+    kno_decref(value);
+    if (!(ok)) goto done;
+    /* Without the document's length and terminating NUL */
+    deltas[i] = ((int32_t)(values[i]->len-5))-
+      ((int32_t)(site->site_end-site->site_start));
+    total += deltas[i];
+    i++;}
+  if (total > INT32_MAX) {
+    kno_seterr(kno_BSON_Error,"collection_execute","Query too large",bindings);
+    goto done;}
+  buf = u8_malloc(total);
+  i = 0; while (i < n) {
+    struct KNO_MONGODB_PARAM_SITE *site = &(sites[i]);
+    uint32_t elt_len = values[i]->len-5;
+    memcpy(buf+to,src+from,site->site_start-from);
+    to += site->site_start-from;
+    memcpy(buf+to,bson_get_data(values[i])+4,elt_len);
+    to += elt_len;
+    from = site->site_end;
+    i++;}
+  memcpy(buf+to,src+from,src_len-from);
+  add_bson_length(buf,0,((int32_t)total)-((int32_t)src_len));
+  /* Each parameter changes the lengths of the documents containing it,
+     which have moved by the changes of the parameters before them */
+  i = 0; while (i < n) {
+    struct KNO_MONGODB_PARAM_SITE *site = &(sites[i]);
+    int j = 0; while (j < site->site_n_parents) {
+      uint32_t off = site->site_parents[j++];
+      int32_t shift = 0;
+      int k = 0; while ( (k < n) && (sites[k].site_end <= off) )
+		   shift += deltas[k++];
+      add_bson_length(buf,off+shift,deltas[i]);}
+    i++;}
+  result = bson_new_from_data(buf,total);
+  if (result == NULL)
+    kno_seterr(kno_BSON_Error,"collection_execute","Bad bound query",bindings);
+ done:
+  if (buf) u8_free(buf);
+  i = 0; while (i < n) {
+    if (values[i]) bson_destroy(values[i]);
+    i++;}
+  u8_free(values);
+  u8_free(deltas);
+  return result;
+}
+
+DEFC_PRIM("collection/prepare",collection_prepare,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "Returns a prepared query for finding the documents in "
+	  "*collection* which match *query* (which can contain parameters "
+	  "made by mongodb/param), given *opts*.",
+	  {"collection",KNO_MONGOC_COLLECTION,KNO_VOID},
+	  {"query",kno_any_type,KNO_VOID},
+	  {"opts_arg",kno_any_type,KNO_VOID})
+static lispval collection_prepare(lispval arg,lispval query,lispval opts_arg)
+{
+  struct KNO_MONGODB_COLLECTION *coll = (struct KNO_MONGODB_COLLECTION *)arg;
+  int flags = getflags(opts_arg,coll->collection_flags);
+  lispval opts = combine_opts(opts_arg,coll->collection_opts);
+  bson_t *q = kno_lisp2bson(query,flags|KNO_MONGODB_PREPARING,opts);
+  if (q == NULL) {
+    kno_decref(opts);
+    return KNO_ERROR_VALUE;}
+  lispval params = KNO_EMPTY_CHOICE;
+  collect_params(query,&params,0);
+  struct KNO_MONGODB_PREPARED *p = u8_alloc(struct KNO_MONGODB_PREPARED);
+  KNO_INIT_CONS(p,kno_mongoc_prepared);
+  p->prepared_coll = kno_incref(arg);
+  p->prepared_query = kno_incref(query);
+  p->prepared_opts = opts;
+  p->prepared_fieldmap = kno_getopt(opts,fieldmap_symbol,KNO_VOID);
+  p->prepared_flags = flags;
+  p->prepared_sorted = kno_testopt(opts,KNOSYM_SORTED,KNO_VOID);
+  p->prepared_bson = q;
+  p->prepared_findopts = get_search_opts(opts,flags,KNO_FIND_MATCHES);
+  p->prepared_readprefs = get_read_prefs(opts);
+  p->prepared_n_params = KNO_CHOICE_SIZE(params);
+  p->prepared_params = (p->prepared_n_params) ?
+    (u8_alloc_n(p->prepared_n_params,lispval)) : (NULL);
+  int i = 0; KNO_DO_CHOICES(param,params) {
+    p->prepared_params[i++] = kno_incref(param);}
+  kno_decref(params);
+  p->prepared_n_sites = 0;
+  p->prepared_sites = NULL;
+  if (p->prepared_n_params) {
+    int max_sites = p->prepared_n_params;
+    uint32_t parents[KNO_MONGODB_PARAM_DEPTH];
+    bson_iter_t iter;
+    p->prepared_sites = u8_alloc_n(max_sites,struct KNO_MONGODB_PARAM_SITE);
+    if ( (!(bson_iter_init(&iter,q))) ||
+	 (find_param_sites(p,&iter,bson_get_data(q),parents,0,&max_sites) < 0) ) {
+      if (u8_current_exception == NULL)
+	kno_seterr(kno_BSON_Error,"collection_prepare",NULL,query);
+      kno_decref((lispval)p);
+      return KNO_ERROR_VALUE;}}
+  return (lispval) p;
+}
+
+DEFC_PRIM("collection/execute",collection_execute,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "Returns the documents matching the prepared query *prepared* "
+	  "with its parameters bound to the values in *bindings* (a table "
+	  "of names or a vector of positional values)",
+	  {"prepared",kno_any_type,KNO_VOID},
+	  {"bindings",kno_any_type,KNO_VOID})
+static lispval collection_execute(lispval prepared,lispval bindings)
+{
+  if (!(KNO_TYPEP(prepared,kno_mongoc_prepared)))
+    return kno_type_error("prepared query","collection_execute",prepared);
+  struct KNO_MONGODB_PREPARED *p = (struct KNO_MONGODB_PREPARED *)prepared;
+  struct KNO_MONGODB_COLLECTION *coll =
+    (struct KNO_MONGODB_COLLECTION *)(p->prepared_coll);
+  int flags = p->prepared_flags;
+  bson_t *q = p->prepared_bson;
+  if (p->prepared_n_sites) {
+    q = bind_params(p,bindings);
+    if (q == NULL) {
+      if (u8_current_exception == NULL)
+	kno_seterr(kno_BSON_Error,"collection_execute",NULL,bindings);
+      return KNO_ERROR_VALUE;}}
+  lispval results;
+  mongoc_client_t *client = NULL;
+  mongoc_collection_t *collection =
+    open_collection(coll,&client,flags,p->prepared_opts);
+  if (collection) {
+    if ((logops)||(flags&KNO_MONGODB_LOGOPS)) {
+      char *qstring = bson_as_json(q,NULL);
+      u8_logf(LOG_NOTICE,"collection_execute","Matches in %q to\n%s",
+	      p->prepared_coll,qstring);
+      bson_free(qstring);}
+    results = find_results(p->prepared_coll,p->prepared_query,collection,q,
+			   p->prepared_findopts,p->prepared_readprefs,
+			   flags,p->prepared_opts,p->prepared_sorted);
+    collection_done(collection,client,coll);}
+  else results = KNO_ERROR_VALUE;
+  if (q != p->prepared_bson) bson_destroy(q);
+  U8_CLEAR_ERRNO();
+  return results;
+}
+
+static void recycle_prepared(struct KNO_RAW_CONS *c)
+{
+  struct KNO_MONGODB_PREPARED *p = (struct KNO_MONGODB_PREPARED *)c;
+  if (p->prepared_params) {
+    kno_decref_elts(p->prepared_params,p->prepared_n_params);
+    u8_free(p->prepared_params);}
+  if (p->prepared_sites) u8_free(p->prepared_sites);
+  if (p->prepared_readprefs) mongoc_read_prefs_destroy(p->prepared_readprefs);
+  if (p->prepared_findopts) bson_destroy(p->prepared_findopts);
+  bson_destroy(p->prepared_bson);
+  kno_decref(p->prepared_fieldmap);
+  kno_decref(p->prepared_opts);
+  kno_decref(p->prepared_query);
+  kno_decref(p->prepared_coll);
+  if (!(KNO_STATIC_CONSP(c))) u8_free(c);
+}
+static int unparse_prepared(struct U8_OUTPUT *out,lispval x)
+{
+  struct KNO_MONGODB_PREPARED *p = (struct KNO_MONGODB_PREPARED *)x;
+  struct KNO_MONGODB_COLLECTION *coll =
+    (struct KNO_MONGODB_COLLECTION *)(p->prepared_coll);
+  u8_printf(out,"#<MongoDB/Prepared %s %d params>",
+	    coll->collection_name,p->prepared_n_params);
+  return 1;
+}
+
+/* Find and Modify */
+
+static int getnewopt(lispval opts,int dflt);
+
+
+DEFC_PRIM("collection/modify!",collection_modify,
+	  KNO_MAX_ARGS(4)|KNO_MIN_ARGS(3),
+	  "**undocumented**",
+	  {"collection",KNO_MONGOC_COLLECTION,KNO_VOID},
+	  {"query",kno_any_type,KNO_VOID},
+	  {"update",kno_any_type,KNO_VOID},
+	  {"opts_arg",kno_any_type,KNO_VOID})
+static lispval collection_modify(lispval arg,lispval query,
+				 lispval update,
+				 lispval opts_arg)
+{
+  struct KNO_MONGODB_COLLECTION *coll = (struct KNO_MONGODB_COLLECTION *)arg;
+  struct KNO_MONGODB_DATABASE *db = COLL2DB(coll);
+  int flags = getflags(opts_arg,coll->collection_flags);
+  lispval opts = combine_opts(opts_arg,coll->collection_opts);
+  mongoc_client_t *client;
+  mongoc_collection_t *collection = open_collection(coll,&client,flags,opts);
+  if (collection) {
+    lispval result = KNO_VOID;
+    lispval sort = kno_getopt(opts,KNOSYM_SORT,KNO_VOID);
+    lispval fields = kno_getopt(opts,fieldssym,KNO_VOID);
+    lispval upsert = kno_getopt(opts,upsertsym,KNO_FALSE);
+    lispval remove = kno_getopt(opts,removesym,KNO_FALSE);
+    int return_new = getnewopt(opts,1);
+    bson_t *q = kno_lisp2bson(query,flags,opts);
+    bson_t *u = kno_lisp2bson(update,flags,opts);
+    if ((q == NULL)||(u == NULL)) {
+      U8_CLEAR_ERRNO();
+      return KNO_ERROR_VALUE;}
+    if ((logops)||(flags&KNO_MONGODB_LOGOPS)) {
+      unsigned char *qstring = bson_as_json(q,NULL);
+      unsigned char *ustring = bson_as_json(u,NULL);
+      u8_logf(LOG_NOTICE,"mongodb_modify",
+	      "Updating in %q to\n%Q\n%s\n+%Q\n+%s",
+	      arg,query,qstring,update,ustring);
+      bson_free(qstring);
+      bson_free(ustring);}
+    bson_t reply; bson_error_t error = { 0 };
+    if (mongoc_collection_find_and_modify
+	(collection,
+	 q,kno_lisp2bson(sort,flags,opts),
+	 u,kno_lisp2bson(fields,flags,opts),
+	 ((KNO_FALSEP(remove))?(false):(true)),
+	 ((KNO_FALSEP(upsert))?(false):(true)),
+	 ((return_new)?(true):(false)),
+	 &reply,&error)) {
+      U8_CLEAR_ERRNO();
+      result = kno_bson2lisp(&reply,flags,opts);}
+    else {
+      u8_byte buf[1000];
+      kno_seterr(kno_MongoDB_Error,"mongodb_modify",
+		 u8_sprintf(buf,1000,"%s (%s>%s)",
+			    error.message,db->dburi,coll->collection_name),
+		 kno_make_pair(query,update));
+      result = KNO_ERROR_VALUE;}
+    qcache_invalidate(coll);
+    collection_done(collection,client,coll);
+    if (q) bson_destroy(q);
+    if (u) bson_destroy(u);
+    bson_destroy(&reply);
+    kno_decref(opts);
+    kno_decref(fields);
+    kno_decref(upsert);
+    kno_decref(remove);
+    U8_CLEAR_ERRNO();
+    return result;}
+  else {
+    kno_decref(opts);
+    U8_CLEAR_ERRNO();
+    return KNO_ERROR_VALUE;}
+}
+
+static int getnewopt(lispval opts,int dflt)
+{
+  lispval v = kno_getopt(opts,newsym,KNO_VOID);
+  if (KNO_VOIDP(v)) {
+    v = kno_getopt(opts,originalsym,KNO_VOID);
+    if (KNO_VOIDP(v))
+      return dflt;
+    else if (KNO_FALSEP(v))
+      return 1;
+    else {
+      kno_decref(v);
+      return 0;}}
+  else if (KNO_FALSEP(v))
+    return 0;
+  else {
+    kno_decref(v);
+    return 1;}
+}
+
+/* Command execution */
+
+DEFC_PRIM("->mongovec",make_mongovec,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "**undocumented**",
+	  {"vec",kno_vector_type,KNO_VOID})
+static lispval make_mongovec(lispval vec)
+{
+  lispval *elts = KNO_VECTOR_ELTS(vec);
+  int n = KNO_VECTOR_LENGTH(vec);
+  return kno_init_compound_from_elts
+    (NULL,mongovec_symbol,KNO_COMPOUND_INCREF|KNO_COMPOUND_SEQUENCE,n,elts);
+}
+
+static lispval make_command(int n,kno_argvec values)
+{
+  if ((n%2)==1)
+    return kno_err(kno_SyntaxError,"make_command","Odd number of arguments",KNO_VOID);
+  else {
+    lispval result = kno_make_slotmap(n/2,n/2,NULL);
+    struct KNO_KEYVAL *keyvals = KNO_SLOTMAP_KEYVALS(result);
+    int n_slots=n/2;
     int i = 0; while (i<n_slots) {
       lispval key = values[i*2];
       lispval value = values[i*2+1];
@@ -2005,7 +5380,7 @@ static lispval collection_command(lispval arg,lispval command,lispval opts_arg)
   lispval opts = combine_opts(opts_arg,coll->collection_opts);
   lispval fields = kno_get(opts,fieldssym,KNO_VOID);
   mongoc_client_t *client;
-  mongoc_collection_t *collection = open_collection(coll,&client,flags);
+  mongoc_collection_t *collection = open_collection(coll,&client,flags,opts);
   if (collection) {U8_CLEAR_ERRNO();}
   if (collection) {
     lispval results = KNO_EMPTY_CHOICE;
@@ -2034,11 +5409,11 @@ static lispval collection_command(lispval arg,lispval command,lispval opts_arg)
 	    lispval r = kno_bson2lisp((bson_t *)doc,flags,opts);
 	    KNO_ADD_TO_CHOICE(results,r);}
 	  mongoc_cursor_destroy(cursor);}
-	else results=KNO_ERROR_VALUE;}
+	else results=KNO_ERROR_VALUE;
+	qcache_invalidate(coll);}
       else results = kno_err(kno_TypeError,"collection_command",
 			     "bad skip/limit/batch",opts);
-      mongoc_collection_destroy(collection);
-      client_done(arg,client);
+      collection_done(collection,client,coll);
       if (cmd) bson_destroy(cmd);
       if (flds) bson_destroy(flds);
       kno_decref(opts);
@@ -2046,6 +5421,10 @@ static lispval collection_command(lispval arg,lispval command,lispval opts_arg)
       U8_CLEAR_ERRNO();
       return results;}
     else {
+      collection_done(collection,client,coll);
+      if (flds) bson_destroy(flds);
+      kno_decref(opts);
+      kno_decref(fields);
       return KNO_ERROR_VALUE;}}
   else return KNO_ERROR_VALUE;
 }
@@ -2057,7 +5436,8 @@ static lispval db_command(lispval arg,lispval command,
   int flags = getflags(opts_arg,srv->dbflags);
   lispval opts = combine_opts(opts_arg,srv->dbopts);
   lispval fields = kno_getopt(opts,fieldssym,KNO_VOID);
-  mongoc_client_t *client = get_client(srv,MONGODB_CLIENT_BLOCK);
+  mongoc_client_t *client =
+    get_client(srv,MONGODB_CLIENT_BLOCK,get_lane(opts));
   if (client) {U8_CLEAR_ERRNO();}
   if (client) {
     lispval results = KNO_EMPTY_CHOICE;
@@ -2091,7 +5471,8 @@ static lispval db_command(lispval arg,lispval command,
 	  mongoc_cursor_destroy(cursor);}
 	else {
 	  kno_decref(results);
-	  results=KNO_ERROR_VALUE;}}
+	  results=KNO_ERROR_VALUE;}
+	qcache_invalidate_db(srv,NULL);}
       else results = kno_err(kno_TypeError,"collection_command",
 			     "bad skip/limit/batch",opts);
       kno_decref(skip_arg);
@@ -2147,7 +5528,7 @@ static lispval collection_simple_command(lispval arg,lispval command,
   bson_t *cmd = kno_lisp2bson(command,flags,opts);
   if (cmd) {
     mongoc_client_t *client;
-    mongoc_collection_t *collection = open_collection(coll,&client,flags);
+    mongoc_collection_t *collection = open_collection(coll,&client,flags,opts);
     if (collection) {U8_CLEAR_ERRNO();}
     if (collection) {
       bson_t response; bson_error_t error;
@@ -2157,8 +5538,10 @@ static lispval collection_simple_command(lispval arg,lispval command,
 	       "For %q:\n  COMMAND: %Q\n JSON=%s",
 	       arg,command,cmd_string);
 	bson_free(cmd_string);}
-      if (mongoc_collection_command_simple
-	  (collection,cmd,NULL,&response,&error)) {
+      int ok = mongoc_collection_command_simple
+	(collection,cmd,NULL,&response,&error);
+      qcache_invalidate(coll);
+      if (ok) {
 	U8_CLEAR_ERRNO();
 	lispval result = kno_bson2lisp(&response,flags,opts);
 	collection_done(collection,client,coll);
@@ -2186,7 +5569,8 @@ static lispval db_simple_command(lispval arg,lispval command,
   struct KNO_MONGODB_DATABASE *srv = (struct KNO_MONGODB_DATABASE *)arg;
   int flags = getflags(opts_arg,srv->dbflags);
   lispval opts = combine_opts(opts_arg,srv->dbopts);
-  mongoc_client_t *client = get_client(srv,MONGODB_CLIENT_BLOCK);
+  mongoc_client_t *client =
+    get_client(srv,MONGODB_CLIENT_BLOCK,get_lane(opts));
   if (client) {
     bson_t response; bson_error_t error;
     bson_t *cmd = kno_lisp2bson(command,flags,opts);
@@ -2197,8 +5581,10 @@ static lispval db_simple_command(lispval arg,lispval command,
 	       "For %q:\n  COMMAND: %Q\n  JSON: %s",
 	       arg,command,cmd_string);
 	bson_free(cmd_string);}
-      if (mongoc_client_command_simple
-	  (client,srv->dbname,cmd,NULL,&response,&error)) {
+      int ok = mongoc_client_command_simple
+	(client,srv->dbname,cmd,NULL,&response,&error);
+      qcache_invalidate_db(srv,NULL);
+      if (ok) {
 	U8_CLEAR_ERRNO();
 	lispval result = kno_bson2lisp(&response,flags,opts);
 	client_done(arg,client);
@@ -2249,7 +5635,249 @@ static lispval mongodb_simple_command(int n,kno_argvec args)
 
 static int reckless_threading = 0;
 
-DEF_KNOSYM(skip);
+DEF_KNOSYM(skip); DEF_KNOSYM(prefetch); DEF_KNOSYM(shared);
+
+static struct KNO_MONGODB_SHARING *make_sharing()
+{
+  struct KNO_MONGODB_SHARING *sh = u8_alloc(struct KNO_MONGODB_SHARING);
+  memset(sh,0,sizeof(struct KNO_MONGODB_SHARING));
+  u8_init_mutex(&(sh->sharing_lock));
+  return sh;
+}
+
+static void free_sharing(struct KNO_MONGODB_SHARING *sh)
+{
+  int i = 0; while (i < sh->sharing_n_fieldcaches)
+    free_fieldcache(sh->sharing_fieldcaches[i++]);
+  u8_destroy_mutex(&(sh->sharing_lock));
+  u8_free(sh);
+}
+
+/* Prefetching cursors */
+
+/* A cursor opened with the `prefetch` option (a number of batches)
+   hands its mongoc cursor to a worker thread, which decodes batches
+   of prefetch_batch documents (or `batch` documents if specified)
+   into vectors and keeps up to `prefetch` of them (prefetch_limit,
+   which follows the number of consumers of shared cursors) in a
+   ring. The worker is the only writer of prefetch_tail and the reader
+   (the cursor's thread) is the only writer of prefetch_head, so
+   neither takes a lock unless it has to wait for the other. Documents
+   are decoded with the flags and options the cursor was opened with. */
+
+static int prefetch_batch = 100;
+
+/* This wakes the other side of *pf* if it's waiting */
+static void prefetch_notify(struct KNO_MONGODB_PREFETCH *pf)
+{
+  if (__atomic_load_n(&(pf->prefetch_waiting),__ATOMIC_SEQ_CST)) {
+    u8_lock_mutex(&(pf->prefetch_lock));
+    u8_condvar_broadcast(&(pf->prefetch_wakeup));
+    u8_unlock_mutex(&(pf->prefetch_lock));}
+}
+
+/* This waits (for the worker if *reader* is true and for the reader
+   otherwise) while the ring is empty or full, respectively */
+static void prefetch_wait(struct KNO_MONGODB_PREFETCH *pf,int reader)
+{
+  u8_lock_mutex(&(pf->prefetch_lock));
+  __atomic_add_fetch(&(pf->prefetch_waiting),1,__ATOMIC_SEQ_CST);
+  while (1) {
+    unsigned int head = __atomic_load_n(&(pf->prefetch_head),__ATOMIC_SEQ_CST);
+    unsigned int tail = __atomic_load_n(&(pf->prefetch_tail),__ATOMIC_SEQ_CST);
+    if (reader) {
+      if ( (head != tail) ||
+	   (__atomic_load_n(&(pf->prefetch_done),__ATOMIC_SEQ_CST)) )
+	break;}
+    else if ( ((tail-head) <
+	       __atomic_load_n(&(pf->prefetch_limit),__ATOMIC_SEQ_CST)) ||
+	      (__atomic_load_n(&(pf->prefetch_stop),__ATOMIC_SEQ_CST)) )
+      break;
+    u8_condvar_wait(&(pf->prefetch_wakeup),&(pf->prefetch_lock));}
+  __atomic_sub_fetch(&(pf->prefetch_waiting),1,__ATOMIC_SEQ_CST);
+  u8_unlock_mutex(&(pf->prefetch_lock));
+}
+
+/* This adds *batch* (which it takes) to the ring, returning 0 if the
+   prefetch has been stopped */
+static int prefetch_push(struct KNO_MONGODB_PREFETCH *pf,lispval batch)
+{
+  unsigned int tail = pf->prefetch_tail;
+  while ((tail-__atomic_load_n(&(pf->prefetch_head),__ATOMIC_SEQ_CST)) >=
+	 __atomic_load_n(&(pf->prefetch_limit),__ATOMIC_SEQ_CST)) {
+    if (__atomic_load_n(&(pf->prefetch_stop),__ATOMIC_SEQ_CST)) {
+      kno_decref(batch);
+      return 0;}
+    prefetch_wait(pf,0);}
+  pf->prefetch_ring[tail%pf->prefetch_size] = batch;
+  __atomic_store_n(&(pf->prefetch_tail),tail+1,__ATOMIC_SEQ_CST);
+  prefetch_notify(pf);
+  return 1;
+}
+
+/* This records the worker's error, which is the current exception if
+   *msg* is NULL */
+static void prefetch_fail(struct KNO_MONGODB_PREFETCH *pf,u8_string msg)
+{
+  if (pf->prefetch_error) return;
+  struct MONGODB_THREAD_ERROR *err = u8_alloc(struct MONGODB_THREAD_ERROR);
+  memset(err,0,sizeof(struct MONGODB_THREAD_ERROR));
+  if (msg)
+    thread_error_set(err,kno_MongoDB_Error,NULL,msg,KNO_VOID);
+  else thread_error_catch(err,kno_BSON_Input_Error,"BSON decoding failed");
+  pf->prefetch_error = err;
+}
+
+static void *prefetch_worker(void *arg)
+{
+  struct KNO_MONGODB_CURSOR *c = (struct KNO_MONGODB_CURSOR *)arg;
+  struct KNO_MONGODB_PREFETCH *pf = c->cursor_prefetch;
+  int batch_size = pf->prefetch_batch, more = 1;
+  lispval *docs = u8_alloc_n(batch_size,lispval);
+  const bson_t *doc;
+  struct KNO_BSON_ARENA arena;
+  init_bson_arena(&arena,bson_arena_size);
+  while ( (more) &&
+	  (!(__atomic_load_n(&(pf->prefetch_stop),__ATOMIC_SEQ_CST))) ) {
+    int n = 0;
+    while ( (n < batch_size) &&
+	    (more = mongoc_cursor_next(c->mongoc_cursor,&doc)) ) {
+      lispval r = bson2lisp((bson_t *)doc,c->cursor_flags,c->cursor_opts,
+			    c->cursor_fieldcache,&arena);
+      if (KNO_ABORTP(r)) {
+	prefetch_fail(pf,NULL);
+	kno_clear_errors(0);
+	more = 0;
+	break;}
+      else docs[n++] = r;}
+    if ( (n > 0) && (pf->prefetch_error == NULL) ) {
+      /* The vector takes over the references in docs */
+      if (!(prefetch_push(pf,kno_make_vector(n,docs)))) break;}
+    else kno_decref_elts(docs,n);}
+  if ( (!(more)) && (pf->prefetch_error == NULL) ) {
+    bson_error_t err;
+    if (mongoc_cursor_error(c->mongoc_cursor,&err))
+      prefetch_fail(pf,err.message);}
+  U8_CLEAR_ERRNO();
+  free_bson_arena(&arena);
+  u8_free(docs);
+  __atomic_store_n(&(pf->prefetch_done),1,__ATOMIC_SEQ_CST);
+  prefetch_notify(pf);
+  return NULL;
+}
+
+/* This makes the next batch from the ring current, returning 1 if
+   there was one, 0 if the cursor is exhausted, and -1 (with an error)
+   if the worker failed */
+static int prefetch_next(struct KNO_MONGODB_CURSOR *c)
+{
+  struct KNO_MONGODB_PREFETCH *pf = c->cursor_prefetch;
+  unsigned int head = pf->prefetch_head;
+  while (__atomic_load_n(&(pf->prefetch_tail),__ATOMIC_SEQ_CST) == head) {
+    if (__atomic_load_n(&(pf->prefetch_done),__ATOMIC_SEQ_CST)) {
+      /* The last batch is pushed before done is set */
+      if (__atomic_load_n(&(pf->prefetch_tail),__ATOMIC_SEQ_CST) != head)
+	break;
+      else if (pf->prefetch_error) {
+	thread_error_raise(pf->prefetch_error,"cursor_prefetch",(lispval)c);
+	return -1;}
+      else return 0;}
+    prefetch_wait(pf,1);}
+  lispval batch = pf->prefetch_ring[head%pf->prefetch_size];
+  pf->prefetch_ring[head%pf->prefetch_size] = KNO_VOID;
+  __atomic_store_n(&(pf->prefetch_head),head+1,__ATOMIC_SEQ_CST);
+  prefetch_notify(pf);
+  kno_decref(pf->prefetch_current);
+  pf->prefetch_current = batch;
+  pf->prefetch_offset = 0;
+  return 1;
+}
+
+/* This returns 1 if a prefetched document is ready, waiting for the
+   worker if needed, 0 if the cursor is exhausted, or -1 on error */
+static int prefetch_ready(struct KNO_MONGODB_CURSOR *c)
+{
+  struct KNO_MONGODB_PREFETCH *pf = c->cursor_prefetch;
+  while ( (!(KNO_VECTORP(pf->prefetch_current))) ||
+	  (pf->prefetch_offset >= KNO_VECTOR_LENGTH(pf->prefetch_current)) ) {
+    int rv = prefetch_next(c);
+    if (rv <= 0) {
+      if (rv == 0) c->cursor_done = 1;
+      return rv;}}
+  return 1;
+}
+
+/* This stores up to *n* prefetched documents in *into*, returning how
+   many were stored or -1 on error */
+static int prefetch_take(struct KNO_MONGODB_CURSOR *c,lispval *into,int n)
+{
+  struct KNO_MONGODB_PREFETCH *pf = c->cursor_prefetch;
+  int k = 0;
+  while (k < n) {
+    int rv = prefetch_ready(c);
+    if (rv < 0) {
+      kno_decref_elts(into,k);
+      return -1;}
+    else if (rv == 0)
+      break;
+    lispval doc = KNO_VECTOR_REF(pf->prefetch_current,pf->prefetch_offset);
+    pf->prefetch_offset++;
+    into[k++] = kno_incref(doc);}
+  return k;
+}
+
+static int start_prefetch(struct KNO_MONGODB_CURSOR *c,int limit,int size,
+			  lispval opts)
+{
+  lispval batch_arg = kno_getopt(opts,batchsym,KNO_VOID);
+  struct KNO_MONGODB_PREFETCH *pf = u8_alloc(struct KNO_MONGODB_PREFETCH);
+  memset(pf,0,sizeof(struct KNO_MONGODB_PREFETCH));
+  pf->prefetch_size = (size > limit) ? (size) : (limit);
+  pf->prefetch_limit = limit;
+  pf->prefetch_batch = ( (KNO_UINTP(batch_arg)) && (KNO_FIX2INT(batch_arg) > 0) ) ?
+    (KNO_FIX2INT(batch_arg)) : (prefetch_batch > 0) ? (prefetch_batch) : (1);
+  pf->prefetch_ring = u8_alloc_n(pf->prefetch_size,lispval);
+  pf->prefetch_current = KNO_VOID;
+  u8_init_mutex(&(pf->prefetch_lock));
+  u8_init_condvar(&(pf->prefetch_wakeup));
+  kno_decref(batch_arg);
+  c->cursor_prefetch = pf;
+  if (mongodb_thread_create(&(pf->prefetch_thread),prefetch_worker,c) != 0) {
+    u8_logf(LOG_WARN,"cursor_prefetch",
+	    "Couldn't start a prefetch thread for %q",(lispval)c);
+    u8_destroy_condvar(&(pf->prefetch_wakeup));
+    u8_destroy_mutex(&(pf->prefetch_lock));
+    u8_free(pf->prefetch_ring);
+    u8_free(pf);
+    c->cursor_prefetch = NULL;
+    return -1;}
+  return 1;
+}
+
+/* This stops the prefetch worker (waiting for any pending read to
+   return) and frees the prefetched documents */
+static void stop_prefetch(struct KNO_MONGODB_CURSOR *c)
+{
+  struct KNO_MONGODB_PREFETCH *pf = c->cursor_prefetch;
+  if (pf == NULL) return;
+  __atomic_store_n(&(pf->prefetch_stop),1,__ATOMIC_SEQ_CST);
+  u8_lock_mutex(&(pf->prefetch_lock));
+  u8_condvar_broadcast(&(pf->prefetch_wakeup));
+  u8_unlock_mutex(&(pf->prefetch_lock));
+  pthread_join(pf->prefetch_thread,NULL);
+  while (pf->prefetch_head != pf->prefetch_tail) {
+    kno_decref(pf->prefetch_ring[pf->prefetch_head%pf->prefetch_size]);
+    pf->prefetch_head++;}
+  kno_decref(pf->prefetch_current);
+  if (pf->prefetch_error) {
+    thread_error_free(pf->prefetch_error);
+    u8_free(pf->prefetch_error);}
+  u8_destroy_condvar(&(pf->prefetch_wakeup));
+  u8_destroy_mutex(&(pf->prefetch_lock));
+  u8_free(pf->prefetch_ring);
+  u8_free(pf);
+  c->cursor_prefetch = NULL;
+}
 
 #if HAVE_MONGOC_OPTS_FUNCTIONS
 
@@ -2266,7 +5894,8 @@ static lispval mongodb_cursor(lispval arg,lispval query,lispval opts_arg)
   lispval opts = combine_opts(opts_arg,coll->collection_opts);
   mongoc_client_t *connection;
   mongoc_cursor_t *cursor = NULL;
-  mongoc_collection_t *collection = open_collection(coll,&connection,flags);
+  mongoc_collection_t *collection =
+    open_collection(coll,&connection,(flags&(~KNO_MONGODB_AFFINITY)),opts);
   bson_t *bq = kno_lisp2bson(query,flags,opts);
   bson_t *findopts = get_search_opts(opts,flags,KNO_FIND_MATCHES);
   mongoc_read_prefs_t *rp = get_read_prefs(opts);
@@ -2290,13 +5919,30 @@ static lispval mongodb_cursor(lispval arg,lispval query,lispval opts_arg)
     consed->cursor_flags = flags;
     consed->cursor_done  = 0;
     consed->cursor_opts = opts;
+    consed->cursor_opts_bson = findopts;
     consed->cursor_connection = connection;
     consed->cursor_collection = collection;
     consed->mongoc_cursor = cursor;
+    consed->cursor_fieldcache = new_fieldcache();
+    consed->cursor_prefetch = NULL;
+    consed->cursor_sharing = NULL;
+    if (kno_testopt(opts,KNOSYM(shared),KNO_VOID)) {
+      /* Shared cursors can be used from any thread */
+      consed->cursor_sharing = make_sharing();
+      consed->cursor_threadid = 0;}
     if ( (KNO_FIXNUMP(wait_ms)) && ((KNO_FIX2INT(wait_ms))>=0) &&
 	 ((KNO_FIX2INT(wait_ms)) < UINT_MAX) ) {
       unsigned int milliseconds = KNO_INT(wait_ms);
       mongoc_cursor_set_max_await_time_ms(cursor,milliseconds);}
+    lispval prefetch_arg = kno_getopt(opts,KNOSYM(prefetch),KNO_VOID);
+    if ( (KNO_UINTP(prefetch_arg)) && (KNO_FIX2INT(prefetch_arg) > 0) )
+      start_prefetch(consed,KNO_FIX2INT(prefetch_arg),
+		     (consed->cursor_sharing) ? (KNO_MONGODB_MAX_CONSUMERS) : (0),
+		     opts);
+    if ( (consed->cursor_sharing) && (consed->cursor_prefetch) )
+      consed->cursor_sharing->sharing_base_limit =
+	consed->cursor_prefetch->prefetch_limit;
+    kno_decref(prefetch_arg);
     kno_decref(wait_ms);
     kno_decref(skip_arg);
     return (lispval) consed;}
@@ -2323,7 +5969,8 @@ static lispval mongodb_cursor(lispval arg,lispval query,lispval opts_arg)
   lispval opts = combine_opts(opts_arg,coll->collection_opts);
   mongoc_client_t *connection;
   mongoc_cursor_t *cursor = NULL;
-  mongoc_collection_t *collection = open_collection(coll,&connection,flags);
+  mongoc_collection_t *collection =
+    open_collection(coll,&connection,(flags&(~KNO_MONGODB_AFFINITY)),opts);
   lispval skip_arg = kno_getopt(opts,skipsym,KNO_FIXZERO);
   lispval limit_arg = kno_getopt(opts,limitsym,KNO_FIXZERO);
   lispval batch_arg = kno_getopt(opts,batchsym,KNO_FIXZERO);
@@ -2357,6 +6004,9 @@ static lispval mongodb_cursor(lispval arg,lispval query,lispval opts_arg)
     consed->cursor_connection = connection;
     consed->cursor_collection = collection;
     consed->mongoc_cursor = cursor;
+    consed->cursor_fieldcache = new_fieldcache();
+    consed->cursor_prefetch = NULL;
+    consed->cursor_sharing = NULL;
     return (lispval) consed;}
   else {
     kno_decref(skip_arg); kno_decref(limit_arg); kno_decref(batch_arg);
@@ -2368,16 +6018,33 @@ static lispval mongodb_cursor(lispval arg,lispval query,lispval opts_arg)
 }
 #endif
 
+static void close_cursor(struct KNO_MONGODB_CURSOR *cursor);
+
 DEFC_PRIM("cursor/close!",cursor_close,
 	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
 	  "Closes a MongoDB cursor",
 	  {"cursor",KNO_MONGOC_CURSOR,KNO_VOID})
 static lispval cursor_close(lispval cursor_val)
 {
-  struct KNO_MONGODB_CURSOR *cursor = (struct KNO_MONGODB_CURSOR *)cursor_val;
-  if (cursor->mongoc_cursor==NULL) return KNO_VOID;
+  struct KNO_MONGODB_CURSOR *cursor = (struct KNO_MONGODB_CURSOR *)cursor_val;
+  if (cursor->cursor_sharing) {
+    /* Wait for any other thread reading the cursor */
+    u8_lock_mutex(&(cursor->cursor_sharing->sharing_lock));
+    if (cursor->mongoc_cursor) close_cursor(cursor);
+    u8_unlock_mutex(&(cursor->cursor_sharing->sharing_lock));
+    return KNO_FALSE;}
+  else if (cursor->mongoc_cursor==NULL)
+    return KNO_VOID;
+  else {
+    close_cursor(cursor);
+    return KNO_FALSE;}
+}
+
+static void close_cursor(struct KNO_MONGODB_CURSOR *cursor)
+{
   struct KNO_MONGODB_COLLECTION *coll = CURSOR2COLL(cursor);
   struct KNO_MONGODB_DATABASE *s = COLL2DB(coll);
+  stop_prefetch(cursor);
   mongoc_cursor_t *mc = cursor->mongoc_cursor;
   cursor->mongoc_cursor=NULL;
   mongoc_cursor_destroy(mc);
@@ -2396,7 +6063,6 @@ static lispval cursor_close(lispval cursor_val)
     cursor->cursor_readprefs=NULL;}
   cursor->cursor_value_bson = NULL;
   U8_CLEAR_ERRNO();
-  return KNO_FALSE;
 }
 
 static void recycle_cursor(struct KNO_RAW_CONS *c)
@@ -2404,6 +6070,7 @@ static void recycle_cursor(struct KNO_RAW_CONS *c)
   struct KNO_MONGODB_CURSOR *cursor = (struct KNO_MONGODB_CURSOR *)c;
   struct KNO_MONGODB_COLLECTION *coll = CURSOR2COLL(cursor);
   struct KNO_MONGODB_DATABASE *s = COLL2DB(coll);
+  stop_prefetch(cursor);
   if (cursor->mongoc_cursor) mongoc_cursor_destroy(cursor->mongoc_cursor);
   if (cursor->cursor_collection) mongoc_collection_destroy(cursor->cursor_collection);
   if (cursor->cursor_connection) release_client(s,cursor->cursor_connection);
@@ -2417,6 +6084,9 @@ static void recycle_cursor(struct KNO_RAW_CONS *c)
   if (cursor->cursor_readprefs)
     mongoc_read_prefs_destroy(cursor->cursor_readprefs);
   cursor->cursor_value_bson = NULL;
+  free_fieldcache(cursor->cursor_fieldcache);
+  cursor->cursor_fieldcache = NULL;
+  if (cursor->cursor_sharing) free_sharing(cursor->cursor_sharing);
   if (!(KNO_STATIC_CONSP(c))) u8_free(c);
 }
 static int unparse_cursor(struct U8_OUTPUT *out,lispval x)
@@ -2431,6 +6101,16 @@ static int unparse_cursor(struct U8_OUTPUT *out,lispval x)
 
 /* Operations on cursors */
 
+/* Shared cursors are locked while they're being read */
+static void lock_shared(struct KNO_MONGODB_CURSOR *c)
+{
+  if (c->cursor_sharing) u8_lock_mutex(&(c->cursor_sharing->sharing_lock));
+}
+static void unlock_shared(struct KNO_MONGODB_CURSOR *c)
+{
+  if (c->cursor_sharing) u8_unlock_mutex(&(c->cursor_sharing->sharing_lock));
+}
+
 static int cursor_advance(struct KNO_MONGODB_CURSOR *c,u8_context caller)
 {
   if (c->cursor_done) return 0;
@@ -2444,6 +6124,12 @@ static int cursor_advance(struct KNO_MONGODB_CURSOR *c,u8_context caller)
 			  c->cursor_threadid,u8_threadid()),
 	       (lispval)c);
     return -1;}
+  if (c->cursor_prefetch) {
+    /* Advancing a prefetching cursor drops a decoded document */
+    lispval doc;
+    int n = prefetch_take(c,&doc,1);
+    if (n > 0) kno_decref(doc);
+    return n;}
   bool ok = mongoc_cursor_next(c->mongoc_cursor,&(c->cursor_value_bson));
   if (ok) {
     U8_CLEAR_ERRNO();
@@ -2459,156 +6145,1205 @@ static int cursor_advance(struct KNO_MONGODB_CURSOR *c,u8_context caller)
 }
 
 
-DEFC_PRIM("cursor/done?",cursor_donep,
-	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
-	  "Returns true if *cursor* is exhausted",
-	  {"cursor",KNO_MONGOC_CURSOR,KNO_VOID})
-static lispval cursor_donep(lispval cursor)
+DEFC_PRIM("cursor/done?",cursor_donep,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Returns true if *cursor* is exhausted",
+	  {"cursor",KNO_MONGOC_CURSOR,KNO_VOID})
+static lispval cursor_donep(lispval cursor)
+{
+  struct KNO_MONGODB_CURSOR *c = (struct KNO_MONGODB_CURSOR *)cursor;
+  int rv;
+  lock_shared(c);
+  if (c->cursor_prefetch)
+    rv = (c->cursor_done) ? (0) : (prefetch_ready(c));
+  else if (c->cursor_value_bson)
+    rv = 0;
+  else rv = cursor_advance(c,"cursor_donep");
+  unlock_shared(c);
+  if (rv == 0)
+    return KNO_TRUE;
+  else if (rv == 1)
+    return KNO_FALSE;
+  else return KNO_ERROR;
+}
+
+DEFC_PRIM("cursor/skipcount",cursor_skipcount,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Returns the number of items skipped to date for *cursor*",
+	  {"cursor",KNO_MONGOC_CURSOR,KNO_VOID})
+static lispval cursor_skipcount(lispval cursor)
+{
+  struct KNO_MONGODB_CURSOR *c = (struct KNO_MONGODB_CURSOR *)cursor;
+  return KNO_INT(c->cursor_skipped);
+}
+
+DEFC_PRIM("cursor/readcount",cursor_readcount,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Returns the number of items read (to date) from *cursor*",
+	  {"cursor",KNO_MONGOC_CURSOR,KNO_VOID})
+static lispval cursor_readcount(lispval cursor)
+{
+  struct KNO_MONGODB_CURSOR *c = (struct KNO_MONGODB_CURSOR *)cursor;
+  return KNO_INT(c->cursor_read);
+}
+
+DEFC_PRIM("cursor/skip",cursor_skip,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "Skips ahead *howmany* records on *cursor*. Returns #f when "
+	  "no items are retrieved or the number of items otherwise.",
+	  {"cursor",KNO_MONGOC_CURSOR,KNO_VOID},
+	  {"howmany",kno_fixnum_type,KNO_INT(1)})
+static lispval cursor_skip(lispval cursor,lispval howmany)
+{
+  struct KNO_MONGODB_CURSOR *c = (struct KNO_MONGODB_CURSOR *)cursor;
+  if (!(KNO_UINTP(howmany)))
+    return kno_type_error("uint","mongodb_skip",howmany);
+  int n = KNO_FIX2INT(howmany), i = 0, rv = 0;
+  lock_shared(c);
+  while  ((i<n) && ((rv=cursor_advance(c,"mongodb_skip")) > 0)) i++;
+  if (i>0) c->cursor_skipped += i;
+  unlock_shared(c);
+  if (i<0) return KNO_ERROR;
+  else if (i == 0) return KNO_FALSE;
+  else return KNO_INT(i);
+}
+
+static lispval read_cursor(lispval cursor,lispval howmany,
+			   lispval opts_arg,int sorted)
+{
+  struct KNO_MONGODB_CURSOR *c = (struct KNO_MONGODB_CURSOR *)cursor;
+  if (c->mongoc_cursor == NULL)
+    return kno_err("MongoCursorClosed","mongodb_cursor_reader",NULL,cursor);
+  else if (c->cursor_done)
+    return KNO_EMPTY;
+  else if ( (c->cursor_threadid > 0) && ( c->cursor_threadid != u8_threadid() ) ) {
+    u8_byte msg[100];
+    kno_seterr("CursorThreadConflict","mongodb_cursor_reader",
+	       u8_bprintf(msg,"Opened in thread %llx, using in thread %llx",
+			  c->cursor_threadid,u8_threadid()),
+	       (lispval)c);
+    return KNO_ERROR;}
+  else if (!(KNO_UINTP(howmany)))
+    return kno_type_error("uint","mongodb_cursor_read",howmany);
+  else NO_ELSE;
+  int n = KNO_FIX2INT(howmany);
+  int flags = getflags(opts_arg,c->cursor_flags);
+  if (sorted < 0) sorted = kno_testopt(opts_arg,KNOSYM_SORTED,KNO_VOID);
+  if (n == 0) {
+    if (sorted)
+      return kno_make_vector(0,NULL);
+    else return KNO_EMPTY_CHOICE;}
+  else NO_ELSE;
+  if (c->cursor_prefetch) {
+    /* Prefetched documents have already been decoded */
+    lispval vec[n];
+    int i = prefetch_take(c,vec,n);
+    if (i < 0) return KNO_ERROR;
+    c->cursor_read += i;
+    if (sorted)
+      return kno_make_vector(i,vec);
+    else if (i == 0)
+      return KNO_EMPTY_CHOICE;
+    else if (i == 1)
+      return vec[0];
+    else return kno_init_choice
+	   (NULL,i,vec,KNO_CHOICE_DOSORT|KNO_CHOICE_COMPRESS);}
+  lispval opts = combine_opts(opts_arg,c->cursor_opts);
+  struct KNO_BSON_FIELDCACHE *fc = c->cursor_fieldcache;
+  if ( (n == 1) && (c->cursor_value_bson != NULL) ) {
+    lispval r = bson2lisp((bson_t *)c->cursor_value_bson,flags,opts,fc,NULL);
+    kno_decref(opts);
+    c->cursor_value_bson = NULL;
+    c->cursor_read++;
+    if (sorted)
+      return kno_make_vector(1,&r);
+    else return r;}
+  else {
+    lispval vec[n];
+    mongoc_cursor_t *scan = c->mongoc_cursor;
+    const bson_t *doc;
+    int i = 0, ok = 0;
+    struct KNO_BSON_ARENA arena;
+    init_bson_arena(&arena,bson_arena_size);
+    if (c->cursor_value_bson != NULL) {
+      lispval v = bson2lisp(((bson_t *)c->cursor_value_bson),flags,opts,
+			    fc,&arena);
+      c->cursor_value_bson=NULL;
+      vec[i++] = v;}
+    if ( (i < n) && (parallel_decodingp(flags,opts)) ) {
+      bson_t *docs[DECODE_BATCH_SIZE];
+      ok = 1;
+      while ( (ok) && (i < n) ) {
+	int n_docs = 0, limit = n-i;
+	if (limit > DECODE_BATCH_SIZE) limit = DECODE_BATCH_SIZE;
+	while ( (n_docs < limit) && (ok=mongoc_cursor_next(scan,&doc)) )
+	  docs[n_docs++] = bson_copy(doc);
+	int n_decoded = parallel_decode(docs,n_docs,flags,opts,vec+i,fc,&arena);
+	int k = 0; while (k < n_docs) bson_destroy(docs[k++]);
+	if (n_decoded < 0) {
+	  kno_decref_elts(vec,i);
+	  kno_decref(opts);
+	  free_bson_arena(&arena);
+	  return KNO_ERROR;}
+	else i += n_decoded;}}
+    else while ( (i < n) && (ok=mongoc_cursor_next(scan,&doc)) ) {
+      lispval r = bson2lisp((bson_t *)doc,flags,opts,fc,&arena);
+      if (KNO_ABORTP(r)) {
+	kno_decref_elts(vec,i);
+	kno_decref(opts);
+	free_bson_arena(&arena);
+	return KNO_ERROR;}
+      else vec[i++] = r;}
+    free_bson_arena(&arena);
+    kno_decref(opts);
+    if (!(ok)) {
+      bson_error_t err;
+      int cursor_err = mongoc_cursor_error(scan,&err);
+      if (cursor_err) {
+	grab_mongodb_error(&err,"mongodb");
+	kno_decref_elts(vec,i);
+	return KNO_ERROR;}
+      else c->cursor_done=1;}
+    c->cursor_read += i;
+    if (sorted) {
+      if (i == 0)
+	return kno_make_vector(0,NULL);
+      else return kno_make_vector(i,vec);}
+    else if (i == 0)
+      return KNO_EMPTY_CHOICE;
+    else if (i == 1)
+      return vec[0];
+    else return kno_init_choice
+	   (NULL,i,vec,KNO_CHOICE_DOSORT|KNO_CHOICE_COMPRESS);}
+}
+
+static lispval cursor_reader(lispval cursor,lispval howmany,
+			     lispval opts_arg,int sorted)
+{
+  struct KNO_MONGODB_CURSOR *c = (struct KNO_MONGODB_CURSOR *)cursor;
+  lock_shared(c);
+  lispval result = read_cursor(cursor,howmany,opts_arg,sorted);
+  unlock_shared(c);
+  return result;
+}
+
+DEFC_PRIM("cursor/read",cursor_read,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(1),
+	  "**undocumented**",
+	  {"cursor",KNO_MONGOC_CURSOR,KNO_VOID},
+	  {"howmany",kno_fixnum_type,KNO_INT(1)},
+	  {"opts_arg",kno_any_type,KNO_VOID})
+static lispval cursor_read(lispval cursor,lispval howmany,lispval opts)
+{
+  return cursor_reader(cursor,howmany,opts,-1);
+}
+
+DEFC_PRIM("cursor/readvec",cursor_readvec,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(1),
+	  "**undocumented**",
+	  {"cursor",KNO_MONGOC_CURSOR,KNO_VOID},
+	  {"howmany",kno_fixnum_type,KNO_INT(1)},
+	  {"opts_arg",kno_any_type,KNO_VOID})
+static lispval cursor_readvec(lispval cursor,lispval howmany,lispval opts)
+{
+  return cursor_reader(cursor,howmany,opts,1);
+}
+
+/* Shared cursors */
+
+/* cursor/next-batch lets any number of threads take disjoint batches
+   of documents from a shared cursor. Consumers take turns: each holds
+   the cursor's sharing_lock while it copies its batch of raw documents
+   (or takes decoded documents from the prefetch ring) and decodes the
+   copied documents after releasing it, so only decoding happens in
+   parallel. Each batch is limited to shared_batch_max documents so
+   that one consumer can't hold the lock for too long.
+
+   For a prefetching shared cursor, the number of batches the worker
+   keeps ready follows the number of current consumers (between the
+   cursor's own prefetch limit and KNO_MONGODB_MAX_CONSUMERS). A
+   consumer stops counting when it gets #f or an error, or when the
+   other consumers have taken more than twice as many batches as there
+   are consumers since it last took one. */
+
+static int shared_batch_max = 1000;
+
+/* This sets the prefetch limit of *c* (whose sharing_lock should be
+   held) from its number of consumers */
+static void shared_prefetch_limit(struct KNO_MONGODB_CURSOR *c)
+{
+  struct KNO_MONGODB_SHARING *sh = c->cursor_sharing;
+  struct KNO_MONGODB_PREFETCH *pf = c->cursor_prefetch;
+  if (pf == NULL) return;
+  int limit = sh->sharing_n_consumers;
+  if (limit < sh->sharing_base_limit) limit = sh->sharing_base_limit;
+  if (limit > pf->prefetch_size) limit = pf->prefetch_size;
+  if (limit != pf->prefetch_limit) {
+    __atomic_store_n(&(pf->prefetch_limit),limit,__ATOMIC_SEQ_CST);
+    prefetch_notify(pf);}
+}
+
+/* This removes the *i*th consumer of *c* (which should be locked) */
+static void shared_drop_consumer(struct KNO_MONGODB_SHARING *sh,int i)
+{
+  int last = --(sh->sharing_n_consumers);
+  sh->sharing_consumers[i] = sh->sharing_consumers[last];
+  sh->sharing_last_take[i] = sh->sharing_last_take[last];
+}
+
+/* This records that the current thread is taking a batch from *c*
+   (which should be locked), forgetting any consumers which haven't
+   taken a batch recently */
+static void shared_consumer(struct KNO_MONGODB_CURSOR *c)
+{
+  struct KNO_MONGODB_SHARING *sh = c->cursor_sharing;
+  long long threadid = u8_threadid();
+  long long take = ++(sh->sharing_takes);
+  int i = 0, found = 0;
+  while (i < sh->sharing_n_consumers) {
+    if (sh->sharing_consumers[i] == threadid) {
+      sh->sharing_last_take[i++] = take;
+      found = 1;}
+    else if ((take-sh->sharing_last_take[i]) > (2*sh->sharing_n_consumers))
+      shared_drop_consumer(sh,i);
+    else i++;}
+  if ( (!(found)) && (sh->sharing_n_consumers < KNO_MONGODB_MAX_CONSUMERS) ) {
+    int n = sh->sharing_n_consumers++;
+    sh->sharing_consumers[n] = threadid;
+    sh->sharing_last_take[n] = take;}
+  shared_prefetch_limit(c);
+}
+
+/* This records that the current thread is done with *c* (which should
+   be locked) */
+static void shared_consumer_done(struct KNO_MONGODB_CURSOR *c)
+{
+  struct KNO_MONGODB_SHARING *sh = c->cursor_sharing;
+  long long threadid = u8_threadid();
+  int i = 0; while (i < sh->sharing_n_consumers) {
+    if (sh->sharing_consumers[i] == threadid) {
+      shared_drop_consumer(sh,i);
+      break;}
+    else i++;}
+  shared_prefetch_limit(c);
+}
+
+/* This copies up to *n* documents from the (locked) cursor *c* into
+   *docs*, returning how many were copied or -1 on error */
+static int shared_copy_docs(struct KNO_MONGODB_CURSOR *c,bson_t **docs,int n)
+{
+  const bson_t *doc;
+  int k = 0, ok = 1;
+  if (c->cursor_value_bson) {
+    docs[k++] = bson_copy(c->cursor_value_bson);
+    c->cursor_value_bson = NULL;}
+  while ( (k < n) && (ok = mongoc_cursor_next(c->mongoc_cursor,&doc)) )
+    docs[k++] = bson_copy(doc);
+  if (!(ok)) {
+    bson_error_t err;
+    if (mongoc_cursor_error(c->mongoc_cursor,&err)) {
+      grab_mongodb_error(&err,"cursor_next_batch");
+      while (k > 0) bson_destroy(docs[--k]);
+      return -1;}
+    else c->cursor_done = 1;}
+  return k;
+}
+
+static lispval shared_decode(struct KNO_MONGODB_CURSOR *c,bson_t **docs,
+			     int n,lispval opts_arg)
+{
+  struct KNO_MONGODB_SHARING *sh = c->cursor_sharing;
+  struct KNO_BSON_FIELDCACHE *fc = NULL;
+  u8_lock_mutex(&(sh->sharing_lock));
+  if (sh->sharing_n_fieldcaches > 0)
+    fc = sh->sharing_fieldcaches[--(sh->sharing_n_fieldcaches)];
+  u8_unlock_mutex(&(sh->sharing_lock));
+  if (fc == NULL) fc = new_fieldcache();
+  int flags = getflags(opts_arg,c->cursor_flags);
+  lispval opts = combine_opts(opts_arg,c->cursor_opts);
+  lispval *decoded = u8_alloc_n(n,lispval);
+  struct KNO_BSON_ARENA arena;
+  init_bson_arena(&arena,bson_arena_size);
+  int n_decoded = 0;
+  if (parallel_decodingp(flags,opts))
+    n_decoded = parallel_decode(docs,n,flags,opts,decoded,fc,&arena);
+  else while (n_decoded < n) {
+      lispval r = bson2lisp(docs[n_decoded],flags,opts,fc,&arena);
+      if (KNO_ABORTP(r)) {
+	kno_decref_elts(decoded,n_decoded);
+	n_decoded = -1;
+	break;}
+      else decoded[n_decoded++] = r;}
+  free_bson_arena(&arena);
+  kno_decref(opts);
+  u8_lock_mutex(&(sh->sharing_lock));
+  if (sh->sharing_n_fieldcaches < KNO_MONGODB_MAX_CONSUMERS)
+    sh->sharing_fieldcaches[(sh->sharing_n_fieldcaches)++] = fc;
+  else {
+    free_fieldcache(fc);
+    fc = NULL;}
+  u8_unlock_mutex(&(sh->sharing_lock));
+  lispval result = (n_decoded < 0) ? (KNO_ERROR_VALUE) :
+    (kno_make_vector(n_decoded,decoded));
+  u8_free(decoded);
+  return result;
+}
+
+DEFC_PRIM("cursor/next-batch",cursor_next_batch,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(1),
+	  "Returns a vector of up to *howmany* documents from *cursor*, "
+	  "or #f if it is exhausted. Cursors opened with the `shared` "
+	  "option can be read this way from any number of threads at "
+	  "once, with each call getting different documents.",
+	  {"cursor",KNO_MONGOC_CURSOR,KNO_VOID},
+	  {"howmany",kno_any_type,KNO_VOID},
+	  {"opts_arg",kno_any_type,KNO_VOID})
+static lispval cursor_next_batch(lispval cursor,lispval howmany,
+				 lispval opts_arg)
+{
+  struct KNO_MONGODB_CURSOR *c = (struct KNO_MONGODB_CURSOR *)cursor;
+  struct KNO_MONGODB_SHARING *sh = c->cursor_sharing;
+  int n;
+  if ( (KNO_VOIDP(howmany)) || (KNO_DEFAULTP(howmany)) )
+    n = (c->cursor_prefetch) ? (c->cursor_prefetch->prefetch_batch) :
+      (prefetch_batch > 0) ? (prefetch_batch) : (1);
+  else if ( (KNO_UINTP(howmany)) && (KNO_FIX2INT(howmany) > 0) )
+    n = KNO_FIX2INT(howmany);
+  else return kno_type_error("positive fixnum","cursor_next_batch",howmany);
+  if (sh == NULL) {
+    lispval batch = cursor_reader(cursor,KNO_INT(n),opts_arg,1);
+    if (KNO_EMPTYP(batch))
+      return KNO_FALSE;
+    else if ( (KNO_VECTORP(batch)) && (KNO_VECTOR_LENGTH(batch) == 0) ) {
+      kno_decref(batch);
+      return KNO_FALSE;}
+    else return batch;}
+  u8_lock_mutex(&(sh->sharing_lock));
+  if (c->mongoc_cursor == NULL) {
+    u8_unlock_mutex(&(sh->sharing_lock));
+    return kno_err("MongoCursorClosed","cursor_next_batch",NULL,cursor);}
+  else if (c->cursor_done) {
+    shared_consumer_done(c);
+    u8_unlock_mutex(&(sh->sharing_lock));
+    return KNO_FALSE;}
+  if ( (shared_batch_max > 0) && (n > shared_batch_max) )
+    n = shared_batch_max;
+  shared_consumer(c);
+  if (c->cursor_prefetch) {
+    lispval *vec = u8_alloc_n(n,lispval);
+    int k = prefetch_take(c,vec,n);
+    if (k > 0) c->cursor_read += k;
+    else shared_consumer_done(c);
+    u8_unlock_mutex(&(sh->sharing_lock));
+    lispval result = (k < 0) ? (KNO_ERROR_VALUE) :
+      (k == 0) ? (KNO_FALSE) : (kno_make_vector(k,vec));
+    u8_free(vec);
+    return result;}
+  bson_t **docs = u8_alloc_n(n,bson_t *);
+  int k = shared_copy_docs(c,docs,n);
+  if (k > 0) c->cursor_read += k;
+  else shared_consumer_done(c);
+  u8_unlock_mutex(&(sh->sharing_lock));
+  U8_CLEAR_ERRNO();
+  lispval result = (k < 0) ? (KNO_ERROR_VALUE) : (k == 0) ? (KNO_FALSE) :
+    (shared_decode(c,docs,k,opts_arg));
+  int i = 0; while (i < k) bson_destroy(docs[i++]);
+  u8_free(docs);
+  return result;
+}
+
+/* Streaming results */
+
+/* collection/foreach and cursor/foreach call a procedure on each
+   document (or on each vector of *batch* documents) as it comes off
+   the cursor, freeing it once the procedure returns, so the result
+   set is never accumulated. Iteration stops early if the procedure
+   returns #f. */
+
+/* This calls *fn* on the documents from *cursor*, starting with
+   *first* (if not NULL), and returns the number of documents
+   processed, or -1 on error. *donep* is set when the cursor is
+   exhausted. */
+static ssize_t stream_documents(mongoc_cursor_t *cursor,const bson_t *first,
+				lispval fn,int batch,int flags,lispval opts,
+				struct KNO_BSON_FIELDCACHE *fc,int *donep)
+{
+  int bufsize = (batch > 0) ? (batch) : (1);
+  int parallel = parallel_decodingp(flags,opts), more = 1, stop = 0, n = 0;
+  lispval *vec = u8_alloc_n(bufsize,lispval);
+  ssize_t count = 0;
+  const bson_t *doc;
+  struct KNO_BSON_ARENA arena;
+  init_bson_arena(&arena,bson_arena_size);
+  if (first) {
+    lispval r = bson2lisp((bson_t *)first,flags,opts,fc,&arena);
+    if (KNO_ABORTP(r)) goto failed;
+    vec[n++] = r;}
+  while ( (more) && (!(stop)) ) {
+    if (n < bufsize) {
+      if (parallel) {
+	bson_t *docs[DECODE_BATCH_SIZE];
+	int n_docs = 0, limit = bufsize-n;
+	if (limit > DECODE_BATCH_SIZE) limit = DECODE_BATCH_SIZE;
+	while ( (n_docs < limit) && (more = mongoc_cursor_next(cursor,&doc)) )
+	  docs[n_docs++] = bson_copy(doc);
+	int n_decoded = parallel_decode(docs,n_docs,flags,opts,vec+n,fc,&arena);
+	int k = 0; while (k < n_docs) bson_destroy(docs[k++]);
+	if (n_decoded < 0) goto failed;
+	n += n_decoded;}
+      else if ( (more = mongoc_cursor_next(cursor,&doc)) ) {
+	lispval r = bson2lisp((bson_t *)doc,flags,opts,fc,&arena);
+	if (KNO_ABORTP(r)) goto failed;
+	vec[n++] = r;}
+      else NO_ELSE;}
+    if ( (n == bufsize) || ( (n > 0) && (!(more)) ) ) {
+      /* The vector takes over the references in vec */
+      lispval arg = (batch > 0) ? (kno_make_vector(n,vec)) : (vec[0]);
+      lispval v = kno_apply(fn,1,&arg);
+      kno_decref(arg);
+      count += n; n = 0;
+      if (KNO_ABORTP(v)) goto failed;
+      else if (KNO_FALSEP(v)) stop = 1;
+      else kno_decref(v);}}
+  if (!(more)) {
+    bson_error_t err;
+    if (mongoc_cursor_error(cursor,&err)) {
+      grab_mongodb_error(&err,"mongodb_foreach");
+      goto failed;}
+    else *donep = 1;}
+  free_bson_arena(&arena);
+  u8_free(vec);
+  return count;
+ failed:
+  kno_decref_elts(vec,n);
+  free_bson_arena(&arena);
+  u8_free(vec);
+  return -1;
+}
+
+static int get_foreach_batch(lispval batch)
+{
+  if ( (KNO_VOIDP(batch)) || (KNO_FALSEP(batch)) || (KNO_DEFAULTP(batch)) )
+    return 0;
+  else if ( (KNO_UINTP(batch)) && (KNO_FIX2INT(batch) > 0) )
+    return KNO_FIX2INT(batch);
+  else {
+    kno_type_error("positive fixnum","mongodb_foreach",batch);
+    return -1;}
+}
+
+DEFC_PRIM("collection/foreach",collection_foreach,
+	  KNO_MAX_ARGS(5)|KNO_MIN_ARGS(3),
+	  "Calls *fn* on each document in *collection* matching *query*, "
+	  "as they are retrieved. If *batch* is provided, *fn* is called "
+	  "on vectors of up to *batch* documents. Iteration stops if *fn* "
+	  "returns #f. Returns the number of documents processed.",
+	  {"collection",KNO_MONGOC_COLLECTION,KNO_VOID},
+	  {"query",kno_any_type,KNO_VOID},
+	  {"fn",kno_any_type,KNO_VOID},
+	  {"opts_arg",kno_any_type,KNO_VOID},
+	  {"batch",kno_any_type,KNO_VOID})
+static lispval collection_foreach(lispval arg,lispval query,lispval fn,
+				  lispval opts_arg,lispval batch_arg)
+{
+  struct KNO_MONGODB_COLLECTION *coll = (struct KNO_MONGODB_COLLECTION *)arg;
+  if (!(KNO_APPLICABLEP(fn)))
+    return kno_type_error("applicable","collection_foreach",fn);
+  int batch = get_foreach_batch(batch_arg);
+  if (batch < 0) return KNO_ERROR_VALUE;
+  int flags = getflags(opts_arg,coll->collection_flags);
+  lispval opts = combine_opts(opts_arg,coll->collection_opts);
+  mongoc_client_t *client = NULL;
+  mongoc_collection_t *collection = open_collection(coll,&client,flags,opts);
+  if (collection == NULL) {
+    kno_decref(opts);
+    return KNO_ERROR_VALUE;}
+  ssize_t count = -1;
+  bson_t *q = kno_lisp2bson(query,flags,opts);
+  bson_t *findopts = get_search_opts(opts,flags,KNO_FIND_MATCHES);
+  mongoc_read_prefs_t *rp = get_read_prefs(opts);
+  if ((logops)||(flags&KNO_MONGODB_LOGOPS)) {
+    char *qstring = (q) ? (bson_as_json(q,NULL)) : (NULL);
+    u8_logf(LOG_NOTICE,"collection_foreach","Matches in %q to\n%Q\n%s",
+	    arg,query,qstring);
+    if (qstring) bson_free(qstring);}
+  mongoc_cursor_t *cursor = (q) ?
+    (open_cursor(collection,q,findopts,rp,opts)) : (NULL);
+  if (cursor) {
+    struct KNO_BSON_FIELDCACHE *fc = new_fieldcache();
+    int done = 0;
+    count = stream_documents(cursor,NULL,fn,batch,flags,opts,fc,&done);
+    free_fieldcache(fc);
+    mongoc_cursor_destroy(cursor);}
+  else if (q) {
+    kno_seterr(kno_MongoDB_Error,"collection_foreach",
+	       "couldn't get query cursor",kno_incref(query));}
+  else NO_ELSE;
+  if (rp) mongoc_read_prefs_destroy(rp);
+  if (q) bson_destroy(q);
+  if (findopts) bson_destroy(findopts);
+  collection_done(collection,client,coll);
+  kno_decref(opts);
+  U8_CLEAR_ERRNO();
+  if (count < 0)
+    return KNO_ERROR_VALUE;
+  else return KNO_INT(count);
+}
+
+DEFC_PRIM("cursor/foreach",cursor_foreach,
+	  KNO_MAX_ARGS(4)|KNO_MIN_ARGS(2),
+	  "Calls *fn* on each of the remaining documents from *cursor*. If "
+	  "*batch* is provided, *fn* is called on vectors of up to *batch* "
+	  "documents. Iteration stops if *fn* returns #f. Returns the "
+	  "number of documents processed. *opts* and *batch* come in the "
+	  "same order as for collection/foreach.",
+	  {"cursor",KNO_MONGOC_CURSOR,KNO_VOID},
+	  {"fn",kno_any_type,KNO_VOID},
+	  {"opts_arg",kno_any_type,KNO_VOID},
+	  {"batch",kno_any_type,KNO_VOID})
+static lispval cursor_foreach(lispval cursor,lispval fn,
+			      lispval opts_arg,lispval batch_arg)
+{
+  struct KNO_MONGODB_CURSOR *c = (struct KNO_MONGODB_CURSOR *)cursor;
+  if (!(KNO_APPLICABLEP(fn)))
+    return kno_type_error("applicable","cursor_foreach",fn);
+  else if (c->mongoc_cursor == NULL)
+    return kno_err("MongoCursorClosed","cursor_foreach",NULL,cursor);
+  else if (c->cursor_done)
+    return KNO_INT(0);
+  else if ( (c->cursor_threadid > 0) && ( c->cursor_threadid != u8_threadid() ) ) {
+    u8_byte msg[100];
+    kno_seterr("CursorThreadConflict","cursor_foreach",
+	       u8_bprintf(msg,"Opened in thread %llx, using in thread %llx",
+			  c->cursor_threadid,u8_threadid()),
+	       (lispval)c);
+    return KNO_ERROR;}
+  else NO_ELSE;
+  int batch = get_foreach_batch(batch_arg);
+  if (batch < 0) return KNO_ERROR_VALUE;
+  if (c->cursor_sharing) {
+    /* Other threads may be reading the cursor too */
+    lispval chunk_size = (batch > 0) ? (KNO_INT(batch)) : (KNO_VOID);
+    ssize_t count = 0;
+    int stop = 0;
+    while (!(stop)) {
+      lispval chunk = cursor_next_batch(cursor,chunk_size,opts_arg);
+      if (KNO_ABORTP(chunk))
+	return chunk;
+      else if (!(KNO_VECTORP(chunk)))
+	break;
+      int i = 0, n = KNO_VECTOR_LENGTH(chunk);
+      while ( (!(stop)) && (i < n) ) {
+	lispval arg = (batch > 0) ? (chunk) : (KNO_VECTOR_REF(chunk,i));
+	lispval v = kno_apply(fn,1,&arg);
+	if (batch > 0) {
+	  count += n; i = n;}
+	else {
+	  count++; i++;}
+	if (KNO_ABORTP(v)) {
+	  kno_decref(chunk);
+	  return v;}
+	else if (KNO_FALSEP(v)) stop = 1;
+	else kno_decref(v);}
+      kno_decref(chunk);}
+    return KNO_INT(count);}
+  else if (c->cursor_prefetch) {
+    int bufsize = (batch > 0) ? (batch) : (1), n, stop = 0;
+    lispval *vec = u8_alloc_n(bufsize,lispval);
+    ssize_t count = 0;
+    while ( (!(stop)) && ((n = prefetch_take(c,vec,bufsize)) > 0) ) {
+      lispval arg = (batch > 0) ? (kno_make_vector(n,vec)) : (vec[0]);
+      lispval v = kno_apply(fn,1,&arg);
+      kno_decref(arg);
+      count += n;
+      if (KNO_ABORTP(v)) n = -1;
+      else if (KNO_FALSEP(v)) stop = 1;
+      else kno_decref(v);
+      if (n < 0) break;}
+    u8_free(vec);
+    c->cursor_read += count;
+    if (n < 0)
+      return KNO_ERROR_VALUE;
+    else return KNO_INT(count);}
+  int flags = getflags(opts_arg,c->cursor_flags);
+  lispval opts = combine_opts(opts_arg,c->cursor_opts);
+  const bson_t *first = c->cursor_value_bson;
+  c->cursor_value_bson = NULL;
+  ssize_t count = stream_documents(c->mongoc_cursor,first,fn,batch,flags,opts,
+				   c->cursor_fieldcache,&(c->cursor_done));
+  kno_decref(opts);
+  if (count < 0)
+    return KNO_ERROR_VALUE;
+  c->cursor_read += count;
+  return KNO_INT(count);
+}
+
+/* Parallel scans */
+
+/* collection/pscan splits the documents matching a query into ranges
+   of _id values and scans the ranges concurrently, each with its own
+   pooled client and thread. The split points come from the `splits`
+   option (a vector of _id values, for instance OIDs spaced over a
+   pool's capacity) or from a $bucketAuto aggregation over _id. The
+   scanning threads queue the raw documents (at most pscan_queue_max
+   of them) and the calling thread decodes them and calls the
+   callback, so callbacks always run in the calling thread and
+   documents arrive in no particular order. Since ranges are
+   expressed as $gte/$lt comparisons, every _id should be of the same
+   BSON type. With the `snapshot` option, every range is read at
+   the same snapshot of the data, taken when the scan starts.
+
+   A scan never takes the last client its lane can get (counting the
+   pool's other users), since the callback may need one while the
+   workers wait for it to empty the queue. When the scan can't have a
+   worker without doing that (for instance, with a pool of one
+   client), it reads the ranges one after another in the calling
+   thread instead. */
+
+static int pscan_threads = 4;
+static int pscan_queue_max = 1024;
+
+#define PSCAN_MAX_THREADS 16
+
+struct PSCAN_JOB {
+  bson_t **pscan_ranges;
+  int pscan_n_ranges, pscan_next_range;
+  const bson_t *pscan_findopts;
+  const mongoc_read_prefs_t *pscan_readprefs;
+  /* The queue of documents (a ring buffer) */
+  bson_t **pscan_queue;
+  int pscan_queue_size, pscan_queue_start, pscan_queue_len;
+  int pscan_active, pscan_stopped, pscan_failed;
+  u8_mutex pscan_lock;
+  u8_condvar pscan_nonempty, pscan_nonfull;
+  u8_string pscan_error;};
+
+struct PSCAN_WORKER {
+  struct PSCAN_JOB *worker_job;
+  mongoc_client_t *worker_client;
+  mongoc_collection_t *worker_collection;
+  pthread_t worker_thread;};
+
+static void pscan_stop(struct PSCAN_JOB *job,u8_string msg)
+{
+  u8_lock_mutex(&(job->pscan_lock));
+  if ( (msg) && (job->pscan_error == NULL) ) {
+    job->pscan_error = u8_strdup(msg);
+    job->pscan_failed = 1;}
+  __atomic_store_n(&(job->pscan_stopped),1,__ATOMIC_RELEASE);
+  u8_condvar_broadcast(&(job->pscan_nonfull));
+  u8_condvar_broadcast(&(job->pscan_nonempty));
+  u8_unlock_mutex(&(job->pscan_lock));
+}
+
+/* This queues *doc* (which it takes), returning 0 if the scan has
+   been stopped */
+static int pscan_push(struct PSCAN_JOB *job,bson_t *doc)
+{
+  u8_lock_mutex(&(job->pscan_lock));
+  while ( (job->pscan_queue_len >= job->pscan_queue_size) &&
+	  (!(job->pscan_stopped)) )
+    u8_condvar_wait(&(job->pscan_nonfull),&(job->pscan_lock));
+  if (job->pscan_stopped) {
+    u8_unlock_mutex(&(job->pscan_lock));
+    bson_destroy(doc);
+    return 0;}
+  int pos = (job->pscan_queue_start+job->pscan_queue_len)%job->pscan_queue_size;
+  job->pscan_queue[pos] = doc;
+  job->pscan_queue_len++;
+  u8_condvar_signal(&(job->pscan_nonempty));
+  u8_unlock_mutex(&(job->pscan_lock));
+  return 1;
+}
+
+/* This waits for documents and takes up to *max* of them, returning 0
+   when the scan is finished */
+static int pscan_take(struct PSCAN_JOB *job,bson_t **docs,int max)
+{
+  int n = 0;
+  u8_lock_mutex(&(job->pscan_lock));
+  while ( (job->pscan_queue_len == 0) && (job->pscan_active > 0) &&
+	  (!(job->pscan_stopped)) )
+    u8_condvar_wait(&(job->pscan_nonempty),&(job->pscan_lock));
+  if (!(job->pscan_stopped)) {
+    while ( (n < max) && (job->pscan_queue_len > 0) ) {
+      docs[n++] = job->pscan_queue[job->pscan_queue_start];
+      job->pscan_queue_start = (job->pscan_queue_start+1)%job->pscan_queue_size;
+      job->pscan_queue_len--;}
+    u8_condvar_broadcast(&(job->pscan_nonfull));}
+  u8_unlock_mutex(&(job->pscan_lock));
+  return n;
+}
+
+static void *pscan_worker(void *arg)
 {
-  struct KNO_MONGODB_CURSOR *c = (struct KNO_MONGODB_CURSOR *)cursor;
-  if (c->cursor_value_bson)
-    return KNO_TRUE;
-  else {
-    int rv = cursor_advance(c,"cursor_donep");
-    if (rv == 0)
-      return KNO_TRUE;
-    else if (rv == 1)
-      return KNO_FALSE;
-    else return KNO_ERROR;}
+  struct PSCAN_WORKER *w = (struct PSCAN_WORKER *)arg;
+  struct PSCAN_JOB *job = w->worker_job;
+  while (!(__atomic_load_n(&(job->pscan_stopped),__ATOMIC_ACQUIRE))) {
+    int i = __atomic_fetch_add(&(job->pscan_next_range),1,__ATOMIC_ACQ_REL);
+    if (i >= job->pscan_n_ranges) break;
+    mongoc_cursor_t *cursor = mongoc_collection_find_with_opts
+      (w->worker_collection,job->pscan_ranges[i],
+       job->pscan_findopts,job->pscan_readprefs);
+    const bson_t *doc;
+    bson_error_t err;
+    int more = 1;
+    while ( (more) && (mongoc_cursor_next(cursor,&doc)) )
+      more = pscan_push(job,bson_copy(doc));
+    if ( (more) && (mongoc_cursor_error(cursor,&err)) )
+      pscan_stop(job,err.message);
+    mongoc_cursor_destroy(cursor);}
+  u8_lock_mutex(&(job->pscan_lock));
+  job->pscan_active--;
+  u8_condvar_broadcast(&(job->pscan_nonempty));
+  u8_unlock_mutex(&(job->pscan_lock));
+  return NULL;
 }
 
-DEFC_PRIM("cursor/skipcount",cursor_skipcount,
-	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
-	  "Returns the number of items skipped to date for *cursor*",
-	  {"cursor",KNO_MONGOC_CURSOR,KNO_VOID})
-static lispval cursor_skipcount(lispval cursor)
+/* This returns the query for _id values from *lo* (inclusive) to *hi*
+   (exclusive), where either may be NULL, combined with *q*. */
+static bson_t *pscan_range_query(const bson_t *q,bson_t *lo,bson_t *hi)
 {
-  struct KNO_MONGODB_CURSOR *c = (struct KNO_MONGODB_CURSOR *)cursor;
-  return KNO_INT(c->cursor_skipped);
+  bson_t *out = bson_new(), clauses, range, bounds;
+  bson_iter_t iter;
+  bson_append_array_begin(out,"$and",4,&clauses);
+  bson_append_document(&clauses,"0",1,q);
+  bson_append_document_begin(&clauses,"1",1,&range);
+  if ( (lo) || (hi) ) {
+    bson_append_document_begin(&range,"_id",3,&bounds);
+    if ( (lo) && (bson_iter_init(&iter,lo)) && (bson_iter_next(&iter)) )
+      bson_append_iter(&bounds,"$gte",4,&iter);
+    if ( (hi) && (bson_iter_init(&iter,hi)) && (bson_iter_next(&iter)) )
+      bson_append_iter(&bounds,"$lt",3,&iter);
+    bson_append_document_end(&range,&bounds);}
+  bson_append_document_end(&clauses,&range);
+  bson_append_array_end(out,&clauses);
+  return out;
 }
 
-DEFC_PRIM("cursor/readcount",cursor_readcount,
-	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
-	  "Returns the number of items read (to date) from *cursor*",
-	  {"cursor",KNO_MONGOC_CURSOR,KNO_VOID})
-static lispval cursor_readcount(lispval cursor)
+/* This stores up to *n*-1 split points (as {"": _id} documents) for
+   the documents matching *q* into *splits*, returning how many were
+   stored or -1 on error */
+static int pscan_auto_splits(mongoc_collection_t *collection,const bson_t *q,
+			     const mongoc_read_prefs_t *rp,
+			     int n,bson_t **splits)
 {
-  struct KNO_MONGODB_CURSOR *c = (struct KNO_MONGODB_CURSOR *)cursor;
-  return KNO_INT(c->cursor_read);
+  bson_t pipeline, stage, spec, aggopts;
+  bson_init(&pipeline);
+  bson_append_document_begin(&pipeline,"0",1,&stage);
+  bson_append_document(&stage,"$match",6,q);
+  bson_append_document_end(&pipeline,&stage);
+  bson_append_document_begin(&pipeline,"1",1,&stage);
+  bson_append_document_begin(&stage,"$bucketAuto",11,&spec);
+  BSON_APPEND_UTF8(&spec,"groupBy","$_id");
+  BSON_APPEND_INT32(&spec,"buckets",n);
+  bson_append_document_end(&stage,&spec);
+  bson_append_document_end(&pipeline,&stage);
+  bson_init(&aggopts);
+  BSON_APPEND_BOOL(&aggopts,"allowDiskUse",true);
+  mongoc_cursor_t *cursor = mongoc_collection_aggregate
+    (collection,MONGOC_QUERY_NONE,&pipeline,&aggopts,rp);
+  const bson_t *doc;
+  bson_error_t err;
+  int n_splits = 0, first = 1;
+  while (mongoc_cursor_next(cursor,&doc)) {
+    bson_iter_t iter, bucket;
+    /* The first bucket starts at the beginning */
+    if (first) { first = 0; continue;}
+    if ( (n_splits < (n-1)) &&
+	 (bson_iter_init_find(&iter,doc,"_id")) &&
+	 (BSON_ITER_HOLDS_DOCUMENT(&iter)) &&
+	 (bson_iter_recurse(&iter,&bucket)) &&
+	 (bson_iter_find(&bucket,"min")) ) {
+      bson_t *split = bson_new();
+      bson_append_iter(split,"",0,&bucket);
+      splits[n_splits++] = split;}}
+  if (mongoc_cursor_error(cursor,&err)) {
+    grab_mongodb_error(&err,"collection_pscan");
+    while (n_splits > 0) bson_destroy(splits[--n_splits]);
+    n_splits = -1;}
+  mongoc_cursor_destroy(cursor);
+  bson_destroy(&aggopts);
+  bson_destroy(&pipeline);
+  return n_splits;
 }
 
-DEFC_PRIM("cursor/skip",cursor_skip,
-	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
-	  "Skips ahead *howmany* records on *cursor*. Returns #f when "
-	  "no items are retrieved or the number of items otherwise.",
-	  {"cursor",KNO_MONGOC_CURSOR,KNO_VOID},
-	  {"howmany",kno_fixnum_type,KNO_INT(1)})
-static lispval cursor_skip(lispval cursor,lispval howmany)
+/* This adds a snapshot read concern at the server's current operation
+   time (if it reports one) to *findopts* */
+static int pscan_snapshot(mongoc_client_t *client,bson_t *findopts)
 {
-  struct KNO_MONGODB_CURSOR *c = (struct KNO_MONGODB_CURSOR *)cursor;
-  if (!(KNO_UINTP(howmany)))
-    return kno_type_error("uint","mongodb_skip",howmany);
-  int n = KNO_FIX2INT(howmany), i = 0, rv = 0;
-  while  ((i<n) && ((rv=cursor_advance(c,"mongodb_skip")) > 0)) i++;
-  if (i>0) c->cursor_skipped += i;
-  if (i<0) return KNO_ERROR;
-  else if (i == 0) return KNO_FALSE;
-  else return KNO_INT(i);
+  bson_t cmd, reply, concern;
+  bson_error_t err;
+  bson_iter_t iter;
+  bson_init(&cmd);
+  BSON_APPEND_INT32(&cmd,"ping",1);
+  bool ok = mongoc_client_command_simple(client,"admin",&cmd,NULL,&reply,&err);
+  bson_destroy(&cmd);
+  if (!(ok)) {
+    grab_mongodb_error(&err,"collection_pscan");
+    bson_destroy(&reply);
+    return -1;}
+  bson_append_document_begin(findopts,"readConcern",11,&concern);
+  BSON_APPEND_UTF8(&concern,"level","snapshot");
+  if ( (bson_iter_init_find(&iter,&reply,"operationTime")) &&
+       (BSON_ITER_HOLDS_TIMESTAMP(&iter)) )
+    bson_append_iter(&concern,"atClusterTime",13,&iter);
+  bson_append_document_end(findopts,&concern);
+  bson_destroy(&reply);
+  return 1;
 }
 
-static lispval cursor_reader(lispval cursor,lispval howmany,
-			     lispval opts_arg,int sorted)
+/* This calls *fn* on the *n* documents in *vec* (as a vector if
+   *batch* is positive), returning 1 to continue, 0 to stop, or -1
+   on error */
+static int pscan_call(lispval fn,int batch,lispval *vec,int n)
 {
-  struct KNO_MONGODB_CURSOR *c = (struct KNO_MONGODB_CURSOR *)cursor;
-  if (c->mongoc_cursor == NULL)
-    return kno_err("MongoCursorClosed","mongodb_cursor_reader",NULL,cursor);
-  else if (c->cursor_done)
-    return KNO_EMPTY;
-  else if ( (c->cursor_threadid > 0) && ( c->cursor_threadid != u8_threadid() ) ) {
-    u8_byte msg[100];
-    kno_seterr("CursorThreadConflict","mongodb_cursor_reader",
-	       u8_bprintf(msg,"Opened in thread %llx, using in thread %llx",
-			  c->cursor_threadid,u8_threadid()),
-	       (lispval)c);
-    return KNO_ERROR;}
-  else if (!(KNO_UINTP(howmany)))
-    return kno_type_error("uint","mongodb_cursor_read",howmany);
-  else NO_ELSE;
-  int n = KNO_FIX2INT(howmany);
-  int flags = getflags(opts_arg,c->cursor_flags);
-  if (sorted < 0) sorted = kno_testopt(opts_arg,KNOSYM_SORTED,KNO_VOID);
-  if (n == 0) {
-    if (sorted)
-      return kno_make_vector(0,NULL);
-    else return KNO_EMPTY_CHOICE;}
-  else NO_ELSE;
-  lispval opts = combine_opts(opts_arg,c->cursor_opts);
-  if ( (n == 1) && (c->cursor_value_bson != NULL) ) {
-    lispval r = kno_bson2lisp((bson_t *)c->cursor_value_bson,flags,opts);
-    kno_decref(opts);
-    c->cursor_value_bson = NULL;
-    c->cursor_read++;
-    if (sorted)
-      return kno_make_vector(1,&r);
-    else return r;}
-  else {
-    lispval vec[n];
-    mongoc_cursor_t *scan = c->mongoc_cursor;
+  lispval arg = (batch > 0) ? (kno_make_vector(n,vec)) : (vec[0]);
+  lispval v = kno_apply(fn,1,&arg);
+  kno_decref(arg);
+  if (KNO_ABORTP(v))
+    return -1;
+  else if (KNO_FALSEP(v))
+    return 0;
+  kno_decref(v);
+  return 1;
+}
+
+/* This decodes queued documents and passes them to *fn* until the
+   scan is finished or *fn* stops it */
+static int pscan_consume(struct PSCAN_JOB *job,lispval fn,int batch,
+			 int flags,lispval opts,ssize_t *countp)
+{
+  int bufsize = (batch > 0) ? (batch) : (1), n = 0, ok = 1;
+  int parallel = parallel_decodingp(flags,opts);
+  lispval *vec = u8_alloc_n(bufsize,lispval);
+  bson_t *docs[DECODE_BATCH_SIZE];
+  lispval decoded[DECODE_BATCH_SIZE];
+  struct KNO_BSON_FIELDCACHE *fc = new_fieldcache();
+  struct KNO_BSON_ARENA arena;
+  init_bson_arena(&arena,bson_arena_size);
+  while (ok > 0) {
+    int n_docs = pscan_take(job,docs,DECODE_BATCH_SIZE), n_decoded = 0;
+    if (n_docs == 0) break;
+    if (parallel)
+      n_decoded = parallel_decode(docs,n_docs,flags,opts,decoded,fc,&arena);
+    else while (n_decoded < n_docs) {
+	lispval r = bson2lisp(docs[n_decoded],flags,opts,fc,&arena);
+	if (KNO_ABORTP(r)) {
+	  kno_decref_elts(decoded,n_decoded);
+	  n_decoded = -1;
+	  break;}
+	else decoded[n_decoded++] = r;}
+    int k = 0; while (k < n_docs) bson_destroy(docs[k++]);
+    if (n_decoded < 0) {
+      ok = -1;
+      break;}
+    int j = 0; while (j < n_decoded) {
+      vec[n++] = decoded[j++];
+      if (n == bufsize) {
+	ok = pscan_call(fn,batch,vec,n);
+	*countp += n; n = 0;
+	if (ok <= 0) {
+	  kno_decref_elts(decoded+j,n_decoded-j);
+	  break;}}}}
+  if ( (ok > 0) && (n > 0) && (!(job->pscan_failed)) ) {
+    ok = pscan_call(fn,batch,vec,n);
+    *countp += n; n = 0;}
+  kno_decref_elts(vec,n);
+  u8_free(vec);
+  free_fieldcache(fc);
+  free_bson_arena(&arena);
+  return ok;
+}
+
+/* This scans the ranges one after another in the calling thread with
+   *collection*, calling *fn* on the documents. It returns like
+   pscan_consume. */
+static int pscan_inline(struct PSCAN_JOB *job,mongoc_collection_t *collection,
+			lispval fn,int batch,int flags,lispval opts,
+			ssize_t *countp)
+{
+  int bufsize = (batch > 0) ? (batch) : (1), n = 0, ok = 1, i = 0;
+  lispval *vec = u8_alloc_n(bufsize,lispval);
+  struct KNO_BSON_FIELDCACHE *fc = new_fieldcache();
+  struct KNO_BSON_ARENA arena;
+  init_bson_arena(&arena,bson_arena_size);
+  while ( (ok > 0) && (i < job->pscan_n_ranges) ) {
+    mongoc_cursor_t *cursor = mongoc_collection_find_with_opts
+      (collection,job->pscan_ranges[i++],
+       job->pscan_findopts,job->pscan_readprefs);
     const bson_t *doc;
-    int i = 0, ok = 0;
-    if (c->cursor_value_bson != NULL) {
-      lispval v = kno_bson2lisp(((bson_t *)c->cursor_value_bson),flags,opts);
-      c->cursor_value_bson=NULL;
-      vec[i++] = v;}
-    while ( (i < n) && (ok=mongoc_cursor_next(scan,&doc)) ) {
-      lispval r = kno_bson2lisp((bson_t *)doc,flags,opts);
+    bson_error_t err;
+    while ( (ok > 0) && (mongoc_cursor_next(cursor,&doc)) ) {
+      lispval r = bson2lisp((bson_t *)doc,flags,opts,fc,&arena);
       if (KNO_ABORTP(r)) {
-	kno_decref_elts(vec,i);
-	kno_decref(opts);
-	return KNO_ERROR;}
-      else vec[i++] = r;}
-    if (!(ok)) {
-      bson_error_t err;
-      int cursor_err = mongoc_cursor_error(scan,&err);
-      if (cursor_err) {
-	grab_mongodb_error(&err,"mongodb");
-	kno_decref_elts(vec,i);
-	kno_decref(opts);
-	return KNO_ERROR;}
-      else c->cursor_done=1;}
-    c->cursor_read += i;
-    if (sorted) {
-      if (i == 0)
-	return kno_make_vector(0,NULL);
-      else return kno_make_vector(i,vec);}
-    else if (i == 0)
-      return KNO_EMPTY_CHOICE;
-    else if (i == 1)
-      return vec[0];
-    else return kno_init_choice
-	   (NULL,i,vec,KNO_CHOICE_DOSORT|KNO_CHOICE_COMPRESS);}
+	ok = -1;
+	break;}
+      vec[n++] = r;
+      if (n == bufsize) {
+	ok = pscan_call(fn,batch,vec,n);
+	*countp += n; n = 0;}}
+    if ( (ok > 0) && (mongoc_cursor_error(cursor,&err)) ) {
+      pscan_stop(job,err.message);
+      ok = 0;}
+    mongoc_cursor_destroy(cursor);}
+  if ( (ok > 0) && (n > 0) ) {
+    ok = pscan_call(fn,batch,vec,n);
+    *countp += n; n = 0;}
+  kno_decref_elts(vec,n);
+  u8_free(vec);
+  free_fieldcache(fc);
+  free_bson_arena(&arena);
+  return ok;
 }
 
-DEFC_PRIM("cursor/read",cursor_read,
-	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(1),
-	  "**undocumented**",
-	  {"cursor",KNO_MONGOC_CURSOR,KNO_VOID},
-	  {"howmany",kno_fixnum_type,KNO_INT(1)},
-	  {"opts_arg",kno_any_type,KNO_VOID})
-static lispval cursor_read(lispval cursor,lispval howmany,lispval opts)
+/* This gets the split points for a scan (from *splits_arg* or from
+   the server) and adds a snapshot read concern to *findopts* if
+   *snapshot* is true. It returns the number of split points, or -1
+   on error. */
+static int pscan_prepare(struct KNO_MONGODB_COLLECTION *coll,
+			 const bson_t *q,bson_t *findopts,
+			 const mongoc_read_prefs_t *rp,
+			 lispval splits_arg,int n_partitions,int snapshot,
+			 int flags,lispval opts,bson_t ***splitsp)
 {
-  return cursor_reader(cursor,howmany,opts,-1);
+  bson_t **splits = NULL;
+  int n_splits = 0;
+  if (KNO_VECTORP(splits_arg)) {
+    int i = 0, n = KNO_VECTOR_LENGTH(splits_arg);
+    splits = u8_alloc_n(n+1,bson_t *);
+    while (i < n) {
+      bson_t *split = getn_encode_key(KNO_VECTOR_REF(splits_arg,i),flags,opts);
+      if (split == NULL) {
+	while (n_splits > 0) bson_destroy(splits[--n_splits]);
+	u8_free(splits);
+	return -1;}
+      splits[n_splits++] = split;
+      i++;}}
+  if ( ( (splits == NULL) && (n_partitions > 1) ) || (snapshot) ) {
+    mongoc_client_t *client = NULL;
+    mongoc_collection_t *collection =
+      open_collection(coll,&client,flags,opts);
+    if (collection == NULL)
+      n_splits = -1;
+    else {
+      if ( (splits == NULL) && (n_partitions > 1) ) {
+	splits = u8_alloc_n(n_partitions,bson_t *);
+	n_splits = pscan_auto_splits(collection,q,rp,n_partitions,splits);}
+      if ( (n_splits >= 0) && (snapshot) &&
+	   (pscan_snapshot(client,findopts) < 0) ) {
+	while (n_splits > 0) bson_destroy(splits[--n_splits]);
+	n_splits = -1;}
+      collection_done(collection,client,coll);}
+    if ( (n_splits < 0) && (splits) ) {
+      u8_free(splits);
+      splits = NULL;}}
+  *splitsp = splits;
+  return n_splits;
 }
 
-DEFC_PRIM("cursor/readvec",cursor_readvec,
-	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(1),
-	  "**undocumented**",
-	  {"cursor",KNO_MONGOC_CURSOR,KNO_VOID},
-	  {"howmany",kno_fixnum_type,KNO_INT(1)},
-	  {"opts_arg",kno_any_type,KNO_VOID})
-static lispval cursor_readvec(lispval cursor,lispval howmany,lispval opts)
+/* This returns how many more clients operations in *lane* could get
+   from *server*'s pool right now */
+static int pool_spare(struct KNO_MONGODB_DATABASE *server,lispval lane)
 {
-  return cursor_reader(cursor,howmany,opts,1);
+  struct KNO_MONGODB_POOL *pool = server->dbpool;
+  int max = (pool->pool_stats.pool_max) ? (pool->pool_stats.pool_max) :
+    (MONGODB_DEFAULT_POOLMAX);
+  int spare = max-__atomic_load_n(&(pool->pool_stats.pool_busy),
+				  __ATOMIC_RELAXED);
+  if (pool->pool_lanes) {
+    int lane_spare_clients = lane_spare(pool->pool_lanes,lane);
+    if ( (lane_spare_clients >= 0) && (lane_spare_clients < spare) )
+      spare = lane_spare_clients;}
+  return spare;
+}
+
+/* This scans the ranges between *splits* concurrently, calling *fn* on
+   the documents */
+static lispval pscan_run(struct KNO_MONGODB_COLLECTION *coll,
+			 const bson_t *q,const bson_t *findopts,
+			 const mongoc_read_prefs_t *rp,
+			 bson_t **splits,int n_splits,int max_threads,
+			 lispval fn,int batch,int flags,lispval opts)
+{
+  struct KNO_MONGODB_DATABASE *server = COLL2DB(coll);
+  lispval arg = (lispval) coll, result = KNO_VOID;
+  struct PSCAN_JOB job;
+  memset(&job,0,sizeof(struct PSCAN_JOB));
+  job.pscan_n_ranges = n_splits+1;
+  job.pscan_ranges = u8_alloc_n(job.pscan_n_ranges,bson_t *);
+  int i = 0; while (i < job.pscan_n_ranges) {
+    bson_t *lo = (i > 0) ? (splits[i-1]) : (NULL);
+    bson_t *hi = (i < n_splits) ? (splits[i]) : (NULL);
+    job.pscan_ranges[i++] = pscan_range_query(q,lo,hi);}
+  job.pscan_findopts = findopts;
+  job.pscan_readprefs = rp;
+  job.pscan_queue_size = (pscan_queue_max > 0) ? (pscan_queue_max) : (1);
+  job.pscan_queue = u8_alloc_n(job.pscan_queue_size,bson_t *);
+  u8_init_mutex(&(job.pscan_lock));
+  u8_init_condvar(&(job.pscan_nonempty));
+  u8_init_condvar(&(job.pscan_nonfull));
+  if (max_threads > job.pscan_n_ranges) max_threads = job.pscan_n_ranges;
+
+  /* The first client is waited for, and becomes the first worker's
+     unless taking it left nothing for the callback. The other workers
+     only use clients which the pool has to spare, and only while it
+     still has one left over afterwards. */
+  struct PSCAN_WORKER workers[PSCAN_MAX_THREADS];
+  struct KNO_MONGODB_LANES *lanes = server->dbpool->pool_lanes;
+  lispval lane = (lanes) ? (get_lane(opts)) : (KNO_VOID);
+  int pool_limit = (server->dbpool->pool_stats.pool_max) ?
+    (server->dbpool->pool_stats.pool_max) : (MONGODB_DEFAULT_POOLMAX);
+  int lane_limit = (lanes) ? (lane_capacity(lanes,lane)) : (-1);
+  if ( (lane_limit >= 0) && (lane_limit < pool_limit) )
+    pool_limit = lane_limit;
+  if (max_threads > (pool_limit-1)) max_threads = pool_limit-1;
+  ssize_t count = 0;
+  int n_workers = 0, scanned = 0, ok = -1;
+  mongoc_client_t *first = get_client(server,1,lane);
+  mongoc_collection_t *first_collection = (first) ?
+    (mongoc_client_get_collection(first,server->dbname,coll->collection_name)) :
+    (NULL);
+  if (first_collection == NULL) NO_ELSE;
+  else if ( (max_threads < 1) || (pool_spare(server,lane) < 1) ) {
+    if ((logops)||(flags&KNO_MONGODB_LOGOPS))
+      u8_logf(LOG_NOTICE,"collection_pscan",
+	      "Scanning %q in %d ranges in the calling thread",
+	      arg,job.pscan_n_ranges);
+    ok = pscan_inline(&job,first_collection,fn,batch,flags,opts,&count);
+    scanned = 1;}
+  else {
+    while (n_workers < max_threads) {
+      struct PSCAN_WORKER *w = &(workers[n_workers]);
+      w->worker_job = &job;
+      if (n_workers == 0) {
+	w->worker_client = first;
+	w->worker_collection = first_collection;
+	first = NULL;
+	first_collection = NULL;}
+      else {
+	w->worker_client = get_client(server,0,lane);
+	if (w->worker_client == NULL) break;
+	else if (pool_spare(server,lane) < 1) {
+	  release_client(server,w->worker_client);
+	  break;}
+	w->worker_collection = mongoc_client_get_collection
+	  (w->worker_client,server->dbname,coll->collection_name);}
+      job.pscan_active++;
+      if ( (w->worker_collection == NULL) ||
+	   (mongodb_thread_create(&(w->worker_thread),pscan_worker,w) != 0) ) {
+	job.pscan_active--;
+	if (w->worker_collection)
+	  mongoc_collection_destroy(w->worker_collection);
+	release_client(server,w->worker_client);
+	break;}
+      n_workers++;}
+    if ((logops)||(flags&KNO_MONGODB_LOGOPS))
+      u8_logf(LOG_NOTICE,"collection_pscan",
+	      "Scanning %q in %d ranges with %d threads",
+	      arg,job.pscan_n_ranges,n_workers);
+    if (n_workers > 0) {
+      ok = pscan_consume(&job,fn,batch,flags,opts,&count);
+      scanned = 1;}}
+  pscan_stop(&job,NULL);
+  i = 0; while (i < n_workers) {
+    struct PSCAN_WORKER *w = &(workers[i++]);
+    pthread_join(w->worker_thread,NULL);
+    mongoc_collection_destroy(w->worker_collection);
+    release_client(server,w->worker_client);}
+  if (first_collection) mongoc_collection_destroy(first_collection);
+  if (first) release_client(server,first);
+  U8_CLEAR_ERRNO();
+  while (job.pscan_queue_len > 0) {
+    bson_destroy(job.pscan_queue[job.pscan_queue_start]);
+    job.pscan_queue_start = (job.pscan_queue_start+1)%job.pscan_queue_size;
+    job.pscan_queue_len--;}
+  if (job.pscan_failed) {
+    kno_seterr(kno_MongoDB_Error,"collection_pscan",job.pscan_error,arg);
+    result = KNO_ERROR_VALUE;}
+  else if (!(scanned)) {
+    if (u8_current_exception == NULL)
+      kno_seterr(kno_MongoDB_Error,"collection_pscan",
+		 "couldn't get a client",arg);
+    result = KNO_ERROR_VALUE;}
+  else if (ok < 0)
+    result = KNO_ERROR_VALUE;
+  else result = KNO_INT(count);
+  i = 0; while (i < job.pscan_n_ranges) bson_destroy(job.pscan_ranges[i++]);
+  u8_free(job.pscan_ranges);
+  u8_free(job.pscan_queue);
+  if (job.pscan_error) u8_free(job.pscan_error);
+  u8_destroy_condvar(&(job.pscan_nonfull));
+  u8_destroy_condvar(&(job.pscan_nonempty));
+  u8_destroy_mutex(&(job.pscan_lock));
+  return result;
+}
+
+DEF_KNOSYM(splits); DEF_KNOSYM(partitions); DEF_KNOSYM(snapshot);
+
+DEFC_PRIM("collection/pscan",collection_pscan,
+	  KNO_MAX_ARGS(5)|KNO_MIN_ARGS(3),
+	  "Calls *fn* on each document in *collection* matching *query*, "
+	  "scanning ranges of _id values concurrently with several "
+	  "clients. If *batch* is provided, *fn* is called on vectors "
+	  "of up to *batch* documents. *fn* is always called in the "
+	  "calling thread and the scan stops if it returns #f. Returns "
+	  "the number of documents processed.",
+	  {"collection",KNO_MONGOC_COLLECTION,KNO_VOID},
+	  {"query",kno_any_type,KNO_VOID},
+	  {"fn",kno_any_type,KNO_VOID},
+	  {"opts_arg",kno_any_type,KNO_VOID},
+	  {"batch",kno_any_type,KNO_VOID})
+static lispval collection_pscan(lispval arg,lispval query,lispval fn,
+				lispval opts_arg,lispval batch_arg)
+{
+  struct KNO_MONGODB_COLLECTION *coll = (struct KNO_MONGODB_COLLECTION *)arg;
+  if (!(KNO_APPLICABLEP(fn)))
+    return kno_type_error("applicable","collection_pscan",fn);
+  int batch = get_foreach_batch(batch_arg);
+  if (batch < 0) return KNO_ERROR_VALUE;
+  int flags = getflags(opts_arg,coll->collection_flags);
+  lispval opts = combine_opts(opts_arg,coll->collection_opts);
+  lispval threads_arg = kno_getopt(opts,KNOSYM(threads),KNO_VOID);
+  lispval partitions_arg = kno_getopt(opts,KNOSYM(partitions),KNO_VOID);
+  lispval splits_arg = kno_getopt(opts,KNOSYM(splits),KNO_VOID);
+  int max_threads = (KNO_UINTP(threads_arg)) ?
+    (KNO_FIX2INT(threads_arg)) : (pscan_threads);
+  if (max_threads > PSCAN_MAX_THREADS) max_threads = PSCAN_MAX_THREADS;
+  else if (max_threads < 1) max_threads = 1;
+  /* More ranges than threads lets faster threads take up the slack */
+  int n_partitions = (KNO_UINTP(partitions_arg)) ?
+    (KNO_FIX2INT(partitions_arg)) : (max_threads*4);
+  if (n_partitions < 1) n_partitions = 1;
+  int snapshot = kno_testopt(opts,KNOSYM(snapshot),KNO_VOID);
+  kno_decref(threads_arg);
+  kno_decref(partitions_arg);
+  bson_t *q = kno_lisp2bson(query,flags,opts);
+  bson_t *searchopts = (q) ? (get_search_opts(opts,flags,KNO_FIND_MATCHES)) :
+    (NULL);
+  mongoc_read_prefs_t *rp = get_read_prefs(opts);
+  bson_t **splits = NULL, *findopts = NULL;
+  int n_splits = -1;
+  if (searchopts) {
+    /* Skipping, limits and sorting would apply to each range */
+    findopts = bson_new();
+    bson_copy_to_excluding_noinit(searchopts,findopts,
+				  "skip","limit","sort",NULL);
+    n_splits = pscan_prepare(coll,q,findopts,rp,splits_arg,n_partitions,
+			     snapshot,flags,opts,&splits);}
+  lispval result = (n_splits < 0) ? (KNO_ERROR_VALUE) :
+    (pscan_run(coll,q,findopts,rp,splits,n_splits,max_threads,
+	       fn,batch,flags,opts));
+  if (splits) {
+    int i = 0; while (i < n_splits) bson_destroy(splits[i++]);
+    u8_free(splits);}
+  if (findopts) bson_destroy(findopts);
+  if (searchopts) bson_destroy(searchopts);
+  if (rp) mongoc_read_prefs_destroy(rp);
+  if (q) bson_destroy(q);
+  kno_decref(splits_arg);
+  kno_decref(opts);
+  return result;
 }
 
 /* BSON output functions */
@@ -2818,7 +7553,15 @@ static bool bson_append_lisp(struct KNO_BSON_OUTPUT b,
 	bson_append_array_end(out,&doc);
       else bson_append_document_end(out,&doc);
       break;}
-    default: {
+    default:
+      if (ctype == kno_mongoc_lazydoc) {
+	/* Lazy documents are written as they were read */
+	struct KNO_MONGODB_LAZYDOC *doc = (kno_mongodb_lazydoc) val;
+	ok = bson_append_document(out,key,keylen,doc->lazydoc_bson);
+	break;}
+      else if (ctype == kno_mongoc_param) {
+	ok = bson_append_param(b,key,keylen,val);
+	break;}
       struct U8_OUTPUT vout; unsigned char buf[128];
       U8_INIT_OUTPUT_BUF(&vout,128,buf);
       vout.u8_streaminfo |= U8_STREAM_VERBOSE;
@@ -2827,7 +7570,7 @@ static bool bson_append_lisp(struct KNO_BSON_OUTPUT b,
       else kno_unparse(&vout,val);
       ok = bson_append_utf8(out,key,keylen,vout.u8_outbuf,
 			    vout.u8_write-vout.u8_outbuf);
-      u8_close((u8_stream)&vout);}}
+      u8_close((u8_stream)&vout);}
     return ok;}
   else if (KNO_INTP(val))
     return bson_append_int32(out,key,keylen,((int)(KNO_FIX2INT(val))));
@@ -2896,6 +7639,62 @@ static bool bson_append_lisp(struct KNO_BSON_OUTPUT b,
 
 #define lookup_op(key) (kno_sortvec_get((key),mongo_opmap,mongo_opmap_size))
 
+/* The BSON key cache */
+
+/* Translating a symbol or OID key into a BSON field name (checking
+   the opmap, colonizing, rendering OIDs, and escaping periods)
+   depends only on the key and on whether we're slotifying, so the
+   translated field names are cached as Kno strings. There are two
+   caches, one for each setting of KNO_MONGODB_SLOTIFY. */
+
+static lispval bson_keycache_slotify = KNO_VOID;
+static lispval bson_keycache_raw = KNO_VOID;
+static int bson_keycache_max = 65536;
+
+static lispval bson_key_string(lispval key,int flags)
+{
+  struct U8_OUTPUT keyout; unsigned char buf[256];
+  U8_INIT_OUTPUT_BUF(&keyout,sizeof(buf),buf);
+  if (KNO_SYMBOLP(key)) {
+    struct KNO_KEYVAL *opmap = lookup_op(key);
+    if ( (opmap) && (KNO_STRINGP(opmap->kv_val)) )
+      u8_puts(&keyout,KNO_CSTRING(opmap->kv_val));
+    else if (flags&KNO_MONGODB_SLOTIFY)
+      u8_puts(&keyout,KNO_SYMBOL_NAME(key));
+    else u8_printf(&keyout,":%s",KNO_SYMBOL_NAME(key));}
+  else if (KNO_OIDP(key)) {
+    KNO_OID addr = KNO_OID_ADDR(key);
+    u8_printf(&keyout,"@%x/%x",KNO_OID_HI(addr),KNO_OID_LO(addr));}
+  else {
+    if (flags&KNO_MONGODB_SLOTIFY) u8_putc(&keyout,':');
+    kno_unparse(&keyout,key);}
+  /* Keys can't have periods in them, so we need to replace the
+     periods on write and replace them back on read. */
+  u8_byte *scan = keyout.u8_outbuf, *limit = keyout.u8_write;
+  while (scan < limit) {
+    if (*scan == '.') *scan = 0x02;
+    scan++;}
+  lispval result = kno_make_string
+    (NULL,keyout.u8_write-keyout.u8_outbuf,keyout.u8_outbuf);
+  u8_close((u8_stream)&keyout);
+  return result;
+}
+
+/* This returns a string (which should be decref'd) containing the
+   BSON field name for *key*. */
+static lispval get_bson_key(lispval key,int flags)
+{
+  lispval cache = (flags&KNO_MONGODB_SLOTIFY) ?
+    (bson_keycache_slotify) : (bson_keycache_raw);
+  struct KNO_HASHTABLE *ht = (kno_hashtable) cache;
+  lispval v = kno_hashtable_get(ht,key,KNO_VOID);
+  if (!(KNO_VOIDP(v))) return v;
+  v = bson_key_string(key,flags);
+  if ( (bson_keycache_max > 0) && (ht->table_n_keys < bson_keycache_max) )
+    kno_hashtable_store(ht,key,v);
+  return v;
+}
+
 static lispval lookup_mapfn(lispval fieldmap,u8_string keystring,int keylen)
 {
   struct KNO_STRING _probe;
@@ -2904,15 +7703,34 @@ static lispval lookup_mapfn(lispval fieldmap,u8_string keystring,int keylen)
   return kno_get(fieldmap,probe,KNO_VOID);
 }
 
-static bool bson_append_keyval(KNO_BSON_OUTPUT b,lispval key,lispval val)
+/* This returns the flags to use when writing the value of *key*. If
+   *mapfnp* is not NULL, it is set to the fieldmap function (if any)
+   for *key*, which should be decref'd. */
+static int bson_key_flags(lispval fieldmap,lispval key,int flags,
+			  lispval *mapfnp)
 {
-  if (KNO_VOIDP(val)) return 0;
-  int flags = b.bson_flags;
-  lispval fieldmap = b.bson_fieldmap, mapfn = KNO_VOID;
-  struct U8_OUTPUT keyout; unsigned char buf[100];
-  U8_INIT_OUTPUT_BUF(&keyout,1000,buf);
-  const char *keystring = NULL; int keylen; bool ok = true;
-  if ( (STRINGP(key)) || (kno_testopt(fieldmap,rawslots_symbol,key)) ) {
+  int props = ( (KNO_SYMBOLP(key)) || (KNO_OIDP(key)) ) ?
+    (get_slotprops(key)) : (0);
+  int fmflags = props; lispval mapfn = KNO_VOID;
+  if (KNO_VOIDP(fieldmap)) {}
+  else if (KNO_TYPEP(fieldmap,kno_mongoc_fieldmap)) {
+    struct KNO_MONGODB_SLOTINFO *info =
+      fieldmap_lookup((kno_mongodb_fieldmap)fieldmap,key);
+    if (info) {
+      fmflags |= info->slot_flags;
+      if ( (mapfnp) && (KNO_SYMBOLP(key)) )
+	mapfn = kno_incref(info->slot_mapfn);}}
+  else {
+    if (kno_testopt(fieldmap,rawslots_symbol,key))
+      fmflags |= KNO_MONGODB_RAWSLOT;
+    else {
+      if (kno_testopt(fieldmap,choiceslots_symbol,key))
+	fmflags |= KNO_MONGODB_CHOICESLOT;
+      if (kno_testopt(fieldmap,symslots_symbol,key))
+	fmflags |= KNO_MONGODB_SYMSLOT;}
+    if ( (mapfnp) && (KNO_SYMBOLP(key)) )
+      mapfn = kno_get(fieldmap,key,KNO_VOID);}
+  if ( (STRINGP(key)) || (fmflags&KNO_MONGODB_RAWSLOT) ) {
     flags = flags | KNO_MONGODB_RAWSLOT;
     flags = flags & (~KNO_MONGODB_PREFCHOICES);
     flags = flags & (~KNO_MONGODB_CHOICESLOT);
@@ -2920,83 +7738,241 @@ static bool bson_append_keyval(KNO_BSON_OUTPUT b,lispval key,lispval val)
     flags = flags & (~KNO_MONGODB_SYMSLOT);}
   else {
     /* Get other flags for the value */
-    if ( (get_choiceslot(key) >= 0) ||
-	 (kno_testopt(fieldmap,choiceslots_symbol,key)) )
+    if (fmflags&KNO_MONGODB_CHOICESLOT)
       flags = flags | KNO_MONGODB_CHOICESLOT;
-    if (kno_testopt(fieldmap,symslots_symbol,key))
-      flags = flags | KNO_MONGODB_SYMSLOT;}
-  if (KNO_SYMBOLP(key)) {
-    struct KNO_KEYVAL *opmap = lookup_op(key);
-    if (KNO_RARELY(opmap!=NULL))  {
-      if (KNO_STRINGP(opmap->kv_val)) {
-	lispval mapped = opmap->kv_val;
-	keystring = KNO_CSTRING(mapped);
-	keylen = KNO_STRLEN(mapped);}}
-    else if (flags&KNO_MONGODB_SLOTIFY) {
-      keystring = KNO_SYMBOL_NAME(key);
-      keylen = strlen(keystring);}
-    else {
-      u8_printf(&keyout,":%s",KNO_SYMBOL_NAME(key));
-      keystring = keyout.u8_outbuf;
-      keylen = keyout.u8_write-keyout.u8_outbuf;}
-    if (!(KNO_VOIDP(fieldmap)))
-      mapfn = kno_get(fieldmap,key,KNO_VOID);}
-  else if (KNO_OIDP(key)) {
-    KNO_OID addr = KNO_OID_ADDR(key);
-    u8_printf(&keyout,"@%x/%x",KNO_OID_HI(addr),KNO_OID_LO(addr));
-    keystring = keyout.u8_outbuf;
-    keylen = keyout.u8_write-keyout.u8_outbuf;}
+    if (fmflags&KNO_MONGODB_SYMSLOT)
+      flags = flags | KNO_MONGODB_SYMSLOT;
+    flags = apply_slotprops(flags,props);}
+  if (mapfnp) *mapfnp = mapfn;
+  return flags;
+}
+
+/* This applies a fieldmap function to a value being written. It
+   returns VOID if the value should be written as is. */
+static lispval map_output_value(lispval mapfn,lispval val)
+{
+  if (KNO_APPLICABLEP(mapfn))
+    return kno_apply(mapfn,1,&val);
+  else if (KNO_TABLEP(mapfn))
+    return kno_get(mapfn,val,KNO_VOID);
+  else if ( (KNO_FALSEP(mapfn)) || (KNO_EMPTYP(mapfn)) ||
+	    (KNO_DEFAULTP(mapfn)) )
+    return KNO_VOID;
+  else {
+    struct U8_OUTPUT out; U8_INIT_OUTPUT(&out,256);
+    out.u8_streaminfo |= U8_STREAM_VERBOSE;
+    kno_unparse(&out,val);
+    return kno_stream2string(&out);}
+}
+
+static bool bson_append_mapped(KNO_BSON_OUTPUT b,
+			       const char *keystring,int keylen,
+			       lispval val,int flags,
+			       lispval mapfn)
+{
+  if (KNO_VOIDP(mapfn))
+    return bson_append_lisp(b,keystring,keylen,val,flags);
+  lispval mapped = map_output_value(mapfn,val);
+  if (KNO_ABORTED(mapped))
+    return 0;
+  else if (KNO_VOIDP(mapped))
+    return bson_append_lisp(b,keystring,keylen,val,flags);
+  else {
+    bool ok = bson_append_lisp(b,keystring,keylen,mapped,flags);
+    kno_decref(mapped);
+    return ok;}
+}
+
+static bool bson_append_keyval(KNO_BSON_OUTPUT b,lispval key,lispval val)
+{
+  if (KNO_VOIDP(val)) return 0;
+  lispval fieldmap = b.bson_fieldmap, mapfn = KNO_VOID;
+  int flags = bson_key_flags(fieldmap,key,b.bson_flags,&mapfn);
+  lispval keystr = KNO_VOID;
+  const char *keystring = NULL; int keylen; bool ok = true;
+  if ( (KNO_SYMBOLP(key)) || (KNO_OIDP(key)) ) {
+    /* The cached key string is already escaped */
+    keystr = get_bson_key(key,flags);}
   else if (KNO_STRINGP(key)) {
     keystring = KNO_CSTRING(key);
     keylen = KNO_STRLEN(key);}
-  else {
-    keyout.u8_write = keyout.u8_outbuf;
-    if (flags&KNO_MONGODB_SLOTIFY)
-      u8_putc(&keyout,':');
-    kno_unparse(&keyout,key);
-    keystring = keyout.u8_outbuf;
-    keylen = keyout.u8_write-keyout.u8_outbuf;}
-  lispval store_value = val; int decref_stored = 0;
-  if (!(KNO_VOIDP(mapfn))) {
-    decref_stored=1;
-    if (KNO_APPLICABLEP(mapfn))
-      store_value = kno_apply(mapfn,1,&val);
-    else if (KNO_TABLEP(mapfn))
-      store_value = kno_get(mapfn,val,KNO_VOID);
-    else if (KNO_TRUEP(mapfn)) {
-      struct U8_OUTPUT out; U8_INIT_OUTPUT(&out,256);
-      out.u8_streaminfo |= U8_STREAM_VERBOSE;
-      kno_unparse(&out,val);
-      store_value = kno_stream2string(&out);}
-    else if ( (KNO_FALSEP(mapfn)) || (KNO_EMPTYP(mapfn)) ||
-	      (KNO_DEFAULTP(mapfn)) )
-      decref_stored = 0;
-    else {
-      struct U8_OUTPUT out; U8_INIT_OUTPUT(&out,256);
-      out.u8_streaminfo |= U8_STREAM_VERBOSE;
-      kno_unparse(&out,val);
-      store_value = kno_stream2string(&out);}
-    if (KNO_ABORTED(store_value)) {
-      u8_close((u8_stream)&keyout);
-      return 0;}}
+  else keystr = bson_key_string(key,flags);
+  if (KNO_STRINGP(keystr)) {
+    keystring = KNO_CSTRING(keystr);
+    keylen = KNO_STRLEN(keystr);}
   /* Keys can't have periods in them, so we need to replace the
-     periods on write and replace them back on read. */
+     periods on write and replace them back on read. Cached keys have
+     already been escaped. */
   size_t  max_len = keylen+1;
   u8_byte newbuf[max_len], *write = newbuf;
-  u8_string dotted = strchr(keystring,'.');
-  if ( (dotted) || (keystring[0] == '+') || (keystring[0] == '/') )  {
+  if ( (KNO_VOIDP(keystr)) && (strchr(keystring,'.')) ) {
     const u8_byte *scan = keystring, *limit = scan+keylen;
     while (scan < limit) {
       unsigned char c = *scan++;
       if (c == '.') *write++ = 0x02;
       else *write++ = c;}
     keystring = newbuf;}
-  ok = bson_append_lisp(b,keystring,keylen,store_value,flags);
-  if (decref_stored) kno_decref(store_value);
-  u8_close((u8_stream)&keyout);
+  ok = bson_append_mapped(b,keystring,keylen,val,flags,mapfn);
+  kno_decref(keystr);
+  kno_decref(mapfn);
   return ok;
 }
 
+/* Encode plans */
+
+/* Most documents come in a handful of shapes, so when writing a
+   slotmap or schemap whose keys are all symbols or OIDs, we compile
+   an 'encode plan' recording the BSON field name, value flags, and
+   fieldmap function for each key. Plans are cached per thread (so no
+   locking is needed) and are matched against the key sequence, the
+   base flags, the fieldmap, and the generation of the global slot
+   properties (MONGODB:CHOICESLOTS and friends). */
+
+#define ENCODE_PLAN_CACHE_SIZE 64
+#define ENCODE_PLAN_MAX_SLOTS 256
+
+struct BSON_ENCODE_SLOT {
+  lispval slot_key, slot_keystr, slot_mapfn;
+  int slot_flags;};
+
+struct BSON_ENCODE_PLAN {
+  unsigned int plan_hash, plan_generation;
+  int plan_flags, plan_inuse;
+  lispval plan_fieldmap;
+  int plan_n_slots;
+  struct BSON_ENCODE_SLOT plan_slots[];};
+
+struct BSON_ENCODE_PLANS {
+  struct BSON_ENCODE_PLAN *plans[ENCODE_PLAN_CACHE_SIZE];};
+
+static u8_tld_key encode_plans_key;
+static int use_encode_plans = 1;
+
+/* Fieldmap tables can change underneath us, but compiled fieldmaps
+   can't. */
+static int plannable_fieldmap(lispval fieldmap)
+{
+  return ( (KNO_VOIDP(fieldmap)) ||
+	   (KNO_TYPEP(fieldmap,kno_mongoc_fieldmap)) );
+}
+
+static unsigned int encode_plan_hash(lispval *keys,int n,
+				     int flags,lispval fieldmap)
+{
+  unsigned long long hash = (n*1000003ULL)^(flags)^((fieldmap)>>3);
+  int i = 0; while (i<n) {
+    hash = (hash*31)^(keys[i]>>2);
+    i++;}
+  return (unsigned int) (hash^(hash>>29));
+}
+
+static int encode_plan_matchp(struct BSON_ENCODE_PLAN *plan,unsigned int hash,
+			      lispval *keys,int n,int flags,lispval fieldmap)
+{
+  if ( (plan->plan_hash != hash) || (plan->plan_n_slots != n) ||
+       (plan->plan_flags != flags) || (plan->plan_fieldmap != fieldmap) ||
+       (plan->plan_generation != slotprops_generation) )
+    return 0;
+  struct BSON_ENCODE_SLOT *slots = plan->plan_slots;
+  int i = 0; while (i<n) {
+    if (slots[i].slot_key != keys[i]) return 0;
+    i++;}
+  return 1;
+}
+
+static void free_encode_plan(struct BSON_ENCODE_PLAN *plan)
+{
+  struct BSON_ENCODE_SLOT *slots = plan->plan_slots;
+  int i = 0, n = plan->plan_n_slots; while (i<n) {
+    kno_decref(slots[i].slot_keystr);
+    kno_decref(slots[i].slot_mapfn);
+    i++;}
+  kno_decref(plan->plan_fieldmap);
+  u8_free(plan);
+}
+
+static void free_encode_plans(void *ptr)
+{
+  struct BSON_ENCODE_PLANS *cache = (struct BSON_ENCODE_PLANS *) ptr;
+  if (cache == NULL) return;
+  int i = 0; while (i<ENCODE_PLAN_CACHE_SIZE) {
+    struct BSON_ENCODE_PLAN *plan = cache->plans[i++];
+    if (plan) free_encode_plan(plan);}
+  u8_free(cache);
+}
+
+static struct BSON_ENCODE_PLAN *
+compile_encode_plan(struct KNO_BSON_OUTPUT *out,lispval *keys,int n,
+		    unsigned int hash)
+{
+  lispval fieldmap = out->bson_fieldmap;
+  struct BSON_ENCODE_PLAN *plan = u8_malloc
+    (sizeof(struct BSON_ENCODE_PLAN)+(n*sizeof(struct BSON_ENCODE_SLOT)));
+  if (plan == NULL) return plan;
+  plan->plan_hash = hash;
+  plan->plan_generation = slotprops_generation;
+  plan->plan_flags = out->bson_flags;
+  plan->plan_inuse = 0;
+  plan->plan_fieldmap = kno_incref(fieldmap);
+  plan->plan_n_slots = n;
+  struct BSON_ENCODE_SLOT *slots = plan->plan_slots;
+  int i = 0; while (i<n) {
+    lispval key = keys[i], mapfn = KNO_VOID;
+    int flags = bson_key_flags(fieldmap,key,out->bson_flags,&mapfn);
+    slots[i].slot_key = key;
+    slots[i].slot_flags = flags;
+    slots[i].slot_keystr = get_bson_key(key,flags);
+    slots[i].slot_mapfn = mapfn;
+    i++;}
+  return plan;
+}
+
+/* This returns an encode plan for writing *n* *keys* to *out* or NULL
+   if the keys can't (or shouldn't) be planned. */
+static struct BSON_ENCODE_PLAN *
+get_encode_plan(struct KNO_BSON_OUTPUT *out,lispval *keys,int n)
+{
+  if ( (!(use_encode_plans)) || (n == 0) || (n > ENCODE_PLAN_MAX_SLOTS) )
+    return NULL;
+  lispval fieldmap = out->bson_fieldmap;
+  int flags = out->bson_flags;
+  if (!(plannable_fieldmap(fieldmap))) return NULL;
+  int i = 0; while (i<n) {
+    lispval key = keys[i++];
+    if (!( (KNO_SYMBOLP(key)) || (KNO_OIDP(key)) )) return NULL;}
+  unsigned int hash = encode_plan_hash(keys,n,flags,fieldmap);
+  struct BSON_ENCODE_PLANS *cache = u8_tld_get(encode_plans_key);
+  if (cache == NULL) {
+    cache = u8_alloc(struct BSON_ENCODE_PLANS);
+    memset(cache,0,sizeof(struct BSON_ENCODE_PLANS));
+    u8_tld_set(encode_plans_key,cache);}
+  struct BSON_ENCODE_PLAN **loc = &(cache->plans[hash%ENCODE_PLAN_CACHE_SIZE]);
+  struct BSON_ENCODE_PLAN *plan = *loc;
+  if (plan == NULL) {}
+  else if (encode_plan_matchp(plan,hash,keys,n,flags,fieldmap))
+    return plan;
+  /* A fieldmap function may be encoding other documents, so we never
+     replace a plan which is being used */
+  else if (plan->plan_inuse)
+    return NULL;
+  else NO_ELSE;
+  struct BSON_ENCODE_PLAN *fresh = compile_encode_plan(out,keys,n,hash);
+  if (fresh == NULL) return NULL;
+  if (plan) free_encode_plan(plan);
+  *loc = fresh;
+  return fresh;
+}
+
+static bool bson_append_planned(struct KNO_BSON_OUTPUT out,
+				struct BSON_ENCODE_SLOT *slot,
+				lispval val)
+{
+  if (KNO_VOIDP(val)) return 0;
+  lispval keystr = slot->slot_keystr;
+  return bson_append_mapped(out,KNO_CSTRING(keystr),KNO_STRLEN(keystr),val,
+			    slot->slot_flags,slot->slot_mapfn);
+}
+
 KNO_EXPORT lispval kno_bson_output(struct KNO_BSON_OUTPUT out,lispval obj)
 {
   int ok = 1;
@@ -3020,7 +7996,20 @@ KNO_EXPORT lispval kno_bson_output(struct KNO_BSON_OUTPUT out,lispval obj)
     struct KNO_SLOTMAP *smap = (kno_slotmap) obj;
     int i = 0, n = smap->n_slots;
     struct KNO_KEYVAL *keyvals = smap->sm_keyvals;
-    while (i < n) {
+    struct BSON_ENCODE_PLAN *plan = NULL;
+    if ( (n > 0) && (n <= ENCODE_PLAN_MAX_SLOTS) ) {
+      lispval keys[n];
+      int j = 0; while (j<n) { keys[j] = keyvals[j].kv_key; j++; }
+      plan = get_encode_plan(&out,keys,n);}
+    if (plan) {
+      struct BSON_ENCODE_SLOT *slots = plan->plan_slots;
+      plan->plan_inuse++;
+      while (i < n) {
+	ok = bson_append_planned(out,&(slots[i]),keyvals[i].kv_val);
+	if (!(ok)) break;
+	i++;}
+      plan->plan_inuse--;}
+    else while (i < n) {
       lispval key = keyvals[i].kv_key;
       lispval val = keyvals[i].kv_val;
       ok = bson_append_keyval(out,key,val);
@@ -3035,12 +8024,25 @@ KNO_EXPORT lispval kno_bson_output(struct KNO_BSON_OUTPUT out,lispval obj)
     lispval *values = smap->schema_values;
 #endif
     int i = 0, n = smap->schema_length;
-    while (i < n) {
+    struct BSON_ENCODE_PLAN *plan = get_encode_plan(&out,schema,n);
+    if (plan) {
+      struct BSON_ENCODE_SLOT *slots = plan->plan_slots;
+      plan->plan_inuse++;
+      while (i < n) {
+	ok = bson_append_planned(out,&(slots[i]),values[i]);
+	if (!(ok)) break;
+	i++;}
+      plan->plan_inuse--;}
+    else while (i < n) {
       lispval key = schema[i];
       lispval val = values[i];
       ok = bson_append_keyval(out,key,val);
       if (!(ok)) break;
       i++;}}
+  else if (KNO_TYPEP(obj,kno_mongoc_lazydoc)) {
+    /* Lazy documents are written as they were read */
+    struct KNO_MONGODB_LAZYDOC *doc = (kno_mongodb_lazydoc) obj;
+    ok = bson_concat(out.bson_doc,doc->lazydoc_bson);}
   else if (KNO_TABLEP(obj)) {
     lispval keys = kno_getkeys(obj);
     {KNO_DO_CHOICES(key,keys) {
@@ -3126,6 +8128,7 @@ static int slotifyp(u8_string s)
 }
 
 static lispval bson_read_vector(KNO_BSON_INPUT b,int flags);
+static lispval bson_read_document(KNO_BSON_INPUT b,int flags,int *specialp);
 static lispval bson_read_choice(KNO_BSON_INPUT b,int flags);
 static lispval bson_read_generic(KNO_BSON_INPUT b,int flags);
 
@@ -3147,15 +8150,19 @@ static int oidstringp(u8_string string)
   else return 0;
 }
 
-static void bson_read_step(KNO_BSON_INPUT b,int flags,
-			   lispval into,lispval *loc)
+/* This resolves the BSON field name *field* into a slotid (returned
+   in *slotidp*) and returns the flags for reading its value. It also
+   returns (in *mapfnp*) any fieldmap function for the field and
+   whether the slot is a symslot or choiceslot. */
+static int bson_read_field(KNO_BSON_INPUT b,const unsigned char *field,
+			   int flags,lispval *slotidp,lispval *mapfnp,
+			   int *symslotp,int *choiceslotp)
 {
-  int symslot = 0, choiceslot = 0, choicevals = 0;
-  bson_iter_t *in = b.bson_iter;
-  const unsigned char *field = bson_iter_key(in);
+  int symslot = 0, choiceslot = 0;
   const size_t field_len = strlen(field);
+  /* Interning is only inherited from the field itself */
+  flags = flags & (~KNO_MONGODB_INTERNSLOT);
   unsigned char tmpbuf[field_len+1];
-  if (flags < 0) flags = b.bson_flags;
   if (strchr(field,0x02)) {
     const unsigned char *read = field, *limit = read+field_len;
     unsigned char *write = tmpbuf;
@@ -3164,8 +8171,7 @@ static void bson_read_step(KNO_BSON_INPUT b,int flags,
       if (c == 0x02) *write++='.'; else *write++=c;}
     *write++='\0';
     field = tmpbuf;}
-  bson_type_t bt = bson_iter_type(in);
-  lispval slotid, value;
+  lispval slotid;
   if ( (flags&KNO_MONGODB_SLOTIFY) &&
        (flags&KNO_MONGODB_COLONIZE) &&
        (field[0]==':') &&
@@ -3190,19 +8196,117 @@ static void bson_read_step(KNO_BSON_INPUT b,int flags,
     kno_clear_errors(1);
     slotid=kno_make_string(NULL,-1,(unsigned char *)field);}
   lispval fieldmap = b.bson_fieldmap;
-  if ( (KNO_STRINGP(slotid)) ||
-       (kno_testopt(fieldmap,rawslots_symbol,slotid)) ) {
+  struct KNO_MONGODB_FIELDMAP *fm =
+    (KNO_TYPEP(fieldmap,kno_mongoc_fieldmap)) ?
+    ((kno_mongodb_fieldmap)fieldmap) : (NULL);
+  /* Global choiceslots only determine how values are written, so
+     they're not used here. */
+  int props = ( (KNO_SYMBOLP(slotid)) || (KNO_OIDP(slotid)) ) ?
+    ((get_slotprops(slotid))&(~KNO_MONGODB_CHOICESLOT)) : (0);
+  int fmflags = props;
+  if (fm) {
+    struct KNO_MONGODB_SLOTINFO *info = fieldmap_lookup(fm,slotid);
+    if (info) fmflags |= info->slot_flags;}
+  else if (KNO_VOIDP(fieldmap)) {}
+  else if (kno_testopt(fieldmap,rawslots_symbol,slotid))
+    fmflags |= KNO_MONGODB_RAWSLOT;
+  else if ( (KNO_OIDP(slotid)) || (KNO_SYMBOLP(slotid)) ) {
+    if (kno_testopt(fieldmap,symslots_symbol,slotid))
+      fmflags |= KNO_MONGODB_SYMSLOT;
+    if (kno_testopt(fieldmap,choiceslots_symbol,slotid))
+      fmflags |= KNO_MONGODB_CHOICESLOT;
+    if (kno_testopt(fieldmap,internslots_symbol,slotid))
+      fmflags |= KNO_MONGODB_INTERNSLOT;}
+  else NO_ELSE;
+  if ( ( (KNO_OIDP(slotid)) || (KNO_SYMBOLP(slotid)) ) &&
+       (kno_testopt(b.bson_opts,internslots_symbol,slotid)) )
+    fmflags |= KNO_MONGODB_INTERNSLOT;
+  if ( (KNO_STRINGP(slotid)) || (fmflags&KNO_MONGODB_RAWSLOT) ) {
     flags = flags | KNO_MONGODB_RAWSLOT;
     flags = flags & (~KNO_MONGODB_PREFCHOICES);
     flags = flags & (~KNO_MONGODB_COLONIZE);
     flags = flags & (~KNO_MONGODB_CHOICESLOT);
     flags = flags & (~KNO_MONGODB_SYMSLOT);}
   else if ( (KNO_OIDP(slotid)) || (KNO_SYMBOLP(slotid)) ) {
-    if (kno_testopt(fieldmap,symslots_symbol,slotid))
+    if (fmflags&KNO_MONGODB_SYMSLOT)
       flags = flags | KNO_MONGODB_SYMSLOT;
-    if (kno_testopt(fieldmap,choiceslots_symbol,slotid))
-      choiceslot=1;}
+    if (fmflags&KNO_MONGODB_CHOICESLOT)
+      choiceslot=1;
+    if (fmflags&KNO_MONGODB_INTERNSLOT)
+      flags = flags | KNO_MONGODB_INTERNSLOT;
+    flags = apply_slotprops(flags,props);}
   else NO_ELSE;
+  /* Fieldmap functions for reading are looked up by field name */
+  lispval mapfn = KNO_VOID;
+  if ( (fm) ? (fm->fieldmap_string_keys) : (!(KNO_VOIDP(fieldmap))) ) {
+    struct KNO_STRING _tempkey;
+    lispval tempkey = kno_init_string(&_tempkey,strlen(field),field);
+    KNO_INIT_STACK_CONS(tempkey,kno_string_type);
+    if (fm) {
+      struct KNO_MONGODB_SLOTINFO *info = fieldmap_lookup(fm,tempkey);
+      if (info) mapfn = kno_incref(info->slot_mapfn);}
+    else mapfn = kno_get(fieldmap,tempkey,KNO_VOID);}
+  *slotidp = slotid;
+  *mapfnp = mapfn;
+  *symslotp = symslot;
+  *choiceslotp = choiceslot;
+  return flags;
+}
+
+/* Array elements are read with the flags for a slot named by their
+   index (which is what their field names are) without actually
+   resolving the index. */
+static int bson_element_flags(int flags,int *symslotp)
+{
+  if (flags&KNO_MONGODB_SLOTIFY) {
+    *symslotp = 1;
+    return flags;}
+  else {
+    *symslotp = 0;
+    flags = flags | KNO_MONGODB_RAWSLOT;
+    flags = flags & (~KNO_MONGODB_PREFCHOICES);
+    flags = flags & (~KNO_MONGODB_COLONIZE);
+    flags = flags & (~KNO_MONGODB_CHOICESLOT);
+    flags = flags & (~KNO_MONGODB_SYMSLOT);
+    return flags;}
+}
+
+/* This reads the current field of *b*, returning its value and
+   storing its slotid in *slotidp*. It returns KNO_NULL if the field
+   couldn't be read. If *slotidp* is NULL, the field is an array
+   element and its name isn't resolved. */
+static lispval bson_read_value(KNO_BSON_INPUT b,int flags,lispval *slotidp)
+{
+  int symslot = 0, choiceslot = 0, choicevals = 0;
+  bson_iter_t *in = b.bson_iter;
+  const unsigned char *field = bson_iter_key(in);
+  bson_type_t bt = bson_iter_type(in);
+  lispval slotid = KNO_VOID, value, mapfn = KNO_VOID;
+  if (flags < 0) flags = b.bson_flags;
+  struct KNO_BSON_FIELDCACHE *fc = b.bson_fieldcache;
+  struct KNO_BSON_FIELDINFO *cached = ( (fc) && (slotidp) ) ?
+    (fieldcache_lookup(fc,field,flags)) : (NULL);
+  struct KNO_MONGODB_INTERNS *interns = NULL;
+  if (slotidp == NULL) {
+    flags = bson_element_flags(flags,&symslot);
+    interns = b.bson_interns;}
+  else if (cached) {
+    slotid = kno_incref(cached->field_slotid);
+    mapfn = kno_incref(cached->field_mapfn);
+    symslot = cached->field_symslot;
+    choiceslot = cached->field_choiceslot;
+    flags = cached->field_flags;
+    interns = cached->field_interns;}
+  else {
+    int inflags = flags;
+    flags = bson_read_field(b,field,flags,&slotid,&mapfn,
+			    &symslot,&choiceslot);
+    if (flags&KNO_MONGODB_INTERNSLOT)
+      interns = get_interns(slotid);
+    if (fc) fieldcache_add(fc,field,inflags,flags,slotid,mapfn,
+			   symslot,choiceslot,interns);}
+  /* Array elements share the intern table of their slot */
+  b.bson_interns = interns;
   switch (bt) {
   case BSON_TYPE_DOUBLE:
     value = kno_make_double(bson_iter_double(in)); break;
@@ -3222,16 +8326,13 @@ static void bson_read_step(KNO_BSON_INPUT b,int flags,
     if ( (flags&KNO_MONGODB_COLONIZE) && (bytes[0] == ':') )
       value = kno_parse_arg((u8_string)(bytes));
     else if ( (flags&KNO_MONGODB_COLONIZE) && (bytes[0]=='\\'))
-      value = kno_make_string(NULL,((len>0)?(len-1):(-1)),
-			      (unsigned char *)bytes+1);
+      value = bson_make_string(interns,bytes+1,((len>0)?(len-1):(-1)));
     else if (flags&KNO_MONGODB_SYMSLOT) {
       if ( (bytes[0] == ':') || (bytes[0] == '@') ||
 	   (bytes[0] == '#') )
 	value = kno_parse_arg((u8_string)(bytes));
-      else value = kno_make_string(NULL,((len>0)?(len):(-1)),
-				   (unsigned char *)bytes);}
-    else value = kno_make_string(NULL,((len>0)?(len):(-1)),
-				 (unsigned char *)bytes);
+      else value = bson_make_string(interns,bytes,((len>0)?(len):(-1)));}
+    else value = bson_make_string(interns,bytes,((len>0)?(len):(-1)));
     if (KNO_ABORTED(value)) {
       u8_exception ex = u8_current_exception;
       u8_log(LOGWARN,"MongoDBParseError","%s<%s> (%s): %s",
@@ -3312,19 +8413,23 @@ static void bson_read_step(KNO_BSON_INPUT b,int flags,
       bson_iter_recurse(in,&child);
       r.bson_iter = &child; r.bson_flags = b.bson_flags;
       r.bson_opts = b.bson_opts; r.bson_fieldmap = b.bson_fieldmap;
-      value = kno_init_slotmap(NULL,0,NULL);
-      while (bson_iter_next(&child))
-	bson_read_step(r,flags,value,NULL);
-      if (kno_test(value,dotcar_symbol,KNO_VOID)) {
+      r.bson_fieldcache = b.bson_fieldcache;
+      r.bson_arena = b.bson_arena;
+      r.bson_interns = NULL;
+      int special = 0;
+      value = bson_read_document(r,flags,&special);
+      if (special&BSON_DOC_PAIR) {
 	lispval car = kno_get(value,dotcar_symbol,KNO_VOID);
 	lispval cdr = kno_get(value,dotcdr_symbol,KNO_VOID);
 	kno_decref(value);
 	value = kno_init_pair(NULL,car,cdr);}
-      else if (kno_test(value,knotag_symbol,KNO_VOID)) {
+      else if (special&BSON_DOC_COMPOUND) {
 	lispval tag = kno_get(value,knotag_symbol,KNO_VOID), compound;
 	struct KNO_TYPEINFO *entry = kno_use_typeinfo(tag);
-	lispval fields[16] = { KNO_VOID }, keys = kno_getkeys(value);
+	lispval fields[16], keys = kno_getkeys(value);
 	int max = -1, i = 0, n, ok = 1;
+	while (i<16) fields[i++] = KNO_VOID;
+	i = 0;
 	{KNO_DO_CHOICES(key,keys) {
 	    if (KNO_FIXNUMP(key)) {
 	      long long index = KNO_FIX2INT(key);
@@ -3349,7 +8454,7 @@ static void bson_read_step(KNO_BSON_INPUT b,int flags,
 	    lispval *cdata = &(c->compound_0);
 	    kno_init_compound(c,tag,0,0);
 	    c->compound_length = n;
-	    memcpy(cdata,fields,n);
+	    memcpy(cdata,fields,n*LISPVAL_LEN);
 	    compound = LISP_CONS(c);}
 	  kno_decref(value);
 	  value = compound;}
@@ -3367,16 +8472,12 @@ static void bson_read_step(KNO_BSON_INPUT b,int flags,
     else {
       u8_logf(LOG_ERR,kno_BSON_Input_Error,
 	      "Can't handle BSON type %d",bt);
-      return;}}
-  if (!(KNO_VOIDP(b.bson_fieldmap))) {
-    struct KNO_STRING _tempkey;
-    lispval tempkey = kno_init_string(&_tempkey,strlen(field),field);
-    lispval mapfn = KNO_VOID, new_value = KNO_VOID;
-    lispval fieldmap = b.bson_fieldmap;
-    KNO_INIT_STACK_CONS(tempkey,kno_string_type);
-    mapfn = kno_get(fieldmap,tempkey,KNO_VOID);
-    if (KNO_VOIDP(mapfn)) {}
-    else if (KNO_APPLICABLEP(mapfn))
+      kno_decref(slotid);
+      kno_decref(mapfn);
+      return KNO_NULL;}}
+  if (!(KNO_VOIDP(mapfn))) {
+    lispval new_value = KNO_VOID;
+    if (KNO_APPLICABLEP(mapfn))
       new_value = kno_apply(mapfn,1,&value);
     else if (KNO_TABLEP(mapfn))
       new_value = kno_get(mapfn,value,KNO_VOID);
@@ -3390,110 +8491,533 @@ static void bson_read_step(KNO_BSON_INPUT b,int flags,
       lispval old_value = value;
       value = new_value;
       kno_decref(old_value);}
-    else {}}
+    else {}
+    kno_decref(mapfn);}
   /* For weird bugs */
-  /* if (!(KNO_CHECK_ANY_PTR(value))) kno_raise("BadPtr","bson_read_step",NULL,KNO_VOID); */
-  if (!(KNO_VOIDP(into))) kno_store(into,slotid,value);
-  if (loc) *loc = value;
-  else kno_decref(value);
+  /* if (!(KNO_CHECK_ANY_PTR(value))) kno_raise("BadPtr","bson_read_value",NULL,KNO_VOID); */
+  if (slotidp) *slotidp = slotid;
+  return value;
+}
+
+/* This returns the number of fields remaining for *iter* */
+static int bson_iter_count(bson_iter_t *iter)
+{
+  bson_iter_t scan; int n = 0;
+  memcpy(&scan,iter,sizeof(bson_iter_t));
+  while (bson_iter_next(&scan)) n++;
+  return n;
+}
+
+/* Shared schemas */
+
+/* When KNO_MONGODB_SCHEMAPS is set, documents are returned as
+   schemaps whose schemas (key vectors) are shared with every other
+   document having the same keys in the same order. Shared schemas are
+   kept in a registry and never freed, so the registry is bounded by
+   MONGODB:MAXSCHEMAS and documents with more than
+   MONGODB_SCHEMA_MAX_SLOTS keys just become slotmaps. Lookups don't
+   lock; new schemas are published by storing their slots last.
+
+   A key sequence is only registered the second time it is seen, so
+   one-off documents don't use up the registry. Sightings are
+   recorded by hash in a small fixed table, where later shapes just
+   overwrite earlier ones. */
+
+#define MONGODB_SCHEMA_MAX_SLOTS 64
+#define MONGODB_SCHEMA_SIGHTINGS 1021
+
+struct MONGODB_SCHEMA {
+  unsigned int schema_hash;
+  int schema_length;
+  lispval *schema_slots;};
+
+static struct MONGODB_SCHEMA *shared_schemas = NULL;
+static int n_shared_schemas = 0, shared_schemas_size = 0;
+static int max_shared_schemas = 4096;
+static u8_mutex shared_schemas_lock;
+static unsigned int schema_sightings[MONGODB_SCHEMA_SIGHTINGS];
+
+static unsigned int schema_hash(lispval *keys,int n)
+{
+  unsigned int hash = 2166136261U;
+  int i = 0; while (i < n) {
+    hash ^= slot_hash(keys[i++]);
+    hash *= 16777619U;}
+  return hash;
+}
+
+static lispval *probe_schema(struct MONGODB_SCHEMA *table,int size,
+			     unsigned int hash,lispval *keys,int n,
+			     struct MONGODB_SCHEMA **emptyp)
+{
+  unsigned int probe = hash%size;
+  int i = 0; while (i < size) {
+    struct MONGODB_SCHEMA *entry = &(table[probe]);
+    lispval *slots = __atomic_load_n(&(entry->schema_slots),__ATOMIC_ACQUIRE);
+    if (slots == NULL) {
+      if (emptyp) *emptyp = entry;
+      return NULL;}
+    else if ( (entry->schema_hash == hash) && (entry->schema_length == n) &&
+	      (memcmp(slots,keys,n*sizeof(lispval)) == 0) )
+      return slots;
+    else probe = (probe+1)%size;
+    i++;}
+  if (emptyp) *emptyp = NULL;
+  return NULL;
+}
+
+/* This records a sighting of the shape with *hash*, returning 1 if
+   the last shape recorded in its slot had the same hash. */
+static int schema_seen_before(unsigned int hash)
+{
+  unsigned int *sighting =
+    &(schema_sightings[hash%MONGODB_SCHEMA_SIGHTINGS]);
+  unsigned int seen = __atomic_exchange_n(sighting,hash,__ATOMIC_RELAXED);
+  return (seen == hash);
+}
+
+/* Returns a shared schema for *keys* or NULL if there isn't (yet, or
+   can't be) one. */
+static lispval *get_shared_schema(lispval *keys,int n)
+{
+  if ( (n == 0) || (n > MONGODB_SCHEMA_MAX_SLOTS) ) return NULL;
+  int i = 0; while (i < n) {
+    lispval key = keys[i++];
+    if (! ( (KNO_SYMBOLP(key)) || (KNO_OIDP(key)) ) ) return NULL;}
+  unsigned int hash = schema_hash(keys,n);
+  struct MONGODB_SCHEMA *table =
+    __atomic_load_n(&shared_schemas,__ATOMIC_ACQUIRE);
+  if (table) {
+    lispval *found = probe_schema(table,shared_schemas_size,hash,keys,n,NULL);
+    if (found) return found;}
+  if (n_shared_schemas >= max_shared_schemas) return NULL;
+  if (!(schema_seen_before(hash))) return NULL;
+  /* Schemaps can't have duplicate keys */
+  i = 0; while (i < n) {
+    lispval key = keys[i]; int j = i+1;
+    while (j < n) { if (keys[j++] == key) return NULL; }
+    i++;}
+  u8_lock_mutex(&shared_schemas_lock);
+  if (shared_schemas == NULL) {
+    if (max_shared_schemas <= 0) {
+      u8_unlock_mutex(&shared_schemas_lock);
+      return NULL;}
+    int size = (max_shared_schemas*2)+1;
+    struct MONGODB_SCHEMA *fresh = u8_alloc_n(size,struct MONGODB_SCHEMA);
+    memset(fresh,0,size*sizeof(struct MONGODB_SCHEMA));
+    shared_schemas_size = size;
+    __atomic_store_n(&shared_schemas,fresh,__ATOMIC_RELEASE);}
+  struct MONGODB_SCHEMA *empty = NULL;
+  lispval *schema = probe_schema(shared_schemas,shared_schemas_size,
+				 hash,keys,n,&empty);
+  if ( (schema == NULL) && (empty) &&
+       (n_shared_schemas < max_shared_schemas) &&
+       (((n_shared_schemas+1)*2) < shared_schemas_size) ) {
+    schema = u8_alloc_n(n,lispval);
+    memcpy(schema,keys,n*sizeof(lispval));
+    empty->schema_hash = hash;
+    empty->schema_length = n;
+    __atomic_store_n(&(empty->schema_slots),schema,__ATOMIC_RELEASE);
+    n_shared_schemas++;}
+  u8_unlock_mutex(&shared_schemas_lock);
+  return schema;
+}
+
+#define BSON_DOC_PAIR 1
+#define BSON_DOC_COMPOUND 2
+
+static int bson_doc_special(lispval slotid,lispval value)
+{
+  if ( (KNO_VOIDP(value)) || (KNO_EMPTYP(value)) )
+    return 0;
+  else if (slotid == dotcar_symbol)
+    return BSON_DOC_PAIR;
+  else if (slotid == knotag_symbol)
+    return BSON_DOC_COMPOUND;
+  else return 0;
+}
+
+static lispval make_slotmap(lispval *keys,lispval *values,int n)
+{
+  lispval result = kno_make_slotmap(n,0,NULL);
+  int i = 0; while (i < n) {
+    kno_store(result,keys[i],values[i]);
+    kno_decref(keys[i]);
+    kno_decref(values[i]);
+    i++;}
+  return result;
+}
+
+static lispval bson_read_schemap(KNO_BSON_INPUT b,int flags,int *specialp)
+{
+  lispval keys[MONGODB_SCHEMA_MAX_SLOTS], values[MONGODB_SCHEMA_MAX_SLOTS];
+  bson_iter_t *in = b.bson_iter;
+  int n = 0;
+  while (bson_iter_next(in)) {
+    if (n >= MONGODB_SCHEMA_MAX_SLOTS) {
+      /* Too many slots, so just use a slotmap */
+      lispval result = make_slotmap(keys,values,n);
+      do {
+	lispval slotid = KNO_VOID;
+	lispval value = bson_read_value(b,flags,&slotid);
+	if (value == KNO_NULL) continue;
+	if (specialp) *specialp |= bson_doc_special(slotid,value);
+	kno_store(result,slotid,value);
+	kno_decref(slotid);
+	kno_decref(value);}
+      while (bson_iter_next(in));
+      return result;}
+    lispval slotid = KNO_VOID;
+    lispval value = bson_read_value(b,flags,&slotid);
+    if (value == KNO_NULL) continue;
+    if (specialp) *specialp |= bson_doc_special(slotid,value);
+    keys[n] = slotid;
+    values[n] = value;
+    n++;}
+  lispval *schema = get_shared_schema(keys,n);
+  if (schema) {
+    lispval *vals = u8_alloc_n(n,lispval);
+    memcpy(vals,values,n*sizeof(lispval));
+    return kno_make_schemap(NULL,n,KNO_SCHEMAP_STATIC_SCHEMA,schema,vals);}
+  else return make_slotmap(keys,values,n);
+}
+
+/* This reads the remaining fields of *b* into a table. If *specialp*
+   is not NULL, it is updated with BSON_DOC_PAIR or BSON_DOC_COMPOUND
+   if the document has the slots which encode pairs or compounds. */
+static lispval bson_read_document(KNO_BSON_INPUT b,int flags,int *specialp)
+{
+  if (flags < 0) flags = b.bson_flags;
+  if (flags&KNO_MONGODB_SCHEMAPS)
+    return bson_read_schemap(b,flags,specialp);
+  lispval result = kno_make_slotmap(bson_iter_count(b.bson_iter),0,NULL);
+  while (bson_iter_next(b.bson_iter)) {
+    lispval slotid = KNO_VOID;
+    lispval value = bson_read_value(b,flags,&slotid);
+    if (value == KNO_NULL) continue;
+    if (specialp) *specialp |= bson_doc_special(slotid,value);
+    kno_store(result,slotid,value);
+    kno_decref(slotid);
+    kno_decref(value);}
+  return result;
+}
+
+/* Scratch buffers for reading arrays come from the arena (if any),
+   and are released (in LIFO order) as soon as their contents have been
+   copied. */
+
+static size_t arena_mark(struct KNO_BSON_ARENA *arena)
+{
+  return (arena) ? (arena->arena_used) : (0);
+}
+
+static lispval *arena_alloc(struct KNO_BSON_ARENA *arena,int n)
+{
+  size_t bytes = ((n>0)?(n):(1))*sizeof(lispval);
+  if ( (arena) && ((arena->arena_used+bytes) <= arena->arena_size) ) {
+    lispval *buf = (lispval *) (arena->arena_data+arena->arena_used);
+    arena->arena_used += bytes;
+    return buf;}
+  else return u8_alloc_n(((n>0)?(n):(1)),lispval);
+}
+
+static void arena_release(struct KNO_BSON_ARENA *arena,lispval *buf,
+			  size_t mark)
+{
+  if ( (arena) &&
+       ( ((unsigned char *)buf) >= arena->arena_data) &&
+       ( ((unsigned char *)buf) < (arena->arena_data+arena->arena_size) ) )
+    arena->arena_used = mark;
+  else u8_free(buf);
+}
+
+static void init_bson_arena(struct KNO_BSON_ARENA *arena,size_t size)
+{
+  arena->arena_data = (size) ? (u8_malloc(size)) : (NULL);
+  arena->arena_size = (arena->arena_data) ? (size) : (0);
+  arena->arena_used = 0;
+}
+
+static void free_bson_arena(struct KNO_BSON_ARENA *arena)
+{
+  if (arena->arena_data) u8_free(arena->arena_data);
+  arena->arena_data = NULL;
+  arena->arena_size = arena->arena_used = 0;
+}
+
+static void init_element_input(KNO_BSON_INPUT *r,KNO_BSON_INPUT *b,
+			       bson_iter_t *child,int flags)
+{
+  r->bson_iter = child; r->bson_flags = flags;
+  r->bson_opts = b->bson_opts; r->bson_fieldmap = b->bson_fieldmap;
+  /* Array indices aren't worth caching */
+  r->bson_fieldcache = NULL;
+  r->bson_arena = b->bson_arena;
+  r->bson_interns = b->bson_interns;
 }
 
 static lispval bson_read_vector(KNO_BSON_INPUT b,int flags)
 {
   struct KNO_BSON_INPUT r; bson_iter_t child;
-  lispval result, *data = u8_alloc_n(16,lispval);
-  lispval *write = data, *lim = data+16;
   if (flags < 0) flags = b.bson_flags;
   bson_iter_recurse(b.bson_iter,&child);
-  r.bson_iter = &child; r.bson_flags = flags;
-  r.bson_opts = b.bson_opts; r.bson_fieldmap = b.bson_fieldmap;
-  while (bson_iter_next(&child)) {
-    if (write>=lim) {
-      int len = lim-data;
-      int newlen = ((len<16384)?(len*2):(len+16384));
-      lispval *newdata = u8_realloc_n(data,newlen,lispval);
-      if (!(newdata)) u8_raise(kno_MallocFailed,"mongodb_cursor_read_vector",NULL);
-      write = newdata+(write-data); lim = newdata+newlen; data = newdata;}
-    bson_read_step(r,flags,KNO_VOID,write);
-    write++;}
-  result = kno_make_vector(write-data,data);
-  u8_free(data);
+  init_element_input(&r,&b,&child,flags);
+  int n = bson_iter_count(&child);
+  size_t mark = arena_mark(b.bson_arena);
+  lispval *data = arena_alloc(b.bson_arena,n), *write = data, *lim = data+n;
+  while ( (write < lim) && (bson_iter_next(&child)) ) {
+    lispval v = bson_read_value(r,flags,NULL);
+    if (v != KNO_NULL) *write++ = v;}
+  lispval result = kno_make_vector(write-data,data);
+  arena_release(b.bson_arena,data,mark);
   return result;
 }
 
 static lispval bson_read_choice(KNO_BSON_INPUT b,int flags)
 {
   struct KNO_BSON_INPUT r; bson_iter_t child;
-  lispval *data = u8_alloc_n(16,lispval), *write = data, *lim = data+16;
   if (flags < 0) flags = b.bson_flags;
   bson_iter_recurse(b.bson_iter,&child);
-  r.bson_iter = &child; r.bson_flags = flags;
-  r.bson_opts = b.bson_opts; r.bson_fieldmap = b.bson_fieldmap;
-  while (bson_iter_next(&child)) {
-    if (write>=lim) {
-      int len = lim-data;
-      int newlen = ((len<16384)?(len*2):(len+16384));
-      lispval *newdata = u8_realloc_n(data,newlen,lispval);
-      if (!(newdata)) u8_raise(kno_MallocFailed,"mongodb_cursor_read_vector",NULL);
-      write = newdata+(write-data); lim = newdata+newlen; data = newdata;}
+  init_element_input(&r,&b,&child,flags);
+  int n = bson_iter_count(&child);
+  size_t mark = arena_mark(b.bson_arena);
+  lispval *data = arena_alloc(b.bson_arena,n), *write = data, *lim = data+n;
+  while ( (write < lim) && (bson_iter_next(&child)) ) {
     if (BSON_ITER_HOLDS_ARRAY(&child)) {
       *write++=bson_read_vector(r,flags);}
     else {
-      bson_read_step(r,flags,KNO_VOID,write);
-      write++;}}
-  if (write == data) {
-    u8_free(data);
-    return KNO_EMPTY_CHOICE;}
-  else return kno_make_choice
-	 (write-data,data,
-	  KNO_CHOICE_DOSORT|KNO_CHOICE_COMPRESS|
-	  KNO_CHOICE_FREEDATA|KNO_CHOICE_REALLOC);
+      lispval v = bson_read_value(r,flags,NULL);
+      if (v != KNO_NULL) *write++ = v;}}
+  lispval result = (write == data) ? (KNO_EMPTY_CHOICE) :
+    (kno_make_choice(write-data,data,
+		     KNO_CHOICE_DOSORT|KNO_CHOICE_COMPRESS));
+  arena_release(b.bson_arena,data,mark);
+  return result;
 }
 
 static lispval bson_read_generic(KNO_BSON_INPUT b,int flags)
 {
   struct KNO_BSON_INPUT r; bson_iter_t child; int ischoice=0;
-  lispval *data = u8_alloc_n(16,lispval), *write = data, *lim = data+16;
   if (flags < 0) flags = b.bson_flags;
   bson_iter_recurse(b.bson_iter,&child);
-  r.bson_iter = &child; r.bson_flags = flags;
-  r.bson_opts = b.bson_opts; r.bson_fieldmap = b.bson_fieldmap;
-  while (bson_iter_next(&child)) {
-    if (write>=lim) {
-      int len = lim-data;
-      int newlen = ((len<16384)?(len*2):(len+16384));
-      lispval *newdata = u8_realloc_n(data,newlen,lispval);
-      if (!(newdata)) u8_raise(kno_MallocFailed,"mongodb_cursor_read_vector",NULL);
-      write = newdata+(write-data); lim = newdata+newlen; data = newdata;}
+  init_element_input(&r,&b,&child,flags);
+  int n = bson_iter_count(&child);
+  size_t mark = arena_mark(b.bson_arena);
+  lispval *data = arena_alloc(b.bson_arena,n), *write = data, *lim = data+n;
+  while ( (write < lim) && (bson_iter_next(&child)) ) {
     if (BSON_ITER_HOLDS_ARRAY(&child)) {
       *write++=bson_read_vector(r,flags);}
     else {
-      bson_read_step(r,flags,KNO_VOID,write);
-      if ( (write == data) && (*write==choice_tagsym) )
+      lispval v = bson_read_value(r,flags,NULL);
+      if (v == KNO_NULL) continue;
+      else if ( (write == data) && (v == choice_tagsym) )
 	ischoice=1;
-      else if ( (write == data) && (KNO_STRINGP(*write)) &&
-		(strcmp(KNO_STRDATA(*write),CHOICE_TAGSTRING_TEXT)==0) ) {
-	kno_decref(*write);
+      else if ( (write == data) && (KNO_STRINGP(v)) &&
+		(strcmp(KNO_STRDATA(v),CHOICE_TAGSTRING_TEXT)==0) ) {
+	kno_decref(v);
 	ischoice=1;}
-      else write++;}}
-  if (ischoice) {
-    if (write == data) {
-      u8_free(data);
-      return KNO_EMPTY_CHOICE;}
-    else return kno_make_choice
-	   (write-data,data,
-	    KNO_CHOICE_DOSORT|KNO_CHOICE_COMPRESS|
-	    KNO_CHOICE_FREEDATA|KNO_CHOICE_REALLOC);}
+      else *write++ = v;}}
+  lispval result;
+  if (ischoice)
+    result = (write == data) ? (KNO_EMPTY_CHOICE) :
+      (kno_make_choice(write-data,data,
+		       KNO_CHOICE_DOSORT|KNO_CHOICE_COMPRESS));
+  else result = kno_make_vector(write-data,data);
+  arena_release(b.bson_arena,data,mark);
+  return result;
+}
+
+/* Lazy documents */
+
+/* A lazy document wraps a copy of the BSON for a document and
+   implements the table interface, decoding fields only when they're
+   accessed and remembering the results. The index of fields (and
+   their slotids) is built on first access. Both the index and decoded
+   values are filled in with atomic compare-and-swap, so lazy documents
+   can be shared between threads without locking. */
+
+static void free_lazyindex(struct KNO_MONGODB_LAZYINDEX *index)
+{
+  int i = 0, n = index->lazy_n_fields;
+  while (i < n) {
+    lispval v = index->lazy_values[i];
+    if (v != KNO_NULL) kno_decref(v);
+    kno_decref(index->lazy_slotids[i]);
+    i++;}
+  u8_free(index->lazy_slotids);
+  u8_free(index->lazy_values);
+  u8_free(index->lazy_iters);
+  u8_free(index);
+}
+
+static struct KNO_MONGODB_LAZYINDEX *lazydoc_index(struct KNO_MONGODB_LAZYDOC *doc)
+{
+  struct KNO_MONGODB_LAZYINDEX *index =
+    __atomic_load_n(&(doc->lazydoc_index),__ATOMIC_ACQUIRE);
+  if (index) return index;
+  bson_iter_t iter;
+  if (!(bson_iter_init(&iter,doc->lazydoc_bson))) {
+    kno_seterr(kno_BSON_Input_Error,"lazydoc_index",NULL,(lispval)doc);
+    return NULL;}
+  int n = bson_count_keys(doc->lazydoc_bson), i = 0;
+  index = u8_alloc(struct KNO_MONGODB_LAZYINDEX);
+  index->lazy_slotids = u8_alloc_n(n,lispval);
+  index->lazy_values = u8_alloc_n(n,lispval);
+  index->lazy_iters = u8_alloc_n(n,bson_iter_t);
+  struct KNO_BSON_INPUT b = { 0 };
+  b.bson_iter = &iter; b.bson_flags = doc->lazydoc_flags;
+  b.bson_opts = doc->lazydoc_opts; b.bson_fieldmap = doc->lazydoc_fieldmap;
+  while ( (i < n) && (bson_iter_next(&iter)) ) {
+    lispval slotid = KNO_VOID, mapfn = KNO_VOID;
+    int symslot = 0, choiceslot = 0;
+    bson_read_field(b,bson_iter_key(&iter),doc->lazydoc_flags,
+		    &slotid,&mapfn,&symslot,&choiceslot);
+    kno_decref(mapfn);
+    index->lazy_slotids[i] = slotid;
+    index->lazy_values[i] = KNO_NULL;
+    memcpy(&(index->lazy_iters[i]),&iter,sizeof(bson_iter_t));
+    i++;}
+  index->lazy_n_fields = i;
+  struct KNO_MONGODB_LAZYINDEX *expected = NULL;
+  if (__atomic_compare_exchange_n(&(doc->lazydoc_index),&expected,index,0,
+				  __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+    return index;
   else {
-    lispval result = kno_make_vector(write-data,data);
-    u8_free(data);
-    return result;}
+    free_lazyindex(index);
+    return expected;}
 }
 
-KNO_EXPORT lispval kno_bson2lisp(bson_t *in,int flags,lispval opts)
+/* Returns the position of the last field for *key* or -1 */
+static int lazydoc_find(struct KNO_MONGODB_LAZYINDEX *index,lispval key)
+{
+  int i = index->lazy_n_fields-1;
+  while (i >= 0) {
+    lispval slotid = index->lazy_slotids[i];
+    if ( (slotid == key) ||
+	 ( (KNO_CONSP(slotid)) && (KNO_CONSP(key)) &&
+	   (kno_equalp(slotid,key)) ) )
+      return i;
+    else i--;}
+  return -1;
+}
+
+/* Returns the (uncounted) decoded value of field *i* */
+static lispval lazydoc_value(struct KNO_MONGODB_LAZYDOC *doc,
+			     struct KNO_MONGODB_LAZYINDEX *index,
+			     int i)
+{
+  lispval v = __atomic_load_n(&(index->lazy_values[i]),__ATOMIC_ACQUIRE);
+  if (v != KNO_NULL) return v;
+  bson_iter_t iter;
+  memcpy(&iter,&(index->lazy_iters[i]),sizeof(bson_iter_t));
+  struct KNO_BSON_INPUT b = { 0 };
+  b.bson_iter = &iter; b.bson_flags = doc->lazydoc_flags;
+  b.bson_opts = doc->lazydoc_opts; b.bson_fieldmap = doc->lazydoc_fieldmap;
+  lispval slotid = KNO_VOID;
+  lispval value = bson_read_value(b,doc->lazydoc_flags,&slotid);
+  kno_decref(slotid);
+  if (value == KNO_NULL) value = KNO_VOID;
+  lispval expected = KNO_NULL;
+  if (__atomic_compare_exchange_n(&(index->lazy_values[i]),&expected,value,0,
+				  __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+    return value;
+  else {
+    kno_decref(value);
+    return expected;}
+}
+
+static lispval make_lazydoc(const bson_t *in,int flags,lispval opts)
+{
+  struct KNO_MONGODB_LAZYDOC *doc = u8_alloc(struct KNO_MONGODB_LAZYDOC);
+  KNO_INIT_CONS(doc,kno_mongoc_lazydoc);
+  doc->lazydoc_bson = bson_copy(in);
+  doc->lazydoc_flags = flags & (~KNO_MONGODB_LAZY);
+  doc->lazydoc_opts = kno_incref(opts);
+  doc->lazydoc_fieldmap = kno_getopt(opts,fieldmap_symbol,KNO_VOID);
+  doc->lazydoc_index = NULL;
+  return (lispval) doc;
+}
+
+static lispval lazydoc_get(lispval obj,lispval key,lispval dflt)
+{
+  struct KNO_MONGODB_LAZYDOC *doc = (kno_mongodb_lazydoc) obj;
+  struct KNO_MONGODB_LAZYINDEX *index = lazydoc_index(doc);
+  if (index == NULL) return KNO_ERROR_VALUE;
+  int i = lazydoc_find(index,key);
+  if (i < 0) return kno_incref(dflt);
+  lispval v = lazydoc_value(doc,index,i);
+  if (KNO_VOIDP(v))
+    return kno_incref(dflt);
+  else return kno_incref(v);
+}
+
+static int lazydoc_test(lispval obj,lispval key,lispval val)
+{
+  struct KNO_MONGODB_LAZYDOC *doc = (kno_mongodb_lazydoc) obj;
+  struct KNO_MONGODB_LAZYINDEX *index = lazydoc_index(doc);
+  if (index == NULL) return -1;
+  int i = lazydoc_find(index,key);
+  if (i < 0) return 0;
+  lispval v = lazydoc_value(doc,index,i);
+  if ( (KNO_VOIDP(v)) || (KNO_EMPTYP(v)) )
+    return 0;
+  else if (KNO_VOIDP(val))
+    return 1;
+  else return kno_overlapp(v,val);
+}
+
+static int lazydoc_getsize(lispval obj)
+{
+  struct KNO_MONGODB_LAZYDOC *doc = (kno_mongodb_lazydoc) obj;
+  struct KNO_MONGODB_LAZYINDEX *index = lazydoc_index(doc);
+  if (index == NULL) return -1;
+  else return index->lazy_n_fields;
+}
+
+static lispval lazydoc_keys(lispval obj)
+{
+  struct KNO_MONGODB_LAZYDOC *doc = (kno_mongodb_lazydoc) obj;
+  struct KNO_MONGODB_LAZYINDEX *index = lazydoc_index(doc);
+  if (index == NULL) return KNO_ERROR_VALUE;
+  lispval keys = KNO_EMPTY;
+  int i = 0, n = index->lazy_n_fields;
+  while (i < n) {
+    lispval key = index->lazy_slotids[i++];
+    kno_incref(key);
+    KNO_ADD_TO_CHOICE(keys,key);}
+  return kno_simplify_choice(keys);
+}
+
+static struct KNO_TABLEFNS lazydoc_tablefns = {
+  .get = lazydoc_get,
+  .test = lazydoc_test,
+  .getsize = lazydoc_getsize,
+  .keys = lazydoc_keys};
+
+static void recycle_lazydoc(struct KNO_RAW_CONS *c)
+{
+  struct KNO_MONGODB_LAZYDOC *doc = (struct KNO_MONGODB_LAZYDOC *)c;
+  if (doc->lazydoc_index) free_lazyindex(doc->lazydoc_index);
+  if (doc->lazydoc_bson) bson_destroy(doc->lazydoc_bson);
+  kno_decref(doc->lazydoc_opts);
+  kno_decref(doc->lazydoc_fieldmap);
+  if (!(KNO_STATIC_CONSP(c))) u8_free(c);
+}
+static int unparse_lazydoc(struct U8_OUTPUT *out,lispval x)
+{
+  struct KNO_MONGODB_LAZYDOC *doc = (struct KNO_MONGODB_LAZYDOC *)x;
+  u8_printf(out,"#<MongoDB/Document %d fields>",
+	    bson_count_keys(doc->lazydoc_bson));
+  return 1;
+}
+
+static lispval bson2lisp(bson_t *in,int flags,lispval opts,
+			 struct KNO_BSON_FIELDCACHE *fc,
+			 struct KNO_BSON_ARENA *arena)
 {
   bson_iter_t iter;
   if (flags<0) flags = getflags(opts,KNO_MONGODB_DEFAULTS);
+  if (flags&KNO_MONGODB_LAZY) return make_lazydoc(in,flags,opts);
   memset(&iter,0,sizeof(bson_iter_t));
   if (bson_iter_init(&iter,in)) {
     lispval result, fieldmap = kno_getopt(opts,fieldmap_symbol,KNO_VOID);
@@ -3501,13 +9025,243 @@ KNO_EXPORT lispval kno_bson2lisp(bson_t *in,int flags,lispval opts)
     memset(&b,0,sizeof(struct KNO_BSON_INPUT));
     b.bson_iter = &iter; b.bson_flags = flags;
     b.bson_opts = opts; b.bson_fieldmap = fieldmap;
-    result = kno_init_slotmap(NULL,0,NULL);
-    while (bson_iter_next(&iter)) bson_read_step(b,flags,result,NULL);
+    b.bson_fieldcache = (use_fieldcache(fc,fieldmap,opts)) ? (fc) : (NULL);
+    b.bson_arena = arena;
+    result = bson_read_document(b,flags,NULL);
     kno_decref(fieldmap);
     return result;}
   else return kno_err(kno_BSON_Input_Error,"kno_bson2lisp",NULL,KNO_VOID);
 }
 
+KNO_EXPORT lispval kno_bson2lisp(bson_t *in,int flags,lispval opts)
+{
+  return bson2lisp(in,flags,opts,NULL,NULL);
+}
+
+/* Parallel decoding */
+
+/* In parallel mode, batches of documents (copied out of the cursor)
+   are split into chunks which are decoded by a pool of decoder
+   threads together with the calling thread. Results are stored by
+   position, so they come back in cursor order. Decoder threads don't
+   run any Lisp code, so parallel decoding is only used when there
+   aren't any fieldmap functions to apply.
+
+   The threads are started when parallel decoding is first used.
+   Setting MONGODB:DECODERS after that starts more threads or lets
+   idle ones exit, and all of them are stopped when the process
+   exits. */
+
+#define DECODE_CHUNK_SIZE 16
+#define MAX_DECODERS 64
+
+struct BSON_DECODE_BATCH {
+  bson_t **batch_docs;
+  lispval *batch_results;
+  int batch_n, batch_flags;
+  lispval batch_opts;
+  int batch_claimed, batch_finished, batch_users;
+  struct BSON_DECODE_BATCH *batch_next;};
+
+static struct BSON_DECODE_BATCH *decode_queue = NULL;
+static u8_mutex decode_lock;
+static u8_condvar decode_work, decode_done;
+
+/* A negative value means one fewer than the number of processors */
+static int n_decoders = -1;
+static int decoders_started = 0;
+/* These are changed with decode_lock held */
+static int decoders_running = 0, decoders_wanted = 0;
+
+/* This decodes the next unclaimed chunk of *batch*, returning the
+   number of documents decoded. Documents which can't be decoded get
+   KNO_NULL results and are decoded again by the caller (in its own
+   thread) to signal the error. */
+static int decode_chunk(struct BSON_DECODE_BATCH *batch,
+			struct KNO_BSON_FIELDCACHE *fc,
+			struct KNO_BSON_ARENA *arena)
+{
+  int n = batch->batch_n;
+  int start = __atomic_fetch_add(&(batch->batch_claimed),DECODE_CHUNK_SIZE,
+				 __ATOMIC_ACQ_REL);
+  if (start >= n) return 0;
+  int end = start+DECODE_CHUNK_SIZE, i = start;
+  if (end > n) end = n;
+  while (i < end) {
+    lispval r = bson2lisp(batch->batch_docs[i],batch->batch_flags,
+			  batch->batch_opts,fc,arena);
+    if (KNO_ABORTP(r)) {
+      kno_clear_errors(0);
+      r = KNO_NULL;}
+    batch->batch_results[i++] = r;}
+  __atomic_add_fetch(&(batch->batch_finished),end-start,__ATOMIC_RELEASE);
+  return end-start;
+}
+
+/* Decoder threads use a fresh fieldcache for each batch they work
+   on, since batches come from unrelated cursors, flags and options. */
+static void *decoder_thread(void *ignored)
+{
+  struct KNO_BSON_ARENA arena;
+  init_bson_arena(&arena,bson_arena_size);
+  u8_lock_mutex(&decode_lock);
+  while (1) {
+    struct BSON_DECODE_BATCH *batch = decode_queue;
+    while ( (batch) &&
+	    ( (__atomic_load_n(&(batch->batch_claimed),__ATOMIC_ACQUIRE)) >=
+	      (batch->batch_n) ) )
+      batch = batch->batch_next;
+    if ( (batch == NULL) && (decoders_running > decoders_wanted) ) {
+      decoders_running--;
+      u8_condvar_broadcast(&decode_done);
+      break;}
+    else if (batch == NULL) {
+      u8_condvar_wait(&decode_work,&decode_lock);
+      continue;}
+    else NO_ELSE;
+    batch->batch_users++;
+    u8_unlock_mutex(&decode_lock);
+    struct KNO_BSON_FIELDCACHE *fc = new_fieldcache();
+    while (decode_chunk(batch,fc,&arena)) {}
+    free_fieldcache(fc);
+    u8_lock_mutex(&decode_lock);
+    batch->batch_users--;
+    u8_condvar_broadcast(&decode_done);}
+  u8_unlock_mutex(&decode_lock);
+  free_bson_arena(&arena);
+  return NULL;
+}
+
+static int configured_decoders()
+{
+  int n = n_decoders;
+  if (n < 0) {
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n = (n_cpus > 1) ? (n_cpus-1) : (0);}
+  if (n > MAX_DECODERS) n = MAX_DECODERS;
+  return n;
+}
+
+/* This starts or stops decoder threads until there are *n* of them.
+   Threads which aren't wanted exit once they're idle. It is called
+   with decode_lock held. */
+static void resize_decoders(int n)
+{
+  __atomic_store_n(&decoders_wanted,n,__ATOMIC_RELEASE);
+  while (decoders_running < n) {
+    pthread_t thread;
+    int rv = mongodb_thread_create(&thread,decoder_thread,NULL);
+    if (rv) {
+      u8_logf(LOG_WARN,"MongoDB/Decoders",
+	      "Couldn't start decoder thread (%d/%d): %s",
+	      decoders_running+1,n,strerror(rv));
+      __atomic_store_n(&decoders_wanted,decoders_running,__ATOMIC_RELEASE);
+      break;}
+    pthread_detach(thread);
+    decoders_running++;}
+  if (decoders_running > decoders_wanted)
+    u8_condvar_broadcast(&decode_work);
+  u8_logf(LOG_INFO,"MongoDB/Decoders",
+	  "Using %d BSON decoder threads",decoders_wanted);
+}
+
+/* This starts the decoder threads (the first time it's called) and
+   returns the number of decoder threads */
+static int start_decoders()
+{
+  if (__atomic_load_n(&decoders_started,__ATOMIC_ACQUIRE))
+    return __atomic_load_n(&decoders_wanted,__ATOMIC_ACQUIRE);
+  u8_lock_mutex(&decode_lock);
+  if (decoders_started == 0) {
+    resize_decoders(configured_decoders());
+    __atomic_store_n(&decoders_started,1,__ATOMIC_RELEASE);}
+  int n = decoders_wanted;
+  u8_unlock_mutex(&decode_lock);
+  return n;
+}
+
+static int decoders_config_set(lispval var,lispval val,void *data)
+{
+  int rv = kno_intconfig_set(var,val,data);
+  if (rv < 0) return rv;
+  u8_lock_mutex(&decode_lock);
+  if (decoders_started) resize_decoders(configured_decoders());
+  u8_unlock_mutex(&decode_lock);
+  return rv;
+}
+
+/* This is called when the process exits and waits for the decoder
+   threads to finish */
+static void stop_decoders()
+{
+  u8_lock_mutex(&decode_lock);
+  __atomic_store_n(&decoders_wanted,0,__ATOMIC_RELEASE);
+  u8_condvar_broadcast(&decode_work);
+  while (decoders_running > 0)
+    u8_condvar_wait(&decode_done,&decode_lock);
+  u8_unlock_mutex(&decode_lock);
+}
+
+/* Returns 1 if documents read with *flags* and *opts* should be
+   decoded in parallel */
+static int parallel_decodingp(int flags,lispval opts)
+{
+  if ( (!(flags&KNO_MONGODB_PARALLEL)) || (flags&KNO_MONGODB_LAZY) )
+    return 0;
+  lispval fieldmap = kno_getopt(opts,fieldmap_symbol,KNO_VOID);
+  int ok = (KNO_VOIDP(fieldmap)) ||
+    ( (KNO_TYPEP(fieldmap,kno_mongoc_fieldmap)) &&
+      (((kno_mongodb_fieldmap)fieldmap)->fieldmap_n_mapfns == 0) );
+  kno_decref(fieldmap);
+  if (ok)
+    return (start_decoders() > 0);
+  else return 0;
+}
+
+/* This decodes *n* *docs* into *results*, sharing the work with the
+   decoder threads. It returns -1 (with nothing left in *results*) if
+   any document couldn't be decoded. */
+static int parallel_decode(bson_t **docs,int n,int flags,lispval opts,
+			   lispval *results,struct KNO_BSON_FIELDCACHE *fc,
+			   struct KNO_BSON_ARENA *arena)
+{
+  if (n == 0) return 0;
+  struct BSON_DECODE_BATCH batch = { 0 };
+  batch.batch_docs = docs;
+  batch.batch_results = results;
+  batch.batch_n = n;
+  batch.batch_flags = flags;
+  batch.batch_opts = opts;
+  if (n > DECODE_CHUNK_SIZE) {
+    u8_lock_mutex(&decode_lock);
+    batch.batch_next = decode_queue;
+    decode_queue = &batch;
+    u8_condvar_broadcast(&decode_work);
+    u8_unlock_mutex(&decode_lock);}
+  while (decode_chunk(&batch,fc,arena)) {}
+  if (n > DECODE_CHUNK_SIZE) {
+    u8_lock_mutex(&decode_lock);
+    struct BSON_DECODE_BATCH **scan = &decode_queue;
+    while (*scan != &batch) scan = &((*scan)->batch_next);
+    *scan = batch.batch_next;
+    while ( (batch.batch_users > 0) ||
+	    ( (__atomic_load_n(&(batch.batch_finished),__ATOMIC_ACQUIRE)) < n) )
+      u8_condvar_wait(&decode_done,&decode_lock);
+    u8_unlock_mutex(&decode_lock);}
+  int i = 0; while (i < n) {
+    if (results[i] == KNO_NULL) {
+      lispval r = bson2lisp(docs[i],flags,opts,fc,arena);
+      if (KNO_ABORTP(r)) {
+	int j = 0; while (j < n) {
+	  lispval v = results[j];
+	  if (v != KNO_NULL) kno_decref(v);
+	  results[j++] = KNO_VOID;}
+	return -1;}
+      else results[i] = r;}
+    i++;}
+  return n;
+}
+
 
 DEFC_PRIMN("mongovec",mongovec_lexpr,
 	   KNO_VAR_ARGS|KNO_MIN_ARGS(0)|KNO_AGGREGATE,
@@ -3694,11 +9448,59 @@ static lispval mongodb_getopts(lispval arg)
   else {
     kno_seterr(kno_TypeError,"mongodb_opts","MongoDB object",arg);
     return KNO_ERROR_VALUE;}
+  if (KNO_TYPEP(opts,kno_mongoc_opts))
+    opts = ((kno_mongodb_opts)opts)->opts_table;
   kno_incref(opts);
   return opts;
 }
 
 
+DEFC_PRIM("mongodb/opts",mongodb_compile_opts,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "Returns a compiled version of the options *opts*, which can be "
+	  "passed to any MongoDB primitive in place of *opts*. If *base* "
+	  "is a server or collection, the compiled options include its "
+	  "options. Given just a server, collection or cursor, this "
+	  "returns its options (like mongodb/getopts).",
+	  {"opts",kno_any_type,KNO_VOID},
+	  {"base",kno_any_type,KNO_VOID})
+static lispval mongodb_compile_opts(lispval opts,lispval base)
+{
+  if ( (KNO_VOIDP(base)) &&
+       ( (KNO_TYPEP(opts,kno_mongoc_server)) ||
+	 (KNO_TYPEP(opts,kno_mongoc_collection)) ||
+	 (KNO_TYPEP(opts,kno_mongoc_cursor)) ) )
+    return mongodb_getopts(opts);
+  lispval baseopts; int baseflags;
+  if (KNO_TYPEP(base,kno_mongoc_collection)) {
+    struct KNO_MONGODB_COLLECTION *coll =
+      (struct KNO_MONGODB_COLLECTION *)base;
+    baseopts = coll->collection_opts;
+    baseflags = coll->collection_flags;}
+  else if (KNO_TYPEP(base,kno_mongoc_server)) {
+    struct KNO_MONGODB_DATABASE *srv = (struct KNO_MONGODB_DATABASE *)base;
+    baseopts = srv->dbopts;
+    baseflags = srv->dbflags;}
+  else if ( (KNO_VOIDP(base)) || (KNO_FALSEP(base)) || (KNO_DEFAULTP(base)) ) {
+    baseopts = KNO_VOID;
+    baseflags = mongodb_defaults;}
+  else return kno_type_error("MongoDB server or collection",
+			     "mongodb_compile_opts",base);
+  if (KNO_TYPEP(opts,kno_mongoc_opts)) {
+    struct KNO_MONGODB_OPTS *c = (kno_mongodb_opts) opts;
+    if (c->opts_base == baseopts)
+      return kno_incref(opts);
+    else opts = c->opts_table;}
+  else if (!( (KNO_VOIDP(opts)) || (KNO_TABLEP(opts)) ||
+	      (KNO_PAIRP(opts)) ))
+    return kno_type_error("options","mongodb_compile_opts",opts);
+  int flags = getflags(opts,baseflags);
+  lispval combined = combine_opts(opts,baseopts);
+  lispval result = compile_opts(combined,opts,baseopts,flags);
+  kno_decref(combined);
+  return result;
+}
+
 DEFC_PRIM("mongodb/getdb",mongodb_getdb,
 	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
 	  "**undocumented**",
@@ -3857,6 +9659,125 @@ static lispval mongodb_getinfo(lispval mongodb,lispval field)
     return v;}
 }
 
+DEF_KNOSYM(pops); DEF_KNOSYM(nowait); DEF_KNOSYM(busy); DEF_KNOSYM(peak);
+DEF_KNOSYM(waittime); DEF_KNOSYM(waits); DEF_KNOSYM(shared);
+DEF_KNOSYM(warmups);
+
+DEFC_PRIM("mongodb/poolstats",mongodb_poolstats,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Returns a table of client pool statistics for the server "
+	  "used by *arg* (a server, collection, or cursor), including "
+	  "its *poolmin* if it has one. `warmups` counts the clients "
+	  "pinged to warm up the pool, which aren't counted as `pops`. "
+	  "`waits` is "
+	  "a histogram of the time spent getting clients, counting waits "
+	  "of under 10us, 100us, 1ms, 10ms, 100ms, 1s, 10s and longer.",
+	  {"arg",kno_any_type,KNO_VOID})
+static lispval mongodb_poolstats(lispval arg)
+{
+  struct KNO_MONGODB_DATABASE *db = NULL;
+  if (KNO_TYPEP(arg,kno_mongoc_server))
+    db = (struct KNO_MONGODB_DATABASE *)arg;
+  else if (KNO_TYPEP(arg,kno_mongoc_collection))
+    db = COLL2DB((struct KNO_MONGODB_COLLECTION *)arg);
+  else if (KNO_TYPEP(arg,kno_mongoc_cursor))
+    db = COLL2DB(CURSOR2COLL((struct KNO_MONGODB_CURSOR *)arg));
+  else return kno_type_error("MongoDB object","mongodb_poolstats",arg);
+  struct KNO_MONGODB_POOLSTATS *stats = &(db->dbpool->pool_stats);
+  lispval result = kno_make_slotmap(8,0,NULL);
+  lispval waits[KNO_MONGODB_WAIT_BUCKETS];
+  int i = 0; while (i < KNO_MONGODB_WAIT_BUCKETS) {
+    long long count = __atomic_load_n(&(stats->pool_waits[i]),__ATOMIC_RELAXED);
+    waits[i++] = KNO_INT(count);}
+  lispval waitvec = kno_make_vector(KNO_MONGODB_WAIT_BUCKETS,waits);
+  lispval pops = KNO_INT(stats->pool_pops);
+  lispval nowait = KNO_INT(stats->pool_nowait_fails);
+  lispval waittime = kno_make_double(stats->pool_wait_usecs/1000000.0);
+  lispval maxwait = kno_make_double(stats->pool_max_wait_usecs/1000000.0);
+  kno_store(result,KNOSYM(pops),pops);
+  kno_store(result,KNOSYM(nowait),nowait);
+  kno_store(result,KNOSYM(busy),KNO_INT(stats->pool_busy));
+  kno_store(result,KNOSYM(peak),KNO_INT(stats->pool_peak));
+  kno_store(result,KNOSYM(warmups),KNO_INT(stats->pool_warmups));
+  if (stats->pool_max)
+    kno_store(result,poolmaxsym,KNO_INT(stats->pool_max));
+  int poolmin = __atomic_load_n(&(db->dbpool->pool_min),__ATOMIC_RELAXED);
+  if (poolmin)
+    kno_store(result,KNOSYM(poolmin),KNO_INT(poolmin));
+  kno_store(result,KNOSYM(waittime),waittime);
+  kno_store(result,KNOSYM(maxwait),maxwait);
+  kno_store(result,KNOSYM(waits),waitvec);
+  if (db->dbpool->pool_lanes) {
+    struct KNO_MONGODB_LANES *lanes = db->dbpool->pool_lanes;
+    lispval busy = kno_make_slotmap(lanes->lanes_n+1,0,NULL);
+    u8_lock_mutex(&(lanes->lanes_lock));
+    int j = 0; while (j < lanes->lanes_n) {
+      struct KNO_MONGODB_LANE *lane = &(lanes->lanes[j++]);
+      kno_store(busy,lane->lane_name,KNO_INT(lane->lane_busy));}
+    kno_store(busy,KNOSYM(shared),KNO_INT(lanes->lanes_shared_busy));
+    u8_unlock_mutex(&(lanes->lanes_lock));
+    kno_store(result,KNOSYM(lanes),busy);
+    kno_decref(busy);}
+  kno_decref(pops); kno_decref(nowait);
+  kno_decref(waittime); kno_decref(maxwait);
+  kno_decref(waitvec);
+  return result;
+}
+
+DEF_KNOSYM(hits); DEF_KNOSYM(misses); DEF_KNOSYM(expired);
+DEF_KNOSYM(evictions); DEF_KNOSYM(invalidations); DEF_KNOSYM(entries);
+DEF_KNOSYM(bytes); DEF_KNOSYM(maxbytes); DEF_KNOSYM(ttl);
+
+DEFC_PRIM("collection/cachestats",collection_cachestats,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Returns a table of statistics for the query cache of "
+	  "*collection*, or #f if it doesn't have one.",
+	  {"collection",KNO_MONGOC_COLLECTION,KNO_VOID})
+static lispval collection_cachestats(lispval arg)
+{
+  struct KNO_MONGODB_COLLECTION *coll = (struct KNO_MONGODB_COLLECTION *)arg;
+  struct KNO_MONGODB_QCACHE *qc = coll->collection_qcache;
+  if (qc == NULL) return KNO_FALSE;
+  lispval result = kno_make_slotmap(9,0,NULL);
+  u8_lock_mutex(&(qc->qcache_lock));
+  lispval vals[8] = {
+    KNO_INT(qc->qcache_hits), KNO_INT(qc->qcache_misses),
+    KNO_INT(qc->qcache_expired), KNO_INT(qc->qcache_evictions),
+    KNO_INT(qc->qcache_invalidations), KNO_INT(qc->qcache_n_entries),
+    KNO_INT(qc->qcache_bytes), KNO_INT(qc->qcache_max_bytes) };
+  u8_unlock_mutex(&(qc->qcache_lock));
+  lispval ttl = kno_make_double(qc->qcache_ttl);
+  kno_store(result,KNOSYM(hits),vals[0]);
+  kno_store(result,KNOSYM(misses),vals[1]);
+  kno_store(result,KNOSYM(expired),vals[2]);
+  kno_store(result,KNOSYM(evictions),vals[3]);
+  kno_store(result,KNOSYM(invalidations),vals[4]);
+  kno_store(result,KNOSYM(entries),vals[5]);
+  kno_store(result,KNOSYM(bytes),vals[6]);
+  kno_store(result,KNOSYM(maxbytes),vals[7]);
+  kno_store(result,KNOSYM(ttl),ttl);
+  kno_decref_elts(vals,8);
+  kno_decref(ttl);
+  return result;
+}
+
+DEFC_PRIM("mongodb/lane!",mongodb_set_lane,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Sets the default priority lane for MongoDB operations in the "
+	  "current thread, returning the previous default (or #f). "
+	  "#f clears the default.",
+	  {"lane",kno_any_type,KNO_VOID})
+static lispval mongodb_set_lane(lispval lane)
+{
+  lispval prev = (lispval) u8_tld_get(thread_lane_key);
+  if (KNO_FALSEP(lane))
+    u8_tld_set(thread_lane_key,NULL);
+  else if (KNO_SYMBOLP(lane))
+    u8_tld_set(thread_lane_key,(void *)lane);
+  else return kno_type_error("lane name (symbol)","mongodb_set_lane",lane);
+  return (prev) ? (prev) : (KNO_FALSE);
+}
+
 /* MongoDB logging */
 
 static int getu8loglevel(mongoc_log_level_t l);
@@ -3916,6 +9837,23 @@ KNO_EXPORT int kno_init_mongodb()
 
   init_mongo_opmap();
 
+  bson_keycache_slotify = kno_make_hashtable(NULL,1024);
+  bson_keycache_raw = kno_make_hashtable(NULL,256);
+  u8_new_threadkey(&encode_plans_key,free_encode_plans);
+  u8_new_threadkey(&thread_clients_key,free_thread_clients);
+  u8_new_threadkey(&thread_lane_key,NULL);
+  u8_init_mutex(&slotprops_lock);
+  u8_init_mutex(&shared_schemas_lock);
+  u8_init_mutex(&decode_lock);
+  u8_init_mutex(&client_pools_lock);
+  u8_init_mutex(&flights_lock);
+  u8_init_mutex(&qcaches_lock);
+  u8_init_mutex(&intern_tables_lock);
+  u8_init_mutex(&thread_clients_lock);
+  u8_init_condvar(&thread_clients_wakeup);
+  u8_init_condvar(&decode_work);
+  u8_init_condvar(&decode_done);
+
   mongodb_module = kno_new_cmodule("mongodb",0,kno_init_mongodb);
 
   idsym = kno_intern("_id");
@@ -3984,6 +9922,7 @@ KNO_EXPORT int kno_init_mongodb()
   symslots_symbol = kno_intern("symslots");
   choiceslots_symbol = kno_intern("choiceslots");
   rawslots_symbol = kno_intern("rawslots");
+  internslots_symbol = kno_intern("internslots");
 
   mongo_timestamp_tag = kno_intern("mongotime");
 
@@ -3996,14 +9935,37 @@ KNO_EXPORT int kno_init_mongodb()
     kno_register_cons_type("mongoc_collection",KNO_MONGOC_COLLECTION);
   kno_mongoc_cursor =
     kno_register_cons_type("mongoc_cursor",KNO_MONGOC_CURSOR);
+  kno_mongoc_fieldmap =
+    kno_register_cons_type("mongoc_fieldmap",KNO_MONGOC_FIELDMAP);
+  kno_mongoc_lazydoc =
+    kno_register_cons_type("mongoc_lazydoc",KNO_MONGOC_LAZYDOC);
+  kno_mongoc_param =
+    kno_register_cons_type("mongoc_param",KNO_MONGOC_PARAM);
+  kno_mongoc_prepared =
+    kno_register_cons_type("mongoc_prepared",KNO_MONGOC_PREPARED);
+  kno_mongoc_opts =
+    kno_register_cons_type("mongoc_opts",KNO_MONGOC_OPTS);
 
   kno_recyclers[kno_mongoc_server]=recycle_server;
   kno_recyclers[kno_mongoc_collection]=recycle_collection;
   kno_recyclers[kno_mongoc_cursor]=recycle_cursor;
+  kno_recyclers[kno_mongoc_fieldmap]=recycle_fieldmap;
+  kno_recyclers[kno_mongoc_lazydoc]=recycle_lazydoc;
+  kno_recyclers[kno_mongoc_param]=recycle_param;
+  kno_recyclers[kno_mongoc_prepared]=recycle_prepared;
+  kno_recyclers[kno_mongoc_opts]=recycle_compiled_opts;
 
   kno_unparsers[kno_mongoc_server]=unparse_server;
   kno_unparsers[kno_mongoc_collection]=unparse_collection;
   kno_unparsers[kno_mongoc_cursor]=unparse_cursor;
+  kno_unparsers[kno_mongoc_fieldmap]=unparse_fieldmap;
+  kno_unparsers[kno_mongoc_lazydoc]=unparse_lazydoc;
+  kno_unparsers[kno_mongoc_param]=unparse_param;
+  kno_unparsers[kno_mongoc_prepared]=unparse_prepared;
+  kno_unparsers[kno_mongoc_opts]=unparse_compiled_opts;
+
+  kno_tablefns[kno_mongoc_lazydoc]=&lazydoc_tablefns;
+  kno_tablefns[kno_mongoc_opts]=&compiled_opts_tablefns;
 
   link_local_cprims();
 
@@ -4045,11 +10007,116 @@ KNO_EXPORT int kno_init_mongodb()
 
   kno_register_config("MONGODB:MULTISLOTS",
 		      "Which slots should always have vector values",
-		      multislots_config_get,multislots_config_add,NULL);
+		      slotprops_config_get,slotprops_config_add,
+		      (void *)KNO_MONGODB_CHOICESLOT);
   kno_register_config("MONGODB:CHOICESLOTS",
 		      "Alias for MONGODB:MULTISLOTS: Which slots should "
 		      "always have vector values",
-		      multislots_config_get,multislots_config_add,NULL);
+		      slotprops_config_get,slotprops_config_add,
+		      (void *)KNO_MONGODB_CHOICESLOT);
+  kno_register_config("MONGODB:SYMSLOTS",
+		      "Which slots should have their values stored as symbols",
+		      slotprops_config_get,slotprops_config_add,
+		      (void *)KNO_MONGODB_SYMSLOT);
+  kno_register_config("MONGODB:RAWSLOTS",
+		      "Which slots should have their values stored without "
+		      "colonization",
+		      slotprops_config_get,slotprops_config_add,
+		      (void *)KNO_MONGODB_RAWSLOT);
+  kno_register_config("MONGODB:PREFCHOICES",
+		      "Which slots should treat arrays as choices",
+		      slotprops_config_get,slotprops_config_add,
+		      (void *)KNO_MONGODB_PREFCHOICES);
+  kno_register_config("MONGODB:VECSLOTS",
+		      "Which slots should treat arrays as vectors",
+		      slotprops_config_get,slotprops_config_add,
+		      (void *)KNO_MONGODB_VECSLOT);
+  kno_register_config("MONGODB:INTERNSLOTS",
+		      "Which slots should share strings for repeated values",
+		      slotprops_config_get,slotprops_config_add,
+		      (void *)KNO_MONGODB_INTERNSLOT);
+  kno_register_config("MONGODB:INTERNMAX",
+		      "Max number of distinct values to intern for each "
+		      "internslot (0 disables)",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &interns_max_values);
+
+  kno_register_config("MONGODB:MAXSCHEMAS",
+		      "Max number of shared schemas for decoded schemaps",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &max_shared_schemas);
+  kno_register_config("MONGODB:ARENA",
+		      "Bytes of scratch space for decoding each batch of "
+		      "documents (0 disables)",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &bson_arena_size);
+  kno_register_config("MONGODB:DECODERS",
+		      "Number of threads for decoding documents in parallel "
+		      "mode (negative means one fewer than the number of "
+		      "processors)",
+		      kno_intconfig_get,decoders_config_set,
+		      &n_decoders);
+  kno_register_config("MONGODB:GETN:CHUNKBYTES",
+		      "Max bytes of keys in each query made by collection/getn",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &getn_chunk_bytes);
+  kno_register_config("MONGODB:GETN:THREADS",
+		      "Max number of concurrent queries made by collection/getn",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &getn_threads);
+  kno_register_config("MONGODB:PSCAN:THREADS",
+		      "Default number of threads (and clients) used by "
+		      "collection/pscan",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &pscan_threads);
+  kno_register_config("MONGODB:PSCAN:QUEUE",
+		      "Max number of documents queued by collection/pscan "
+		      "threads for the calling thread",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &pscan_queue_max);
+  kno_register_config("MONGODB:PREFETCH:BATCH",
+		      "Default number of documents in each batch decoded "
+		      "by prefetching cursors",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &prefetch_batch);
+  kno_register_config("MONGODB:SHARED:MAXBATCH",
+		      "Max number of documents in each batch taken from a "
+		      "shared cursor by cursor/next-batch",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &shared_batch_max);
+  kno_register_config("MONGODB:COALESCE:WINDOW",
+		      "Default time (in microseconds) to wait for more "
+		      "keys when coalescing collection/get calls",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &coalesce_usecs);
+  kno_register_config("MONGODB:COALESCE:MAX",
+		      "Default max number of keys in each coalesced fetch",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &coalesce_max);
+  kno_register_config("MONGODB:CACHE:MAXBYTES",
+		      "Default max (estimated) bytes of results to keep in "
+		      "each collection's query cache",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &qcache_max_bytes);
+  kno_register_config("MONGODB:CACHE:TTL",
+		      "Default time (in seconds) to keep cached query results",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &qcache_ttl);
+  kno_register_config("MONGODB:FIELDCACHE",
+		      "Max number of field names to cache for each cursor "
+		      "(0 disables)",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &fieldcache_max_fields);
+  kno_register_config("MONGODB:KEYCACHE",
+		      "Max number of translated BSON keys to cache (0 disables)",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &bson_keycache_max);
+
+  kno_register_config("MONGODB:ENCODEPLANS",
+		      "Whether to compile and cache encode plans for "
+		      "repeated document shapes",
+		      kno_boolconfig_get,kno_boolconfig_set,
+		      &use_encode_plans);
 
   kno_register_config("MONGODB:SOCKET_TIMEOUT",
 		      "Default socket timeout for mongodb",
@@ -4071,23 +10138,42 @@ KNO_EXPORT int kno_init_mongodb()
 		      "Default max connection pools limit for mongodb",
 		      kno_intconfig_get,kno_intconfig_set,
 		      &default_maxpools_limit);
+  kno_register_config("MONGODB:KEEPER:INTERVAL",
+		      "How often (in seconds) pool keepers check that "
+		      "*poolmin* clients are connected",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &pool_keeper_interval);
+  kno_register_config("MONGODB:AFFINITY:IDLE",
+		      "How many seconds a thread keeps an unused client "
+		      "for servers or collections with the `affinity` "
+		      "option (negative means until the thread exits)",
+		      kno_intconfig_get,kno_intconfig_set,
+		      &thread_client_idle);
+  kno_register_config("MONGODB:AFFINITY:SWEEP",
+		      "How often (in seconds) to release idle thread "
+		      "clients (negative means half of "
+		      "MONGODB:AFFINITY:IDLE)",
+		      kno_intconfig_get,thread_client_sweep_config_set,
+		      &thread_client_sweep);
   kno_register_config("MONGODB:THREADS:RECKLESS",
 		      "Whether to ignore thread-safety for cursors",
 		      kno_boolconfig_get,kno_boolconfig_set,
 		      &reckless_threading);
 
-  add_choiceslot(kno_intern("$each"));
-  add_choiceslot(kno_intern("$in"));
-  add_choiceslot(kno_intern("$nin"));
-  add_choiceslot(kno_intern("$all"));
-  add_choiceslot(kno_intern("$and"));
-  add_choiceslot(kno_intern("$or"));
-  add_choiceslot(kno_intern("$nor"));
+  set_slotprops(kno_intern("$each"),KNO_MONGODB_CHOICESLOT,0);
+  set_slotprops(kno_intern("$in"),KNO_MONGODB_CHOICESLOT,0);
+  set_slotprops(kno_intern("$nin"),KNO_MONGODB_CHOICESLOT,0);
+  set_slotprops(kno_intern("$all"),KNO_MONGODB_CHOICESLOT,0);
+  set_slotprops(kno_intern("$and"),KNO_MONGODB_CHOICESLOT,0);
+  set_slotprops(kno_intern("$or"),KNO_MONGODB_CHOICESLOT,0);
+  set_slotprops(kno_intern("$nor"),KNO_MONGODB_CHOICESLOT,0);
 
   kno_finish_module(mongodb_module);
 
   mongoc_init();
   atexit(mongoc_cleanup);
+  atexit(stop_decoders);
+  atexit(stop_thread_client_sweeper);
 
   strcpy(mongoc_version_string,"libmongoc ");
   strcat(mongoc_version_string,MONGOC_VERSION_S);
@@ -4116,11 +10202,16 @@ static void link_local_cprims()
   KNO_LINK_CPRIM("mongodb/collection?",mongodb_collectionp,1,mongodb_module);
   KNO_LINK_CPRIM("mongodb/getdb",mongodb_getdb,1,mongodb_module);
   KNO_LINK_CPRIM("mongodb/getopts",mongodb_getopts,1,mongodb_module);
+  KNO_LINK_CPRIM("mongodb/opts",mongodb_compile_opts,2,mongodb_module);
 
   KNO_LINK_CPRIM("mongodb/dburi",mongodb_uri,1,mongodb_module);
   KNO_LINK_CPRIM("mongodb/dbspec",mongodb_spec,1,mongodb_module);
   KNO_LINK_CPRIM("mongodb/dbname",mongodb_dbname,1,mongodb_module);
   KNO_LINK_CPRIM("mongodb/dbinfo",mongodb_getinfo,2,mongodb_module);
+  KNO_LINK_CPRIM("mongodb/poolstats",mongodb_poolstats,1,mongodb_module);
+  KNO_LINK_CPRIM("mongodb/lane!",mongodb_set_lane,1,mongodb_module);
+  KNO_LINK_CPRIM("collection/cachestats",collection_cachestats,1,mongodb_module);
+  KNO_LINK_CPRIM("mongodb/fieldmap",mongodb_fieldmap,1,mongodb_module);
 
   KNO_LINK_CPRIM("mongovec?",mongovecp,1,mongodb_module);
   KNO_LINK_CPRIM("->mongovec",make_mongovec,1,mongodb_module);
@@ -4130,8 +10221,11 @@ static void link_local_cprims()
   KNO_LINK_CPRIM("collection/open",mongodb_collection,3,mongodb_module);
   KNO_LINK_CPRIM("collection/name",mongodb_collection_name,1,mongodb_module);
   KNO_LINK_CPRIM("collection/get",collection_get,3,mongodb_module);
+  KNO_LINK_CPRIM("collection/getn",collection_getn,3,mongodb_module);
   KNO_LINK_CPRIM("collection/count",collection_count,3,mongodb_module);
   KNO_LINK_CPRIM("collection/find",collection_find,3,mongodb_module);
+  KNO_LINK_CPRIM("collection/foreach",collection_foreach,5,mongodb_module);
+  KNO_LINK_CPRIM("collection/pscan",collection_pscan,5,mongodb_module);
   KNO_LINK_CPRIM("collection/modify!",collection_modify,4,mongodb_module);
   KNO_LINK_CPRIM("collection/upsert!",collection_upsert,4,mongodb_module);
   KNO_LINK_CPRIM("collection/update!",collection_update,4,mongodb_module);
@@ -4139,6 +10233,9 @@ static void link_local_cprims()
   KNO_LINK_CPRIM("collection/insert!",collection_insert,3,mongodb_module);
   KNO_LINK_CPRIM("collection/open",mongodb_collection,3,mongodb_module);
   KNO_LINK_CPRIM("collection/oidslot",collection_oidslot,1,mongodb_module);
+  KNO_LINK_CPRIM("mongodb/param",mongodb_param,1,mongodb_module);
+  KNO_LINK_CPRIM("collection/prepare",collection_prepare,3,mongodb_module);
+  KNO_LINK_CPRIM("collection/execute",collection_execute,2,mongodb_module);
   KNO_LINK_ALIAS("mongodb/collection",mongodb_collection,mongodb_module);
 
   KNO_LINK_CPRIM("mongodb/cursor",mongodb_cursor,3,mongodb_module);
@@ -4146,6 +10243,8 @@ static void link_local_cprims()
   KNO_LINK_CPRIM("cursor/skipcount",cursor_skipcount,1,mongodb_module);
   KNO_LINK_CPRIM("cursor/readcount",cursor_readcount,1,mongodb_module);
   KNO_LINK_CPRIM("cursor/readvec",cursor_readvec,3,mongodb_module);
+  KNO_LINK_CPRIM("cursor/foreach",cursor_foreach,4,mongodb_module);
+  KNO_LINK_CPRIM("cursor/next-batch",cursor_next_batch,3,mongodb_module);
   KNO_LINK_CPRIM("cursor/read",cursor_read,3,mongodb_module);
   KNO_LINK_CPRIM("cursor/skip",cursor_skip,2,mongodb_module);
   KNO_LINK_CPRIM("cursor/close",cursor_close,1,mongodb_module);
@@ -4191,5 +10290,4 @@ static void link_local_cprims()
 
   KNO_LINK_ALIAS("mongodb/spec",mongodb_spec,mongodb_module);
   KNO_LINK_ALIAS("mongodb/uri",mongodb_uri,mongodb_module);
-  KNO_LINK_ALIAS("mongodb/opts",mongodb_getopts,mongodb_module);
 }
@@ -25,8 +25,18 @@
 #define KNO_MONGODB_CHOICESLOT    0x00008
 #define KNO_MONGODB_SYMSLOT       0x00010
 #define KNO_MONGODB_RAWSLOT       0x00020
+#define KNO_MONGODB_VECSLOT       0x00040
+#define KNO_MONGODB_SCHEMAPS      0x00080
+#define KNO_MONGODB_LAZY          0x00100
+#define KNO_MONGODB_PARALLEL      0x00200
+#define KNO_MONGODB_INTERNSLOT    0x00400
 #define KNO_MONGODB_NOBLOCK       0x10000
 #define KNO_MONGODB_LOGOPS	  0x20000
+#define KNO_MONGODB_AFFINITY      0x40000
+#define KNO_MONGODB_SINGLEFLIGHT  0x80000
+/* Set while collection/prepare encodes a query, since parameters
+   can't be written anywhere else */
+#define KNO_MONGODB_PREPARING     0x100000
 
 #define KNO_MONGODB_DEFAULTS (KNO_MONGODB_COLONIZE    | KNO_MONGODB_SLOTIFY)
 
@@ -36,26 +46,230 @@
 
 KNO_EXPORT u8_condition kno_MongoDB_Error, kno_MongoDB_Warning;
 KNO_EXPORT kno_lisp_type kno_mongoc_server, kno_mongoc_collection, kno_mongoc_cursor;
+KNO_EXPORT kno_lisp_type kno_mongoc_fieldmap, kno_mongoc_lazydoc;
+KNO_EXPORT kno_lisp_type kno_mongoc_param, kno_mongoc_prepared;
+KNO_EXPORT kno_lisp_type kno_mongoc_opts;
 
 typedef struct KNO_BSON_OUTPUT {
   bson_t *bson_doc;
   lispval bson_opts, bson_fieldmap;
   int bson_flags;} KNO_BSON_OUTPUT;
+/* Intern tables hold the distinct string values read for a slot, so
+   that repeated values can share a single string. They are emptied
+   and start over when they fill up. */
+typedef struct KNO_MONGODB_INTERNS {
+  lispval interns_slot;
+  int interns_n_values, interns_max_values, interns_n_buckets;
+  lispval *interns_values;
+  u8_rwlock interns_lock;
+  struct KNO_MONGODB_INTERNS *interns_next;} KNO_MONGODB_INTERNS;
+typedef struct KNO_MONGODB_INTERNS *kno_mongodb_interns;
+
+/* Field caches map BSON field names (as stored) to the slotids and
+   flags used when decoding them. They belong to a single decoding
+   context (like a cursor) and are not thread-safe. */
+typedef struct KNO_BSON_FIELDINFO {
+  unsigned int field_hash;
+  size_t field_len;
+  u8_byte *field_name;
+  int field_inflags, field_flags;
+  short field_symslot, field_choiceslot;
+  lispval field_slotid, field_mapfn;
+  struct KNO_MONGODB_INTERNS *field_interns;} KNO_BSON_FIELDINFO;
+typedef struct KNO_BSON_FIELDINFO *kno_bson_fieldinfo;
+
+typedef struct KNO_BSON_FIELDCACHE {
+  int fieldcache_n_buckets, fieldcache_n_fields;
+  unsigned int fieldcache_generation;
+  lispval fieldcache_fieldmap, fieldcache_internslots;
+  struct KNO_BSON_FIELDINFO *fieldcache_fields;} KNO_BSON_FIELDCACHE;
+typedef struct KNO_BSON_FIELDCACHE *kno_bson_fieldcache;
+
+/* Arenas provide scratch space for decoding batches of documents */
+typedef struct KNO_BSON_ARENA {
+  unsigned char *arena_data;
+  size_t arena_size, arena_used;} KNO_BSON_ARENA;
+typedef struct KNO_BSON_ARENA *kno_bson_arena;
+
 typedef struct KNO_BSON_INPUT {
   bson_iter_t *bson_iter;
   lispval bson_opts, bson_fieldmap;
-  int bson_flags;} KNO_BSON_INPUT;
+  int bson_flags;
+  struct KNO_BSON_FIELDCACHE *bson_fieldcache;
+  struct KNO_BSON_ARENA *bson_arena;
+  struct KNO_MONGODB_INTERNS *bson_interns;} KNO_BSON_INPUT;
 typedef struct KNO_BSON_INPUT *kno_bson_input;
 
+/* Slot info entries are used in compiled fieldmaps; slot_flags
+   combines KNO_MONGODB_RAWSLOT, KNO_MONGODB_SYMSLOT,
+   KNO_MONGODB_CHOICESLOT and KNO_MONGODB_INTERNSLOT, and slot_mapfn
+   is the fieldmap function (if any) for the slot. Empty entries have
+   a VOID slot_key. */
+typedef struct KNO_MONGODB_SLOTINFO {
+  lispval slot_key;
+  int slot_flags;
+  lispval slot_mapfn;} KNO_MONGODB_SLOTINFO;
+typedef struct KNO_MONGODB_SLOTINFO *kno_mongodb_slotinfo;
+
+typedef struct KNO_MONGODB_FIELDMAP {
+  KNO_CONS_HEADER;
+  lispval fieldmap_source;
+  int fieldmap_n_slots, fieldmap_n_buckets;
+  int fieldmap_string_keys, fieldmap_n_mapfns;
+  struct KNO_MONGODB_SLOTINFO *fieldmap_slots;} KNO_MONGODB_FIELDMAP;
+typedef struct KNO_MONGODB_FIELDMAP *kno_mongodb_fieldmap;
+
+/* Lazy documents keep the BSON for a document and decode fields on
+   demand. The index is built on first access; lazy_values are KNO_NULL
+   until the corresponding field has been decoded. */
+typedef struct KNO_MONGODB_LAZYINDEX {
+  int lazy_n_fields;
+  lispval *lazy_slotids;
+  lispval *lazy_values;
+  bson_iter_t *lazy_iters;} KNO_MONGODB_LAZYINDEX;
+
+typedef struct KNO_MONGODB_LAZYDOC {
+  KNO_CONS_HEADER;
+  bson_t *lazydoc_bson;
+  int lazydoc_flags;
+  lispval lazydoc_opts, lazydoc_fieldmap;
+  struct KNO_MONGODB_LAZYINDEX *lazydoc_index;} KNO_MONGODB_LAZYDOC;
+typedef struct KNO_MONGODB_LAZYDOC *kno_mongodb_lazydoc;
+
+/* Prepared queries keep their query encoded as BSON, with parameters
+   encoded as user binary values referring to the parameter objects
+   in prepared_params. prepared_sites records where each parameter
+   was written, together with the offsets of the lengths of the
+   documents containing it, so that executing the query only has to
+   encode the bound values. */
+typedef struct KNO_MONGODB_PARAM {
+  KNO_CONS_HEADER;
+  lispval param_name;} KNO_MONGODB_PARAM;
+typedef struct KNO_MONGODB_PARAM *kno_mongodb_param;
+
+#define KNO_MONGODB_PARAM_DEPTH 16
+typedef struct KNO_MONGODB_PARAM_SITE {
+  lispval site_param;
+  uint32_t site_start, site_end;
+  int site_n_parents;
+  uint32_t site_parents[KNO_MONGODB_PARAM_DEPTH];} KNO_MONGODB_PARAM_SITE;
+
+typedef struct KNO_MONGODB_PREPARED {
+  KNO_CONS_HEADER;
+  lispval prepared_coll, prepared_query;
+  lispval prepared_opts, prepared_fieldmap;
+  int prepared_flags, prepared_sorted, prepared_n_params;
+  int prepared_n_sites;
+  lispval *prepared_params;
+  struct KNO_MONGODB_PARAM_SITE *prepared_sites;
+  bson_t *prepared_bson, *prepared_findopts;
+  mongoc_read_prefs_t *prepared_readprefs;} KNO_MONGODB_PREPARED;
+typedef struct KNO_MONGODB_PREPARED *kno_mongodb_prepared;
+
+/* Compiled options, made by mongodb/opts. The encoded search options
+   and read preferences are only used while the slot property configs
+   and MONGODB:FLAGS are as they were when they were compiled
+   (opts_generation and opts_defaults). */
+typedef struct KNO_MONGODB_OPTS {
+  KNO_CONS_HEADER;
+  lispval opts_table, opts_base, opts_fieldmap;
+  int opts_flags, opts_setflags, opts_keepflags;
+  unsigned int opts_generation;
+  int opts_defaults;
+  bson_t *opts_findopts, *opts_countopts;
+  mongoc_read_prefs_t *opts_readprefs;
+  mongoc_write_concern_t *opts_writeconcern;} KNO_MONGODB_OPTS;
+typedef struct KNO_MONGODB_OPTS *kno_mongodb_opts;
+
+/* Client pool statistics, which are updated atomically. pool_waits
+   is a histogram of the time spent popping clients, with buckets for
+   under 10us, 100us, 1ms, 10ms, 100ms, 1s and 10s, and for 10s or
+   more. pool_warmups counts the clients pinged to warm up the pool,
+   which aren't counted in pool_pops. */
+#define KNO_MONGODB_WAIT_BUCKETS 8
+typedef struct KNO_MONGODB_POOLSTATS {
+  long long pool_pops, pool_nowait_fails, pool_warmups;
+  long long pool_wait_usecs, pool_max_wait_usecs;
+  int pool_max, pool_busy, pool_peak;
+  long long pool_waits[KNO_MONGODB_WAIT_BUCKETS];} KNO_MONGODB_POOLSTATS;
+
+/* Client pools are shared by all the servers opened with the same
+   (normalized) URI, TLS options, poolmax and lanes. pool_min is the
+   largest of the poolmins (in pool_mins) of the servers using the
+   pool. */
+typedef struct KNO_MONGODB_POOL {
+  u8_string pool_key;
+  int pool_refcount;
+  mongoc_client_pool_t *pool_clients;
+  struct KNO_MONGODB_POOLSTATS pool_stats;
+  struct KNO_MONGODB_LANES *pool_lanes;
+  int pool_min, pool_keeper_state;
+  int *pool_mins, pool_n_mins, pool_mins_len;
+  pthread_t pool_keeper;
+  u8_mutex pool_keeper_lock;
+  u8_condvar pool_keeper_wakeup;
+  struct KNO_MONGODB_POOL *pool_next;} KNO_MONGODB_POOL;
+typedef struct KNO_MONGODB_POOL *kno_mongodb_pool;
+
+/* Priority lanes reserve some of a pool's clients for the operations
+   in each lane. Operations outside of any lane (or beyond their
+   lane's reservation) share whatever isn't reserved. lanes_clients
+   records the lane (or -1 for shared) of each client in use. */
+typedef struct KNO_MONGODB_LANE {
+  lispval lane_name;
+  int lane_reserved, lane_busy;} KNO_MONGODB_LANE;
+
+typedef struct KNO_MONGODB_LANE_CLIENT {
+  mongoc_client_t *lane_client;
+  int lane_index;} KNO_MONGODB_LANE_CLIENT;
+
+typedef struct KNO_MONGODB_LANES {
+  int lanes_n, lanes_shared, lanes_shared_busy, lanes_max_clients;
+  struct KNO_MONGODB_LANE *lanes;
+  struct KNO_MONGODB_LANE_CLIENT *lanes_clients;
+  u8_mutex lanes_lock;
+  u8_condvar lanes_free;} KNO_MONGODB_LANES;
+typedef struct KNO_MONGODB_LANES *kno_mongodb_lanes;
+
 typedef struct KNO_MONGODB_DATABASE {
   KNO_CONS_HEADER;
   u8_string dburi, dbname, dbspec;
   lispval dbopts;
-  int dbflags;
+  int dbflags, dbpoolmin;
   mongoc_client_pool_t *dbclients;
-  mongoc_uri_t *dburi_info;} KNO_MONGODB_DATABASE;
+  mongoc_uri_t *dburi_info;
+  struct KNO_MONGODB_POOL *dbpool;} KNO_MONGODB_DATABASE;
 typedef struct KNO_MONGODB_DATABASE *kno_mongodb_database;
 
+/* Coalescers combine concurrent collection/get calls on a collection
+   into single `$in` queries. coalesce_batch is the batch (if any)
+   which is still accepting keys. */
+typedef struct KNO_MONGODB_COALESCER {
+  int coalesce_usecs, coalesce_max;
+  u8_mutex coalesce_lock;
+  struct MONGODB_COALESCE_BATCH *coalesce_batch;} KNO_MONGODB_COALESCER;
+typedef struct KNO_MONGODB_COALESCER *kno_mongodb_coalescer;
+
+/* Query caches keep the results of finds and gets on a collection for
+   qcache_ttl seconds, evicting the least recently used results to stay
+   under qcache_max_bytes (as estimated). Writes to the collection from
+   this process clear the cache and bump qcache_generation, so results
+   fetched before a write aren't stored after it. */
+typedef struct KNO_MONGODB_QCACHE {
+  size_t qcache_max_bytes, qcache_bytes;
+  double qcache_ttl;
+  int qcache_n_entries;
+  unsigned int qcache_generation;
+  long long qcache_hits, qcache_misses, qcache_expired;
+  long long qcache_evictions, qcache_invalidations;
+  u8_mutex qcache_lock;
+  struct KNO_MONGODB_POOL *qcache_pool;
+  u8_string qcache_dbname, qcache_collection;
+  struct MONGODB_QCACHE_ENTRY **qcache_buckets;
+  struct MONGODB_QCACHE_ENTRY *qcache_newest, *qcache_oldest;
+  struct KNO_MONGODB_QCACHE *qcache_next;} KNO_MONGODB_QCACHE;
+typedef struct KNO_MONGODB_QCACHE *kno_mongodb_qcache;
+
 typedef struct KNO_MONGODB_COLLECTION {
   KNO_CONS_HEADER;
   u8_string collection_name;
@@ -63,10 +277,50 @@ typedef struct KNO_MONGODB_COLLECTION {
   lispval collection_opts;
   lispval collection_oidslot;
   u8_string collection_oidkey;
-  int collection_flags;}
+  int collection_flags;
+  struct KNO_MONGODB_COALESCER *collection_coalescer;
+  struct KNO_MONGODB_QCACHE *collection_qcache;}
   KNO_MONGODB_COLLECTION;
 typedef struct KNO_MONGODB_COLLECTION *kno_mongodb_collection;
 
+/* Cursors opened with the `prefetch` option have a worker thread
+   which owns the mongoc cursor and keeps up to prefetch_limit decoded
+   batches (vectors) in prefetch_ring, which has prefetch_size slots.
+   The worker only advances prefetch_tail and the cursor's reader only
+   advances prefetch_head; prefetch_current is the batch the reader is
+   taking documents from. */
+typedef struct KNO_MONGODB_PREFETCH {
+  int prefetch_size, prefetch_limit, prefetch_batch;
+  lispval *prefetch_ring;
+  unsigned int prefetch_head, prefetch_tail;
+  int prefetch_done, prefetch_stop, prefetch_waiting;
+  /* The worker's error (if any), which the reader signals again */
+  struct MONGODB_THREAD_ERROR *prefetch_error;
+  lispval prefetch_current;
+  int prefetch_offset;
+  u8_mutex prefetch_lock;
+  u8_condvar prefetch_wakeup;
+  pthread_t prefetch_thread;} KNO_MONGODB_PREFETCH;
+typedef struct KNO_MONGODB_PREFETCH *kno_mongodb_prefetch;
+
+/* Shared cursors (opened with the `shared` option) can be read from
+   any thread. sharing_lock serializes access to the mongoc cursor (or
+   prefetch ring). sharing_consumers are the threads currently taking
+   batches with cursor/next-batch and sharing_last_take is when (in
+   sharing_takes) each last took one. sharing_base_limit is the
+   cursor's own prefetch limit and sharing_fieldcaches are fieldcaches
+   not currently being used to decode batches. */
+#define KNO_MONGODB_MAX_CONSUMERS 64
+typedef struct KNO_MONGODB_SHARING {
+  u8_mutex sharing_lock;
+  int sharing_n_consumers, sharing_n_fieldcaches, sharing_base_limit;
+  long long sharing_takes;
+  long long sharing_consumers[KNO_MONGODB_MAX_CONSUMERS];
+  long long sharing_last_take[KNO_MONGODB_MAX_CONSUMERS];
+  struct KNO_BSON_FIELDCACHE *sharing_fieldcaches[KNO_MONGODB_MAX_CONSUMERS];}
+  KNO_MONGODB_SHARING;
+typedef struct KNO_MONGODB_SHARING *kno_mongodb_sharing;
+
 typedef struct KNO_MONGODB_CURSOR {
   KNO_CONS_HEADER;
   lispval cursor_db, cursor_coll, cursor_query;
@@ -81,7 +335,10 @@ typedef struct KNO_MONGODB_CURSOR {
   bson_t *cursor_opts_bson;
   const bson_t *cursor_value_bson;
   mongoc_read_prefs_t *cursor_readprefs;
-  mongoc_cursor_t *mongoc_cursor;}
+  mongoc_cursor_t *mongoc_cursor;
+  struct KNO_BSON_FIELDCACHE *cursor_fieldcache;
+  struct KNO_MONGODB_PREFETCH *cursor_prefetch;
+  struct KNO_MONGODB_SHARING *cursor_sharing;}
   KNO_MONGODB_CURSOR;
 typedef struct KNO_MONGODB_CURSOR *kno_mongodb_cursor;
 
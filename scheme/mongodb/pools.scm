@@ -75,13 +75,9 @@
 
 (define (mongopool-fetchn pool mp oidvec (collection))
   (default! collection (mongopool-collection mp))
-  (let ((values (fetchn collection oidvec))
-	(result (make-vector (length oidvec) #f))
-	(map (make-hashtable)))
-    (do-choices (value values)
-      (store! map (get value '_id) value))
-    (doseq (oid oidvec i)
-      (vector-set! result i (get map oid)))
+  (let ((result (collection/getn collection oidvec #[keyslot _id __index 0])))
+    (doseq (value result i)
+      (unless value (vector-set! result i {})))
     result))
 
 (define (mongopool-lockoids pool mp oids (collection))
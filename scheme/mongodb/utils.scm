@@ -152,18 +152,22 @@
       #f))
 
 (define (collection/copy! source dest (opts #f) (batchsize))
+  ;; The source is read with a parallel scan, so documents are copied
+  ;; in no particular order
   (default! batchsize (getopt opts 'batchsize 200))
-  (let* ((cursor (mongodb/cursor source #[]))
-	 (batch (cursor/read cursor batchsize)))
-    (while (exists? batch)
-      (if (getopt opts 'upsert)
-	  (do-choices (save batch)
-	    (collection/upsert! dest `#[_id ,(get save '_id)]
-				`#[$set ,save]))
-	  (collection/insert! dest batch))
-      (if (cursor/done? cursor) 
-	  (set! batch {})
-	  (set! batch (cursor/read cursor batchsize))))))
+  (collection/pscan source #[]
+		    (lambda (vec)
+		      (let ((batch (elts vec)))
+			(if (getopt opts 'upsert)
+			    (do-choices (save batch)
+			      (collection/upsert! dest `#[_id ,(get save '_id)]
+						  `#[$set ,save]))
+			    (collection/insert! dest batch))
+			#t))
+		    `#[threads ,(getopt opts 'threads {})
+		       partitions ,(getopt opts 'partitions {})
+		       snapshot ,(getopt opts 'snapshot {})]
+		    batchsize))
 
 (define (mongodb/dropdb! db)
   (mongodb/cmd db #["dropDatabase" 1]))